@@ -2,7 +2,7 @@ include (FindPackageHandleStandardArgs)
 
 set(OCL_SDK_Light_DIR "${CMAKE_SOURCE_DIR}/3rdparty/OCL_SDK_Light")
 
-find_library(OCL_SDK_Light_LIBRARY_RELEASE NAMES opencl PATHS "${OCL_SDK_Light_DIR}/lib/x86_64")
+find_library(OCL_SDK_Light_LIBRARY_RELEASE NAMES opencl OpenCL PATHS "${OCL_SDK_Light_DIR}/lib/x86_64")
 find_path(OCL_SDK_Light_INCLUDE_DIR NAMES CL/cl.h PATHS "${OCL_SDK_Light_DIR}/include")
 
 find_package_handle_standard_args(OpenCL_Light DEFAULT_MSG OCL_SDK_Light_LIBRARY_RELEASE OCL_SDK_Light_INCLUDE_DIR)
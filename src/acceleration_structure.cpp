@@ -0,0 +1,425 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "acceleration_structure.hpp"
+#include "kernels/common/constants.h"
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+namespace
+{
+    // Cost of a traversal step relative to a triangle test, same as in the SAH builder
+    constexpr float kSahTraversalCost = 1.0f;
+
+    bool IsLeaf(LinearBVHNode const& node)
+    {
+        return (node.num_primitives_axis >> 16) > 0;
+    }
+
+    template <typename WideNode, std::size_t kWidth>
+    std::uint32_t CollapseNode(std::vector<LinearBVHNode> const& nodes, std::uint32_t node_index,
+        std::vector<WideNode>& wide_nodes)
+    {
+        std::uint32_t wide_index = static_cast<std::uint32_t>(wide_nodes.size());
+        wide_nodes.emplace_back();
+
+        // A leaf root becomes the only child
+        std::uint32_t children[kWidth] = { node_index };
+        std::size_t num_children = 1;
+
+        // Open the interior child with the largest surface area until the node is full
+        while (num_children < kWidth)
+        {
+            std::size_t best_child = kWidth;
+            float best_area = -1.0f;
+            for (std::size_t i = 0; i < num_children; ++i)
+            {
+                LinearBVHNode const& child = nodes[children[i]];
+                if (!IsLeaf(child) && child.bounds.SurfaceArea() > best_area)
+                {
+                    best_child = i;
+                    best_area = child.bounds.SurfaceArea();
+                }
+            }
+
+            if (best_child == kWidth)
+            {
+                break;
+            }
+
+            std::uint32_t opened = children[best_child];
+            children[best_child] = opened + 1;
+            children[num_children++] = nodes[opened].offset;
+        }
+
+        for (std::size_t i = 0; i < kWidth; ++i)
+        {
+            float3 child_min(std::numeric_limits<float>::max());
+            float3 child_max(std::numeric_limits<float>::lowest());
+            std::uint32_t child_offset = INVALID_ID;
+            std::uint32_t child_count = 0;
+
+            if (i < num_children)
+            {
+                LinearBVHNode const& child = nodes[children[i]];
+                child_min = child.bounds.min;
+                child_max = child.bounds.max;
+                if (IsLeaf(child))
+                {
+                    child_offset = child.offset;
+                    child_count = child.num_primitives_axis >> 16;
+                }
+                else
+                {
+                    // The vector grows here, the node is accessed by index below
+                    child_offset = CollapseNode<WideNode, kWidth>(nodes, children[i], wide_nodes);
+                }
+            }
+
+            WideNode& wide_node = wide_nodes[wide_index];
+            wide_node.child_min_x[i] = child_min.x;
+            wide_node.child_min_y[i] = child_min.y;
+            wide_node.child_min_z[i] = child_min.z;
+            wide_node.child_max_x[i] = child_max.x;
+            wide_node.child_max_y[i] = child_max.y;
+            wide_node.child_max_z[i] = child_max.z;
+            wide_node.child_offsets[i] = child_offset;
+            wide_node.child_counts[i] = child_count;
+        }
+
+        return wide_index;
+    }
+
+    template <typename WideNode, std::size_t kWidth>
+    void CollapseBvh(std::vector<LinearBVHNode> const& nodes, std::vector<WideNode>& wide_nodes)
+    {
+        wide_nodes.clear();
+        if (nodes.empty())
+        {
+            return;
+        }
+
+        wide_nodes.reserve(nodes.size() / (kWidth - 1) + 1);
+        CollapseNode<WideNode, kWidth>(nodes, 0, wide_nodes);
+    }
+
+    // Grid step exponent covering [min_value, max_value] with 255 steps. The step is at least
+    // one ulp of min_value, so the inverted bounds of the empty slots stay inverted after decoding
+    int GetQuantizationExponent(float min_value, float max_value)
+    {
+        int exponent = -126;
+        float extent = max_value - min_value;
+        if (extent > 0.0f)
+        {
+            exponent = std::max(exponent, static_cast<int>(std::ceil(std::log2(extent / 255.0f))));
+        }
+
+        if (min_value != 0.0f)
+        {
+            exponent = std::max(exponent, std::ilogb(min_value) - 23);
+        }
+
+        // Float rounding of the grid end
+        while (exponent < 127 && min_value + 255.0f * std::ldexp(1.0f, exponent) < max_value)
+        {
+            ++exponent;
+        }
+
+        return std::min(exponent, 127);
+    }
+
+    // Conservative 8 bit grid coordinates of the child bounds
+    void QuantizeBounds(float child_min, float child_max, float origin, float scale,
+        std::uint32_t& quantized_min, std::uint32_t& quantized_max)
+    {
+        // Empty slot
+        if (child_min > child_max)
+        {
+            quantized_min = 255;
+            quantized_max = 0;
+            return;
+        }
+
+        float q_min = std::floor((child_min - origin) / scale);
+        float q_max = std::ceil((child_max - origin) / scale);
+        quantized_min = static_cast<std::uint32_t>(std::min(std::max(q_min, 0.0f), 255.0f));
+        quantized_max = static_cast<std::uint32_t>(std::min(std::max(q_max, 0.0f), 255.0f));
+
+        // The decoded bounds must contain the child
+        while (quantized_min > 0 && origin + float(quantized_min) * scale > child_min)
+        {
+            --quantized_min;
+        }
+
+        while (quantized_max < 255 && origin + float(quantized_max) * scale < child_max)
+        {
+            ++quantized_max;
+        }
+    }
+
+    template <typename WideNode, typename CompressedNode, std::size_t kWidth>
+    void CompressBvh(std::vector<WideNode> const& wide_nodes, std::vector<CompressedNode>& compressed_nodes)
+    {
+        compressed_nodes.assign(wide_nodes.size(), CompressedNode());
+
+        for (std::size_t node_index = 0; node_index < wide_nodes.size(); ++node_index)
+        {
+            WideNode const& node = wide_nodes[node_index];
+            CompressedNode& compressed_node = compressed_nodes[node_index];
+
+            float const* child_min[3] = { node.child_min_x, node.child_min_y, node.child_min_z };
+            float const* child_max[3] = { node.child_max_x, node.child_max_y, node.child_max_z };
+            std::uint32_t* quantized_min[3] = { compressed_node.child_min_x, compressed_node.child_min_y, compressed_node.child_min_z };
+            std::uint32_t* quantized_max[3] = { compressed_node.child_max_x, compressed_node.child_max_y, compressed_node.child_max_z };
+            float* origin[3] = { &compressed_node.origin_x, &compressed_node.origin_y, &compressed_node.origin_z };
+
+            compressed_node.scale_exponents = 0;
+            for (std::uint32_t axis = 0; axis < 3; ++axis)
+            {
+                // The frame is the node bounds, the empty slots don't contribute
+                float node_min = std::numeric_limits<float>::max();
+                float node_max = std::numeric_limits<float>::lowest();
+                for (std::size_t i = 0; i < kWidth; ++i)
+                {
+                    if (child_min[axis][i] <= child_max[axis][i])
+                    {
+                        node_min = std::min(node_min, child_min[axis][i]);
+                        node_max = std::max(node_max, child_max[axis][i]);
+                    }
+                }
+
+                int exponent = GetQuantizationExponent(node_min, node_max);
+                float scale = std::ldexp(1.0f, exponent);
+                *origin[axis] = node_min;
+                compressed_node.scale_exponents |= static_cast<std::uint32_t>(exponent + 127) << (axis * 8);
+
+                for (std::size_t i = 0; i < kWidth; ++i)
+                {
+                    std::uint32_t q_min, q_max;
+                    QuantizeBounds(child_min[axis][i], child_max[axis][i], node_min, scale, q_min, q_max);
+                    quantized_min[axis][i / 4] |= q_min << ((i % 4) * 8);
+                    quantized_max[axis][i / 4] |= q_max << ((i % 4) * 8);
+                }
+            }
+
+            for (std::size_t i = 0; i < kWidth; ++i)
+            {
+                if (node.child_counts[i] > 0xFFFF)
+                {
+                    throw std::runtime_error("BVH leaf is too large for the compressed node format");
+                }
+
+                compressed_node.child_offsets[i] = node.child_offsets[i];
+                compressed_node.child_counts[i / 2] |= node.child_counts[i] << ((i % 2) * 16);
+            }
+        }
+    }
+}
+
+void RefitBvhNodes(std::vector<LinearBVHNode>& nodes, std::vector<std::uint32_t> const& primitive_indices,
+    std::vector<Triangle> const& triangles, std::size_t first_node)
+{
+    for (std::size_t i = nodes.size(); i-- > first_node;)
+    {
+        LinearBVHNode& node = nodes[i];
+        unsigned int num_primitives = node.num_primitives_axis >> 16;
+
+        Bounds3 bounds;
+        if (num_primitives > 0)
+        {
+            for (unsigned int j = node.offset; j < node.offset + num_primitives; ++j)
+            {
+                std::uint32_t primitive_index = primitive_indices.empty() ? j : primitive_indices[j];
+                bounds = Union(bounds, triangles[primitive_index].GetBounds());
+            }
+        }
+        else
+        {
+            bounds = Union(nodes[i + 1].bounds, nodes[node.offset].bounds);
+        }
+
+        node.bounds = bounds;
+    }
+}
+
+void GetBvhLevels(std::vector<LinearBVHNode> const& nodes, std::vector<std::uint32_t>& level_nodes,
+    std::vector<std::uint32_t>& level_offsets)
+{
+    // Parents go first, so the depth of the children is known when they are reached
+    std::vector<std::uint32_t> depths(nodes.size(), 0);
+    std::uint32_t num_levels = nodes.empty() ? 0 : 1;
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        if ((nodes[i].num_primitives_axis >> 16) == 0)
+        {
+            depths[i + 1] = depths[i] + 1;
+            depths[nodes[i].offset] = depths[i] + 1;
+            num_levels = std::max(num_levels, depths[i] + 2);
+        }
+    }
+
+    // Counting sort by depth
+    level_offsets.assign(num_levels + 1, 0);
+    for (auto depth : depths)
+    {
+        level_offsets[depth + 1]++;
+    }
+
+    for (std::uint32_t level = 0; level < num_levels; ++level)
+    {
+        level_offsets[level + 1] += level_offsets[level];
+    }
+
+    std::vector<std::uint32_t> level_ends(level_offsets.begin(), level_offsets.end() - 1);
+    level_nodes.resize(nodes.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        level_nodes[level_ends[depths[i]]++] = static_cast<std::uint32_t>(i);
+    }
+}
+
+void CollapseBvh4(std::vector<LinearBVHNode> const& nodes, std::vector<BVH4Node>& wide_nodes)
+{
+    CollapseBvh<BVH4Node, 4>(nodes, wide_nodes);
+}
+
+void CollapseBvh8(std::vector<LinearBVHNode> const& nodes, std::vector<BVH8Node>& wide_nodes)
+{
+    CollapseBvh<BVH8Node, 8>(nodes, wide_nodes);
+}
+
+void CompressBvh4(std::vector<BVH4Node> const& wide_nodes, std::vector<CompressedBVH4Node>& compressed_nodes)
+{
+    CompressBvh<BVH4Node, CompressedBVH4Node, 4>(wide_nodes, compressed_nodes);
+}
+
+void CompressBvh8(std::vector<BVH8Node> const& wide_nodes, std::vector<CompressedBVH8Node>& compressed_nodes)
+{
+    CompressBvh<BVH8Node, CompressedBVH8Node, 8>(wide_nodes, compressed_nodes);
+}
+
+void PrintBvhStatistics(std::vector<LinearBVHNode> const& nodes, std::size_t num_primitive_indices)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    // Parents go first, so the depth of the children is known when they are reached
+    std::vector<std::uint32_t> depths(nodes.size(), 0);
+    std::vector<std::uint32_t> leaf_depth_counts;
+    std::map<std::uint32_t, std::uint32_t> leaf_size_counts;
+    double interior_area = 0.0;
+    double leaf_cost = 0.0;
+    double overlap_ratio_sum = 0.0;
+    std::size_t num_leaves = 0;
+    std::size_t num_references = 0;
+    std::uint64_t leaf_depth_sum = 0;
+
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        LinearBVHNode const& node = nodes[i];
+        float area = node.bounds.SurfaceArea();
+        if (IsLeaf(node))
+        {
+            std::uint32_t num_primitives = node.num_primitives_axis >> 16;
+            leaf_cost += double(area) * num_primitives;
+            leaf_size_counts[num_primitives]++;
+            if (depths[i] >= leaf_depth_counts.size())
+            {
+                leaf_depth_counts.resize(depths[i] + 1, 0);
+            }
+            leaf_depth_counts[depths[i]]++;
+            leaf_depth_sum += depths[i];
+            num_references += num_primitives;
+            num_leaves++;
+        }
+        else
+        {
+            interior_area += area;
+            depths[i + 1] = depths[i] + 1;
+            depths[node.offset] = depths[i] + 1;
+
+            Bounds3 overlap = Intersect(nodes[i + 1].bounds, nodes[node.offset].bounds);
+            if (overlap.IsValid() && area > 0.0f)
+            {
+                overlap_ratio_sum += overlap.SurfaceArea() / area;
+            }
+        }
+    }
+
+    std::size_t num_interior_nodes = nodes.size() - num_leaves;
+    float root_area = nodes[0].bounds.SurfaceArea();
+    double sah_cost = root_area > 0.0f ? (kSahTraversalCost * interior_area + leaf_cost) / root_area : 0.0;
+    auto to_mb = [](std::size_t size) { return float(size) / (1024.0f * 1024.0f); };
+
+    std::cout << "BVH statistics: SAH cost " << sah_cost << ", " << nodes.size() << " nodes (" << num_interior_nodes
+        << " interior, " << num_leaves << " leaves), " << num_references << " primitive references" << std::endl;
+
+    char const* separator = " ";
+    std::cout << "BVH leaf sizes:";
+    for (auto const& leaf_size_count : leaf_size_counts)
+    {
+        std::cout << separator << leaf_size_count.first << ": " << leaf_size_count.second;
+        separator = ", ";
+    }
+    std::cout << std::endl;
+
+    std::cout << "BVH leaf depths (average " << double(leaf_depth_sum) / num_leaves << ", max "
+        << leaf_depth_counts.size() - 1 << "):";
+    separator = " ";
+    for (std::size_t depth = 0; depth < leaf_depth_counts.size(); ++depth)
+    {
+        if (leaf_depth_counts[depth] > 0)
+        {
+            std::cout << separator << depth << ": " << leaf_depth_counts[depth];
+            separator = ", ";
+        }
+    }
+    std::cout << std::endl;
+
+    std::cout << "BVH child overlap: " << (num_interior_nodes > 0 ? 100.0 * overlap_ratio_sum / num_interior_nodes : 0.0)
+        << "% of the parent surface area on average" << std::endl;
+    std::cout << "BVH memory: nodes " << to_mb(nodes.size() * sizeof(LinearBVHNode)) << " MB, primitive indices "
+        << to_mb(num_primitive_indices * sizeof(std::uint32_t)) << " MB" << std::endl;
+}
+
+void PrintBvhMemoryReport(std::vector<LinearBVHNode> const& nodes)
+{
+    auto to_mb = [](std::size_t size) { return float(size) / (1024.0f * 1024.0f); };
+    std::vector<BVH4Node> bvh4_nodes;
+    std::vector<BVH8Node> bvh8_nodes;
+    CollapseBvh4(nodes, bvh4_nodes);
+    CollapseBvh8(nodes, bvh8_nodes);
+
+    std::cout << "BVH node memory: binary " << to_mb(nodes.size() * sizeof(LinearBVHNode))
+        << " MB, BVH4 " << to_mb(bvh4_nodes.size() * sizeof(BVH4Node))
+        << " MB, compressed BVH4 " << to_mb(bvh4_nodes.size() * sizeof(CompressedBVH4Node))
+        << " MB (" << bvh4_nodes.size() << " nodes), BVH8 " << to_mb(bvh8_nodes.size() * sizeof(BVH8Node))
+        << " MB, compressed BVH8 " << to_mb(bvh8_nodes.size() * sizeof(CompressedBVH8Node))
+        << " MB (" << bvh8_nodes.size() << " nodes)" << std::endl;
+}
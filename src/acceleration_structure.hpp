@@ -25,14 +25,93 @@
 #pragma once
 
 #include "kernels/common/shared_structures.h"
+#include <string>
 #include <vector>
 
+enum class BvhBuilder
+{
+    // Binned SAH, optionally with spatial splits
+    kSah,
+    // Morton code ordered linear BVH
+    kLbvh,
+    // LBVH treelets under SAH top levels
+    kHlbvh
+};
+
+struct BvhBuildOptions
+{
+    BvhBuilder builder = BvhBuilder::kSah;
+    // Spatial splits (SBVH) let one triangle be referenced from several leaves, SAH builder only
+    bool enable_spatial_splits = false;
+    // Spatial splits are tried only if the children of the object split overlap
+    // by more than alpha * root surface area
+    float spatial_split_alpha = 1e-5f;
+    // Upper bound of the number of references relative to the number of triangles
+    float max_reference_ratio = 2.0f;
+    // LBVH builders use 63-bit Morton codes (21 bits per axis) instead of 30-bit ones
+    bool use_63bit_morton_codes = false;
+    // Restructure treelets of the SAH BVH to lower its SAH cost, slower to build but faster to trace
+    bool optimize_treelets = false;
+    // The treelet optimization stops after this many passes over the tree or when the time budget is spent
+    std::uint32_t treelet_optimization_passes = 3;
+    float treelet_optimization_budget_ms = 5000.0f;
+    // Node width of the traversal, 4 and 8 collapse the binary BVH into wide nodes.
+    // Two-level BVHs and the GL backend always use the binary nodes
+    std::uint32_t node_width = 2;
+    // Quantize the child bounds of the wide nodes to 8 bits, ignored for the binary nodes
+    bool compress_nodes = false;
+    // Print the SAH cost, the leaf size and depth histograms, the child overlap and the memory of the built BVH
+    bool print_statistics = false;
+    // File the single level BVH is loaded from if it was built for the same triangles and options,
+    // and saved to otherwise. Empty - no caching
+    std::string cache_path;
+};
+
 class CLContext;
 class AccelerationStructure
 {
 public:
-    virtual void BuildCPU(std::vector<Triangle> & triangles) = 0;
+    virtual void BuildCPU(std::vector<Triangle> const& triangles) = 0;
+    // Recomputes the node bounds for the moved vertices, the topology and the triangle order are kept
+    virtual void Refit(std::vector<Triangle> const& triangles) = 0;
+    // Takes the node bounds refitted on the device, the nodes must have the topology of GetNodes()
+    virtual void SetRefittedNodes(std::vector<LinearBVHNode> const& nodes) = 0;
     virtual std::vector<LinearBVHNode> const& GetNodes() const = 0;
+    // Triangle indices referenced by the leaves, empty if leaves index the triangles directly
+    virtual std::vector<std::uint32_t> const& GetPrimitiveIndices() const = 0;
+    // The leaves reference the triangles in this order, triangle i is the input triangle order[i].
+    // Apply it to the scene with Scene::ReorderTriangles after BuildCPU
+    virtual std::vector<std::uint32_t> const& GetTriangleOrder() const = 0;
+    // Number of nodes at the start of GetNodes() that form the top level BVH over the scene instances,
+    // 0 if the structure has a single level
+    virtual std::size_t GetTopLevelNodeCount() const { return 0; }
     //virtual void IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
     //    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit = true) = 0;
 };
+
+// Bottom-up refit of the flattened BVH, the children are always stored after their parents.
+// primitive_indices is empty if the leaves index the triangles directly.
+// The nodes before first_node are not touched
+void RefitBvhNodes(std::vector<LinearBVHNode>& nodes, std::vector<std::uint32_t> const& primitive_indices,
+    std::vector<Triangle> const& triangles, std::size_t first_node = 0);
+
+// Groups the node indices by depth, nodes of level i are stored at [level_offsets[i], level_offsets[i + 1]).
+// Refitting the levels from the deepest one allows to process the nodes of each level in parallel
+void GetBvhLevels(std::vector<LinearBVHNode> const& nodes, std::vector<std::uint32_t>& level_nodes,
+    std::vector<std::uint32_t>& level_offsets);
+
+// Collapse the binary BVH into wide nodes, the leaves keep their primitive ranges.
+// The wide nodes are stored in depth-first order starting from the root
+void CollapseBvh4(std::vector<LinearBVHNode> const& nodes, std::vector<BVH4Node>& wide_nodes);
+void CollapseBvh8(std::vector<LinearBVHNode> const& nodes, std::vector<BVH8Node>& wide_nodes);
+
+// Quantize the child bounds of the wide nodes to 8 bits, the node order is kept
+void CompressBvh4(std::vector<BVH4Node> const& wide_nodes, std::vector<CompressedBVH4Node>& compressed_nodes);
+void CompressBvh8(std::vector<BVH8Node> const& wide_nodes, std::vector<CompressedBVH8Node>& compressed_nodes);
+
+// Prints the quality metrics of a single level binary BVH: SAH cost, leaf size and leaf depth histograms,
+// child overlap relative to the parent surface area and memory footprint
+void PrintBvhStatistics(std::vector<LinearBVHNode> const& nodes, std::size_t num_primitive_indices);
+
+// Prints the node memory of the binary BVH and of its BVH4/BVH8 collapses, plain and compressed
+void PrintBvhMemoryReport(std::vector<LinearBVHNode> const& nodes);
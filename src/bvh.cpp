@@ -23,88 +23,422 @@
  *****************************************************************************/
 
 #include "bvh.hpp"
+#include "utils/thread_pool.hpp"
+#include "kernels/common/constants.h"
+#include <chrono>
+#include <limits>
+#include <mutex>
 
 namespace
 {
     constexpr auto kMaxPrimitivesInNode = 4u;
+    // Child subtrees of bigger nodes are built as separate tasks
+    constexpr auto kParallelSubtreeThreshold = 4096u;
+    // Bounds and buckets of bigger nodes are computed by parallel loops
+    constexpr auto kParallelBinningThreshold = 65536u;
+    constexpr std::size_t kPrimitivesGrainSize = 16384;
+    // Number of bins per axis of the spatial split build
+    constexpr auto kSpatialBuildBins = 32u;
+    // Deeper nodes use object splits only, keeps the tree within the traversal stack
+    constexpr auto kMaxSpatialSplitDepth = 48u;
+    // Number of leaves of the treelets restructured by the optimizer, 2^N subsets are evaluated per treelet
+    constexpr auto kTreeletSize = 7u;
+    // Treelets under shallower nodes are optimized as separate tasks
+    constexpr auto kParallelTreeletDepth = 10u;
+    // Treelets are restructured only if the cost is lower by this fraction, avoids rebuilding equal topologies
+    constexpr float kMinTreeletImprovement = 1e-5f;
+    // Cost of a traversal step relative to a triangle test, same as in the binned SAH build
+    constexpr float kTraversalCost = 1.0f;
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    double ElapsedMs(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // Computes bounds of the parts of the triangle on both sides of the plane, clipped by the reference bounds
+    void SplitReference(Triangle const& triangle, Bounds3 const& reference_bounds, unsigned int dim, float position,
+        Bounds3& left_bounds, Bounds3& right_bounds)
+    {
+        float3 const vertices[3] = { triangle.v1.position, triangle.v2.position, triangle.v3.position };
+
+        left_bounds = Bounds3();
+        right_bounds = Bounds3();
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            float3 const& v0 = vertices[i];
+            float3 const& v1 = vertices[(i + 1) % 3];
+            float p0 = v0[dim];
+            float p1 = v1[dim];
+
+            if (p0 <= position)
+            {
+                left_bounds = Union(left_bounds, v0);
+            }
+            if (p0 >= position)
+            {
+                right_bounds = Union(right_bounds, v0);
+            }
+
+            // The edge crosses the plane
+            if ((p0 < position && p1 > position) || (p0 > position && p1 < position))
+            {
+                float t = clamp((position - p0) / (p1 - p0), 0.0f, 1.0f);
+                float3 p = v0 + (v1 - v0) * t;
+                p[dim] = position;
+                left_bounds = Union(left_bounds, p);
+                right_bounds = Union(right_bounds, p);
+            }
+        }
+
+        left_bounds = Intersect(left_bounds, reference_bounds);
+        right_bounds = Intersect(right_bounds, reference_bounds);
+    }
+
+    using BuildNode = Bvh::BVHBuildNode;
+
+    // Computes the SAH costs of the subtree nodes, not normalized by the root surface area
+    float ComputeSahCosts(BuildNode* node)
+    {
+        float area = node->bounds.SurfaceArea();
+        if (node->nPrimitives > 0)
+        {
+            node->cost = area * node->nPrimitives;
+        }
+        else
+        {
+            node->cost = kTraversalCost * area + ComputeSahCosts(node->children[0]) + ComputeSahCosts(node->children[1]);
+        }
+        return node->cost;
+    }
+
+    struct Treelet
+    {
+        static constexpr unsigned int kNumSubsets = 1u << kTreeletSize;
+
+        // Roots of the subtrees hanging from the treelet, they are kept as is
+        BuildNode* leaves[kTreeletSize];
+        // Interior nodes below the treelet root, reused for the new topology
+        BuildNode* interior_nodes[kTreeletSize - 2];
+        unsigned int num_leaves = 0;
+        unsigned int num_interior_nodes = 0;
+        // Minimal cost of a subtree over each subset of the leaves and the subset of its left child
+        float costs[kNumSubsets];
+        std::uint8_t partitions[kNumSubsets];
+    };
+
+    BuildNode* GetTreeletNode(Treelet& treelet, unsigned int subset, unsigned int& next_interior_node)
+    {
+        // Subsets of one leaf are the leaf itself
+        if ((subset & (subset - 1)) == 0)
+        {
+            unsigned int leaf_idx = 0;
+            while (!(subset & (1u << leaf_idx)))
+            {
+                ++leaf_idx;
+            }
+            return treelet.leaves[leaf_idx];
+        }
+        return treelet.interior_nodes[next_interior_node++];
+    }
+
+    void RebuildTreelet(Treelet& treelet, unsigned int subset, BuildNode* node, unsigned int& next_interior_node)
+    {
+        unsigned int subsets[2] = { treelet.partitions[subset], subset & ~treelet.partitions[subset] };
+        BuildNode* children[2];
+        for (unsigned int i = 0; i < 2; ++i)
+        {
+            children[i] = GetTreeletNode(treelet, subsets[i], next_interior_node);
+            if ((subsets[i] & (subsets[i] - 1)) != 0)
+            {
+                RebuildTreelet(treelet, subsets[i], children[i], next_interior_node);
+            }
+        }
+
+        // The traversal visits the children in the ray direction along the split axis,
+        // so use the axis that separates their centers the most
+        float3 offset = (children[1]->bounds.min + children[1]->bounds.max) - (children[0]->bounds.min + children[0]->bounds.max);
+        unsigned int axis = 0;
+        for (unsigned int i = 1; i < 3; ++i)
+        {
+            if (std::fabs(offset[i]) > std::fabs(offset[axis]))
+            {
+                axis = i;
+            }
+        }
+        if (offset[axis] < 0.0f)
+        {
+            std::swap(children[0], children[1]);
+        }
+
+        node->InitInterior(axis, children[0], children[1]);
+        node->cost = treelet.costs[subset];
+    }
+
+    // Finds the topology of the treelet under the node with minimal SAH cost by dynamic programming over
+    // the subsets of its leaves, see "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies".
+    // Returns true if the treelet was restructured
+    bool OptimizeTreelet(BuildNode* root)
+    {
+        Treelet treelet;
+        treelet.leaves[treelet.num_leaves++] = root->children[0];
+        treelet.leaves[treelet.num_leaves++] = root->children[1];
+
+        // Grow the treelet by expanding the interior leaf with the largest surface area
+        while (treelet.num_leaves < kTreeletSize)
+        {
+            int largest_leaf = -1;
+            float largest_area = -1.0f;
+            for (unsigned int i = 0; i < treelet.num_leaves; ++i)
+            {
+                float area = treelet.leaves[i]->bounds.SurfaceArea();
+                if (treelet.leaves[i]->nPrimitives == 0 && area > largest_area)
+                {
+                    largest_leaf = i;
+                    largest_area = area;
+                }
+            }
+
+            if (largest_leaf < 0)
+            {
+                break;
+            }
+
+            BuildNode* node = treelet.leaves[largest_leaf];
+            treelet.interior_nodes[treelet.num_interior_nodes++] = node;
+            treelet.leaves[largest_leaf] = node->children[0];
+            treelet.leaves[treelet.num_leaves++] = node->children[1];
+        }
+
+        // Two leaves have a single topology
+        if (treelet.num_leaves < 3)
+        {
+            return false;
+        }
+
+        unsigned int num_subsets = 1u << treelet.num_leaves;
+        for (unsigned int subset = 1; subset < num_subsets; ++subset)
+        {
+            if ((subset & (subset - 1)) == 0)
+            {
+                unsigned int leaf_idx = 0;
+                while (!(subset & (1u << leaf_idx)))
+                {
+                    ++leaf_idx;
+                }
+                treelet.costs[subset] = treelet.leaves[leaf_idx]->cost;
+                treelet.partitions[subset] = 0;
+                continue;
+            }
+
+            Bounds3 bounds;
+            for (unsigned int i = 0; i < treelet.num_leaves; ++i)
+            {
+                if (subset & (1u << i))
+                {
+                    bounds = Union(bounds, treelet.leaves[i]->bounds);
+                }
+            }
+
+            // Proper subsets are smaller numbers, so their costs are already known
+            float best_cost = std::numeric_limits<float>::max();
+            unsigned int best_partition = 0;
+            for (unsigned int partition = (subset - 1) & subset; partition != 0; partition = (partition - 1) & subset)
+            {
+                float cost = treelet.costs[partition] + treelet.costs[subset & ~partition];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_partition = partition;
+                }
+            }
+
+            treelet.costs[subset] = kTraversalCost * bounds.SurfaceArea() + best_cost;
+            treelet.partitions[subset] = static_cast<std::uint8_t>(best_partition);
+        }
+
+        unsigned int all_leaves = num_subsets - 1;
+        if (treelet.costs[all_leaves] >= root->cost * (1.0f - kMinTreeletImprovement))
+        {
+            return false;
+        }
+
+        unsigned int next_interior_node = 0;
+        RebuildTreelet(treelet, all_leaves, root, next_interior_node);
+        assert(next_interior_node == treelet.num_interior_nodes);
+        return true;
+    }
+
+    // Optimizes the treelets bottom-up, so every treelet is formed from the already optimized subtrees
+    void OptimizeTreeletsRecursive(ThreadPool& thread_pool, BuildNode* node, unsigned int depth,
+        Clock::time_point deadline, std::atomic<std::uint32_t>& num_restructured)
+    {
+        if (node->nPrimitives > 0)
+        {
+            return;
+        }
+
+        if (depth < kParallelTreeletDepth)
+        {
+            ThreadPool::TaskGroup task_group(thread_pool);
+            task_group.Run([&]()
+                {
+                    OptimizeTreeletsRecursive(thread_pool, node->children[0], depth + 1, deadline, num_restructured);
+                });
+            OptimizeTreeletsRecursive(thread_pool, node->children[1], depth + 1, deadline, num_restructured);
+            task_group.Wait();
+        }
+        else
+        {
+            OptimizeTreeletsRecursive(thread_pool, node->children[0], depth + 1, deadline, num_restructured);
+            OptimizeTreeletsRecursive(thread_pool, node->children[1], depth + 1, deadline, num_restructured);
+        }
+
+        node->cost = kTraversalCost * node->bounds.SurfaceArea() + node->children[0]->cost + node->children[1]->cost;
+
+        // Past the deadline the tree is left as is, the costs are still updated
+        if (Clock::now() < deadline && OptimizeTreelet(node))
+        {
+            num_restructured++;
+        }
+    }
 }
 
-Bvh::Bvh()
+Bvh::Bvh(BvhBuildOptions const& options)
+    : options_(options)
 {
 }
 
-void Bvh::BuildCPU(std::vector<Triangle> & triangles)
+void Bvh::BuildCPU(std::vector<Triangle> const& triangles)
 {
     std::cout << "Building Bounding Volume Hierarchy for scene" << std::endl;
 
-    std::uint32_t max_prims_in_node = 4u;
+    if (options_.enable_spatial_splits)
+    {
+        BuildSpatial(triangles);
+        return;
+    }
+
+    primitive_indices_.clear();
+
+    ThreadPool thread_pool;
+    auto start_time = Clock::now();
 
-    //double startTime = m_Render.GetCurtime();
     std::vector<BVHPrimitiveInfo> primitiveInfo(triangles.size());
-    for (unsigned int i = 0; i < triangles.size(); ++i)
+    thread_pool.ParallelFor(triangles.size(), [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                primitiveInfo[i] = { (unsigned int)i, triangles[i].GetBounds() };
+            }
+        }, kPrimitivesGrainSize);
+
+    auto primitive_info_time = Clock::now();
+
+    // A binary tree with N leaves has 2N - 1 nodes, and every leaf has at least one primitive
+    auto arena = std::make_unique<BuildNodeArena>(std::max<std::size_t>(2 * triangles.size(), 2) - 1);
+    BVHBuildNode* root_node = RecursiveBuild(thread_pool, primitiveInfo, 0, triangles.size(), *arena);
+    unsigned int totalNodes = arena->GetAllocatedCount();
+    float arena_size_mb = float(arena->GetCapacity() * sizeof(BVHBuildNode)) / (1024.0f * 1024.0f);
+
+    auto tree_time = Clock::now();
+
+    if (options_.optimize_treelets)
     {
-        primitiveInfo[i] = { i, triangles[i].GetBounds() };
+        OptimizeTreelets(thread_pool, root_node);
     }
 
-    unsigned int totalNodes = 0;
-    std::vector<Triangle> orderedTriangles;
-    root_node_ = RecursiveBuild(triangles, primitiveInfo, 0, triangles.size(), &totalNodes, orderedTriangles);
-    triangles.swap(orderedTriangles);
+    auto optimize_time = Clock::now();
 
-    //primitiveInfo.resize(0);
-    std::cout << "BVH created with " << totalNodes << " nodes for " << triangles.size()
-        << " triangles (" << float(totalNodes * sizeof(BVHBuildNode)) / (1024.0f * 1024.0f) << " MB, "
-        //<< m_Render.GetCurtime() - startTime << "s elapsed)"
-        << std::endl;
+    // Every leaf references a range of primitiveInfo starting at its firstPrimOffset,
+    // so the triangles are ordered the same way
+    triangle_order_.resize(triangles.size());
+    thread_pool.ParallelFor(triangles.size(), [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                triangle_order_[i] = primitiveInfo[i].primitiveNumber;
+            }
+        }, kPrimitivesGrainSize);
+
+    auto reorder_time = Clock::now();
 
     // Compute representation of depth-first traversal of BVH tree
     nodes_.resize(totalNodes);
     unsigned int offset = 0;
-    FlattenBVHTree(root_node_, &offset);
+    FlattenBVHTree(root_node, &offset);
     assert(totalNodes == offset);
+
+    // The build tree is not needed anymore
+    arena.reset();
+
+    auto flatten_time = Clock::now();
+
+    std::cout << "BVH created with " << totalNodes << " nodes for " << triangles.size()
+        << " triangles (" << float(totalNodes * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MB, "
+        << ElapsedMs(start_time, flatten_time) << " ms elapsed on " << thread_pool.GetThreadCount() << " threads)"
+        << std::endl;
+    std::cout << "BVH build phases: primitive info " << ElapsedMs(start_time, primitive_info_time)
+        << " ms, tree " << ElapsedMs(primitive_info_time, tree_time)
+        << " ms, treelets " << ElapsedMs(tree_time, optimize_time)
+        << " ms, reorder " << ElapsedMs(optimize_time, reorder_time)
+        << " ms, flatten " << ElapsedMs(reorder_time, flatten_time) << " ms, "
+        << arena_size_mb << " MB build tree arena released" << std::endl;
 }
 
 Bvh::BVHBuildNode* Bvh::RecursiveBuild(
-    std::vector<Triangle> const& triangles,
+    ThreadPool& thread_pool,
     std::vector<BVHPrimitiveInfo>& primitiveInfo,
     unsigned int start,
-    unsigned int end, unsigned int* totalNodes,
-    std::vector<Triangle>& orderedTriangles)
+    unsigned int end, BuildNodeArena& arena)
 {
     assert(start <= end);
 
-    //// TODO: Add memory pool
-    BVHBuildNode* node = new BVHBuildNode;
-    (*totalNodes)++;
+    BVHBuildNode* node = arena.Allocate();
+
+    unsigned int nPrimitives = end - start;
+    bool parallel_binning = nPrimitives >= kParallelBinningThreshold;
 
-    // Compute bounds of all primitives in BVH node
+    // Compute bounds of all primitives and their centroids in BVH node
     Bounds3 bounds;
-    for (unsigned int i = start; i < end; ++i)
+    Bounds3 centroidBounds;
+    if (parallel_binning)
     {
-        bounds = Union(bounds, primitiveInfo[i].bounds);
-    }
+        std::mutex mutex;
+        thread_pool.ParallelFor(nPrimitives, [&](std::size_t begin, std::size_t end)
+            {
+                Bounds3 local_bounds;
+                Bounds3 local_centroid_bounds;
+                for (std::size_t i = start + begin; i < start + end; ++i)
+                {
+                    local_bounds = Union(local_bounds, primitiveInfo[i].bounds);
+                    local_centroid_bounds = Union(local_centroid_bounds, primitiveInfo[i].centroid);
+                }
 
-    unsigned int nPrimitives = end - start;
-    if (nPrimitives == 1)
+                std::lock_guard<std::mutex> lock(mutex);
+                bounds = Union(bounds, local_bounds);
+                centroidBounds = Union(centroidBounds, local_centroid_bounds);
+            }, kPrimitivesGrainSize);
+    }
+    else
     {
-        // Create leaf
-        int firstPrimOffset = orderedTriangles.size();
         for (unsigned int i = start; i < end; ++i)
         {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            orderedTriangles.push_back(triangles[primNum]);
+            bounds = Union(bounds, primitiveInfo[i].bounds);
+            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
         }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+    }
+
+    if (nPrimitives == 1)
+    {
+        // Create leaf
+        node->InitLeaf(start, nPrimitives, bounds);
         return node;
     }
     else
     {
-        // Compute bound of primitive centroids, choose split dimension
-        Bounds3 centroidBounds;
-        for (unsigned int i = start; i < end; ++i)
-        {
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
-        }
+        // Choose split dimension
         unsigned int dim = centroidBounds.MaximumExtent();
 
         // Partition primitives into two sets and build children
@@ -112,13 +446,7 @@ Bvh::BVHBuildNode* Bvh::RecursiveBuild(
         if (centroidBounds.max[dim] == centroidBounds.min[dim])
         {
             // Create leaf
-            unsigned int firstPrimOffset = orderedTriangles.size();
-            for (unsigned int i = start; i < end; ++i)
-            {
-                unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                orderedTriangles.push_back(triangles[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+            node->InitLeaf(start, nPrimitives, bounds);
             return node;
         }
         else
@@ -139,14 +467,44 @@ Bvh::BVHBuildNode* Bvh::RecursiveBuild(
                 const unsigned int nBuckets = 12;
                 BucketInfo buckets[nBuckets];
 
-                // Initialize _BucketInfo_ for SAH partition buckets
-                for (unsigned int i = start; i < end; ++i)
+                auto bucket_index = [&](const BVHPrimitiveInfo& pi)
                 {
-                    int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
+                    int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
                     if (b == nBuckets) b = nBuckets - 1;
                     assert(b >= 0 && b < nBuckets);
-                    buckets[b].count++;
-                    buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                    return b;
+                };
+
+                // Initialize _BucketInfo_ for SAH partition buckets
+                if (parallel_binning)
+                {
+                    std::mutex mutex;
+                    thread_pool.ParallelFor(nPrimitives, [&](std::size_t begin, std::size_t end)
+                        {
+                            BucketInfo local_buckets[nBuckets];
+                            for (std::size_t i = start + begin; i < start + end; ++i)
+                            {
+                                int b = bucket_index(primitiveInfo[i]);
+                                local_buckets[b].count++;
+                                local_buckets[b].bounds = Union(local_buckets[b].bounds, primitiveInfo[i].bounds);
+                            }
+
+                            std::lock_guard<std::mutex> lock(mutex);
+                            for (unsigned int b = 0; b < nBuckets; ++b)
+                            {
+                                buckets[b].count += local_buckets[b].count;
+                                buckets[b].bounds = Union(buckets[b].bounds, local_buckets[b].bounds);
+                            }
+                        }, kPrimitivesGrainSize);
+                }
+                else
+                {
+                    for (unsigned int i = start; i < end; ++i)
+                    {
+                        int b = bucket_index(primitiveInfo[i]);
+                        buckets[b].count++;
+                        buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+                    }
                 }
 
                 // Compute costs for splitting after each bucket
@@ -187,39 +545,460 @@ Bvh::BVHBuildNode* Bvh::RecursiveBuild(
                     BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
                         [=](const BVHPrimitiveInfo& pi)
                         {
-                            int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
-                            if (b == nBuckets) b = nBuckets - 1;
-                            assert(b >= 0 && b < nBuckets);
-                            return b <= minCostSplitBucket;
+                            return bucket_index(pi) <= minCostSplitBucket;
                         });
                     mid = pmid - &primitiveInfo[0];
                 }
                 else
                 {
                     // Create leaf
-                    unsigned int firstPrimOffset = orderedTriangles.size();
-                    for (unsigned int i = start; i < end; ++i)
+                    node->InitLeaf(start, nPrimitives, bounds);
+                    return node;
+                }
+            }
+
+            BVHBuildNode* children[2];
+            if (nPrimitives >= kParallelSubtreeThreshold)
+            {
+                // Build the subtrees concurrently
+                ThreadPool::TaskGroup task_group(thread_pool);
+                task_group.Run([&]()
                     {
-                        unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                        orderedTriangles.push_back(triangles[primNum]);
+                        children[0] = RecursiveBuild(thread_pool, primitiveInfo, start, mid, arena);
+                    });
+                children[1] = RecursiveBuild(thread_pool, primitiveInfo, mid, end, arena);
+                task_group.Wait();
+            }
+            else
+            {
+                children[0] = RecursiveBuild(thread_pool, primitiveInfo, start, mid, arena);
+                children[1] = RecursiveBuild(thread_pool, primitiveInfo, mid, end, arena);
+            }
+
+            node->InitInterior(dim, children[0], children[1]);
+        }
+    }
+
+    return node;
+}
+
+void Bvh::BuildSpatial(std::vector<Triangle> const& triangles)
+{
+    auto start_time = Clock::now();
+
+    std::vector<BVHPrimitiveInfo> references(triangles.size());
+    Bounds3 scene_bounds;
+    for (unsigned int i = 0; i < triangles.size(); ++i)
+    {
+        references[i] = { i, triangles[i].GetBounds() };
+        scene_bounds = Union(scene_bounds, references[i].bounds);
+    }
+
+    std::size_t max_references = std::max(triangles.size(),
+        static_cast<std::size_t>(triangles.size() * options_.max_reference_ratio));
+    SpatialSplitState state = { triangles, options_.spatial_split_alpha * scene_bounds.SurfaceArea(),
+        max_references, triangles.size() };
+
+    primitive_indices_.clear();
+    primitive_indices_.reserve(max_references);
+
+    // Every leaf has at least one reference
+    auto arena = std::make_unique<BuildNodeArena>(std::max<std::size_t>(2 * max_references, 2) - 1);
+    BVHBuildNode* root_node = RecursiveBuildSpatial(state, references, 0, *arena);
+    unsigned int totalNodes = arena->GetAllocatedCount();
+
+    if (options_.optimize_treelets)
+    {
+        ThreadPool thread_pool;
+        OptimizeTreelets(thread_pool, root_node);
+    }
+
+    // Order the triangles by their first reference to keep the leaves coherent in memory
+    std::vector<std::uint32_t> new_indices(triangles.size(), INVALID_ID);
+    triangle_order_.clear();
+    triangle_order_.reserve(triangles.size());
+    for (auto& primitive_index : primitive_indices_)
+    {
+        if (new_indices[primitive_index] == INVALID_ID)
+        {
+            new_indices[primitive_index] = static_cast<std::uint32_t>(triangle_order_.size());
+            triangle_order_.push_back(primitive_index);
+        }
+        primitive_index = new_indices[primitive_index];
+    }
+    assert(triangle_order_.size() == triangles.size());
+
+    // Compute representation of depth-first traversal of BVH tree
+    nodes_.resize(totalNodes);
+    unsigned int offset = 0;
+    FlattenBVHTree(root_node, &offset);
+    assert(totalNodes == offset);
+
+    // The build tree is not needed anymore
+    arena.reset();
+
+    std::cout << "SBVH created with " << totalNodes << " nodes and " << primitive_indices_.size()
+        << " references for " << triangles.size() << " triangles ("
+        << float(totalNodes * sizeof(LinearBVHNode) + primitive_indices_.size() * sizeof(std::uint32_t)) / (1024.0f * 1024.0f)
+        << " MB, " << ElapsedMs(start_time, Clock::now()) << " ms elapsed)" << std::endl;
+}
+
+Bvh::BVHBuildNode* Bvh::RecursiveBuildSpatial(
+    SpatialSplitState& state,
+    std::vector<BVHPrimitiveInfo>& references,
+    unsigned int depth, BuildNodeArena& arena)
+{
+    BVHBuildNode* node = arena.Allocate();
+
+    unsigned int nReferences = static_cast<unsigned int>(references.size());
+
+    // Compute bounds of all references and their centroids in BVH node
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    for (auto const& reference : references)
+    {
+        bounds = Union(bounds, reference.bounds);
+        centroidBounds = Union(centroidBounds, reference.centroid);
+    }
+
+    auto create_leaf = [&]()
+    {
+        node->InitLeaf(static_cast<int>(primitive_indices_.size()), nReferences, bounds);
+        for (auto const& reference : references)
+        {
+            primitive_indices_.push_back(reference.primitiveNumber);
+        }
+        return node;
+    };
+
+    if (nReferences == 1)
+    {
+        return create_leaf();
+    }
+
+    auto bucket_index = [&](const BVHPrimitiveInfo& pi, unsigned int dim)
+    {
+        int b = kSpatialBuildBins * centroidBounds.Offset(pi.centroid)[dim];
+        if (b == kSpatialBuildBins) b = kSpatialBuildBins - 1;
+        assert(b >= 0 && b < kSpatialBuildBins);
+        return b;
+    };
+
+    // Find the object split with minimal SAH cost over all axes,
+    // buckets [0, object_bucket) go to the left child
+    float object_cost = std::numeric_limits<float>::max();
+    unsigned int object_dim = 0;
+    int object_bucket = 0;
+    Bounds3 object_left_bounds;
+    Bounds3 object_right_bounds;
+    for (unsigned int dim = 0; dim < 3; ++dim)
+    {
+        if (centroidBounds.max[dim] == centroidBounds.min[dim])
+        {
+            continue;
+        }
+
+        BucketInfo buckets[kSpatialBuildBins];
+        for (auto const& reference : references)
+        {
+            int b = bucket_index(reference, dim);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, reference.bounds);
+        }
+
+        Bounds3 right_bounds[kSpatialBuildBins];
+        int right_count[kSpatialBuildBins];
+        Bounds3 accumulated_bounds;
+        int accumulated_count = 0;
+        for (unsigned int i = kSpatialBuildBins - 1; i > 0; --i)
+        {
+            accumulated_bounds = Union(accumulated_bounds, buckets[i].bounds);
+            accumulated_count += buckets[i].count;
+            right_bounds[i] = accumulated_bounds;
+            right_count[i] = accumulated_count;
+        }
+
+        accumulated_bounds = Bounds3();
+        accumulated_count = 0;
+        for (unsigned int i = 1; i < kSpatialBuildBins; ++i)
+        {
+            accumulated_bounds = Union(accumulated_bounds, buckets[i - 1].bounds);
+            accumulated_count += buckets[i - 1].count;
+            if (accumulated_count == 0 || right_count[i] == 0)
+            {
+                continue;
+            }
+
+            float cost = accumulated_count * accumulated_bounds.SurfaceArea() + right_count[i] * right_bounds[i].SurfaceArea();
+            if (cost < object_cost)
+            {
+                object_cost = cost;
+                object_dim = dim;
+                object_bucket = i;
+                object_left_bounds = accumulated_bounds;
+                object_right_bounds = right_bounds[i];
+            }
+        }
+    }
+
+    // Spatial splits are worth trying only if the children of the object split overlap a lot
+    bool try_spatial_split = depth < kMaxSpatialSplitDepth && state.num_references < state.max_references;
+    if (try_spatial_split && object_cost < std::numeric_limits<float>::max())
+    {
+        Bounds3 overlap = Intersect(object_left_bounds, object_right_bounds);
+        try_spatial_split = overlap.IsValid() && overlap.SurfaceArea() > state.min_overlap_area;
+    }
+
+    // Find the spatial split with minimal SAH cost, references are chopped into the bins they overlap
+    float spatial_cost = std::numeric_limits<float>::max();
+    unsigned int spatial_dim = 0;
+    float spatial_position = 0.0f;
+    if (try_spatial_split)
+    {
+        struct SpatialBin
+        {
+            Bounds3 bounds;
+            int entries = 0;
+            int exits = 0;
+        };
+
+        for (unsigned int dim = 0; dim < 3; ++dim)
+        {
+            float origin = bounds.min[dim];
+            float bin_size = (bounds.max[dim] - origin) / kSpatialBuildBins;
+            if (bin_size <= 0.0f)
+            {
+                continue;
+            }
+
+            auto bin_index = [&](float position)
+            {
+                return clamp(static_cast<int>((position - origin) / bin_size), 0, static_cast<int>(kSpatialBuildBins) - 1);
+            };
+
+            SpatialBin bins[kSpatialBuildBins];
+            for (auto const& reference : references)
+            {
+                int first_bin = bin_index(reference.bounds.min[dim]);
+                int last_bin = bin_index(reference.bounds.max[dim]);
+                bins[first_bin].entries++;
+                bins[last_bin].exits++;
+
+                Bounds3 reference_bounds = reference.bounds;
+                for (int b = first_bin; b < last_bin; ++b)
+                {
+                    Bounds3 left_bounds, right_bounds;
+                    SplitReference(state.triangles[reference.primitiveNumber], reference_bounds,
+                        dim, origin + bin_size * (b + 1), left_bounds, right_bounds);
+                    if (left_bounds.IsValid())
+                    {
+                        bins[b].bounds = Union(bins[b].bounds, left_bounds);
                     }
-                    node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+                    reference_bounds = right_bounds;
+                }
 
-                    return node;
+                if (reference_bounds.IsValid())
+                {
+                    bins[last_bin].bounds = Union(bins[last_bin].bounds, reference_bounds);
                 }
             }
 
-            node->InitInterior(dim,
-                RecursiveBuild(triangles, primitiveInfo, start, mid,
-                    totalNodes, orderedTriangles),
-                RecursiveBuild(triangles, primitiveInfo, mid, end,
-                    totalNodes, orderedTriangles));
+            Bounds3 right_bounds[kSpatialBuildBins];
+            int right_count[kSpatialBuildBins];
+            Bounds3 accumulated_bounds;
+            int accumulated_count = 0;
+            for (unsigned int i = kSpatialBuildBins - 1; i > 0; --i)
+            {
+                accumulated_bounds = Union(accumulated_bounds, bins[i].bounds);
+                accumulated_count += bins[i].exits;
+                right_bounds[i] = accumulated_bounds;
+                right_count[i] = accumulated_count;
+            }
+
+            accumulated_bounds = Bounds3();
+            accumulated_count = 0;
+            for (unsigned int i = 1; i < kSpatialBuildBins; ++i)
+            {
+                accumulated_bounds = Union(accumulated_bounds, bins[i - 1].bounds);
+                accumulated_count += bins[i - 1].entries;
+                if (accumulated_count == 0 || right_count[i] == 0)
+                {
+                    continue;
+                }
+
+                float cost = accumulated_count * accumulated_bounds.SurfaceArea() + right_count[i] * right_bounds[i].SurfaceArea();
+                if (cost < spatial_cost)
+                {
+                    spatial_cost = cost;
+                    spatial_dim = dim;
+                    spatial_position = origin + bin_size * i;
+                }
+            }
         }
     }
 
+    // Either create leaf or split references, same cost model as the object split build
+    float min_cost = std::min(object_cost, spatial_cost);
+    if (min_cost == std::numeric_limits<float>::max() ||
+        (nReferences <= kMaxPrimitivesInNode && bounds.SurfaceArea() + min_cost >= nReferences * bounds.SurfaceArea()))
+    {
+        return create_leaf();
+    }
+
+    std::vector<BVHPrimitiveInfo> left_references;
+    std::vector<BVHPrimitiveInfo> right_references;
+    unsigned int dim = object_dim;
+
+    if (spatial_cost < object_cost)
+    {
+        dim = spatial_dim;
+
+        Bounds3 left_bounds;
+        Bounds3 right_bounds;
+        std::vector<BVHPrimitiveInfo> straddling_references;
+        for (auto const& reference : references)
+        {
+            if (reference.bounds.max[dim] <= spatial_position)
+            {
+                left_references.push_back(reference);
+                left_bounds = Union(left_bounds, reference.bounds);
+            }
+            else if (reference.bounds.min[dim] >= spatial_position)
+            {
+                right_references.push_back(reference);
+                right_bounds = Union(right_bounds, reference.bounds);
+            }
+            else
+            {
+                straddling_references.push_back(reference);
+            }
+        }
+
+        // Straddling references are split by default
+        std::vector<std::pair<Bounds3, Bounds3>> split_bounds(straddling_references.size());
+        for (std::size_t i = 0; i < straddling_references.size(); ++i)
+        {
+            auto const& reference = straddling_references[i];
+            SplitReference(state.triangles[reference.primitiveNumber], reference.bounds,
+                dim, spatial_position, split_bounds[i].first, split_bounds[i].second);
+            if (split_bounds[i].first.IsValid())
+            {
+                left_bounds = Union(left_bounds, split_bounds[i].first);
+            }
+            if (split_bounds[i].second.IsValid())
+            {
+                right_bounds = Union(right_bounds, split_bounds[i].second);
+            }
+        }
+
+        // Unless putting the whole reference to one of the children is cheaper
+        std::size_t left_count = left_references.size() + straddling_references.size();
+        std::size_t right_count = right_references.size() + straddling_references.size();
+        for (std::size_t i = 0; i < straddling_references.size(); ++i)
+        {
+            auto const& reference = straddling_references[i];
+            float split_cost = left_bounds.SurfaceArea() * left_count + right_bounds.SurfaceArea() * right_count;
+            float unsplit_left_cost = Union(left_bounds, reference.bounds).SurfaceArea() * left_count +
+                right_bounds.SurfaceArea() * (right_count - 1);
+            float unsplit_right_cost = left_bounds.SurfaceArea() * (left_count - 1) +
+                Union(right_bounds, reference.bounds).SurfaceArea() * right_count;
+
+            bool can_split = state.num_references < state.max_references &&
+                split_bounds[i].first.IsValid() && split_bounds[i].second.IsValid();
+            if (can_split && split_cost < std::min(unsplit_left_cost, unsplit_right_cost))
+            {
+                left_references.emplace_back(reference.primitiveNumber, split_bounds[i].first);
+                right_references.emplace_back(reference.primitiveNumber, split_bounds[i].second);
+                state.num_references++;
+            }
+            else if (unsplit_left_cost <= unsplit_right_cost)
+            {
+                left_references.push_back(reference);
+                left_bounds = Union(left_bounds, reference.bounds);
+                right_count--;
+            }
+            else
+            {
+                right_references.push_back(reference);
+                right_bounds = Union(right_bounds, reference.bounds);
+                left_count--;
+            }
+        }
+
+        // All references moved to one side, nothing is split in this case
+        if (left_references.empty() || right_references.empty())
+        {
+            if (object_cost == std::numeric_limits<float>::max())
+            {
+                return create_leaf();
+            }
+
+            left_references.clear();
+            right_references.clear();
+            spatial_cost = std::numeric_limits<float>::max();
+            dim = object_dim;
+        }
+    }
+
+    if (spatial_cost >= object_cost)
+    {
+        for (auto const& reference : references)
+        {
+            if (bucket_index(reference, object_dim) < object_bucket)
+            {
+                left_references.push_back(reference);
+            }
+            else
+            {
+                right_references.push_back(reference);
+            }
+        }
+    }
+
+    // References of this node are not needed anymore
+    std::vector<BVHPrimitiveInfo>().swap(references);
+
+    BVHBuildNode* child0 = RecursiveBuildSpatial(state, left_references, depth + 1, arena);
+    BVHBuildNode* child1 = RecursiveBuildSpatial(state, right_references, depth + 1, arena);
+    node->InitInterior(dim, child0, child1);
+
     return node;
 }
 
+void Bvh::OptimizeTreelets(ThreadPool& thread_pool, BVHBuildNode* root)
+{
+    if (root->nPrimitives > 0)
+    {
+        return;
+    }
+
+    auto start_time = Clock::now();
+    auto deadline = start_time + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(options_.treelet_optimization_budget_ms));
+
+    float root_area = root->bounds.SurfaceArea();
+    float initial_cost = ComputeSahCosts(root) / root_area;
+
+    std::atomic<std::uint32_t> num_restructured{ 0 };
+    std::uint32_t num_passes = 0;
+    while (num_passes < options_.treelet_optimization_passes && Clock::now() < deadline)
+    {
+        std::uint32_t restructured_before = num_restructured;
+        OptimizeTreeletsRecursive(thread_pool, root, 0, deadline, num_restructured);
+        ++num_passes;
+
+        // Converged, the next pass would find the same topologies
+        if (num_restructured == restructured_before)
+        {
+            break;
+        }
+    }
+
+    std::cout << "Treelet optimization: SAH cost " << initial_cost << " -> " << root->cost / root_area
+        << ", " << num_restructured << " treelets restructured in " << num_passes << " passes ("
+        << ElapsedMs(start_time, Clock::now()) << " ms elapsed)" << std::endl;
+}
+
 unsigned int Bvh::FlattenBVHTree(BVHBuildNode* node, unsigned int* offset)
 {
     LinearBVHNode* linearNode = &nodes_[*offset];
@@ -25,16 +25,23 @@
 #pragma once
 
 #include "acceleration_structure.hpp"
+#include <atomic>
+#include <cassert>
 #include <memory>
 
+class ThreadPool;
+
 class Bvh : public AccelerationStructure
 {
 public:
-    Bvh();
+    Bvh(BvhBuildOptions const& options = {});
 
-    // TODO: USE CONSTANT REF
-    void BuildCPU(std::vector<Triangle> & triangles) override;
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    void Refit(std::vector<Triangle> const& triangles) override { RefitBvhNodes(nodes_, primitive_indices_, triangles); }
+    void SetRefittedNodes(std::vector<LinearBVHNode> const& nodes) override { nodes_ = nodes; }
     std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<std::uint32_t> const& GetPrimitiveIndices() const override { return primitive_indices_; }
+    std::vector<std::uint32_t> const& GetTriangleOrder() const override { return triangle_order_; }
 
     //void IntersectRays(cl::Buffer const& rays_buffer, cl::Buffer const& ray_counter_buffer,
     //    std::uint32_t max_num_rays, cl::Buffer const& hits_buffer, bool closest_hit = true) override;
@@ -79,6 +86,8 @@ public:
         Bounds3 bounds;
         BVHBuildNode* children[2];
         int splitAxis, firstPrimOffset, nPrimitives;
+        // SAH cost of the subtree, computed by the treelet optimizer
+        float cost;
 
     };
 
@@ -88,16 +97,58 @@ public:
         Bounds3 bounds;
     };
 
+    // Bump allocator for the temporary build tree, thread-safe
+    class BuildNodeArena
+    {
+    public:
+        explicit BuildNodeArena(std::size_t capacity)
+            : nodes_(new BVHBuildNode[capacity]), capacity_(capacity)
+        {}
+
+        BVHBuildNode* Allocate()
+        {
+            unsigned int node_idx = num_allocated_++;
+            assert(node_idx < capacity_);
+            return &nodes_[node_idx];
+        }
+
+        unsigned int GetAllocatedCount() const { return num_allocated_; }
+        std::size_t GetCapacity() const { return capacity_; }
+
+    private:
+        std::unique_ptr<BVHBuildNode[]> nodes_;
+        std::size_t capacity_;
+        std::atomic<unsigned int> num_allocated_{ 0 };
+    };
+
 private:
+    struct SpatialSplitState
+    {
+        std::vector<Triangle> const& triangles;
+        // Spatial splits are not tried for smaller overlap areas
+        float min_overlap_area;
+        std::size_t max_references;
+        std::size_t num_references;
+    };
+
+    void BuildSpatial(std::vector<Triangle> const& triangles);
+    BVHBuildNode* RecursiveBuildSpatial(
+        SpatialSplitState& state,
+        std::vector<BVHPrimitiveInfo>& references,
+        unsigned int depth, BuildNodeArena& arena);
     BVHBuildNode* RecursiveBuild(
-        std::vector<Triangle> const& triangles,
+        ThreadPool& thread_pool,
         std::vector<BVHPrimitiveInfo>& primitiveInfo,
         unsigned int start,
-        unsigned int end, unsigned int* totalNodes,
-        std::vector<Triangle>& orderedTriangles);
+        unsigned int end, BuildNodeArena& arena);
+    // Restructures the treelets of the build tree, the leaves and their primitive ranges are kept
+    void OptimizeTreelets(ThreadPool& thread_pool, BVHBuildNode* root);
     unsigned int FlattenBVHTree(BVHBuildNode* node, unsigned int* offset);
 
     std::vector<LinearBVHNode> nodes_;
-    BVHBuildNode* root_node_;
+    // Leaf references to triangles, filled by the spatial split build only
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> triangle_order_;
+    BvhBuildOptions options_;
     std::uint32_t max_prims_in_node_;
 };
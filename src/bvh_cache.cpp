@@ -0,0 +1,256 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "bvh_cache.hpp"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+namespace
+{
+    // Bump the version when the file layout changes
+    constexpr std::uint32_t kBvhCacheVersion = 1;
+    constexpr char kBvhCacheMagic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 'C', 'H' };
+
+    struct BvhCacheHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        // Catches the node layout changes and the builds for other platforms
+        std::uint32_t node_size;
+        std::uint64_t key;
+        std::uint64_t node_count;
+        std::uint64_t primitive_index_count;
+        std::uint64_t triangle_count;
+    };
+
+    // FNV-1a over 32-bit words
+    constexpr std::uint64_t kFnvOffsetBasis = 14695981039346656037ull;
+    constexpr std::uint64_t kFnvPrime = 1099511628211ull;
+
+    void HashWord(std::uint64_t& hash, std::uint32_t word)
+    {
+        hash ^= word;
+        hash *= kFnvPrime;
+    }
+
+    void HashFloat(std::uint64_t& hash, float value)
+    {
+        std::uint32_t word;
+        std::memcpy(&word, &value, sizeof(word));
+        HashWord(hash, word);
+    }
+
+    void HashPosition(std::uint64_t& hash, float3 const& position)
+    {
+        HashFloat(hash, position.x);
+        HashFloat(hash, position.y);
+        HashFloat(hash, position.z);
+    }
+
+    template <typename T>
+    bool ReadVector(std::ifstream& file, std::vector<T>& data, std::uint64_t count)
+    {
+        data.resize(count);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(data.data()), count * sizeof(T)));
+    }
+
+    // The loaded arrays index each other and the scene, a corrupt file must not send the traversal out of bounds
+    bool IsValidBvh(std::vector<LinearBVHNode> const& nodes, std::vector<std::uint32_t> const& primitive_indices,
+        std::vector<std::uint32_t> const& triangle_order, std::uint64_t triangle_count)
+    {
+        if (nodes.empty() || triangle_order.size() != triangle_count)
+        {
+            return false;
+        }
+
+        // The triangle order must be a permutation
+        std::vector<bool> referenced(triangle_count, false);
+        for (auto triangle_idx : triangle_order)
+        {
+            if (triangle_idx >= triangle_count || referenced[triangle_idx])
+            {
+                return false;
+            }
+            referenced[triangle_idx] = true;
+        }
+
+        for (auto primitive_idx : primitive_indices)
+        {
+            if (primitive_idx >= triangle_count)
+            {
+                return false;
+            }
+        }
+
+        // The leaves stay in the primitive range and the children are stored after their parents
+        std::uint64_t num_primitives = primitive_indices.empty() ? triangle_count : primitive_indices.size();
+        for (std::size_t node_idx = 0; node_idx < nodes.size(); ++node_idx)
+        {
+            auto const& node = nodes[node_idx];
+            std::uint32_t leaf_primitive_count = node.num_primitives_axis >> 16;
+            if (leaf_primitive_count > 0)
+            {
+                if (std::uint64_t(node.offset) + leaf_primitive_count > num_primitives)
+                {
+                    return false;
+                }
+            }
+            else if (node.offset <= node_idx + 1 || node.offset >= nodes.size())
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <typename T>
+    void WriteVector(std::ofstream& file, std::vector<T> const& data)
+    {
+        file.write(reinterpret_cast<char const*>(data.data()), data.size() * sizeof(T));
+    }
+}
+
+CachedBvh::CachedBvh(std::vector<LinearBVHNode> nodes, std::vector<std::uint32_t> primitive_indices,
+    std::vector<std::uint32_t> triangle_order)
+    : nodes_(std::move(nodes))
+    , primitive_indices_(std::move(primitive_indices))
+    , triangle_order_(std::move(triangle_order))
+{
+}
+
+void CachedBvh::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    if (triangles.size() != triangle_order_.size())
+    {
+        throw std::runtime_error("The BVH cache was written for another scene");
+    }
+
+    std::cout << "BVH loaded from the cache with " << nodes_.size() << " nodes for "
+        << triangles.size() << " triangles" << std::endl;
+}
+
+std::uint64_t ComputeBvhCacheKey(std::vector<Triangle> const& triangles, BvhBuildOptions const& options)
+{
+    std::uint64_t hash = kFnvOffsetBasis;
+
+    // The topology depends on the positions only, the other vertex attributes are moved with the triangles
+    HashWord(hash, static_cast<std::uint32_t>(triangles.size()));
+    for (auto const& triangle : triangles)
+    {
+        HashPosition(hash, triangle.v1.position);
+        HashPosition(hash, triangle.v2.position);
+        HashPosition(hash, triangle.v3.position);
+    }
+
+    // The wide node options are applied after the build
+    HashWord(hash, static_cast<std::uint32_t>(options.builder));
+    HashWord(hash, options.enable_spatial_splits ? 1u : 0u);
+    HashFloat(hash, options.spatial_split_alpha);
+    HashFloat(hash, options.max_reference_ratio);
+    HashWord(hash, options.use_63bit_morton_codes ? 1u : 0u);
+    HashWord(hash, options.optimize_treelets ? 1u : 0u);
+    HashWord(hash, options.treelet_optimization_passes);
+    HashFloat(hash, options.treelet_optimization_budget_ms);
+
+    return hash;
+}
+
+std::unique_ptr<CachedBvh> LoadBvhCache(std::string const& path, std::uint64_t key, std::size_t triangle_count)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        return nullptr;
+    }
+
+    std::uint64_t file_size = static_cast<std::uint64_t>(file.tellg());
+    file.seekg(0);
+
+    BvhCacheHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kBvhCacheMagic, sizeof(kBvhCacheMagic)) != 0 ||
+        header.version != kBvhCacheVersion || header.node_size != sizeof(LinearBVHNode) || header.key != key ||
+        header.triangle_count != triangle_count)
+    {
+        return nullptr;
+    }
+
+    // Truncated file
+    std::uint64_t data_size = header.node_count * sizeof(LinearBVHNode) +
+        (header.primitive_index_count + header.triangle_count) * sizeof(std::uint32_t);
+    if (file_size != sizeof(header) + data_size)
+    {
+        return nullptr;
+    }
+
+    std::vector<LinearBVHNode> nodes;
+    std::vector<std::uint32_t> primitive_indices;
+    std::vector<std::uint32_t> triangle_order;
+    if (!ReadVector(file, nodes, header.node_count) ||
+        !ReadVector(file, primitive_indices, header.primitive_index_count) ||
+        !ReadVector(file, triangle_order, header.triangle_count))
+    {
+        return nullptr;
+    }
+
+    if (!IsValidBvh(nodes, primitive_indices, triangle_order, triangle_count))
+    {
+        std::cerr << "The BVH cache " << path << " is corrupt and will be rebuilt" << std::endl;
+        return nullptr;
+    }
+
+    return std::make_unique<CachedBvh>(std::move(nodes), std::move(primitive_indices), std::move(triangle_order));
+}
+
+bool SaveBvhCache(std::string const& path, std::uint64_t key, AccelerationStructure const& acc_structure)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    auto const& nodes = acc_structure.GetNodes();
+    auto const& primitive_indices = acc_structure.GetPrimitiveIndices();
+    auto const& triangle_order = acc_structure.GetTriangleOrder();
+
+    BvhCacheHeader header = {};
+    std::memcpy(header.magic, kBvhCacheMagic, sizeof(kBvhCacheMagic));
+    header.version = kBvhCacheVersion;
+    header.node_size = sizeof(LinearBVHNode);
+    header.key = key;
+    header.node_count = nodes.size();
+    header.primitive_index_count = primitive_indices.size();
+    header.triangle_count = triangle_order.size();
+
+    file.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    WriteVector(file, nodes);
+    WriteVector(file, primitive_indices);
+    WriteVector(file, triangle_order);
+
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,61 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "acceleration_structure.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// BVH restored from a cache file written after a previous build of the same scene.
+// BuildCPU doesn't rebuild anything, the cached triangle order is applied by the scene as usual
+class CachedBvh : public AccelerationStructure
+{
+public:
+    CachedBvh(std::vector<LinearBVHNode> nodes, std::vector<std::uint32_t> primitive_indices,
+        std::vector<std::uint32_t> triangle_order);
+
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    void Refit(std::vector<Triangle> const& triangles) override { RefitBvhNodes(nodes_, primitive_indices_, triangles); }
+    void SetRefittedNodes(std::vector<LinearBVHNode> const& nodes) override { nodes_ = nodes; }
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<std::uint32_t> const& GetPrimitiveIndices() const override { return primitive_indices_; }
+    std::vector<std::uint32_t> const& GetTriangleOrder() const override { return triangle_order_; }
+
+private:
+    std::vector<LinearBVHNode> nodes_;
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> triangle_order_;
+};
+
+// Hash of the triangle positions in the input order and of the options the BVH topology depends on
+std::uint64_t ComputeBvhCacheKey(std::vector<Triangle> const& triangles, BvhBuildOptions const& options);
+
+// Returns nullptr if the file is missing, has another version, was written for another key or triangle count
+// or indexes out of its arrays
+std::unique_ptr<CachedBvh> LoadBvhCache(std::string const& path, std::uint64_t key, std::size_t triangle_count);
+
+// Writes the single level BVH right after BuildCPU, returns false if the file can't be written
+bool SaveBvhCache(std::string const& path, std::uint64_t key, AccelerationStructure const& acc_structure);
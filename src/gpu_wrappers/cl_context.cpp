@@ -24,34 +24,53 @@
 
 #include "cl_context.hpp"
 #include "utils/cl_exception.hpp"
-#include "render.hpp"
 #include <iostream>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <algorithm>
 
 #ifdef WIN32
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#else
+#include <GL/glx.h>
 #endif
 
-CLContext::CLContext(const cl::Platform& platform)
+CLContext::CLContext(const cl::Platform& platform, bool enable_gl_interop)
     : platform_(platform)
     , kernels_path_("src/kernels/cl/")
+    , enable_gl_interop_(enable_gl_interop)
 {
     std::cout << "Platform: " << platform.getInfo<CL_PLATFORM_NAME>() << std::endl;
 
-    cl_context_properties props[] =
+    std::vector<cl_context_properties> props =
     {
         // OpenCL platform
-        CL_CONTEXT_PLATFORM, (cl_context_properties)platform(),
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform()
+    };
+
+    if (enable_gl_interop_)
+    {
+#ifdef WIN32
         // OpenGL context
-        CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+        props.push_back(CL_GL_CONTEXT_KHR);
+        props.push_back((cl_context_properties)wglGetCurrentContext());
         // HDC used to create the OpenGL context
-        CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-        0
-    };
+        props.push_back(CL_WGL_HDC_KHR);
+        props.push_back((cl_context_properties)wglGetCurrentDC());
+#else
+        // OpenGL context
+        props.push_back(CL_GL_CONTEXT_KHR);
+        props.push_back((cl_context_properties)glXGetCurrentContext());
+        // X11 display used to create the OpenGL context
+        props.push_back(CL_GLX_DISPLAY_KHR);
+        props.push_back((cl_context_properties)glXGetCurrentDisplay());
+#endif
+    }
+
+    props.push_back(0);
 
     platform.getDevices(CL_DEVICE_TYPE_ALL, &devices_);
     if (devices_.empty())
@@ -75,7 +94,7 @@ CLContext::CLContext(const cl::Platform& platform)
     }
 
     cl_int status;
-    context_ = cl::Context(devices_, props, 0, 0, &status);
+    context_ = cl::Context(devices_, props.data(), 0, 0, &status);
     ThrowIfFailed(status, "Failed to create OpenCL context");
 
     queue_ = cl::CommandQueue(context_, devices_[0], 0, &status);
@@ -91,12 +110,24 @@ void CLContext::WriteBuffer(const cl::Buffer& buffer, const void* data, size_t s
     ThrowIfFailed(status, "Failed to write buffer");
 }
 
-void CLContext::ReadBuffer(const cl::Buffer& buffer, void* data, size_t size) const
+void CLContext::ReadBuffer(const cl::Buffer& buffer, void* data, size_t size, cl::Event* event) const
 {
-    cl_int status = queue_.enqueueReadBuffer(buffer, false, 0, size, data);
+    cl_int status = queue_.enqueueReadBuffer(buffer, false, 0, size, data, nullptr, event);
     ThrowIfFailed(status, "Failed to read buffer");
 }
 
+void CLContext::ReadImage(const cl::Image2D& image, std::size_t width, std::size_t height, void* data) const
+{
+    cl::size_t<3> origin;
+    cl::size_t<3> region;
+    region[0] = width;
+    region[1] = height;
+    region[2] = 1;
+
+    cl_int status = queue_.enqueueReadImage(image, true, origin, region, 0, 0, data);
+    ThrowIfFailed(status, "Failed to read image");
+}
+
 void CLContext::CopyBuffer(const cl::Buffer& src_buffer, const cl::Buffer& dst_buffer,
     std::size_t src_offset, std::size_t dst_offset, std::size_t size) const
 {
@@ -104,9 +135,10 @@ void CLContext::CopyBuffer(const cl::Buffer& src_buffer, const cl::Buffer& dst_b
     ThrowIfFailed(status, "Failed to copy buffer");
 }
 
-void CLContext::ExecuteKernel(CLKernel const& kernel, std::size_t work_size) const
+void CLContext::ExecuteKernel(CLKernel const& kernel, std::size_t work_size, std::size_t local_size) const
 {
-    cl_int status = queue_.enqueueNDRangeKernel(kernel.GetKernel(), cl::NullRange, cl::NDRange(work_size), cl::NullRange, 0);
+    cl_int status = queue_.enqueueNDRangeKernel(kernel.GetKernel(), cl::NullRange, cl::NDRange(work_size),
+        local_size > 0 ? cl::NDRange(local_size) : cl::NullRange, 0);
     ThrowIfFailed(status, ("Failed to enqueue kernel " + kernel.GetName()).c_str());
 }
 
@@ -37,19 +37,24 @@ class CLKernel;
 class CLContext
 {
 public:
-    CLContext(const cl::Platform& platform);
+    // Pass enable_gl_interop = false to create a plain context (e.g. headless rendering)
+    CLContext(const cl::Platform& platform, bool enable_gl_interop = true);
     std::shared_ptr<CLKernel> CreateKernel(const char* filename, char const* kernel_name,
         std::vector<std::string> const& definitions = std::vector<std::string>());
 
     void WriteBuffer(const cl::Buffer& buffer, const void* data, size_t size) const;
-    void ReadBuffer(const cl::Buffer& buffer, void* ptr, size_t size) const;
+    // Doesn't wait for the read, pass an event to find out when the data is available
+    void ReadBuffer(const cl::Buffer& buffer, void* ptr, size_t size, cl::Event* event = nullptr) const;
+    void ReadImage(const cl::Image2D& image, std::size_t width, std::size_t height, void* ptr) const;
     void CopyBuffer(const cl::Buffer& src_buffer, const cl::Buffer& dst_buffer,
         std::size_t src_offset, std::size_t dst_offset, std::size_t size) const;
-    void ExecuteKernel(CLKernel const& kernel, std::size_t work_size) const;
+    // local_size = 0 lets the implementation pick the work group size
+    void ExecuteKernel(CLKernel const& kernel, std::size_t work_size, std::size_t local_size = 0) const;
     void Finish() const { queue_.finish(); }
     void AcquireGLObject(cl_mem mem);
     void ReleaseGLObject(cl_mem mem);
 
+    bool IsGLInteropEnabled() const { return enable_gl_interop_; }
     const cl::Context& GetContext() const { return context_; }
     std::vector<cl::Device> const& GetDevices() const { return devices_; }
     void ReloadKernels();
@@ -61,6 +66,7 @@ private:
     cl::CommandQueue queue_;
     std::vector<std::weak_ptr<CLKernel>> kernels_;
     std::string kernels_path_;
+    bool enable_gl_interop_;
 
 };
 
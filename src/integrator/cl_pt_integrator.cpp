@@ -26,9 +26,10 @@
 
 #include "cl_pt_integrator.hpp"
 #include "utils/cl_exception.hpp"
-#include "Scene/scene.hpp"
+#include "scene/scene.hpp"
 #include "acceleration_structure.hpp"
-#include "Utils/blue_noise_sampler.hpp"
+#include "utils/blue_noise_sampler.hpp"
+#include <algorithm>
 
 namespace args
 {
@@ -49,6 +50,10 @@ namespace args
             kDepth,
             kNormal,
             kVelocity,
+            // ADAPTIVE_SAMPLING_THRESHOLD only
+            kRadianceBuffer,
+            kLuminanceSqSumsBuffer,
+            kPixelSampleCountsBuffer,
         };
     }
 
@@ -75,7 +80,10 @@ namespace args
             kRayCounterBuffer,
             kPixelIndicesBuffer,
             kHitsBuffer,
-            kTrianglesBuffer,
+            kIndexedTrianglesBuffer,
+            kVertexPositionsBuffer,
+            kVertexTexcoordsBuffer,
+            kInstancesBuffer,
             kMaterialsBuffer,
             kTexturesBuffer,
             kTextureDataBuffer,
@@ -88,6 +96,9 @@ namespace args
             kDepth,
             kNormal,
             kVelocity,
+            // BVH_STATISTICS only
+            kTraversalStats,
+            kTraversalHeatmap,
         };
     }
 
@@ -100,9 +111,12 @@ namespace args
             kIncomingRayCounterBuffer,
             kIncomingPixelIndicesBuffer,
             kHitsBuffer,
-            kTrianglesBuffer,
+            kIndexedTrianglesBuffer,
+            kVertexPositionsBuffer,
+            kVertexTexcoordsBuffer,
+            kInstancesBuffer,
             kAnalyticLightsBuffer,
-            kEmissiveIndicesBuffer,
+            kEmissiveAliasTableBuffer,
             kMaterialsBuffer,
             kTexturesBuffer,
             kTextureDataBuffer,
@@ -116,6 +130,7 @@ namespace args
             kRankingTileBuffer,
             // Output
             kThroughputsBuffer,
+            kBxdfPdfsBuffer,
             kOutgoingRayBuffer,
             kOutgoingRayCounterBuffer,
             kOutgoingPixelIndicesBuffer,
@@ -124,6 +139,8 @@ namespace args
             kShadowPixelIndicesBuffer,
             kDirectLightSamplesBuffer,
             kRadianceBuffer,
+            // MATERIAL_SORTED_SHADING only
+            kShadingOrderBuffer,
         };
     }
 
@@ -168,13 +185,49 @@ namespace args
             kDepth,
             kNormal,
             kMotionVectors,
+            kTraversalHeatmap,
             kSampleCounterBuffer,
             // Output
             kResolvedTexture,
+            // ADAPTIVE_SAMPLING_THRESHOLD only
+            kPixelSampleCountsBuffer,
         };
     }
 }
 
+namespace
+{
+    // Bounces with the ray counts tracked, the deeper ones are launched for all pixels
+    constexpr std::uint32_t kMaxRayCountBounces = 16;
+    // Launches are rounded up to this and never smaller than enough work items to fill a GPU
+    constexpr std::size_t kRayLaunchGranularity = 256;
+    constexpr std::size_t kMinRayLaunchSize = 16384;
+    // Resident work items per compute unit the persistent traversal is launched with
+    constexpr std::size_t kPersistentWorkItemsPerComputeUnit = 2048;
+    // Must match sort_rays.cl
+    constexpr std::uint32_t kRayKeyBits = 3 + 3 * 7;
+    constexpr std::uint32_t kRadixBits = 4;
+    constexpr std::uint32_t kRadixSize = 1u << kRadixBits;
+    constexpr std::size_t kRaySortGroupSize = 256;
+    // Each work group of the radix sort takes a contiguous chunk of the rays
+    constexpr std::uint32_t kRaySortGroups = 128;
+    // Must match hit_surface.cl, the spawned rays are compacted per work group
+    constexpr std::size_t kHitSurfaceGroupSize = 64;
+
+    // Compressed triangles used by the BVH kernels
+    std::vector<RTTriangle> GetRTTriangles(std::vector<Triangle> const& triangles)
+    {
+        std::vector<RTTriangle> rt_triangles;
+        rt_triangles.reserve(triangles.size());
+        for (auto const& triangle : triangles)
+        {
+            rt_triangles.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
+        }
+
+        return rt_triangles;
+    }
+}
+
 cl::Buffer CLPathTraceIntegrator::CreateBuffer(std::size_t size)
 {
     cl_int status;
@@ -197,6 +250,8 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
     cl_int status;
 
     radiance_buffer_ = CreateBuffer(num_rays * sizeof(cl_float4));
+    luminance_sq_sums_buffer_ = CreateBuffer(num_rays * sizeof(cl_float));
+    pixel_sample_counts_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
 
     // if (enable_denoiser_)
     {
@@ -205,19 +260,22 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
 
     for (int i = 0; i < 2; ++i)
     {
-        rays_buffer_[i] = CreateBuffer(num_rays * sizeof(Ray));
-        pixel_indices_buffer_[i] = CreateBuffer(num_rays * sizeof(std::uint32_t));
         ray_counter_buffer_[i] = CreateBuffer(sizeof(std::uint32_t));
     }
 
-    shadow_rays_buffer_ = CreateBuffer(num_rays * sizeof(Ray));
-    shadow_pixel_indices_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
     shadow_ray_counter_buffer_ = CreateBuffer(sizeof(std::uint32_t));
-    hits_buffer_ = CreateBuffer(num_rays * sizeof(Hit));
-    shadow_hits_buffer_ = CreateBuffer(num_rays * sizeof(std::uint32_t));
-    throughputs_buffer_ = CreateBuffer(num_rays * sizeof(cl_float3));
     sample_counter_buffer_ = CreateBuffer(sizeof(std::uint32_t));
-    direct_light_samples_buffer_ = CreateBuffer(num_rays * sizeof(cl_float4));
+    ray_count_history_buffer_ = CreateBuffer(kMaxRayCountBounces * 2 * sizeof(std::uint32_t));
+    CreatePathBuffers();
+
+    ray_queue_counter_buffer_ = CreateBuffer(sizeof(std::uint32_t));
+    std::uint32_t traced_ray_count[2] = { 0, 0 };
+    traced_ray_count_buffer_ = CreateBuffer(sizeof(traced_ray_count));
+    cl_context_.WriteBuffer(traced_ray_count_buffer_, traced_ray_count, sizeof(traced_ray_count));
+    persistent_launch_size_ = cl_context_.GetDevices()[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+        kPersistentWorkItemsPerComputeUnit;
+
+    ray_sort_histograms_buffer_ = CreateBuffer(kRadixSize * kRaySortGroups * sizeof(std::uint32_t));
 
     // Sampler buffers
     {
@@ -246,10 +304,24 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
 
         normal_buffer_ = CreateBuffer(num_rays * sizeof(cl_float3));
         velocity_buffer_ = CreateBuffer(num_rays * sizeof(cl_float2));
+        traversal_heatmap_buffer_ = CreateBuffer(num_rays * sizeof(TraversalStats));
     }
 
-    output_image_ = std::make_unique<cl::ImageGL>(cl_context.GetContext(), CL_MEM_WRITE_ONLY,
-        GL_TEXTURE_2D, 0, gl_interop_image_, &status);
+    if (gl_interop_image_ != 0)
+    {
+        output_image_ = std::make_unique<cl::ImageGL>(cl_context.GetContext(), CL_MEM_WRITE_ONLY,
+            GL_TEXTURE_2D, 0, gl_interop_image_, &status);
+    }
+    else
+    {
+        // Headless mode, the result is read back by the host
+        cl::ImageFormat image_format;
+        image_format.image_channel_order = CL_RGBA;
+        image_format.image_channel_data_type = CL_FLOAT;
+
+        output_image_ = std::make_unique<cl::Image2D>(cl_context.GetContext(), CL_MEM_WRITE_ONLY,
+            image_format, width_, height_, 0, nullptr, &status);
+    }
     ThrowIfFailed(status, "Failed to create output image");
 
     CreateKernels();
@@ -258,11 +330,125 @@ CLPathTraceIntegrator::CLPathTraceIntegrator(std::uint32_t width, std::uint32_t
     Reset();
 }
 
+CLPathTraceIntegrator::~CLPathTraceIntegrator()
+{
+    // The pending readback writes to the host memory of the integrator
+    if (ray_count_readback_event_())
+    {
+        ray_count_readback_event_.wait();
+    }
+}
+
+void CLPathTraceIntegrator::CreatePathBuffers()
+{
+    std::uint32_t num_paths = width_ * height_ * samples_per_launch_;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        rays_buffer_[i] = CreateBuffer(num_paths * sizeof(Ray));
+        pixel_indices_buffer_[i] = CreateBuffer(num_paths * sizeof(std::uint32_t));
+        ray_sort_keys_buffer_[i] = CreateBuffer(num_paths * sizeof(std::uint32_t));
+        ray_sort_values_buffer_[i] = CreateBuffer(num_paths * sizeof(std::uint32_t));
+    }
+
+    shadow_rays_buffer_ = CreateBuffer(num_paths * sizeof(Ray));
+    shadow_pixel_indices_buffer_ = CreateBuffer(num_paths * sizeof(std::uint32_t));
+    hits_buffer_ = CreateBuffer(num_paths * sizeof(Hit));
+    shadow_hits_buffer_ = CreateBuffer(num_paths * sizeof(std::uint32_t));
+    throughputs_buffer_ = CreateBuffer(num_paths * sizeof(cl_float3));
+    bxdf_pdfs_buffer_ = CreateBuffer(num_paths * sizeof(float));
+    direct_light_samples_buffer_ = CreateBuffer(num_paths * sizeof(cl_float4));
+    shading_order_buffer_ = CreateBuffer(num_paths * sizeof(std::uint32_t));
+    traversal_stats_buffer_ = CreateBuffer(num_paths * sizeof(TraversalStats));
+
+    if (UsesPathRadianceBuffer())
+    {
+        // Zeroed once, AccumulatePathRadiance clears the paths it adds up
+        path_radiance_buffer_ = CreateBuffer(num_paths * sizeof(cl_float4));
+        std::vector<cl_float4> zero_radiance(num_paths, cl_float4{});
+        cl_context_.WriteBuffer(path_radiance_buffer_, zero_radiance.data(), num_paths * sizeof(cl_float4));
+    }
+    else
+    {
+        path_radiance_buffer_ = radiance_buffer_;
+    }
+
+    // The pending readback writes to the history we are about to reset
+    if (ray_count_readback_event_())
+    {
+        ray_count_readback_event_.wait();
+    }
+
+    // Until the first readback completes all paths are expected to have live rays
+    ray_count_readback_.assign(kMaxRayCountBounces * 2, num_paths);
+    predicted_ray_counts_ = ray_count_readback_;
+    cl_context_.WriteBuffer(ray_count_history_buffer_, ray_count_readback_.data(),
+        ray_count_readback_.size() * sizeof(std::uint32_t));
+}
+
+std::size_t CLPathTraceIntegrator::GetRayLaunchSize(std::uint32_t history_idx) const
+{
+    std::size_t max_num_rays = width_ * height_ * samples_per_launch_;
+    if (history_idx >= predicted_ray_counts_.size())
+    {
+        return max_num_rays;
+    }
+
+    // The kernels loop over the rays the launch doesn't cover, so the headroom
+    // only absorbs the usual growth of the ray count from frame to frame
+    std::size_t num_rays = predicted_ray_counts_[history_idx];
+    std::size_t launch_size = (num_rays + num_rays / 8 + kRayLaunchGranularity - 1) /
+        kRayLaunchGranularity * kRayLaunchGranularity;
+
+    return std::min(std::max(launch_size, kMinRayLaunchSize), max_num_rays);
+}
+
+void CLPathTraceIntegrator::ReadRayCountHistory()
+{
+    if (ray_count_readback_event_())
+    {
+        // Keep the previous prediction until the last readback is done instead of waiting
+        if (ray_count_readback_event_.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+        {
+            return;
+        }
+
+        predicted_ray_counts_ = ray_count_readback_;
+    }
+
+    cl_context_.ReadBuffer(ray_count_history_buffer_, ray_count_readback_.data(),
+        ray_count_readback_.size() * sizeof(std::uint32_t), &ray_count_readback_event_);
+}
+
+void CLPathTraceIntegrator::ExecuteTraceKernel(CLKernel const& kernel, cl::Buffer const& ray_counter_buffer,
+    std::size_t launch_size)
+{
+    if (enable_persistent_threads_)
+    {
+        clear_counter_kernel_->SetArgument(0, ray_queue_counter_buffer_);
+        cl_context_.ExecuteKernel(*clear_counter_kernel_, 1);
+        launch_size = std::min(launch_size, persistent_launch_size_);
+    }
+
+    cl_context_.ExecuteKernel(kernel, launch_size);
+
+    add_to_counter_kernel_->SetArgument(0, traced_ray_count_buffer_);
+    add_to_counter_kernel_->SetArgument(1, ray_counter_buffer);
+    cl_context_.ExecuteKernel(*add_to_counter_kernel_, 1);
+}
+
+std::uint64_t CLPathTraceIntegrator::GetTracedRayCount()
+{
+    std::uint32_t traced_ray_count[2];
+    cl_context_.ReadBuffer(traced_ray_count_buffer_, traced_ray_count, sizeof(traced_ray_count));
+    cl_context_.Finish();
+
+    return (std::uint64_t(traced_ray_count[1]) << 32) | traced_ray_count[0];
+}
+
 void CLPathTraceIntegrator::CreateKernels()
 {
     // Create kernels
-    reset_kernel_ = cl_context_.CreateKernel("reset_radiance.cl", "ResetRadiance");
-    raygen_kernel_ = cl_context_.CreateKernel("raygeneration.cl", "RayGeneration");
 
     std::vector<std::string> definitions;
     if (enable_white_furnace_)
@@ -280,12 +466,45 @@ void CLPathTraceIntegrator::CreateKernels()
         definitions.push_back("ENABLE_DENOISER");
     }
 
+    if (samples_per_launch_ > 1)
+    {
+        definitions.push_back("SAMPLES_PER_LAUNCH=" + std::to_string(samples_per_launch_));
+    }
+
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        definitions.push_back("ADAPTIVE_SAMPLING_THRESHOLD=" + std::to_string(adaptive_sampling_threshold_) + "f");
+    }
+
+    if (russian_roulette_bounce_ > 0)
+    {
+        definitions.push_back("RUSSIAN_ROULETTE_BOUNCE=" + std::to_string(russian_roulette_bounce_));
+    }
+
+    std::vector<std::string> hit_surface_definitions = definitions;
+    hit_surface_definitions.push_back("MAX_BOUNCES=" + std::to_string(max_bounces_));
+    if (enable_material_sorted_shading_)
+    {
+        hit_surface_definitions.push_back("MATERIAL_SORTED_SHADING");
+    }
+
+    // The AOV kernel gathers the traversal work of the primary rays for the heatmap
+    std::vector<std::string> aov_definitions = definitions;
+    if (aov_ == AOV::kTraversalHeatmap)
+    {
+        aov_definitions.push_back("BVH_STATISTICS");
+    }
+
+    reset_kernel_ = cl_context_.CreateKernel("reset_radiance.cl", "ResetRadiance", definitions);
+    raygen_kernel_ = cl_context_.CreateKernel("raygeneration.cl", "RayGeneration", definitions);
     miss_kernel_ = cl_context_.CreateKernel("miss.cl", "Miss", definitions);
-    aov_kernel_ = cl_context_.CreateKernel("aov.cl", "GenerateAOV");
-    hit_surface_kernel_ = cl_context_.CreateKernel("hit_surface.cl", "HitSurface", definitions);
+    aov_kernel_ = cl_context_.CreateKernel("aov.cl", "GenerateAOV", aov_definitions);
+    hit_surface_kernel_ = cl_context_.CreateKernel("hit_surface.cl", "HitSurface", hit_surface_definitions);
     accumulate_direct_samples_kernel_ = cl_context_.CreateKernel("accumulate_direct_samples.cl", "AccumulateDirectSamples", definitions);
+    accumulate_path_radiance_kernel_ = cl_context_.CreateKernel("accumulate_path_radiance.cl", "AccumulatePathRadiance", definitions);
     clear_counter_kernel_ = cl_context_.CreateKernel("clear_counter.cl", "ClearCounter");
     increment_counter_kernel_ = cl_context_.CreateKernel("increment_counter.cl", "IncrementCounter");
+    add_to_counter_kernel_ = cl_context_.CreateKernel("increment_counter.cl", "AddToCounter");
     resolve_kernel_ = cl_context_.CreateKernel("resolve_radiance.cl", "ResolveRadiance", definitions);
 
     if (enable_denoiser_)
@@ -293,8 +512,55 @@ void CLPathTraceIntegrator::CreateKernels()
         temporal_accumulation_kernel_ = cl_context_.CreateKernel("denoiser.cl", "TemporalAccumulation");
     }
 
-    intersect_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh");
-    intersect_shadow_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", { "SHADOW_RAYS" });
+    std::vector<std::string> trace_definitions;
+    std::vector<std::string> refit_definitions;
+    if (!acc_structure_.GetPrimitiveIndices().empty())
+    {
+        trace_definitions.push_back("PRIMITIVE_INDIRECTION");
+        refit_definitions.push_back("PRIMITIVE_INDIRECTION");
+    }
+
+    if (acc_structure_.GetTopLevelNodeCount() > 0)
+    {
+        trace_definitions.push_back("INSTANCING");
+    }
+
+    if (bvh_width_ != 2)
+    {
+        trace_definitions.push_back("BVH_WIDTH=" + std::to_string(bvh_width_));
+        if (enable_node_compression_)
+        {
+            trace_definitions.push_back("COMPRESSED_NODES");
+        }
+    }
+
+    if (enable_persistent_threads_)
+    {
+        trace_definitions.push_back("PERSISTENT_THREADS");
+    }
+
+    // The traversal work is counted for the heatmap only
+    std::vector<std::string> intersect_definitions = trace_definitions;
+    if (aov_ == AOV::kTraversalHeatmap)
+    {
+        intersect_definitions.push_back("BVH_STATISTICS");
+    }
+
+    intersect_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", intersect_definitions);
+    trace_definitions.push_back("SHADOW_RAYS");
+    intersect_shadow_kernel_ = cl_context_.CreateKernel("trace_bvh.cl", "TraceBvh", trace_definitions);
+    refit_kernel_ = cl_context_.CreateKernel("refit_bvh.cl", "RefitBvh", refit_definitions);
+
+    compute_ray_keys_kernel_ = cl_context_.CreateKernel("sort_rays.cl", "ComputeRayKeys");
+    radix_count_kernel_ = cl_context_.CreateKernel("sort_rays.cl", "RadixCount");
+    radix_scan_kernel_ = cl_context_.CreateKernel("sort_rays.cl", "RadixScan");
+    radix_scatter_kernel_ = cl_context_.CreateKernel("sort_rays.cl", "RadixScatter");
+    reorder_rays_kernel_ = cl_context_.CreateKernel("sort_rays.cl", "ReorderRays");
+
+    clear_material_counts_kernel_ = cl_context_.CreateKernel("sort_materials.cl", "ClearMaterialCounts");
+    count_materials_kernel_ = cl_context_.CreateKernel("sort_materials.cl", "CountMaterials");
+    scan_materials_kernel_ = cl_context_.CreateKernel("sort_materials.cl", "ScanMaterials");
+    scatter_materials_kernel_ = cl_context_.CreateKernel("sort_materials.cl", "ScatterMaterials");
 
     // Setup kernels
     cl_mem output_image_mem = (*output_image_)();
@@ -303,24 +569,33 @@ void CLPathTraceIntegrator::CreateKernels()
     reset_kernel_->SetArgument(0, &width_, sizeof(width_));
     reset_kernel_->SetArgument(1, &height_, sizeof(height_));
     reset_kernel_->SetArgument(2, radiance_buffer_);
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        reset_kernel_->SetArgument(3, luminance_sq_sums_buffer_);
+        reset_kernel_->SetArgument(4, pixel_sample_counts_buffer_);
+    }
 
     // Setup raygen kernel
     raygen_kernel_->SetArgument(args::Raygen::kWidth, &width_, sizeof(width_));
     raygen_kernel_->SetArgument(args::Raygen::kHeight, &height_, sizeof(height_));
     raygen_kernel_->SetArgument(args::Raygen::kSampleCounterBuffer, sample_counter_buffer_);
-    raygen_kernel_->SetArgument(args::Raygen::kRayBuffer, rays_buffer_[0]);
     raygen_kernel_->SetArgument(args::Raygen::kRayCounterBuffer, ray_counter_buffer_[0]);
-    raygen_kernel_->SetArgument(args::Raygen::kPixelIndicesBuffer, pixel_indices_buffer_[0]);
     raygen_kernel_->SetArgument(args::Raygen::kThroughputsBuffer, throughputs_buffer_);
     raygen_kernel_->SetArgument(args::Raygen::kDiffuseAlbedo, diffuse_albedo_buffer_);
     raygen_kernel_->SetArgument(args::Raygen::kDepth, depth_buffer_);
     raygen_kernel_->SetArgument(args::Raygen::kNormal, normal_buffer_);
     raygen_kernel_->SetArgument(args::Raygen::kVelocity, velocity_buffer_);
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        raygen_kernel_->SetArgument(args::Raygen::kRadianceBuffer, radiance_buffer_);
+        raygen_kernel_->SetArgument(args::Raygen::kLuminanceSqSumsBuffer, luminance_sq_sums_buffer_);
+        raygen_kernel_->SetArgument(args::Raygen::kPixelSampleCountsBuffer, pixel_sample_counts_buffer_);
+    }
 
     // Setup miss kernel
     miss_kernel_->SetArgument(args::Miss::kHitsBuffer, hits_buffer_);
     miss_kernel_->SetArgument(args::Miss::kThroughputsBuffer, throughputs_buffer_);
-    miss_kernel_->SetArgument(args::Miss::kRadianceBuffer, radiance_buffer_);
+    miss_kernel_->SetArgument(args::Miss::kRadianceBuffer, path_radiance_buffer_);
 
     // Setup hit surface kernel
 
@@ -334,7 +609,18 @@ void CLPathTraceIntegrator::CreateKernels()
     accumulate_direct_samples_kernel_->SetArgument(args::AccumulateDirectSamples::kDirectLightSamplesBuffer,
         direct_light_samples_buffer_);
     accumulate_direct_samples_kernel_->SetArgument(args::AccumulateDirectSamples::kRadianceBuffer,
-        radiance_buffer_);
+        path_radiance_buffer_);
+
+    // Setup accumulate path radiance kernel
+    accumulate_path_radiance_kernel_->SetArgument(0, &width_, sizeof(width_));
+    accumulate_path_radiance_kernel_->SetArgument(1, &height_, sizeof(height_));
+    accumulate_path_radiance_kernel_->SetArgument(2, path_radiance_buffer_);
+    accumulate_path_radiance_kernel_->SetArgument(3, radiance_buffer_);
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        accumulate_path_radiance_kernel_->SetArgument(4, luminance_sq_sums_buffer_);
+        accumulate_path_radiance_kernel_->SetArgument(5, pixel_sample_counts_buffer_);
+    }
 
     // Setup resolve kernel
     resolve_kernel_->SetArgument(args::Resolve::kWidth, &width_, sizeof(width_));
@@ -345,9 +631,14 @@ void CLPathTraceIntegrator::CreateKernels()
     resolve_kernel_->SetArgument(args::Resolve::kDepth, depth_buffer_);
     resolve_kernel_->SetArgument(args::Resolve::kNormal, normal_buffer_);
     resolve_kernel_->SetArgument(args::Resolve::kMotionVectors, velocity_buffer_);
+    resolve_kernel_->SetArgument(args::Resolve::kTraversalHeatmap, traversal_heatmap_buffer_);
     resolve_kernel_->SetArgument(args::Resolve::kResolvedTexture, output_image_mem);
     std::uint32_t aov_index = aov_;
     resolve_kernel_->SetArgument(args::Resolve::kAovIndex, &aov_index, sizeof(aov_index));
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        resolve_kernel_->SetArgument(args::Resolve::kPixelSampleCountsBuffer, pixel_sample_counts_buffer_);
+    }
 
     if (enable_denoiser_)
     {
@@ -375,7 +666,7 @@ void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     // Create scene buffers
     auto const& triangles = scene.GetTriangles();
     auto const& materials = scene.GetMaterials();
-    auto const& emissive_indices = scene.GetEmissiveIndices();
+    auto const& emissive_alias_table = scene.GetEmissiveAliasTable();
     auto const& lights = scene.GetLights();
     auto const& textures = scene.GetTextures();
     auto const& texture_data = scene.GetTextureData();
@@ -384,33 +675,49 @@ void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     cl_int status;
 
     assert(!triangles.empty());
-    triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-        triangles.size() * sizeof(Triangle), (void*)triangles.data(), &status);
-    ThrowIfFailed(status, "Failed to create triangle buffer");
+    auto const& indexed_triangles = scene.GetIndexedTriangles();
+    indexed_triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        indexed_triangles.size() * sizeof(IndexedTriangle), (void*)indexed_triangles.data(), &status);
+    ThrowIfFailed(status, "Failed to create indexed triangle buffer");
+
+    auto const& vertex_positions = scene.GetVertexPositions();
+    vertex_position_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        vertex_positions.size() * sizeof(float4), (void*)vertex_positions.data(), &status);
+    ThrowIfFailed(status, "Failed to create vertex position buffer");
+
+    auto const& vertex_texcoords = scene.GetVertexTexcoords();
+    vertex_texcoord_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        vertex_texcoords.size() * sizeof(std::uint32_t), (void*)vertex_texcoords.data(), &status);
+    ThrowIfFailed(status, "Failed to create vertex texcoord buffer");
 
     // Additional compressed triangle buffer
     {
-        std::vector<RTTriangle> rt_triangles;
-        for (auto const& triangle : triangles)
-        {
-            rt_triangles.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
-        }
-
+        std::vector<RTTriangle> rt_triangles = GetRTTriangles(triangles);
         rt_triangle_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
             rt_triangles.size() * sizeof(RTTriangle), (void*)rt_triangles.data(), &status);
         ThrowIfFailed(status, "Failed to create rt triangle buffer");
     }
 
+    auto const& instances = scene.GetInstances();
+    if (!instances.empty())
+    {
+        instances_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            instances.size() * sizeof(Instance), (void*)instances.data(), &status);
+        ThrowIfFailed(status, "Failed to create instance buffer");
+    }
+
     assert(!materials.empty());
     material_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
         materials.size() * sizeof(PackedMaterial), (void*)materials.data(), &status);
     ThrowIfFailed(status, "Failed to create material buffer");
+    num_materials_ = (std::uint32_t)materials.size();
+    material_counts_buffer_ = CreateBuffer((num_materials_ + 1) * sizeof(std::uint32_t));
 
-    if (!emissive_indices.empty())
+    if (!emissive_alias_table.empty())
     {
-        emissive_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            emissive_indices.size() * sizeof(std::uint32_t), (void*)emissive_indices.data(), &status);
-        ThrowIfFailed(status, "Failed to create emissive buffer");
+        emissive_alias_table_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            emissive_alias_table.size() * sizeof(EmissiveAliasEntry), (void*)emissive_alias_table.data(), &status);
+        ThrowIfFailed(status, "Failed to create emissive alias table buffer");
     }
 
     if (!lights.empty())
@@ -445,14 +752,157 @@ void CLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     scene_info_ = scene.GetSceneInfo();
 
     auto const& nodes = acc_structure_.GetNodes();
+    host_nodes_stale_ = false;
 
-    // Upload BVH data
-    nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    // Upload BVH data, the refit kernel writes the node bounds
+    nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
         nodes.size() * sizeof(LinearBVHNode), (void*)nodes.data(), &status);
     if (status != CL_SUCCESS)
     {
         throw CLException("Failed to create BVH node buffer", status);
     }
+
+    auto const& primitive_indices = acc_structure_.GetPrimitiveIndices();
+    if (!primitive_indices.empty())
+    {
+        primitive_indices_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            primitive_indices.size() * sizeof(std::uint32_t), (void*)primitive_indices.data(), &status);
+        ThrowIfFailed(status, "Failed to create BVH primitive indices buffer");
+    }
+
+    // Two-level BVHs are refitted on the host
+    if (acc_structure_.GetTopLevelNodeCount() == 0)
+    {
+        std::vector<std::uint32_t> level_nodes;
+        GetBvhLevels(nodes, level_nodes, refit_level_offsets_);
+        refit_level_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            level_nodes.size() * sizeof(std::uint32_t), (void*)level_nodes.data(), &status);
+        ThrowIfFailed(status, "Failed to create BVH refit level buffer");
+    }
+
+    UpdateWideBvh();
+}
+
+void CLPathTraceIntegrator::UpdateGeometry(Scene const& scene)
+{
+    auto const& triangles = scene.GetTriangles();
+    std::vector<RTTriangle> rt_triangles = GetRTTriangles(triangles);
+    auto const& vertex_positions = scene.GetVertexPositions();
+    auto const& vertex_texcoords = scene.GetVertexTexcoords();
+    cl_context_.WriteBuffer(vertex_position_buffer_, vertex_positions.data(), vertex_positions.size() * sizeof(float4));
+    cl_context_.WriteBuffer(vertex_texcoord_buffer_, vertex_texcoords.data(), vertex_texcoords.size() * sizeof(std::uint32_t));
+    cl_context_.WriteBuffer(rt_triangle_buffer_, rt_triangles.data(), rt_triangles.size() * sizeof(RTTriangle));
+
+    if (acc_structure_.GetTopLevelNodeCount() > 0 || bvh_width_ != 2)
+    {
+        // The top level leaves reference the instances and the wide nodes are collapsed
+        // from the binary ones, refit on the host
+        acc_structure_.Refit(triangles);
+        host_nodes_stale_ = false;
+        auto const& nodes = acc_structure_.GetNodes();
+        cl_context_.WriteBuffer(nodes_buffer_, nodes.data(), nodes.size() * sizeof(LinearBVHNode));
+        UpdateWideBvh();
+        RequestReset();
+        return;
+    }
+
+    // Refit the nodes in place, from the deepest level to the root
+    CLKernel& kernel = *refit_kernel_;
+    kernel.SetArgument(0, refit_level_nodes_buffer_);
+    std::uint32_t arg_idx = 3;
+    kernel.SetArgument(arg_idx++, rt_triangle_buffer_);
+    if (!acc_structure_.GetPrimitiveIndices().empty())
+    {
+        kernel.SetArgument(arg_idx++, primitive_indices_buffer_);
+    }
+    kernel.SetArgument(arg_idx++, nodes_buffer_);
+
+    for (std::size_t level = refit_level_offsets_.size() - 1; level-- > 0;)
+    {
+        std::uint32_t first_level_node = refit_level_offsets_[level];
+        std::uint32_t num_level_nodes = refit_level_offsets_[level + 1] - first_level_node;
+        kernel.SetArgument(1, &first_level_node, sizeof(first_level_node));
+        kernel.SetArgument(2, &num_level_nodes, sizeof(num_level_nodes));
+        cl_context_.ExecuteKernel(kernel, num_level_nodes);
+    }
+
+    // The host nodes are read back before the collapse or the ray sorting use them
+    host_nodes_stale_ = true;
+    RequestReset();
+}
+
+void CLPathTraceIntegrator::SyncRefittedNodes()
+{
+    if (!host_nodes_stale_)
+    {
+        return;
+    }
+
+    std::vector<LinearBVHNode> nodes(acc_structure_.GetNodes().size());
+    cl_context_.ReadBuffer(nodes_buffer_, nodes.data(), nodes.size() * sizeof(LinearBVHNode));
+    cl_context_.Finish();
+    acc_structure_.SetRefittedNodes(nodes);
+    host_nodes_stale_ = false;
+}
+
+void CLPathTraceIntegrator::UpdateInstances(Scene const& scene)
+{
+    auto const& instances = scene.GetInstances();
+    cl_context_.WriteBuffer(instances_buffer_, instances.data(), instances.size() * sizeof(Instance));
+
+    // The top level nodes go first, the bottom level ones are not changed
+    auto const& nodes = acc_structure_.GetNodes();
+    cl_context_.WriteBuffer(nodes_buffer_, nodes.data(), acc_structure_.GetTopLevelNodeCount() * sizeof(LinearBVHNode));
+
+    RequestReset();
+}
+
+void CLPathTraceIntegrator::UpdateWideBvh()
+{
+    SyncRefittedNodes();
+    auto const& nodes = acc_structure_.GetNodes();
+    cl_int status = CL_SUCCESS;
+
+    if (bvh_width_ == 4)
+    {
+        std::vector<BVH4Node> wide_nodes;
+        CollapseBvh4(nodes, wide_nodes);
+        if (enable_node_compression_)
+        {
+            std::vector<CompressedBVH4Node> compressed_nodes;
+            CompressBvh4(wide_nodes, compressed_nodes);
+            wide_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                compressed_nodes.size() * sizeof(CompressedBVH4Node), (void*)compressed_nodes.data(), &status);
+        }
+        else
+        {
+            wide_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                wide_nodes.size() * sizeof(BVH4Node), (void*)wide_nodes.data(), &status);
+        }
+    }
+    else if (bvh_width_ == 8)
+    {
+        std::vector<BVH8Node> wide_nodes;
+        CollapseBvh8(nodes, wide_nodes);
+        if (enable_node_compression_)
+        {
+            std::vector<CompressedBVH8Node> compressed_nodes;
+            CompressBvh8(wide_nodes, compressed_nodes);
+            wide_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                compressed_nodes.size() * sizeof(CompressedBVH8Node), (void*)compressed_nodes.data(), &status);
+        }
+        else
+        {
+            wide_nodes_buffer_ = cl::Buffer(cl_context_.GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                wide_nodes.size() * sizeof(BVH8Node), (void*)wide_nodes.data(), &status);
+        }
+    }
+    else
+    {
+        wide_nodes_buffer_ = cl::Buffer();
+    }
+
+    ThrowIfFailed(status, "Failed to create wide BVH node buffer");
 }
 
 void CLPathTraceIntegrator::SetSamplerType(SamplerType sampler_type)
@@ -474,10 +924,19 @@ void CLPathTraceIntegrator::SetAOV(AOV aov)
         return;
     }
 
+    // The trace and AOV kernels are rebuilt with or without BVH_STATISTICS
+    bool recreate_kernels = (aov == AOV::kTraversalHeatmap) != (aov_ == AOV::kTraversalHeatmap);
     aov_ = aov;
 
-    std::uint32_t aov_idx = aov;
-    resolve_kernel_->SetArgument(args::Resolve::kAovIndex, &aov_idx, sizeof(aov_idx));
+    if (recreate_kernels)
+    {
+        CreateKernels();
+    }
+    else
+    {
+        std::uint32_t aov_idx = aov;
+        resolve_kernel_->SetArgument(args::Resolve::kAovIndex, &aov_idx, sizeof(aov_idx));
+    }
 
     RequestReset();
 }
@@ -510,44 +969,84 @@ void CLPathTraceIntegrator::Reset()
 void CLPathTraceIntegrator::AdvanceSampleCount()
 {
     increment_counter_kernel_->SetArgument(0, sample_counter_buffer_);
+    increment_counter_kernel_->SetArgument(1, &samples_per_launch_, sizeof(samples_per_launch_));
     cl_context_.ExecuteKernel(*increment_counter_kernel_, 1);
+
+    // All bounces of the frame are enqueued at this point
+    ReadRayCountHistory();
 }
 
 void CLPathTraceIntegrator::GenerateRays()
 {
-    std::uint32_t num_rays = width_ * height_;
+    std::uint32_t num_rays = width_ * height_ * samples_per_launch_;
+
+    if (adaptive_sampling_threshold_ > 0.0f)
+    {
+        // Only the pixels that haven't converged add their rays
+        clear_counter_kernel_->SetArgument(0, ray_counter_buffer_[0]);
+        cl_context_.ExecuteKernel(*clear_counter_kernel_, 1);
+    }
+
+    // The ray buffers are swapped by the ray sorting
+    raygen_kernel_->SetArgument(args::Raygen::kRayBuffer, rays_buffer_[0]);
+    raygen_kernel_->SetArgument(args::Raygen::kPixelIndicesBuffer, pixel_indices_buffer_[0]);
     cl_context_.ExecuteKernel(*raygen_kernel_, num_rays);
 }
 
 void CLPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
 {
-    std::uint32_t max_num_rays = width_ * height_;
     std::uint32_t incoming_idx = bounce & 1;
 
+    if (bounce < kMaxRayCountBounces)
+    {
+        cl_context_.CopyBuffer(ray_counter_buffer_[incoming_idx], ray_count_history_buffer_,
+            0, bounce * 2 * sizeof(std::uint32_t), sizeof(std::uint32_t));
+    }
+    std::size_t launch_size = GetRayLaunchSize(bounce * 2);
+
     CLKernel& kernel = *intersect_kernel_;
-    kernel.SetArgument(0, rays_buffer_[incoming_idx]);
-    kernel.SetArgument(1, ray_counter_buffer_[incoming_idx]);
-    kernel.SetArgument(2, rt_triangle_buffer_);
-    kernel.SetArgument(3, nodes_buffer_);
-    kernel.SetArgument(4, hits_buffer_);
+    std::uint32_t arg_idx = 0;
+    kernel.SetArgument(arg_idx++, rays_buffer_[incoming_idx]);
+    kernel.SetArgument(arg_idx++, ray_counter_buffer_[incoming_idx]);
+    if (enable_persistent_threads_)
+    {
+        kernel.SetArgument(arg_idx++, ray_queue_counter_buffer_);
+    }
+    kernel.SetArgument(arg_idx++, rt_triangle_buffer_);
+    kernel.SetArgument(arg_idx++, bvh_width_ == 2 ? nodes_buffer_ : wide_nodes_buffer_);
+    if (!acc_structure_.GetPrimitiveIndices().empty())
+    {
+        kernel.SetArgument(arg_idx++, primitive_indices_buffer_);
+    }
+    if (acc_structure_.GetTopLevelNodeCount() > 0)
+    {
+        kernel.SetArgument(arg_idx++, instances_buffer_);
+    }
+    kernel.SetArgument(arg_idx++, hits_buffer_);
+    if (aov_ == AOV::kTraversalHeatmap)
+    {
+        kernel.SetArgument(arg_idx++, traversal_stats_buffer_);
+    }
 
-    ///@TODO: use indirect dispatch
-    cl_context_.ExecuteKernel(kernel, max_num_rays);
+    ExecuteTraceKernel(kernel, ray_counter_buffer_[incoming_idx], launch_size);
 
     //acc_structure_.IntersectRays(rays_buffer_[incoming_idx], ray_counter_buffer_[incoming_idx],
-    //    max_num_rays, hits_buffer_);
+    //    launch_size, hits_buffer_);
 }
 
 void CLPathTraceIntegrator::ComputeAOVs()
 {
-    std::uint32_t max_num_rays = width_ * height_;
+    std::uint32_t max_num_rays = width_ * height_ * samples_per_launch_;
 
     // Setup AOV kernel
     aov_kernel_->SetArgument(args::Aov::kRayBuffer, rays_buffer_[0]);
     aov_kernel_->SetArgument(args::Aov::kRayCounterBuffer, ray_counter_buffer_[0]);
     aov_kernel_->SetArgument(args::Aov::kPixelIndicesBuffer, pixel_indices_buffer_[0]);
     aov_kernel_->SetArgument(args::Aov::kHitsBuffer, hits_buffer_);
-    aov_kernel_->SetArgument(args::Aov::kTrianglesBuffer, triangle_buffer_);
+    aov_kernel_->SetArgument(args::Aov::kIndexedTrianglesBuffer, indexed_triangle_buffer_);
+    aov_kernel_->SetArgument(args::Aov::kVertexPositionsBuffer, vertex_position_buffer_);
+    aov_kernel_->SetArgument(args::Aov::kVertexTexcoordsBuffer, vertex_texcoord_buffer_);
+    aov_kernel_->SetArgument(args::Aov::kInstancesBuffer, instances_buffer_);
     aov_kernel_->SetArgument(args::Aov::kMaterialsBuffer, material_buffer_);
     aov_kernel_->SetArgument(args::Aov::kTexturesBuffer, texture_buffer_);
     aov_kernel_->SetArgument(args::Aov::kTextureDataBuffer, texture_data_buffer_);
@@ -557,44 +1056,56 @@ void CLPathTraceIntegrator::ComputeAOVs()
     aov_kernel_->SetArgument(args::Aov::kDepth, depth_buffer_);
     aov_kernel_->SetArgument(args::Aov::kNormal, normal_buffer_);
     aov_kernel_->SetArgument(args::Aov::kVelocity, velocity_buffer_);
+    if (aov_ == AOV::kTraversalHeatmap)
+    {
+        aov_kernel_->SetArgument(args::Aov::kTraversalStats, traversal_stats_buffer_);
+        aov_kernel_->SetArgument(args::Aov::kTraversalHeatmap, traversal_heatmap_buffer_);
+    }
 
     cl_context_.ExecuteKernel(*aov_kernel_, max_num_rays);
 }
 
 void CLPathTraceIntegrator::IntersectShadowRays()
 {
-    std::uint32_t max_num_rays = width_ * height_;
-
     CLKernel& kernel = *intersect_shadow_kernel_;
-    kernel.SetArgument(0, shadow_rays_buffer_);
-    kernel.SetArgument(1, shadow_ray_counter_buffer_);
-    kernel.SetArgument(2, rt_triangle_buffer_);
-    kernel.SetArgument(3, nodes_buffer_);
-    kernel.SetArgument(4, shadow_hits_buffer_);
+    std::uint32_t arg_idx = 0;
+    kernel.SetArgument(arg_idx++, shadow_rays_buffer_);
+    kernel.SetArgument(arg_idx++, shadow_ray_counter_buffer_);
+    if (enable_persistent_threads_)
+    {
+        kernel.SetArgument(arg_idx++, ray_queue_counter_buffer_);
+    }
+    kernel.SetArgument(arg_idx++, rt_triangle_buffer_);
+    kernel.SetArgument(arg_idx++, bvh_width_ == 2 ? nodes_buffer_ : wide_nodes_buffer_);
+    if (!acc_structure_.GetPrimitiveIndices().empty())
+    {
+        kernel.SetArgument(arg_idx++, primitive_indices_buffer_);
+    }
+    if (acc_structure_.GetTopLevelNodeCount() > 0)
+    {
+        kernel.SetArgument(arg_idx++, instances_buffer_);
+    }
+    kernel.SetArgument(arg_idx++, shadow_hits_buffer_);
 
-    ///@TODO: use indirect dispatch
-    cl_context_.ExecuteKernel(kernel, max_num_rays);
+    ExecuteTraceKernel(kernel, shadow_ray_counter_buffer_, shadow_ray_launch_size_);
 
     //acc_structure_.IntersectRays(shadow_rays_buffer_, shadow_ray_counter_buffer_,
-    //    max_num_rays, shadow_hits_buffer_, false);
+    //    shadow_ray_launch_size_, shadow_hits_buffer_, false);
 }
 
 void CLPathTraceIntegrator::ShadeMissedRays(std::uint32_t bounce)
 {
-    std::uint32_t max_num_rays = width_ * height_;
     std::uint32_t incoming_idx = bounce & 1;
 
     miss_kernel_->SetArgument(args::Miss::kRayBuffer, rays_buffer_[incoming_idx]);
     miss_kernel_->SetArgument(args::Miss::kPixelIndicesBuffer, pixel_indices_buffer_[incoming_idx]);
     miss_kernel_->SetArgument(args::Miss::kRayCounterBuffer, ray_counter_buffer_[incoming_idx]);
     miss_kernel_->SetArgument(args::Miss::kIblTextureBuffer, env_texture_());
-    cl_context_.ExecuteKernel(*miss_kernel_, max_num_rays);
+    cl_context_.ExecuteKernel(*miss_kernel_, GetRayLaunchSize(bounce * 2));
 }
 
 void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
 {
-    std::uint32_t max_num_rays = width_ * height_;
-
     std::uint32_t incoming_idx = bounce & 1;
     std::uint32_t outgoing_idx = (bounce + 1) & 1;
 
@@ -605,9 +1116,12 @@ void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
 
     hit_surface_kernel_->SetArgument(args::HitSurface::kHitsBuffer, hits_buffer_);
 
-    hit_surface_kernel_->SetArgument(args::HitSurface::kTrianglesBuffer, triangle_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kIndexedTrianglesBuffer, indexed_triangle_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kVertexPositionsBuffer, vertex_position_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kVertexTexcoordsBuffer, vertex_texcoord_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kInstancesBuffer, instances_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kAnalyticLightsBuffer, analytic_light_buffer_);
-    hit_surface_kernel_->SetArgument(args::HitSurface::kEmissiveIndicesBuffer, emissive_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kEmissiveAliasTableBuffer, emissive_alias_table_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kMaterialsBuffer, material_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kTexturesBuffer, texture_buffer_);
     hit_surface_kernel_->SetArgument(args::HitSurface::kTextureDataBuffer, texture_data_buffer_);
@@ -624,6 +1138,7 @@ void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
     hit_surface_kernel_->SetArgument(args::HitSurface::kRankingTileBuffer, sampler_ranking_tile_buffer_);
 
     hit_surface_kernel_->SetArgument(args::HitSurface::kThroughputsBuffer, throughputs_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kBxdfPdfsBuffer, bxdf_pdfs_buffer_);
 
     // Outgoing rays
     hit_surface_kernel_->SetArgument(args::HitSurface::kOutgoingRayBuffer, rays_buffer_[outgoing_idx]);
@@ -637,15 +1152,120 @@ void CLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
     hit_surface_kernel_->SetArgument(args::HitSurface::kDirectLightSamplesBuffer, direct_light_samples_buffer_);
 
     // Output radiance
-    hit_surface_kernel_->SetArgument(args::HitSurface::kRadianceBuffer, radiance_buffer_);
+    hit_surface_kernel_->SetArgument(args::HitSurface::kRadianceBuffer, path_radiance_buffer_);
 
-    cl_context_.ExecuteKernel(*hit_surface_kernel_, max_num_rays);
+    std::size_t launch_size = GetRayLaunchSize(bounce * 2);
+    if (enable_material_sorted_shading_)
+    {
+        SortHitsByMaterial(bounce, launch_size);
+        hit_surface_kernel_->SetArgument(args::HitSurface::kShadingOrderBuffer, shading_order_buffer_);
+    }
+
+    launch_size = (launch_size + kHitSurfaceGroupSize - 1) / kHitSurfaceGroupSize * kHitSurfaceGroupSize;
+    cl_context_.ExecuteKernel(*hit_surface_kernel_, launch_size, kHitSurfaceGroupSize);
+
+    // The shadow rays of the bounce are all spawned now
+    if (bounce < kMaxRayCountBounces)
+    {
+        cl_context_.CopyBuffer(shadow_ray_counter_buffer_, ray_count_history_buffer_,
+            0, (bounce * 2 + 1) * sizeof(std::uint32_t), sizeof(std::uint32_t));
+    }
+    shadow_ray_launch_size_ = GetRayLaunchSize(bounce * 2 + 1);
+}
+
+void CLPathTraceIntegrator::SortHitsByMaterial(std::uint32_t bounce, std::size_t launch_size)
+{
+    std::uint32_t incoming_idx = bounce & 1;
+
+    clear_material_counts_kernel_->SetArgument(0, material_counts_buffer_);
+    clear_material_counts_kernel_->SetArgument(1, &num_materials_, sizeof(num_materials_));
+    cl_context_.ExecuteKernel(*clear_material_counts_kernel_, num_materials_ + 1);
+
+    count_materials_kernel_->SetArgument(0, hits_buffer_);
+    count_materials_kernel_->SetArgument(1, ray_counter_buffer_[incoming_idx]);
+    count_materials_kernel_->SetArgument(2, indexed_triangle_buffer_);
+    count_materials_kernel_->SetArgument(3, &num_materials_, sizeof(num_materials_));
+    count_materials_kernel_->SetArgument(4, material_counts_buffer_);
+    cl_context_.ExecuteKernel(*count_materials_kernel_, launch_size);
+
+    scan_materials_kernel_->SetArgument(0, material_counts_buffer_);
+    scan_materials_kernel_->SetArgument(1, &num_materials_, sizeof(num_materials_));
+    cl_context_.ExecuteKernel(*scan_materials_kernel_, kRaySortGroupSize, kRaySortGroupSize);
+
+    scatter_materials_kernel_->SetArgument(0, hits_buffer_);
+    scatter_materials_kernel_->SetArgument(1, ray_counter_buffer_[incoming_idx]);
+    scatter_materials_kernel_->SetArgument(2, indexed_triangle_buffer_);
+    scatter_materials_kernel_->SetArgument(3, &num_materials_, sizeof(num_materials_));
+    scatter_materials_kernel_->SetArgument(4, material_counts_buffer_);
+    scatter_materials_kernel_->SetArgument(5, shading_order_buffer_);
+    cl_context_.ExecuteKernel(*scatter_materials_kernel_, launch_size);
 }
 
 void CLPathTraceIntegrator::AccumulateDirectSamples()
 {
-    std::uint32_t max_num_rays = width_ * height_;
-    cl_context_.ExecuteKernel(*accumulate_direct_samples_kernel_, max_num_rays);
+    cl_context_.ExecuteKernel(*accumulate_direct_samples_kernel_, shadow_ray_launch_size_);
+}
+
+void CLPathTraceIntegrator::AccumulatePathRadiance()
+{
+    cl_context_.ExecuteKernel(*accumulate_path_radiance_kernel_, width_ * height_);
+}
+
+void CLPathTraceIntegrator::SortRays(std::uint32_t bounce)
+{
+    std::uint32_t incoming_idx = bounce & 1;
+    std::uint32_t outgoing_idx = (bounce + 1) & 1;
+    std::size_t launch_size = GetRayLaunchSize((bounce + 1) * 2);
+    cl::Buffer const& ray_counter_buffer = ray_counter_buffer_[outgoing_idx];
+
+    SyncRefittedNodes();
+    Bounds3 scene_bounds = acc_structure_.GetNodes()[0].bounds;
+    compute_ray_keys_kernel_->SetArgument(0, rays_buffer_[outgoing_idx]);
+    compute_ray_keys_kernel_->SetArgument(1, ray_counter_buffer);
+    compute_ray_keys_kernel_->SetArgument(2, &scene_bounds, sizeof(scene_bounds));
+    compute_ray_keys_kernel_->SetArgument(3, ray_sort_keys_buffer_[0]);
+    compute_ray_keys_kernel_->SetArgument(4, ray_sort_values_buffer_[0]);
+    cl_context_.ExecuteKernel(*compute_ray_keys_kernel_, launch_size);
+
+    std::uint32_t num_histogram_entries = kRadixSize * kRaySortGroups;
+    radix_scan_kernel_->SetArgument(0, ray_sort_histograms_buffer_);
+    radix_scan_kernel_->SetArgument(1, &num_histogram_entries, sizeof(num_histogram_entries));
+
+    // Stable LSD radix sort, the even number of passes leaves the result in the first buffers
+    static_assert((kRayKeyBits + kRadixBits - 1) / kRadixBits % 2 == 0, "Odd number of radix sort passes");
+    for (std::uint32_t shift = 0; shift < kRayKeyBits; shift += kRadixBits)
+    {
+        std::uint32_t src = (shift / kRadixBits) & 1;
+
+        radix_count_kernel_->SetArgument(0, ray_sort_keys_buffer_[src]);
+        radix_count_kernel_->SetArgument(1, ray_counter_buffer);
+        radix_count_kernel_->SetArgument(2, &shift, sizeof(shift));
+        radix_count_kernel_->SetArgument(3, ray_sort_histograms_buffer_);
+        cl_context_.ExecuteKernel(*radix_count_kernel_, kRaySortGroups * kRaySortGroupSize, kRaySortGroupSize);
+
+        cl_context_.ExecuteKernel(*radix_scan_kernel_, kRaySortGroupSize, kRaySortGroupSize);
+
+        radix_scatter_kernel_->SetArgument(0, ray_sort_keys_buffer_[src]);
+        radix_scatter_kernel_->SetArgument(1, ray_sort_values_buffer_[src]);
+        radix_scatter_kernel_->SetArgument(2, ray_counter_buffer);
+        radix_scatter_kernel_->SetArgument(3, &shift, sizeof(shift));
+        radix_scatter_kernel_->SetArgument(4, ray_sort_histograms_buffer_);
+        radix_scatter_kernel_->SetArgument(5, ray_sort_keys_buffer_[src ^ 1]);
+        radix_scatter_kernel_->SetArgument(6, ray_sort_values_buffer_[src ^ 1]);
+        cl_context_.ExecuteKernel(*radix_scatter_kernel_, kRaySortGroups * kRaySortGroupSize, kRaySortGroupSize);
+    }
+
+    // The incoming rays of the bounce are consumed, so their buffers take the sorted rays and become the outgoing ones
+    reorder_rays_kernel_->SetArgument(0, rays_buffer_[outgoing_idx]);
+    reorder_rays_kernel_->SetArgument(1, pixel_indices_buffer_[outgoing_idx]);
+    reorder_rays_kernel_->SetArgument(2, ray_counter_buffer);
+    reorder_rays_kernel_->SetArgument(3, ray_sort_values_buffer_[0]);
+    reorder_rays_kernel_->SetArgument(4, rays_buffer_[incoming_idx]);
+    reorder_rays_kernel_->SetArgument(5, pixel_indices_buffer_[incoming_idx]);
+    cl_context_.ExecuteKernel(*reorder_rays_kernel_, launch_size);
+
+    std::swap(rays_buffer_[incoming_idx], rays_buffer_[outgoing_idx]);
+    std::swap(pixel_indices_buffer_[incoming_idx], pixel_indices_buffer_[outgoing_idx]);
 }
 
 void CLPathTraceIntegrator::ClearOutgoingRayCounter(std::uint32_t bounce)
@@ -676,9 +1296,27 @@ void CLPathTraceIntegrator::CopyHistoryBuffers()
 
 void CLPathTraceIntegrator::ResolveRadiance()
 {
+    if (gl_interop_image_ == 0)
+    {
+        cl_context_.ExecuteKernel(*resolve_kernel_, width_ * height_);
+        cl_context_.Finish();
+        return;
+    }
+
     // Copy radiance to the interop image
     cl_context_.AcquireGLObject((*output_image_)());
     cl_context_.ExecuteKernel(*resolve_kernel_, width_ * height_);
     cl_context_.Finish();
     cl_context_.ReleaseGLObject((*output_image_)());
 }
+
+void CLPathTraceIntegrator::ReadOutputImage(std::vector<float>& data)
+{
+    if (gl_interop_image_ != 0)
+    {
+        throw std::runtime_error("Output image readback is only supported in headless mode");
+    }
+
+    data.resize(width_ * height_ * 4);
+    cl_context_.ReadImage(static_cast<cl::Image2D const&>(*output_image_), width_, height_, data.data());
+}
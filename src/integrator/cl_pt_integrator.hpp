@@ -30,16 +30,24 @@
 class CLPathTraceIntegrator : public Integrator
 {
 public:
+    // Pass out_image = 0 to render into an offscreen image (no GL interop)
     CLPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
         AccelerationStructure& acc_structure, CLContext& cl_context, unsigned int out_image);
+    ~CLPathTraceIntegrator() override;
     void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) override;
+    void UpdateGeometry(Scene const& scene) override;
+    void UpdateInstances(Scene const& scene) override;
     void SetCameraData(Camera const& camera) override;
     void SetSamplerType(SamplerType sampler_type) override;
     void SetAOV(AOV aov) override;
     void EnableDenoiser(bool enable) override;
+    void ReadOutputImage(std::vector<float>& data) override;
+    std::uint64_t GetTracedRayCount() override;
 
 protected:
     void CreateKernels() override;
+    void UpdateWideBvh() override;
+    void CreatePathBuffers() override;
     void Reset() override;
     void AdvanceSampleCount() override;
     void GenerateRays() override;
@@ -49,6 +57,8 @@ protected:
     void ShadeSurfaceHits(std::uint32_t bounce) override;
     void IntersectShadowRays() override;
     void AccumulateDirectSamples() override;
+    void AccumulatePathRadiance() override;
+    void SortRays(std::uint32_t bounce) override;
     void ClearOutgoingRayCounter(std::uint32_t bounce) override;
     void ClearShadowRayCounter() override;
     void Denoise() override;
@@ -57,6 +67,15 @@ protected:
 
 private:
     cl::Buffer CreateBuffer(std::size_t size);
+    // Work size covering the rays predicted for the slot of the ray count history
+    std::size_t GetRayLaunchSize(std::uint32_t history_idx) const;
+    void ReadRayCountHistory();
+    // Launches the BVH traversal and counts the traced rays
+    void ExecuteTraceKernel(CLKernel const& kernel, cl::Buffer const& ray_counter_buffer, std::size_t launch_size);
+    // Fills the shading order with the incoming rays grouped by the material of their hits
+    void SortHitsByMaterial(std::uint32_t bounce, std::size_t launch_size);
+    // Reads the nodes refitted on the device back to the acceleration structure
+    void SyncRefittedNodes();
 
     CLContext& cl_context_;
     cl_GLuint gl_interop_image_;
@@ -68,14 +87,30 @@ private:
     std::shared_ptr<CLKernel> aov_kernel_;
     std::shared_ptr<CLKernel> hit_surface_kernel_;
     std::shared_ptr<CLKernel> accumulate_direct_samples_kernel_;
+    std::shared_ptr<CLKernel> accumulate_path_radiance_kernel_;
     std::shared_ptr<CLKernel> clear_counter_kernel_;
     std::shared_ptr<CLKernel> increment_counter_kernel_;
+    std::shared_ptr<CLKernel> add_to_counter_kernel_;
     std::shared_ptr<CLKernel> temporal_accumulation_kernel_;
     std::shared_ptr<CLKernel> resolve_kernel_;
 
     // BVH traversal kernels
     std::shared_ptr<CLKernel> intersect_kernel_;
     std::shared_ptr<CLKernel> intersect_shadow_kernel_;
+    std::shared_ptr<CLKernel> refit_kernel_;
+
+    // Ray sorting kernels
+    std::shared_ptr<CLKernel> compute_ray_keys_kernel_;
+    std::shared_ptr<CLKernel> radix_count_kernel_;
+    std::shared_ptr<CLKernel> radix_scan_kernel_;
+    std::shared_ptr<CLKernel> radix_scatter_kernel_;
+    std::shared_ptr<CLKernel> reorder_rays_kernel_;
+
+    // Material sorting kernels
+    std::shared_ptr<CLKernel> clear_material_counts_kernel_;
+    std::shared_ptr<CLKernel> count_materials_kernel_;
+    std::shared_ptr<CLKernel> scan_materials_kernel_;
+    std::shared_ptr<CLKernel> scatter_materials_kernel_;
 
     // Internal buffers
     cl::Buffer rays_buffer_[2]; // 2 buffers for incoming-outgoing rays
@@ -87,30 +122,70 @@ private:
     cl::Buffer hits_buffer_;
     cl::Buffer shadow_hits_buffer_;
     cl::Buffer throughputs_buffer_;
+    // Pdf of the BxDF sample of every path for the MIS weight of the emission it hits
+    cl::Buffer bxdf_pdfs_buffer_;
     cl::Buffer sample_counter_buffer_;
     cl::Buffer radiance_buffer_;
+    // Radiance of each path of the launch, the pixel radiance itself for one sample per launch
+    cl::Buffer path_radiance_buffer_;
+    // Sums of the squared sample luminances and the sample counts of the pixels for adaptive sampling
+    cl::Buffer luminance_sq_sums_buffer_;
+    cl::Buffer pixel_sample_counts_buffer_;
     cl::Buffer prev_radiance_buffer_;
     cl::Buffer diffuse_albedo_buffer_;
     cl::Buffer depth_buffer_;
     cl::Buffer prev_depth_buffer_;
     cl::Buffer normal_buffer_;
     cl::Buffer velocity_buffer_;
+    // Traversal work of the last traced rays and of the primary rays of the frame
+    cl::Buffer traversal_stats_buffer_;
+    cl::Buffer traversal_heatmap_buffer_;
     cl::Buffer direct_light_samples_buffer_;
+    // Incoming and shadow ray counts of each bounce, read back a frame late to size the launches
+    cl::Buffer ray_count_history_buffer_;
+    std::vector<std::uint32_t> ray_count_readback_;
+    std::vector<std::uint32_t> predicted_ray_counts_;
+    cl::Event ray_count_readback_event_;
+    std::size_t shadow_ray_launch_size_ = 0;
+    // Queue position of the persistent-threads traversal and the 64-bit count of the traced rays
+    cl::Buffer ray_queue_counter_buffer_;
+    cl::Buffer traced_ray_count_buffer_;
+    // Work items filling the device
+    std::size_t persistent_launch_size_ = 0;
+    // Ping-pong keys and ray indices of the radix sort and the digit counts of its work groups
+    cl::Buffer ray_sort_keys_buffer_[2];
+    cl::Buffer ray_sort_values_buffer_[2];
+    cl::Buffer ray_sort_histograms_buffer_;
+    // Hit counts and then offsets of the materials and the miss bucket, the sorted incoming ray indices
+    cl::Buffer material_counts_buffer_;
+    cl::Buffer shading_order_buffer_;
 
     // Scene buffers
-    cl::Buffer triangle_buffer_;
+    cl::Buffer indexed_triangle_buffer_;
+    cl::Buffer vertex_position_buffer_;
+    cl::Buffer vertex_texcoord_buffer_;
     cl::Buffer rt_triangle_buffer_;
+    cl::Buffer instances_buffer_;
     cl::Buffer material_buffer_;
     cl::Buffer texture_buffer_;
     cl::Buffer texture_data_buffer_;
-    cl::Buffer emissive_buffer_;
+    cl::Buffer emissive_alias_table_buffer_;
     cl::Buffer analytic_light_buffer_;
     cl::Buffer scene_info_buffer_;
     cl::Image2D env_texture_;
     SceneInfo scene_info_;
+    std::uint32_t num_materials_ = 0;
 
-    // Acceleration structure buffer
+    // Acceleration structure buffers
     cl::Buffer nodes_buffer_;
+    // Collapsed nodes traversed if the BVH width is not 2
+    cl::Buffer wide_nodes_buffer_;
+    cl::Buffer primitive_indices_buffer_;
+    // Node indices grouped by depth for the refit
+    cl::Buffer refit_level_nodes_buffer_;
+    std::vector<std::uint32_t> refit_level_offsets_;
+    // The device nodes were refitted after the host ones
+    bool host_nodes_stale_ = false;
 
     // Sampler buffers
     cl::Buffer sampler_sobol_buffer_;
@@ -0,0 +1,548 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include <GL/glew.h>
+
+#include "cpu_pt_integrator.hpp"
+#include "kernels/cpu/wavefront_kernels.hpp"
+#include "scene/scene.hpp"
+#include "acceleration_structure.hpp"
+#include "utils/blue_noise_sampler.hpp"
+
+namespace
+{
+    // Number of work items processed by a thread at once
+    constexpr std::size_t kGrainSize = 256;
+
+    cpu::BlueNoiseBuffers GetBlueNoiseBuffers()
+    {
+        // The kernel code takes non-const pointers, the data is never modified
+        cpu::BlueNoiseBuffers buffers;
+        buffers.sobol_256spp_256d = const_cast<int*>(sobol_256spp_256d);
+        buffers.scrambling_tile = const_cast<int*>(scramblingTile);
+        buffers.ranking_tile = const_cast<int*>(rankingTile);
+        return buffers;
+    }
+}
+
+CPUPathTraceIntegrator::CPUPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
+    AccelerationStructure& acc_structure, unsigned int out_image, std::uint32_t num_threads)
+    : Integrator(width, height, acc_structure)
+    , thread_pool_(num_threads)
+    , gl_output_image_(out_image)
+{
+    std::uint32_t num_rays = width_ * height_;
+
+    std::cout << "CPU integrator is using " << thread_pool_.GetThreadCount() << " threads" << std::endl;
+
+    radiance_.resize(num_rays);
+    prev_radiance_.resize(num_rays);
+    luminance_sq_sums_.resize(num_rays);
+    pixel_sample_counts_.resize(num_rays);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ray_counter_[i] = 0;
+    }
+
+    shadow_ray_counter_ = 0;
+    CreatePathBuffers();
+
+    // AOV buffers
+    diffuse_albedo_.resize(num_rays);
+    depth_.resize(num_rays);
+    prev_depth_.resize(num_rays);
+    normal_.resize(num_rays);
+    velocity_.resize(num_rays);
+    traversal_heatmap_.resize(num_rays);
+
+    output_image_.resize(num_rays);
+
+    CreateKernels();
+
+    // Don't forget to reset frame index
+    Reset();
+}
+
+void CPUPathTraceIntegrator::CreatePathBuffers()
+{
+    std::uint32_t num_paths = width_ * height_ * samples_per_launch_;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        rays_[i].resize(num_paths);
+        pixel_indices_[i].resize(num_paths);
+    }
+
+    shadow_rays_.resize(num_paths);
+    shadow_pixel_indices_.resize(num_paths);
+    hits_.resize(num_paths);
+    shading_order_.resize(num_paths);
+    shadow_hits_.resize(num_paths);
+    throughputs_.resize(num_paths);
+    bxdf_pdfs_.resize(num_paths);
+    direct_light_samples_.resize(num_paths);
+    traversal_stats_.resize(num_paths);
+
+    // Zeroed once, AccumulatePathRadiance clears the paths it adds up
+    path_radiance_.assign(UsesPathRadianceBuffer() ? num_paths : 0, float4(0.0f));
+}
+
+cpu::KernelOptions CPUPathTraceIntegrator::GetKernelOptions() const
+{
+    return { enable_white_furnace_, sampler_type_ == SamplerType::kBlueNoise, enable_denoiser_,
+        adaptive_sampling_threshold_, russian_roulette_bounce_, max_bounces_ };
+}
+
+void CPUPathTraceIntegrator::CreateKernels()
+{
+    // Nothing to compile, the kernel options are passed on every dispatch
+}
+
+void CPUPathTraceIntegrator::UpdateWideBvh()
+{
+    bvh4_nodes_.clear();
+    bvh8_nodes_.clear();
+    compressed_bvh4_nodes_.clear();
+    compressed_bvh8_nodes_.clear();
+
+    if (bvh_width_ == 4)
+    {
+        CollapseBvh4(nodes_, bvh4_nodes_);
+        if (enable_node_compression_)
+        {
+            CompressBvh4(bvh4_nodes_, compressed_bvh4_nodes_);
+        }
+    }
+    else if (bvh_width_ == 8)
+    {
+        CollapseBvh8(nodes_, bvh8_nodes_);
+        if (enable_node_compression_)
+        {
+            CompressBvh8(bvh8_nodes_, compressed_bvh8_nodes_);
+        }
+    }
+}
+
+bool CPUPathTraceIntegrator::TraceRay(Ray const& ray, bool closest_hit, Hit* hit, TraversalStats* stats) const
+{
+    std::uint32_t const* primitive_indices = primitive_indices_.empty() ? nullptr : primitive_indices_.data();
+
+    if (bvh_width_ == 4 && enable_node_compression_)
+    {
+        return cpu::TraceWideBvh(ray, rt_triangles_.data(), compressed_bvh4_nodes_.data(), primitive_indices, closest_hit, hit, stats);
+    }
+    else if (bvh_width_ == 8 && enable_node_compression_)
+    {
+        return cpu::TraceWideBvh(ray, rt_triangles_.data(), compressed_bvh8_nodes_.data(), primitive_indices, closest_hit, hit, stats);
+    }
+    else if (bvh_width_ == 4)
+    {
+        return cpu::TraceWideBvh(ray, rt_triangles_.data(), bvh4_nodes_.data(), primitive_indices, closest_hit, hit, stats);
+    }
+    else if (bvh_width_ == 8)
+    {
+        return cpu::TraceWideBvh(ray, rt_triangles_.data(), bvh8_nodes_.data(), primitive_indices, closest_hit, hit, stats);
+    }
+
+    Instance const* instances = instances_.empty() ? nullptr : instances_.data();
+    return cpu::TraceBvh(ray, rt_triangles_.data(), nodes_.data(), primitive_indices, instances, closest_hit, hit, stats);
+}
+
+void CPUPathTraceIntegrator::SetCameraData(Camera const& camera)
+{
+    camera_ = camera;
+}
+
+void CPUPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure)
+{
+    // There is no GPU, just keep the host copies of the scene data
+    auto const& triangles = scene.GetTriangles();
+    indexed_triangles_ = scene.GetIndexedTriangles();
+    vertex_positions_ = scene.GetVertexPositions();
+    vertex_texcoords_ = scene.GetVertexTexcoords();
+    instances_ = scene.GetInstances();
+    materials_ = scene.GetMaterials();
+    analytic_lights_ = scene.GetLights();
+    emissive_alias_table_ = scene.GetEmissiveAliasTable();
+    textures_ = scene.GetTextures();
+    texture_data_ = scene.GetTextureData();
+    env_image_ = scene.GetEnvImage();
+    scene_info_ = scene.GetSceneInfo();
+
+    assert(!triangles.empty());
+    assert(!materials_.empty());
+
+    // Additional compressed triangle buffer
+    rt_triangles_.clear();
+    rt_triangles_.reserve(triangles.size());
+    for (auto const& triangle : triangles)
+    {
+        rt_triangles_.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
+    }
+
+    nodes_ = acc_structure_.GetNodes();
+    primitive_indices_ = acc_structure_.GetPrimitiveIndices();
+    UpdateWideBvh();
+}
+
+void CPUPathTraceIntegrator::UpdateGeometry(Scene const& scene)
+{
+    auto const& triangles = scene.GetTriangles();
+    for (std::size_t i = 0; i < triangles.size(); ++i)
+    {
+        rt_triangles_[i] = RTTriangle(triangles[i].v1.position, triangles[i].v2.position, triangles[i].v3.position);
+    }
+    vertex_positions_ = scene.GetVertexPositions();
+    vertex_texcoords_ = scene.GetVertexTexcoords();
+
+    acc_structure_.Refit(triangles);
+    nodes_ = acc_structure_.GetNodes();
+    UpdateWideBvh();
+
+    RequestReset();
+}
+
+void CPUPathTraceIntegrator::UpdateInstances(Scene const& scene)
+{
+    instances_ = scene.GetInstances();
+
+    // The bottom level nodes are not changed
+    auto const& nodes = acc_structure_.GetNodes();
+    std::copy(nodes.begin(), nodes.begin() + acc_structure_.GetTopLevelNodeCount(), nodes_.begin());
+
+    RequestReset();
+}
+
+void CPUPathTraceIntegrator::SetSamplerType(SamplerType sampler_type)
+{
+    if (sampler_type == sampler_type_)
+    {
+        return;
+    }
+
+    sampler_type_ = sampler_type;
+    RequestReset();
+}
+
+void CPUPathTraceIntegrator::SetAOV(AOV aov)
+{
+    if (aov == aov_)
+    {
+        return;
+    }
+
+    aov_ = aov;
+    RequestReset();
+}
+
+void CPUPathTraceIntegrator::EnableDenoiser(bool enable_denoiser)
+{
+    if (enable_denoiser == enable_denoiser_)
+    {
+        return;
+    }
+
+    enable_denoiser_ = enable_denoiser;
+    RequestReset();
+}
+
+void CPUPathTraceIntegrator::Reset()
+{
+    if (!enable_denoiser_)
+    {
+        // Reset frame index
+        sample_counter_ = 0;
+    }
+
+    // Reset radiance buffer
+    std::fill(radiance_.begin(), radiance_.end(), float4(0.0f));
+    std::fill(luminance_sq_sums_.begin(), luminance_sq_sums_.end(), 0.0f);
+    std::fill(pixel_sample_counts_.begin(), pixel_sample_counts_.end(), 0u);
+}
+
+void CPUPathTraceIntegrator::AdvanceSampleCount()
+{
+    sample_counter_ += samples_per_launch_;
+}
+
+void CPUPathTraceIntegrator::GenerateRays()
+{
+    std::uint32_t num_paths = width_ * height_ * samples_per_launch_;
+    cpu::KernelOptions options = GetKernelOptions();
+
+    // Only the pixels that haven't converged add their rays with adaptive sampling
+    ray_counter_[0] = 0;
+
+    thread_pool_.ParallelFor(num_paths, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t path_idx = begin; path_idx < end; ++path_idx)
+            {
+                cpu::RayGeneration((std::uint32_t)path_idx, width_, height_, camera_, sample_counter_, samples_per_launch_,
+                    radiance_.data(), luminance_sq_sums_.data(), pixel_sample_counts_.data(), options,
+                    rays_[0].data(), &ray_counter_[0], pixel_indices_[0].data(), throughputs_.data(),
+                    diffuse_albedo_.data(), depth_.data(), normal_.data(), velocity_.data());
+            }
+        }, kGrainSize);
+
+    if (adaptive_sampling_threshold_ == 0.0f)
+    {
+        ray_counter_[0] = num_paths;
+    }
+}
+
+void CPUPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
+{
+    std::uint32_t incoming_idx = bounce & 1;
+    // The ray count is known on the host, so there is no need to dispatch the max number of rays
+    std::uint32_t num_rays = ray_counter_[incoming_idx];
+    // The traversal work is counted for the heatmap only, same as the BVH_STATISTICS kernel
+    bool count_traversal_work = aov_ == AOV::kTraversalHeatmap;
+    traced_ray_count_ += num_rays;
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t ray_idx = begin; ray_idx < end; ++ray_idx)
+            {
+                TraversalStats* stats = nullptr;
+                if (count_traversal_work)
+                {
+                    stats = &traversal_stats_[ray_idx];
+                    *stats = {};
+                }
+                TraceRay(rays_[incoming_idx][ray_idx], true, &hits_[ray_idx], stats);
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::ComputeAOVs()
+{
+    std::uint32_t num_rays = ray_counter_[0];
+    // The traversal work of the primary rays is gathered into the pixels for the heatmap
+    TraversalStats* traversal_heatmap = aov_ == AOV::kTraversalHeatmap ? traversal_heatmap_.data() : nullptr;
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t ray_idx = begin; ray_idx < end; ++ray_idx)
+            {
+                cpu::GenerateAOV((std::uint32_t)ray_idx, rays_[0].data(), pixel_indices_[0].data(), hits_.data(),
+                    indexed_triangles_.data(), vertex_positions_.data(), vertex_texcoords_.data(),
+                    instances_.data(), materials_.data(), textures_.data(), texture_data_.data(),
+                    camera_, prev_camera_, samples_per_launch_, traversal_stats_.data(),
+                    diffuse_albedo_.data(), depth_.data(), normal_.data(), velocity_.data(), traversal_heatmap);
+            }
+        }, kGrainSize);
+
+    prev_camera_ = camera_;
+}
+
+void CPUPathTraceIntegrator::IntersectShadowRays()
+{
+    std::uint32_t num_rays = shadow_ray_counter_;
+    traced_ray_count_ += num_rays;
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t ray_idx = begin; ray_idx < end; ++ray_idx)
+            {
+                Hit hit;
+                bool hit_found = TraceRay(shadow_rays_[ray_idx], false, &hit);
+                shadow_hits_[ray_idx] = hit_found ? 0 : INVALID_ID;
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::ShadeMissedRays(std::uint32_t bounce)
+{
+    std::uint32_t incoming_idx = bounce & 1;
+    std::uint32_t num_rays = ray_counter_[incoming_idx];
+    cpu::KernelOptions options = GetKernelOptions();
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t ray_idx = begin; ray_idx < end; ++ray_idx)
+            {
+                cpu::Miss((std::uint32_t)ray_idx, rays_[incoming_idx].data(), hits_.data(),
+                    pixel_indices_[incoming_idx].data(), throughputs_.data(), env_image_, options,
+                    GetPathRadiance());
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
+{
+    std::uint32_t incoming_idx = bounce & 1;
+    std::uint32_t outgoing_idx = (bounce + 1) & 1;
+    std::uint32_t num_rays = ray_counter_[incoming_idx];
+    cpu::KernelOptions options = GetKernelOptions();
+    cpu::BlueNoiseBuffers blue_noise = GetBlueNoiseBuffers();
+
+    if (enable_material_sorted_shading_)
+    {
+        SortHitsByMaterial(num_rays);
+    }
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t sorted_idx = begin; sorted_idx < end; ++sorted_idx)
+            {
+                std::uint32_t ray_idx = enable_material_sorted_shading_ ?
+                    shading_order_[sorted_idx] : (std::uint32_t)sorted_idx;
+                cpu::HitSurface(ray_idx,
+                    // Input
+                    rays_[incoming_idx].data(), pixel_indices_[incoming_idx].data(), hits_.data(),
+                    indexed_triangles_.data(), vertex_positions_.data(), vertex_texcoords_.data(),
+                    instances_.data(), analytic_lights_.data(), emissive_alias_table_.data(), materials_.data(),
+                    textures_.data(), texture_data_.data(),
+                    bounce, width_, sample_counter_, samples_per_launch_, scene_info_, blue_noise, options,
+                    // Output
+                    throughputs_.data(), bxdf_pdfs_.data(),
+                    rays_[outgoing_idx].data(), &ray_counter_[outgoing_idx], pixel_indices_[outgoing_idx].data(),
+                    shadow_rays_.data(), &shadow_ray_counter_, shadow_pixel_indices_.data(),
+                    direct_light_samples_.data(), GetPathRadiance());
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::SortHitsByMaterial(std::uint32_t num_rays)
+{
+    // Counting sort, the rays that missed go to the last bucket
+    std::uint32_t num_materials = (std::uint32_t)materials_.size();
+    auto get_bucket = [&](std::uint32_t ray_idx)
+    {
+        std::uint32_t primitive_id = hits_[ray_idx].primitive_id;
+        return primitive_id == INVALID_ID ? num_materials : indexed_triangles_[primitive_id].mtlIndex;
+    };
+
+    material_counts_.assign(num_materials + 1, 0);
+    for (std::uint32_t ray_idx = 0; ray_idx < num_rays; ++ray_idx)
+    {
+        ++material_counts_[get_bucket(ray_idx)];
+    }
+
+    std::uint32_t prefix = 0;
+    for (std::uint32_t& count : material_counts_)
+    {
+        std::uint32_t bucket_count = count;
+        count = prefix;
+        prefix += bucket_count;
+    }
+
+    for (std::uint32_t ray_idx = 0; ray_idx < num_rays; ++ray_idx)
+    {
+        shading_order_[material_counts_[get_bucket(ray_idx)]++] = ray_idx;
+    }
+}
+
+void CPUPathTraceIntegrator::AccumulateDirectSamples()
+{
+    std::uint32_t num_rays = shadow_ray_counter_;
+
+    thread_pool_.ParallelFor(num_rays, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t ray_idx = begin; ray_idx < end; ++ray_idx)
+            {
+                cpu::AccumulateDirectSamples((std::uint32_t)ray_idx, shadow_hits_.data(),
+                    shadow_pixel_indices_.data(), direct_light_samples_.data(), GetPathRadiance());
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::AccumulatePathRadiance()
+{
+    cpu::KernelOptions options = GetKernelOptions();
+
+    thread_pool_.ParallelFor(width_ * height_, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t pixel_idx = begin; pixel_idx < end; ++pixel_idx)
+            {
+                cpu::AccumulatePathRadiance((std::uint32_t)pixel_idx, samples_per_launch_, path_radiance_.data(),
+                    options, radiance_.data(), luminance_sq_sums_.data(), pixel_sample_counts_.data());
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::SortRays(std::uint32_t bounce)
+{
+    // The rays are traced in the order they are spawned
+}
+
+void CPUPathTraceIntegrator::ClearOutgoingRayCounter(std::uint32_t bounce)
+{
+    std::uint32_t outgoing_idx = (bounce + 1) & 1;
+    ray_counter_[outgoing_idx] = 0;
+}
+
+void CPUPathTraceIntegrator::ClearShadowRayCounter()
+{
+    shadow_ray_counter_ = 0;
+}
+
+void CPUPathTraceIntegrator::Denoise()
+{
+    thread_pool_.ParallelFor(width_ * height_, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t pixel_idx = begin; pixel_idx < end; ++pixel_idx)
+            {
+                cpu::TemporalAccumulation((std::uint32_t)pixel_idx, width_, height_, radiance_.data(),
+                    prev_radiance_.data(), depth_.data(), prev_depth_.data(), velocity_.data());
+            }
+        }, kGrainSize);
+}
+
+void CPUPathTraceIntegrator::CopyHistoryBuffers()
+{
+    // Copy to the history
+    prev_radiance_ = radiance_;
+    prev_depth_ = depth_;
+}
+
+void CPUPathTraceIntegrator::ResolveRadiance()
+{
+    cpu::KernelOptions options = GetKernelOptions();
+    std::uint32_t aov_index = aov_;
+
+    thread_pool_.ParallelFor(width_ * height_, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t pixel_idx = begin; pixel_idx < end; ++pixel_idx)
+            {
+                cpu::ResolveRadiance((std::uint32_t)pixel_idx, aov_index, radiance_.data(), diffuse_albedo_.data(),
+                    depth_.data(), normal_.data(), velocity_.data(), traversal_heatmap_.data(), sample_counter_,
+                    pixel_sample_counts_.data(), options,
+                    output_image_.data());
+            }
+        }, kGrainSize);
+
+    if (gl_output_image_ != 0)
+    {
+        // Upload the result to the framebuffer texture
+        glTextureSubImage2D(gl_output_image_, 0, 0, 0, width_, height_, GL_RGBA, GL_FLOAT, output_image_.data());
+    }
+}
+
+void CPUPathTraceIntegrator::ReadOutputImage(std::vector<float>& data)
+{
+    data.resize(width_ * height_ * 4);
+    std::memcpy(data.data(), output_image_.data(), data.size() * sizeof(float));
+}
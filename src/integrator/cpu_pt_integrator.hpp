@@ -0,0 +1,142 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "integrator.hpp"
+#include "loaders/image_loader.hpp"
+#include "utils/thread_pool.hpp"
+#include <atomic>
+
+namespace cpu
+{
+    struct KernelOptions;
+}
+
+class CPUPathTraceIntegrator : public Integrator
+{
+public:
+    // Pass out_image = 0 to keep the result on the host only (headless mode)
+    // Pass num_threads = 0 to use all hardware threads
+    CPUPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
+        AccelerationStructure& acc_structure, unsigned int out_image, std::uint32_t num_threads = 0);
+    void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) override;
+    void UpdateGeometry(Scene const& scene) override;
+    void UpdateInstances(Scene const& scene) override;
+    void SetCameraData(Camera const& camera) override;
+    void SetSamplerType(SamplerType sampler_type) override;
+    void SetAOV(AOV aov) override;
+    void EnableDenoiser(bool enable) override;
+    void ReadOutputImage(std::vector<float>& data) override;
+    std::uint64_t GetTracedRayCount() override { return traced_ray_count_; }
+
+protected:
+    void CreateKernels() override;
+    void UpdateWideBvh() override;
+    void CreatePathBuffers() override;
+    void Reset() override;
+    void AdvanceSampleCount() override;
+    void GenerateRays() override;
+    void IntersectRays(std::uint32_t bounce) override;
+    void ComputeAOVs() override;
+    void ShadeMissedRays(std::uint32_t bounce) override;
+    void ShadeSurfaceHits(std::uint32_t bounce) override;
+    void IntersectShadowRays() override;
+    void AccumulateDirectSamples() override;
+    void AccumulatePathRadiance() override;
+    void SortRays(std::uint32_t bounce) override;
+    void ClearOutgoingRayCounter(std::uint32_t bounce) override;
+    void ClearShadowRayCounter() override;
+    void Denoise() override;
+    void CopyHistoryBuffers() override;
+    void ResolveRadiance() override;
+
+private:
+    // Traverses the binary or the wide nodes depending on the BVH width, counts the work if stats is not nullptr
+    bool TraceRay(Ray const& ray, bool closest_hit, Hit* hit, TraversalStats* stats = nullptr) const;
+    void SortHitsByMaterial(std::uint32_t num_rays);
+    // The paths accumulate into the pixel radiance directly for one sample per launch
+    float4* GetPathRadiance() { return UsesPathRadianceBuffer() ? path_radiance_.data() : radiance_.data(); }
+    cpu::KernelOptions GetKernelOptions() const;
+
+    ThreadPool thread_pool_;
+    unsigned int gl_output_image_;
+
+    // Internal buffers
+    std::vector<Ray> rays_[2]; // 2 buffers for incoming-outgoing rays
+    std::vector<Ray> shadow_rays_;
+    std::vector<std::uint32_t> pixel_indices_[2];
+    std::vector<std::uint32_t> shadow_pixel_indices_;
+    std::atomic<std::uint32_t> ray_counter_[2];
+    std::atomic<std::uint32_t> shadow_ray_counter_;
+    std::uint64_t traced_ray_count_ = 0;
+    std::vector<Hit> hits_;
+    // Incoming ray indices grouped by the material of their hits
+    std::vector<std::uint32_t> material_counts_;
+    std::vector<std::uint32_t> shading_order_;
+    std::vector<std::uint32_t> shadow_hits_;
+    std::vector<float3> throughputs_;
+    // Pdf of the BxDF sample of every path for the MIS weight of the emission it hits
+    std::vector<float> bxdf_pdfs_;
+    std::uint32_t sample_counter_ = 0;
+    std::vector<float4> radiance_;
+    std::vector<float4> path_radiance_;
+    // Sums of the squared sample luminances and the sample counts of the pixels for adaptive sampling
+    std::vector<float> luminance_sq_sums_;
+    std::vector<std::uint32_t> pixel_sample_counts_;
+    std::vector<float4> prev_radiance_;
+    std::vector<float3> diffuse_albedo_;
+    std::vector<float> depth_;
+    std::vector<float> prev_depth_;
+    std::vector<float3> normal_;
+    std::vector<float2> velocity_;
+    // Traversal work of the last traced rays and of the primary rays of the frame
+    std::vector<TraversalStats> traversal_stats_;
+    std::vector<TraversalStats> traversal_heatmap_;
+    std::vector<float3> direct_light_samples_;
+    std::vector<float4> output_image_;
+
+    // Scene data
+    std::vector<IndexedTriangle> indexed_triangles_;
+    std::vector<float4> vertex_positions_;
+    std::vector<std::uint32_t> vertex_texcoords_;
+    std::vector<RTTriangle> rt_triangles_;
+    std::vector<Instance> instances_;
+    std::vector<PackedMaterial> materials_;
+    std::vector<Texture> textures_;
+    std::vector<std::uint32_t> texture_data_;
+    std::vector<Light> analytic_lights_;
+    std::vector<EmissiveAliasEntry> emissive_alias_table_;
+    Image env_image_;
+    SceneInfo scene_info_ = {};
+
+    // Acceleration structure data
+    std::vector<LinearBVHNode> nodes_;
+    std::vector<BVH4Node> bvh4_nodes_;
+    std::vector<BVH8Node> bvh8_nodes_;
+    std::vector<CompressedBVH4Node> compressed_bvh4_nodes_;
+    std::vector<CompressedBVH8Node> compressed_bvh8_nodes_;
+    std::vector<std::uint32_t> primitive_indices_;
+
+};
@@ -34,6 +34,7 @@ constexpr std::uint32_t kResetGroupSize = 32u;
 constexpr std::uint32_t kRayGenerationGroupSize = 256u;
 constexpr std::uint32_t kIntersectGroupSize = 64u;
 constexpr std::uint32_t kMissGroupSize = 32u;
+// Must match hit_surface.comp
 constexpr std::uint32_t kShadeGroupSize = 32u;
 constexpr std::uint32_t kAccumulateDirectSamplesGroupSize = 256u;
 constexpr std::uint32_t kResolveGroupSize = 32u;
@@ -52,6 +53,12 @@ GLPathTraceIntegrator::GLPathTraceIntegrator(std::uint32_t width, std::uint32_t
     : Integrator(width, height, acc_structure)
     , out_image_(out_image)
 {
+    if (acc_structure_.GetTopLevelNodeCount() > 0)
+    {
+        // The visibility buffer and the kernels work with the scene triangles as is
+        throw std::runtime_error("Instancing is supported only by the OpenCL and CPU backends");
+    }
+
     std::uint32_t num_rays = width_ * height_;
 
     glCreateTextures(GL_TEXTURE_2D, 1, &radiance_image_);
@@ -84,6 +91,7 @@ GLPathTraceIntegrator::GLPathTraceIntegrator(std::uint32_t width, std::uint32_t
     throughputs_buffer_ = CreateBuffer(num_rays * sizeof(float) * 4);
     sample_counter_buffer_ = CreateBuffer(sizeof(std::uint32_t));
     direct_light_samples_buffer_ = CreateBuffer(num_rays * sizeof(float) * 4);
+    dispatch_arguments_buffer_ = CreateBuffer(3 * sizeof(std::uint32_t));
 
     CreateKernels();
 }
@@ -99,11 +107,25 @@ void GLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     auto const& texture_data = scene.GetTextureData();
     auto const& env_image = scene.GetEnvImage();
 
-    // Triangle buffer
+    // Indexed mesh
+    auto const& indexed_triangles = scene.GetIndexedTriangles();
+    auto const& vertex_positions = scene.GetVertexPositions();
+    auto const& vertex_texcoords = scene.GetVertexTexcoords();
     num_triangles_ = triangles.size();
 
-    glCreateBuffers(1, &triangle_buffer_);
-    glNamedBufferData(triangle_buffer_, triangles.size() * sizeof(Triangle), triangles.data(), GL_STATIC_DRAW);
+    glCreateBuffers(1, &indexed_triangle_buffer_);
+    glNamedBufferData(indexed_triangle_buffer_, indexed_triangles.size() * sizeof(IndexedTriangle),
+        indexed_triangles.data(), GL_STATIC_DRAW);
+
+    glCreateBuffers(1, &vertex_position_buffer_);
+    glNamedBufferData(vertex_position_buffer_, vertex_positions.size() * sizeof(float4), vertex_positions.data(), GL_STATIC_DRAW);
+    glCreateTextures(GL_TEXTURE_BUFFER, 1, &vertex_position_texture_);
+    glTextureBuffer(vertex_position_texture_, GL_RGBA32F, vertex_position_buffer_);
+
+    glCreateBuffers(1, &vertex_texcoord_buffer_);
+    glNamedBufferData(vertex_texcoord_buffer_, vertex_texcoords.size() * sizeof(std::uint32_t), vertex_texcoords.data(), GL_STATIC_DRAW);
+    glCreateTextures(GL_TEXTURE_BUFFER, 1, &vertex_texcoord_texture_);
+    glTextureBuffer(vertex_texcoord_texture_, GL_R32UI, vertex_texcoord_buffer_);
 
     // Additional compressed triangle buffer
     {
@@ -169,6 +191,56 @@ void GLPathTraceIntegrator::UploadGPUData(Scene const& scene, AccelerationStruct
     auto const& nodes = acc_structure.GetNodes();
     glCreateBuffers(1, &nodes_buffer_);
     glNamedBufferData(nodes_buffer_, nodes.size() * sizeof(LinearBVHNode), nodes.data(), GL_STATIC_DRAW);
+
+    auto const& primitive_indices = acc_structure.GetPrimitiveIndices();
+    if (!primitive_indices.empty())
+    {
+        glCreateBuffers(1, &primitive_indices_buffer_);
+        glNamedBufferData(primitive_indices_buffer_, primitive_indices.size() * sizeof(std::uint32_t),
+            primitive_indices.data(), GL_STATIC_DRAW);
+    }
+}
+
+void GLPathTraceIntegrator::UpdateGeometry(Scene const& scene)
+{
+    // Refit on the host and upload the nodes
+    auto const& triangles = scene.GetTriangles();
+    acc_structure_.Refit(triangles);
+
+    std::vector<RTTriangle> rt_triangles;
+    rt_triangles.reserve(triangles.size());
+    for (auto const& triangle : triangles)
+    {
+        rt_triangles.emplace_back(triangle.v1.position, triangle.v2.position, triangle.v3.position);
+    }
+
+    auto const& nodes = acc_structure_.GetNodes();
+    auto const& vertex_positions = scene.GetVertexPositions();
+    auto const& vertex_texcoords = scene.GetVertexTexcoords();
+    glNamedBufferSubData(vertex_position_buffer_, 0, vertex_positions.size() * sizeof(float4), vertex_positions.data());
+    glNamedBufferSubData(vertex_texcoord_buffer_, 0, vertex_texcoords.size() * sizeof(std::uint32_t), vertex_texcoords.data());
+    glNamedBufferSubData(rt_triangle_buffer_, 0, rt_triangles.size() * sizeof(RTTriangle), rt_triangles.data());
+    glNamedBufferSubData(nodes_buffer_, 0, nodes.size() * sizeof(LinearBVHNode), nodes.data());
+
+    RequestReset();
+}
+
+void GLPathTraceIntegrator::UpdateInstances(Scene const& scene)
+{
+    // Instanced scenes are rejected by the constructor, the shaders never see the instance transforms
+    throw std::runtime_error("Instancing is supported only by the OpenCL and CPU backends");
+}
+
+void GLPathTraceIntegrator::UpdateWideBvh()
+{
+    // The compute shaders traverse the binary nodes only
+}
+
+void GLPathTraceIntegrator::CreatePathBuffers()
+{
+    // The shaders trace one path for every pixel
+    samples_per_launch_ = 1;
+    adaptive_sampling_threshold_ = 0.0f;
 }
 
 void GLPathTraceIntegrator::SetCameraData(Camera const& camera)
@@ -200,6 +272,11 @@ void GLPathTraceIntegrator::CreateKernels()
         definitions.push_back("ENABLE_DENOISER");
     }
 
+    if (russian_roulette_bounce_ > 0)
+    {
+        definitions.push_back("RUSSIAN_ROULETTE_BOUNCE " + std::to_string(russian_roulette_bounce_));
+    }
+
     GraphicsPipeline::GraphicsPipelineDesc pipeline_desc;
     pipeline_desc.vs_filename = "visibility_buffer.vert";
     pipeline_desc.fs_filename = "visibility_buffer.frag";
@@ -216,14 +293,23 @@ void GLPathTraceIntegrator::CreateKernels()
     clear_counter_pipeline_ = std::make_unique<ComputePipeline>("clear_counter.comp");
     hit_surface_pipeline_ = std::make_unique<ComputePipeline>("hit_surface.comp", definitions);
     increment_counter_pipeline_ = std::make_unique<ComputePipeline>("increment_counter.comp");
+    prepare_indirect_dispatch_pipeline_ = std::make_unique<ComputePipeline>("prepare_indirect_dispatch.comp");
     initialize_hits_pipeline_ = std::make_unique<ComputePipeline>("initialize_hits.comp");
     miss_pipeline_ = std::make_unique<ComputePipeline>("miss.comp", definitions);
     raygen_pipeline_ = std::make_unique<ComputePipeline>("raygeneration.comp");
     reset_pipeline_ = std::make_unique<ComputePipeline>("reset_radiance.comp");
     resolve_pipeline_ = std::make_unique<ComputePipeline>("resolve_radiance.comp", definitions);
-    intersect_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp");
 
-    std::vector<std::string> trace_shadow_definitions = { "SHADOW_RAYS" };
+    std::vector<std::string> trace_definitions;
+    if (!acc_structure_.GetPrimitiveIndices().empty())
+    {
+        trace_definitions.push_back("PRIMITIVE_INDIRECTION");
+    }
+
+    intersect_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp", trace_definitions);
+
+    std::vector<std::string> trace_shadow_definitions = trace_definitions;
+    trace_shadow_definitions.push_back("SHADOW_RAYS");
     intersect_shadow_pipeline_ = std::make_unique<ComputePipeline>("trace_bvh.comp", trace_shadow_definitions);
 }
 
@@ -242,6 +328,13 @@ void GLPathTraceIntegrator::EnableDenoiser(bool enable)
 
 }
 
+void GLPathTraceIntegrator::ReadOutputImage(std::vector<float>& data)
+{
+    data.resize(width_ * height_ * 4);
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glGetTextureImage(out_image_, 0, GL_RGBA, GL_FLOAT, (GLsizei)(data.size() * sizeof(float)), data.data());
+}
+
 void GLPathTraceIntegrator::Reset()
 {
     if (!enable_denoiser_)
@@ -304,7 +397,8 @@ void GLPathTraceIntegrator::RasterizePrimaryBounce()
         GLuint uniform_index = glGetUniformLocation(visibility_pipeline_->GetProgram(), "g_ViewProjection");
         assert(uniform_index != GL_INVALID_INDEX);
         glUniformMatrix4fv(uniform_index, 1, GL_FALSE, &view_proj_matrix_[0][0]);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, triangle_buffer_);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, indexed_triangle_buffer_);
+        glBindTextureUnit(0, vertex_position_texture_);
 
         // Draw the geometry
         glDrawArrays(GL_TRIANGLES, 0, num_triangles_ * 3);
@@ -327,6 +421,21 @@ void GLPathTraceIntegrator::RasterizePrimaryBounce()
     }
 }
 
+void GLPathTraceIntegrator::PrepareIndirectDispatch(GLuint counter_buffer, std::uint32_t group_size)
+{
+    // The counter is written by the previous stage
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    prepare_indirect_dispatch_pipeline_->Bind();
+    prepare_indirect_dispatch_pipeline_->BindConstant("group_size", group_size);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, counter_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dispatch_arguments_buffer_);
+    glDispatchCompute(1, 1, 1);
+
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatch_arguments_buffer_);
+}
+
 void GLPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
 {
     if (bounce == 0)
@@ -335,9 +444,9 @@ void GLPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
         return;
     }
 
-    std::uint32_t max_num_rays = width_ * height_;
     std::uint32_t incoming_idx = bounce & 1;
 
+    PrepareIndirectDispatch(ray_counter_buffer_[incoming_idx], kIntersectGroupSize);
     intersect_pipeline_->Bind();
 
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, rays_buffer_[incoming_idx]);
@@ -345,10 +454,12 @@ void GLPathTraceIntegrator::IntersectRays(std::uint32_t bounce)
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, rt_triangle_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, nodes_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, hits_buffer_);
+    if (primitive_indices_buffer_)
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, primitive_indices_buffer_);
+    }
 
-    ///@TODO: use indirect dispatch
-    std::uint32_t num_groups = (max_num_rays + kIntersectGroupSize - 1) / kIntersectGroupSize;
-    glDispatchCompute(num_groups, 1, 1);
+    glDispatchComputeIndirect(0);
 }
 
 void GLPathTraceIntegrator::ComputeAOVs()
@@ -358,9 +469,9 @@ void GLPathTraceIntegrator::ComputeAOVs()
 
 void GLPathTraceIntegrator::ShadeMissedRays(std::uint32_t bounce)
 {
-    std::uint32_t max_num_rays = width_ * height_;
     std::uint32_t incoming_idx = bounce & 1;
 
+    PrepareIndirectDispatch(ray_counter_buffer_[incoming_idx], kMissGroupSize);
     miss_pipeline_->Bind();
     miss_pipeline_->BindConstant("width", width_);
 
@@ -372,17 +483,15 @@ void GLPathTraceIntegrator::ShadeMissedRays(std::uint32_t bounce)
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, throughputs_buffer_);
     glBindImageTexture(0, radiance_image_, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
-    std::uint32_t num_groups = (max_num_rays + kMissGroupSize - 1) / kMissGroupSize;
-    glDispatchCompute(num_groups, 1, 1);
+    glDispatchComputeIndirect(0);
 }
 
 void GLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
 {
-    std::uint32_t max_num_rays = width_ * height_;
-
     std::uint32_t incoming_idx = bounce & 1;
     std::uint32_t outgoing_idx = (bounce + 1) & 1;
 
+    PrepareIndirectDispatch(ray_counter_buffer_[incoming_idx], kShadeGroupSize);
     hit_surface_pipeline_->Bind();
     hit_surface_pipeline_->BindConstant("bounce", bounce);
     hit_surface_pipeline_->BindConstant("width", width_);
@@ -405,19 +514,19 @@ void GLPathTraceIntegrator::ShadeSurfaceHits(std::uint32_t bounce)
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9,  direct_light_samples_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, hits_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, throughputs_buffer_);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, triangle_buffer_);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, indexed_triangle_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, analytic_light_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, emissive_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, material_buffer_);
+    glBindTextureUnit(0, vertex_position_texture_);
+    glBindTextureUnit(1, vertex_texcoord_texture_);
 
-    std::uint32_t num_groups = (max_num_rays + kShadeGroupSize - 1) / kShadeGroupSize;
-    glDispatchCompute(num_groups, 1, 1);
+    glDispatchComputeIndirect(0);
 }
 
 void GLPathTraceIntegrator::IntersectShadowRays()
 {
-    std::uint32_t max_num_rays = width_ * height_;
-
+    PrepareIndirectDispatch(shadow_ray_counter_buffer_, kIntersectGroupSize);
     intersect_shadow_pipeline_->Bind();
 
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, shadow_rays_buffer_);
@@ -425,16 +534,17 @@ void GLPathTraceIntegrator::IntersectShadowRays()
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, rt_triangle_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, nodes_buffer_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, shadow_hits_buffer_);
+    if (primitive_indices_buffer_)
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, primitive_indices_buffer_);
+    }
 
-    ///@TODO: use indirect dispatch
-    std::uint32_t num_groups = (max_num_rays + kIntersectGroupSize - 1) / kIntersectGroupSize;
-    glDispatchCompute(num_groups, 1, 1);
+    glDispatchComputeIndirect(0);
 }
 
 void GLPathTraceIntegrator::AccumulateDirectSamples()
 {
-    std::uint32_t max_num_rays = width_ * height_;
-
+    PrepareIndirectDispatch(shadow_ray_counter_buffer_, kAccumulateDirectSamplesGroupSize);
     accumulate_direct_samples_pipeline_->Bind();
     accumulate_direct_samples_pipeline_->BindConstant("width", width_);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, shadow_hits_buffer_);
@@ -443,8 +553,17 @@ void GLPathTraceIntegrator::AccumulateDirectSamples()
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, direct_light_samples_buffer_);
     glBindImageTexture(4, radiance_image_, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
-    std::uint32_t num_groups = (max_num_rays + kAccumulateDirectSamplesGroupSize - 1) / kAccumulateDirectSamplesGroupSize;
-    glDispatchCompute(num_groups, 1, 1);
+    glDispatchComputeIndirect(0);
+}
+
+void GLPathTraceIntegrator::AccumulatePathRadiance()
+{
+    // The paths accumulate into the pixel radiance directly
+}
+
+void GLPathTraceIntegrator::SortRays(std::uint32_t bounce)
+{
+    // The rays are traced in the order they are spawned
 }
 
 void GLPathTraceIntegrator::ClearOutgoingRayCounter(std::uint32_t bounce)
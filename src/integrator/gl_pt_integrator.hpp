@@ -35,13 +35,18 @@ public:
     GLPathTraceIntegrator(std::uint32_t width, std::uint32_t height,
         AccelerationStructure& acc_structure, std::uint32_t out_image);
     void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) override;
+    void UpdateGeometry(Scene const& scene) override;
+    void UpdateInstances(Scene const& scene) override;
     void SetCameraData(Camera const& camera) override;
     void SetSamplerType(SamplerType sampler_type) override;
     void SetAOV(AOV aov) override;
     void EnableDenoiser(bool enable) override;
+    void ReadOutputImage(std::vector<float>& data) override;
 
 protected:
     void CreateKernels() override;
+    void UpdateWideBvh() override;
+    void CreatePathBuffers() override;
     void Reset() override;
     void AdvanceSampleCount() override;
     void GenerateRays() override;
@@ -51,6 +56,8 @@ protected:
     void ShadeSurfaceHits(std::uint32_t bounce) override;
     void IntersectShadowRays() override;
     void AccumulateDirectSamples() override;
+    void AccumulatePathRadiance() override;
+    void SortRays(std::uint32_t bounce) override;
     void ClearOutgoingRayCounter(std::uint32_t bounce) override;
     void ClearShadowRayCounter() override;
     void Denoise() override;
@@ -59,6 +66,8 @@ protected:
 
 private:
     void RasterizePrimaryBounce();
+    // Computes the group count of the next glDispatchComputeIndirect from the ray counter
+    void PrepareIndirectDispatch(GLuint counter_buffer, std::uint32_t group_size);
 
     // Pipelines
     std::unique_ptr<GraphicsPipeline> visibility_pipeline_;
@@ -72,6 +81,7 @@ private:
     std::unique_ptr<ComputePipeline> accumulate_direct_samples_pipeline_;
     std::unique_ptr<ComputePipeline> clear_counter_pipeline_;
     std::unique_ptr<ComputePipeline> increment_counter_pipeline_;
+    std::unique_ptr<ComputePipeline> prepare_indirect_dispatch_pipeline_;
     std::unique_ptr<ComputePipeline> initialize_hits_pipeline_;
     std::unique_ptr<ComputePipeline> temporal_accumulation_pipeline_;
     std::unique_ptr<ComputePipeline> resolve_pipeline_;
@@ -84,7 +94,12 @@ private:
     GLuint out_image_;
 
     // Scene buffers
-    GLuint triangle_buffer_;
+    GLuint indexed_triangle_buffer_;
+    // Read through texture buffers, the shading kernel is out of storage buffer bindings
+    GLuint vertex_position_buffer_;
+    GLuint vertex_texcoord_buffer_;
+    GLuint vertex_position_texture_;
+    GLuint vertex_texcoord_texture_;
     GLuint material_buffer_;
     GLuint texture_buffer_;
     GLuint texture_data_buffer_;
@@ -101,6 +116,7 @@ private:
     // Acceleration structure
     GLuint rt_triangle_buffer_;
     GLuint nodes_buffer_;
+    GLuint primitive_indices_buffer_ = 0;
 
     // Indirect rays
     GLuint rays_buffer_[2]; // 2 buffers for incoming-outgoing rays
@@ -116,6 +132,8 @@ private:
     GLuint throughputs_buffer_;
     GLuint sample_counter_buffer_;
     GLuint direct_light_samples_buffer_;
+    // Group counts of the ray stages
+    GLuint dispatch_arguments_buffer_;
 
     std::uint32_t num_triangles_;
     Camera camera = {};
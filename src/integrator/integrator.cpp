@@ -23,6 +23,8 @@
  *****************************************************************************/
 
 #include "integrator.hpp"
+#include "acceleration_structure.hpp"
+#include <stdexcept>
 
 void Integrator::Integrate()
 {
@@ -47,8 +49,16 @@ void Integrator::Integrate()
         ShadeSurfaceHits(bounce);
         IntersectShadowRays();
         AccumulateDirectSamples();
+        if (bounce < max_bounces_ && (ray_sort_bounces_ >> (bounce + 1)) & 1)
+        {
+            SortRays(bounce);
+        }
     }
 
+    if (UsesPathRadianceBuffer())
+    {
+        AccumulatePathRadiance();
+    }
     AdvanceSampleCount();
     if (enable_denoiser_)
     {
@@ -61,6 +71,7 @@ void Integrator::Integrate()
 void Integrator::SetMaxBounces(std::uint32_t max_bounces)
 {
     max_bounces_ = max_bounces;
+    CreateKernels();
     RequestReset();
 }
 
@@ -75,3 +86,111 @@ void Integrator::EnableWhiteFurnace(bool enable)
     CreateKernels();
     RequestReset();
 }
+
+void Integrator::SetBvhWidth(std::uint32_t bvh_width)
+{
+    if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8)
+    {
+        throw std::runtime_error("BVH width must be 2, 4 or 8");
+    }
+
+    // The wide traversal has no top level, two-level BVHs keep the binary nodes
+    if (acc_structure_.GetTopLevelNodeCount() > 0)
+    {
+        bvh_width = 2;
+    }
+
+    if (bvh_width == bvh_width_)
+    {
+        return;
+    }
+
+    bvh_width_ = bvh_width;
+    UpdateWideBvh();
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::EnableNodeCompression(bool enable)
+{
+    if (enable == enable_node_compression_)
+    {
+        return;
+    }
+
+    enable_node_compression_ = enable;
+    UpdateWideBvh();
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::EnablePersistentThreads(bool enable)
+{
+    if (enable == enable_persistent_threads_)
+    {
+        return;
+    }
+
+    // The traced rays and the image stay the same
+    enable_persistent_threads_ = enable;
+    CreateKernels();
+}
+
+void Integrator::EnableMaterialSortedShading(bool enable)
+{
+    if (enable == enable_material_sorted_shading_)
+    {
+        return;
+    }
+
+    enable_material_sorted_shading_ = enable;
+    CreateKernels();
+}
+
+void Integrator::SetSamplesPerLaunch(std::uint32_t samples_per_launch)
+{
+    if (samples_per_launch == 0)
+    {
+        throw std::runtime_error("At least one sample per launch is required");
+    }
+
+    if (samples_per_launch == samples_per_launch_)
+    {
+        return;
+    }
+
+    samples_per_launch_ = samples_per_launch;
+    CreatePathBuffers();
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::SetAdaptiveSamplingThreshold(float error_threshold)
+{
+    if (error_threshold < 0.0f)
+    {
+        throw std::runtime_error("Adaptive sampling threshold must not be negative");
+    }
+
+    if (error_threshold == adaptive_sampling_threshold_)
+    {
+        return;
+    }
+
+    adaptive_sampling_threshold_ = error_threshold;
+    CreatePathBuffers();
+    CreateKernels();
+    RequestReset();
+}
+
+void Integrator::SetRussianRouletteBounce(std::uint32_t bounce)
+{
+    if (bounce == russian_roulette_bounce_)
+    {
+        return;
+    }
+
+    russian_roulette_bounce_ = bounce;
+    CreateKernels();
+    RequestReset();
+}
@@ -26,11 +26,30 @@
 
 #include "gpu_wrappers/cl_context.hpp"
 #include <memory>
+#include <vector>
 
 class Scene;
 class CameraController;
 class AccelerationStructure;
 
+// Wavefront settings passed to the integrator setters after it is created
+struct IntegratorOptions
+{
+    // Trace with persistent work items taking the rays from a global queue, OpenCL backend only
+    bool persistent_threads = false;
+    // Bit N sorts the rays traced at bounce N by direction and origin before the traversal, OpenCL backend only
+    std::uint32_t sort_ray_bounces = 0;
+    // Shade the hits grouped by material with a counting sort, OpenCL and CPU backends
+    bool sort_materials = false;
+    // Paths traced per pixel by one launch of the wavefront, OpenCL and CPU backends
+    std::uint32_t samples_per_launch = 1;
+    // Pixels whose standard error relative to their mean luminance drops below it stop taking samples,
+    // 0 - off. OpenCL and CPU backends
+    float adaptive_sampling_threshold = 0.0f;
+    // Bounce from which the paths are terminated randomly by their throughput, 0 - off
+    std::uint32_t russian_roulette_bounce = 0;
+};
+
 class Integrator
 {
 public:
@@ -46,23 +65,58 @@ public:
         kDiffuseAlbedo,
         kDepth,
         kNormal,
-        kMotionVectors
+        kMotionVectors,
+        // Node visits and triangle tests of the primary rays
+        kTraversalHeatmap
     };
 
     Integrator(std::uint32_t width, std::uint32_t height, AccelerationStructure& acc_structure)
         : width_(width), height_(height), acc_structure_(acc_structure) {}
+    virtual ~Integrator() = default;
     void Integrate();
     virtual void UploadGPUData(Scene const& scene, AccelerationStructure const& acc_structure) = 0;
+    // Uploads the moved vertices of the scene triangles and refits the BVH, the triangle count and order are kept
+    virtual void UpdateGeometry(Scene const& scene) = 0;
+    // Uploads the instance transforms and the rebuilt top level BVH
+    virtual void UpdateInstances(Scene const& scene) = 0;
     virtual void SetCameraData(Camera const& camera) = 0;
     void RequestReset() { request_reset_ = true; }
     void EnableWhiteFurnace(bool enable);
     void SetMaxBounces(std::uint32_t max_bounces);
+    // Traverse the BVH collapsed into 4 or 8 wide nodes, 2 selects the binary nodes
+    void SetBvhWidth(std::uint32_t bvh_width);
+    // Quantize the child bounds of the wide nodes to 8 bits, ignored for the binary nodes
+    void EnableNodeCompression(bool enable);
+    // Trace with the work items taking the rays from a global queue until it drains, OpenCL backend only
+    void EnablePersistentThreads(bool enable);
+    // Bit N sorts the rays traced at bounce N by direction octant and origin before the traversal, OpenCL backend only
+    void SetRaySortBounces(std::uint32_t bounce_mask) { ray_sort_bounces_ = bounce_mask; }
+    // Shade the hits grouped by material, GL backend ignores it
+    void EnableMaterialSortedShading(bool enable);
+    // Trace several paths per pixel in one Integrate() call, the AOVs come from the first one. GL backend ignores it
+    void SetSamplesPerLaunch(std::uint32_t samples_per_launch);
+    std::uint32_t GetSamplesPerLaunch() const { return samples_per_launch_; }
+    // Stop tracing the pixels whose standard error relative to their mean luminance is below the threshold,
+    // 0 - all pixels take every sample. GL backend ignores it
+    void SetAdaptiveSamplingThreshold(float error_threshold);
+    // Terminate the paths randomly by their throughput from this bounce on, 0 - off
+    void SetRussianRouletteBounce(std::uint32_t bounce);
+    // Primary, secondary and shadow rays traced since the creation, 0 if the backend doesn't count them
+    virtual std::uint64_t GetTracedRayCount() { return 0; }
     virtual void SetSamplerType(SamplerType sampler_type) = 0;
     virtual void SetAOV(AOV aov) = 0;
     virtual void EnableDenoiser(bool enable) = 0;
+    // Reads back the resolved RGBA32F image
+    virtual void ReadOutputImage(std::vector<float>& data) = 0;
 
 protected:
+    // The samples are kept apart until AccumulatePathRadiance adds them to the pixels
+    bool UsesPathRadianceBuffer() const { return samples_per_launch_ > 1 || adaptive_sampling_threshold_ > 0.0f; }
     virtual void CreateKernels() = 0;
+    // Collapses the nodes of acc_structure_ for the current BVH width
+    virtual void UpdateWideBvh() = 0;
+    // Sizes the ray, hit and throughput buffers for width * height * samples_per_launch_ paths
+    virtual void CreatePathBuffers() = 0;
     virtual void Reset() = 0;
     virtual void AdvanceSampleCount() = 0;
     virtual void GenerateRays() = 0;
@@ -72,6 +126,10 @@ protected:
     virtual void ShadeSurfaceHits(std::uint32_t bounce) = 0;
     virtual void IntersectShadowRays() = 0;
     virtual void AccumulateDirectSamples() = 0;
+    // Adds the radiance of the paths traced for a pixel by the launch to the pixel and updates its sample statistics
+    virtual void AccumulatePathRadiance() = 0;
+    // Reorders the outgoing rays of the bounce
+    virtual void SortRays(std::uint32_t bounce) = 0;
     virtual void ClearOutgoingRayCounter(std::uint32_t bounce) = 0;
     virtual void ClearShadowRayCounter() = 0;
     virtual void Denoise() = 0;
@@ -89,6 +147,14 @@ protected:
     Camera prev_camera_ = {};
 
     std::uint32_t max_bounces_ = 3u;
+    std::uint32_t bvh_width_ = 2u;
+    bool enable_node_compression_ = false;
+    bool enable_persistent_threads_ = false;
+    std::uint32_t ray_sort_bounces_ = 0;
+    bool enable_material_sorted_shading_ = false;
+    std::uint32_t samples_per_launch_ = 1u;
+    float adaptive_sampling_threshold_ = 0.0f;
+    std::uint32_t russian_roulette_bounce_ = 0;
     SamplerType sampler_type_ = SamplerType::kRandom;
     AOV aov_ = AOV::kShadedColor;
 
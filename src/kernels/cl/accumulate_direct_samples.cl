@@ -35,19 +35,17 @@ __kernel void AccumulateDirectSamples
     __global float4* result_radiance
 )
 {
-    uint ray_idx = get_global_id(0);
     uint num_rays = shadow_ray_counter[0];
 
-    if (ray_idx >= num_rays)
+    // The launch size is predicted from the previous frame, so a work item may process several rays
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
     {
-        return;
-    }
-
-    uint shadow_hit = shadow_hits[ray_idx];
+        uint shadow_hit = shadow_hits[ray_idx];
 
-    if (shadow_hit == INVALID_ID)
-    {
-        uint pixel_idx = shadow_pixel_indices[ray_idx];
-        result_radiance[pixel_idx].xyz += direct_light_samples[ray_idx];
+        if (shadow_hit == INVALID_ID)
+        {
+            uint path_idx = shadow_pixel_indices[ray_idx];
+            result_radiance[path_idx].xyz += direct_light_samples[ray_idx];
+        }
     }
 }
@@ -0,0 +1,86 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "src/kernels/common/constants.h"
+#include "src/kernels/common/adaptive_sampling.h"
+
+// Adds the samples a launch traced for the pixel to its radiance
+__kernel void AccumulatePathRadiance
+(
+    // Input
+    uint width,
+    uint height,
+    __global float4* path_radiance,
+    // Output
+    __global float4* result_radiance
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    , __global float* luminance_sq_sums
+    , __global uint*  pixel_sample_counts
+#endif
+)
+{
+    uint pixel_idx = get_global_id(0);
+
+    if (pixel_idx >= width * height)
+    {
+        return;
+    }
+
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    // Same test as the ray generation, the buffers it reads change only here
+    if (IsPixelConverged(Luminance(result_radiance[pixel_idx].xyz), luminance_sq_sums[pixel_idx],
+        pixel_sample_counts[pixel_idx], ADAPTIVE_SAMPLING_THRESHOLD))
+    {
+        return;
+    }
+
+    float luminance_sq_sum = 0.0f;
+#endif
+
+    float3 radiance = 0.0f;
+    for (uint sample_slot = 0; sample_slot < SAMPLES_PER_LAUNCH; ++sample_slot)
+    {
+        uint path_idx = pixel_idx * SAMPLES_PER_LAUNCH + sample_slot;
+        float3 sample_radiance = path_radiance[path_idx].xyz;
+        radiance += sample_radiance;
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+        float luminance = Luminance(sample_radiance);
+        luminance_sq_sum += luminance * luminance;
+#endif
+        // The paths of the next launch start from zero
+        path_radiance[path_idx] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    luminance_sq_sums[pixel_idx] += luminance_sq_sum;
+    pixel_sample_counts[pixel_idx] += SAMPLES_PER_LAUNCH;
+#endif
+
+#ifdef ENABLE_DENOISER
+    // The radiance is reset every frame, the denoiser takes the mean of the launch
+    radiance /= (float)SAMPLES_PER_LAUNCH;
+#endif // ENABLE_DENOISER
+
+    result_radiance[pixel_idx].xyz += radiance;
+}
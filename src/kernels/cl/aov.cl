@@ -25,6 +25,8 @@
 #include "src/kernels/common/shared_structures.h"
 #include "src/kernels/common/material.h"
 #include "src/kernels/common/sampling.h"
+#include "src/kernels/common/instance.h"
+#include "src/kernels/common/mesh.h"
 #include "src/kernels/common/light.h"
 
 float2 ProjectScreen(float3 position, Camera camera)
@@ -48,7 +50,10 @@ __kernel void GenerateAOV
     __global uint*           ray_counter,
     __global uint*           pixel_indices,
     __global Hit*            hits,
-    __global Triangle*       triangles,
+    __global IndexedTriangle* indexed_triangles,
+    __global float4*         vertex_positions,
+    __global uint*           vertex_texcoords,
+    __global Instance*       instances,
     __global PackedMaterial* materials,
     __global Texture*        textures,
     __global uint*           texture_data,
@@ -61,6 +66,11 @@ __kernel void GenerateAOV
     __global float*  depth_buffer,
     __global float3* normal_buffer,
     __global float2* velocity_buffer
+#ifdef BVH_STATISTICS
+    // Traversal work of the primary rays gathered into the pixels
+    , __global TraversalStats* traversal_stats
+    , __global TraversalStats* traversal_heatmap
+#endif
 )
 {
     uint ray_idx = get_global_id(0);
@@ -71,6 +81,19 @@ __kernel void GenerateAOV
         return;
     }
 
+    // The AOVs come from the first sample of the pixel
+    uint path_idx = pixel_indices[ray_idx];
+    if (path_idx % SAMPLES_PER_LAUNCH != 0)
+    {
+        return;
+    }
+
+    uint pixel_idx = path_idx / SAMPLES_PER_LAUNCH;
+
+#ifdef BVH_STATISTICS
+    traversal_heatmap[pixel_idx] = traversal_stats[ray_idx];
+#endif
+
     Hit hit = hits[ray_idx];
 
     if (hit.primitive_id == INVALID_ID)
@@ -81,12 +104,14 @@ __kernel void GenerateAOV
     Ray ray = rays[ray_idx];
     float3 incoming = -ray.direction.xyz;
 
-    uint pixel_idx = pixel_indices[ray_idx];
-
     int x = pixel_idx % width;
     int y = pixel_idx / width;
 
-    Triangle triangle = triangles[hit.primitive_id];
+    Triangle triangle = FetchTriangle(indexed_triangles, vertex_positions, vertex_texcoords, hit.primitive_id);
+    if (hit.instance_id != INVALID_ID)
+    {
+        triangle = TransformTriangle(instances[hit.instance_id], triangle);
+    }
 
     float3 position = InterpolateAttributes(triangle.v1.position,
         triangle.v2.position, triangle.v3.position, hit.bc);
@@ -25,18 +25,45 @@
 #include "src/kernels/common/shared_structures.h"
 #include "src/kernels/common/material.h"
 #include "src/kernels/common/sampling.h"
+#include "src/kernels/common/instance.h"
+#include "src/kernels/common/mesh.h"
 #include "src/kernels/common/light.h"
 
-__kernel void HitSurface
+// Work group size of the output ray compaction
+#define HIT_SURFACE_GROUP_SIZE 64
+
+// Exclusive prefix sum of the values of the work group, the work group total is returned in the last element
+uint WorkGroupScanExclusive(uint value, __local uint* scan)
+{
+    uint local_id = get_local_id(0);
+    scan[local_id] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint offset = 1; offset < HIT_SURFACE_GROUP_SIZE; offset <<= 1)
+    {
+        uint addend = local_id >= offset ? scan[local_id - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scan[local_id] += addend;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    return scan[local_id] - value;
+}
+
+__kernel __attribute__((reqd_work_group_size(HIT_SURFACE_GROUP_SIZE, 1, 1)))
+void HitSurface
 (
     // Input
     __global Ray*            incoming_rays,
     __global uint*           incoming_ray_counter,
     __global uint*           incoming_pixel_indices,
     __global Hit*            hits,
-    __global Triangle*       triangles,
+    __global IndexedTriangle* indexed_triangles,
+    __global float4*         vertex_positions,
+    __global uint*           vertex_texcoords,
+    __global Instance*       instances,
     __global Light*          analytic_lights,
-    __global uint*           emissive_indices,
+    __global EmissiveAliasEntry* emissive_alias_table,
     __global PackedMaterial* materials,
     __global Texture*        textures,
     __global uint*           texture_data,
@@ -51,6 +78,8 @@ __kernel void HitSurface
     __global int* rankingTile,
     // Output
     __global float3* throughputs,
+    // Pdf of the BxDF sample that spawned the path ray, for the MIS weight of the emission it hits
+    __global float*  bxdf_pdfs,
     __global Ray*    outgoing_rays,
     __global uint*   outgoing_ray_counter,
     __global uint*   outgoing_pixel_indices,
@@ -59,128 +88,241 @@ __kernel void HitSurface
     __global uint*   shadow_pixel_indices,
     __global float3* direct_light_samples,
     __global float4* result_radiance
+#ifdef MATERIAL_SORTED_SHADING
+    // Incoming ray indices grouped by the material of the hits
+    , __global uint* shading_order
+#endif
 )
 {
-    uint incoming_ray_idx = get_global_id(0);
-    uint num_incoming_rays = incoming_ray_counter[0];
-
-    if (incoming_ray_idx >= num_incoming_rays)
-    {
-        return;
-    }
+    __local uint group_scan[HIT_SURFACE_GROUP_SIZE];
+    __local uint group_offsets[2];
 
-    Hit hit = hits[incoming_ray_idx];
+    uint num_incoming_rays = incoming_ray_counter[0];
 
-    if (hit.primitive_id == INVALID_ID)
+    // The launch size is predicted from the previous frame, so a work item may process several rays.
+    // The work groups loop as a whole to reach the barriers of the output ray compaction together
+    for (uint group_base = get_group_id(0) * HIT_SURFACE_GROUP_SIZE; group_base < num_incoming_rays; group_base += get_global_size(0))
     {
-        return;
-    }
-
-    Ray incoming_ray = incoming_rays[incoming_ray_idx];
-    float3 incoming = -incoming_ray.direction.xyz;
-
-    uint pixel_idx = incoming_pixel_indices[incoming_ray_idx];
-    uint sample_idx = sample_counter[0];
-
-    int x = pixel_idx % width;
-    int y = pixel_idx / width;
-
-    Triangle triangle = triangles[hit.primitive_id];
-
-    float3 position = InterpolateAttributes(triangle.v1.position,
-        triangle.v2.position, triangle.v3.position, hit.bc);
-
-    float3 geometry_normal = normalize(cross(triangle.v2.position - triangle.v1.position, triangle.v3.position - triangle.v1.position));
-
-    float2 texcoord = InterpolateAttributes2(triangle.v1.texcoord.xy,
-        triangle.v2.texcoord.xy, triangle.v3.texcoord.xy, hit.bc);
-
-    float3 normal = normalize(InterpolateAttributes(triangle.v1.normal,
-        triangle.v2.normal, triangle.v3.normal, hit.bc));
-
-    PackedMaterial packed_material = materials[triangle.mtlIndex];
-    Material material;
-    ApplyTextures(packed_material, &material, texcoord, textures, texture_data);
+#ifdef MATERIAL_SORTED_SHADING
+        // Neighbouring work items shade the same material and the misses come last
+        uint sorted_idx = group_base + get_local_id(0);
+        uint incoming_ray_idx = sorted_idx < num_incoming_rays ? shading_order[sorted_idx] : INVALID_ID;
+#else
+        uint incoming_ray_idx = group_base + get_local_id(0);
+#endif
+        Hit hit;
+        hit.primitive_id = INVALID_ID;
+        if (incoming_ray_idx < num_incoming_rays)
+        {
+            hit = hits[incoming_ray_idx];
+        }
 
-    float3 hit_throughput = throughputs[pixel_idx];
+        uint path_idx = 0;
+        bool spawn_shadow_ray = false;
+        Ray shadow_ray;
+        float3 light_sample;
+        bool spawn_outgoing_ray = false;
+        Ray outgoing_ray;
 
-#ifndef ENABLE_WHITE_FURNACE
-    if (dot(material.emission.xyz, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f)
-    {
-        result_radiance[pixel_idx].xyz += hit_throughput * material.emission.xyz;
-    }
+        if (hit.primitive_id != INVALID_ID)
+        {
+            Ray incoming_ray = incoming_rays[incoming_ray_idx];
+            float3 incoming = -incoming_ray.direction.xyz;
+
+            path_idx = incoming_pixel_indices[incoming_ray_idx];
+            uint pixel_idx = path_idx / SAMPLES_PER_LAUNCH;
+            uint sample_idx = sample_counter[0] + path_idx % SAMPLES_PER_LAUNCH;
+
+            int x = pixel_idx % width;
+            int y = pixel_idx / width;
+
+            Triangle triangle = FetchTriangle(indexed_triangles, vertex_positions, vertex_texcoords, hit.primitive_id);
+            if (hit.instance_id != INVALID_ID)
+            {
+                triangle = TransformTriangle(instances[hit.instance_id], triangle);
+            }
+
+            float3 position = InterpolateAttributes(triangle.v1.position,
+                triangle.v2.position, triangle.v3.position, hit.bc);
+
+            float3 geometry_normal = normalize(cross(triangle.v2.position - triangle.v1.position, triangle.v3.position - triangle.v1.position));
+
+            float2 texcoord = InterpolateAttributes2(triangle.v1.texcoord.xy,
+                triangle.v2.texcoord.xy, triangle.v3.texcoord.xy, hit.bc);
+
+            float3 normal = normalize(InterpolateAttributes(triangle.v1.normal,
+                triangle.v2.normal, triangle.v3.normal, hit.bc));
+
+            // The watertight test hits both sides, shade the side the ray came from
+            if (dot(geometry_normal, incoming) < 0.0f)
+            {
+                geometry_normal = -geometry_normal;
+                normal = -normal;
+            }
+
+            PackedMaterial packed_material = materials[triangle.mtlIndex];
+            Material material;
+            ApplyTextures(packed_material, &material, texcoord, textures, texture_data);
+
+            float3 hit_throughput = throughputs[path_idx];
+
+#ifdef ENABLE_WHITE_FURNACE
+            float emissive_selection_pdf = 0.0f;
+#else
+            float emissive_selection_pdf = EmissiveLight_SelectionPdf(scene_info);
+
+            if (dot(material.emission.xyz, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f)
+            {
+                // The light sampling of the previous bounce may have reached the same point
+                float mis_weight = 1.0f;
+                if (bounce > 0 && emissive_selection_pdf > 0.0f)
+                {
+                    float bxdf_pdf = bxdf_pdfs[path_idx];
+                    float3 to_hit = position - incoming_ray.origin.xyz;
+                    float light_pdf = EmissiveLight_Pdf(scene_info, packed_material, dot(to_hit, to_hit), fabs(dot(geometry_normal, incoming)));
+                    // 0 - the path came through a delta layer
+                    mis_weight = bxdf_pdf > 0.0f ? PowerHeuristic(bxdf_pdf, light_pdf) : 1.0f;
+                }
+
+                result_radiance[path_idx].xyz += hit_throughput * material.emission.xyz * mis_weight;
+            }
 #endif // ENABLE_WHITE_FURNACE
 
-    // Direct lighting
-    {
-        float s_light = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT, BLUE_NOISE_BUFFERS);
-        float3 outgoing;
-        float pdf;
-        float3 light_radiance = Light_Sample(analytic_lights, scene_info, position, normal, s_light, &outgoing, &pdf);
+            // Direct lighting
+            {
+                float s_light = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT, BLUE_NOISE_BUFFERS);
+                float3 outgoing;
+                float pdf;
+                float3 light_radiance;
+                float mis_weight = 1.0f;
+                float shadow_ray_offset = 0.0f;
+
+                // The sample may round up to 1
+                if (s_light < emissive_selection_pdf || emissive_selection_pdf == 1.0f)
+                {
+                    float2 s_triangle;
+                    s_triangle.x = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT_U, BLUE_NOISE_BUFFERS);
+                    s_triangle.y = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT_V, BLUE_NOISE_BUFFERS);
+                    float light_pdf;
+                    light_radiance = EmissiveLight_Sample(emissive_alias_table, indexed_triangles, vertex_positions,
+                        vertex_texcoords, materials, textures, texture_data, scene_info, position,
+                        s_light / emissive_selection_pdf, s_triangle, &outgoing, &pdf, &light_pdf);
+
+                    // The BxDF sampling reaches the emissive triangles too, the delta layers only by it.
+                    // The rays of the last bounce are not traced, the light sampling takes the full weight there
+                    if (bounce < MAX_BOUNCES)
+                    {
+                        float bxdf_pdf = EvaluateBxdfPdf(material, normal, incoming, normalize(outgoing));
+                        mis_weight = bxdf_pdf > 0.0f ? PowerHeuristic(light_pdf, bxdf_pdf) : 0.0f;
+                    }
+
+                    // Don't hit the sampled triangle
+                    shadow_ray_offset = 2.0f * EPS;
+                }
+                else
+                {
+                    s_light = (s_light - emissive_selection_pdf) / (1.0f - emissive_selection_pdf);
+                    light_radiance = Light_Sample(analytic_lights, scene_info, position, normal, s_light, &outgoing, &pdf);
+                    pdf *= 1.0f - emissive_selection_pdf;
+                }
+
+                float distance_to_light = length(outgoing);
+                outgoing = normalize(outgoing);
+
+                float3 brdf = EvaluateMaterial(material, normal, incoming, outgoing);
+                light_sample = light_radiance * hit_throughput * brdf / pdf * max(dot(outgoing, normal), 0.0f) * mis_weight;
+
+                spawn_shadow_ray = (pdf > 0.0f) && (dot(light_sample, light_sample) > 0.0f);
+
+                shadow_ray.origin.xyz = position + normal * EPS;
+                shadow_ray.origin.w = 0.0f;
+                shadow_ray.direction.xyz = outgoing;
+                shadow_ray.direction.w = distance_to_light - shadow_ray_offset;
+            }
+
+            // Indirect lighting
+            {
+                // Sample bxdf
+                float2 s;
+                s.x = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_U, BLUE_NOISE_BUFFERS);
+                s.y = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_V, BLUE_NOISE_BUFFERS);
+                float s1 = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_LAYER, BLUE_NOISE_BUFFERS);
+
+                float pdf = 0.0f;
+                float3 throughput = 0.0f;
+                float3 outgoing;
+                float offset;
+                float3 bxdf = SampleBxdf(s1, s, material, normal, incoming, &outgoing, &pdf, &offset);
+
+                if (pdf > 0.0)
+                {
+                    throughput = bxdf / pdf;
+                }
+
+                float3 path_throughput = hit_throughput * throughput;
+                spawn_outgoing_ray = (pdf > 0.0);
+
+#ifdef RUSSIAN_ROULETTE_BOUNCE
+                // The surviving paths carry the inverse probability to keep the estimate unbiased
+                if (spawn_outgoing_ray && bounce >= RUSSIAN_ROULETTE_BOUNCE)
+                {
+                    float survival = RussianRouletteSurvival(path_throughput);
+                    float s_rr = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_RUSSIAN_ROULETTE, BLUE_NOISE_BUFFERS);
+                    spawn_outgoing_ray = s_rr < survival;
+                    if (spawn_outgoing_ray)
+                    {
+                        path_throughput /= survival;
+                    }
+                }
+#endif // RUSSIAN_ROULETTE_BOUNCE
+
+                throughputs[path_idx] = path_throughput;
+
+                if (spawn_outgoing_ray && emissive_selection_pdf > 0.0f)
+                {
+                    bxdf_pdfs[path_idx] = EvaluateBxdfPdf(material, normal, incoming, outgoing);
+                }
+
+                outgoing_ray.origin.xyz = position + geometry_normal * EPS * offset;
+                outgoing_ray.origin.w = 0.0f;
+                outgoing_ray.direction.xyz = outgoing;
+                outgoing_ray.direction.w = MAX_RENDER_DIST;
+            }
+        }
 
-        float distance_to_light = length(outgoing);
-        outgoing = normalize(outgoing);
+        // Compact the spawned rays with one global atomic per counter and work group,
+        // the low and high 16 bits count the shadow and the outgoing rays
+        uint spawn_mask = (spawn_outgoing_ray ? 0x10000 : 0) | (spawn_shadow_ray ? 1 : 0);
+        uint local_offsets = WorkGroupScanExclusive(spawn_mask, group_scan);
 
-        float3 brdf = EvaluateMaterial(material, normal, incoming, outgoing);
-        float3 light_sample = light_radiance * hit_throughput * brdf / pdf * max(dot(outgoing, normal), 0.0f);
+        if (get_local_id(0) == HIT_SURFACE_GROUP_SIZE - 1)
+        {
+            uint group_counts = group_scan[HIT_SURFACE_GROUP_SIZE - 1];
+            group_offsets[0] = atomic_add(shadow_ray_counter, group_counts & 0xFFFF);
+            group_offsets[1] = atomic_add(outgoing_ray_counter, group_counts >> 16);
+        }
 
-        bool spawn_shadow_ray = (pdf > 0.0f) && (dot(light_sample, light_sample) > 0.0f);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
         if (spawn_shadow_ray)
         {
-            Ray shadow_ray;
-            shadow_ray.origin.xyz = position + normal * EPS;
-            shadow_ray.origin.w = 0.0f;
-            shadow_ray.direction.xyz = outgoing;
-            shadow_ray.direction.w = distance_to_light;
-
-            ///@TODO: use LDS
-            uint shadow_ray_idx = atomic_add(shadow_ray_counter, 1);
+            uint shadow_ray_idx = group_offsets[0] + (local_offsets & 0xFFFF);
 
             // Store to the memory
             shadow_rays[shadow_ray_idx] = shadow_ray;
-            shadow_pixel_indices[shadow_ray_idx] = pixel_idx;
+            shadow_pixel_indices[shadow_ray_idx] = path_idx;
             direct_light_samples[shadow_ray_idx] = light_sample;
         }
-    }
-
-    // Indirect lighting
-    {
-        // Sample bxdf
-        float2 s;
-        s.x = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_U, BLUE_NOISE_BUFFERS);
-        s.y = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_V, BLUE_NOISE_BUFFERS);
-        float s1 = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_LAYER, BLUE_NOISE_BUFFERS);
-
-        float pdf = 0.0f;
-        float3 throughput = 0.0f;
-        float3 outgoing;
-        float offset;
-        float3 bxdf = SampleBxdf(s1, s, material, normal, incoming, &outgoing, &pdf, &offset);
-
-        if (pdf > 0.0)
-        {
-            throughput = bxdf / pdf;
-        }
-
-        throughputs[pixel_idx] *= throughput;
-
-        bool spawn_outgoing_ray = (pdf > 0.0);
 
         if (spawn_outgoing_ray)
         {
-            ///@TODO: use LDS
-            uint outgoing_ray_idx = atomic_add(outgoing_ray_counter, 1);
-
-            Ray outgoing_ray;
-            outgoing_ray.origin.xyz = position + geometry_normal * EPS * offset;
-            outgoing_ray.origin.w = 0.0f;
-            outgoing_ray.direction.xyz = outgoing;
-            outgoing_ray.direction.w = MAX_RENDER_DIST;
+            uint outgoing_ray_idx = group_offsets[1] + (local_offsets >> 16);
 
             outgoing_rays[outgoing_ray_idx] = outgoing_ray;
-            outgoing_pixel_indices[outgoing_ray_idx] = pixel_idx;
+            outgoing_pixel_indices[outgoing_ray_idx] = path_idx;
         }
-    }
 
+        // The next iteration overwrites the scan and the offsets
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 }
@@ -22,12 +22,25 @@
  SOFTWARE.
  *****************************************************************************/
 
-__kernel void IncrementCounter(__global uint* counter)
+__kernel void IncrementCounter(__global uint* counter, uint increment)
 {
     uint global_id = get_global_id(0);
 
     if (global_id == 0)
     {
-        ++counter[0];
+        counter[0] += increment;
+    }
+}
+
+// Adds the value to the 64-bit counter stored as the low and the high words
+__kernel void AddToCounter(__global uint* counter, __global uint* value)
+{
+    uint global_id = get_global_id(0);
+
+    if (global_id == 0)
+    {
+        uint low = counter[0] + value[0];
+        counter[1] += low < counter[0] ? 1 : 0;
+        counter[0] = low;
     }
 }
@@ -51,27 +51,25 @@ __kernel void Miss
     __global float3* result_radiance
 )
 {
-    uint ray_idx = get_global_id(0);
     uint num_rays = ray_counter[0];
 
-    if (ray_idx >= num_rays)
+    // The launch size is predicted from the previous frame, so a work item may process several rays
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
     {
-        return;
-    }
-
-    Ray ray = rays[ray_idx];
-    Hit hit = hits[ray_idx];
+        Ray ray = rays[ray_idx];
+        Hit hit = hits[ray_idx];
 
-    if (hit.primitive_id == INVALID_ID)
-    {
-        uint pixel_idx = pixel_indices[ray_idx];
-        float3 throughput = throughputs[pixel_idx];
+        if (hit.primitive_id == INVALID_ID)
+        {
+            uint path_idx = pixel_indices[ray_idx];
+            float3 throughput = throughputs[path_idx];
 
 #ifdef ENABLE_WHITE_FURNACE
-        float3 sky_radiance = 0.5f;
+            float3 sky_radiance = 0.5f;
 #else
-        float3 sky_radiance = SampleSky(ray.direction.xyz, tex);
+            float3 sky_radiance = SampleSky(ray.direction.xyz, tex);
 #endif
-        result_radiance[pixel_idx] += sky_radiance * throughput;
+            result_radiance[path_idx] += sky_radiance * throughput;
+        }
     }
 }
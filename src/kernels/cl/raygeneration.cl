@@ -24,6 +24,7 @@
 
 #include "src/kernels/common/shared_structures.h"
 #include "src/kernels/common/constants.h"
+#include "src/kernels/common/adaptive_sampling.h"
 
 float GetRandomFloat(unsigned int* seed)
 {
@@ -78,23 +79,43 @@ __kernel void RayGeneration
     __global float*  depth_buffer,
     __global float3* normal_buffer,
     __global float2* velocity_buffer
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    // Accumulated radiance and sample statistics of the pixels
+    , __global float4* radiance
+    , __global float*  luminance_sq_sums
+    , __global uint*   pixel_sample_counts
+#endif
 )
 {
-    uint ray_idx = get_global_id(0);
+    uint path_idx = get_global_id(0);
+
+    if (path_idx >= width * height * SAMPLES_PER_LAUNCH)
+    {
+        return;
+    }
+
+    uint pixel_idx = path_idx / SAMPLES_PER_LAUNCH;
 
-    if (ray_idx >= width * height)
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    // The converged pixels spawn no rays, the others are packed to the front of the ray buffer
+    if (IsPixelConverged(Luminance(radiance[pixel_idx].xyz), luminance_sq_sums[pixel_idx],
+        pixel_sample_counts[pixel_idx], ADAPTIVE_SAMPLING_THRESHOLD))
     {
         return;
     }
 
-    uint pixel_idx = ray_idx;
+    uint ray_idx = atomic_inc(ray_counter);
+#else
+    // The samples of a pixel are neighbours in the ray buffer
+    uint ray_idx = path_idx;
+#endif
     uint pixel_x = pixel_idx % width;
     uint pixel_y = pixel_idx / width;
 
     float inv_width = 1.0f / (float)(width);
     float inv_height = 1.0f / (float)(height);
 
-    uint sample_idx = sample_counter[0];
+    uint sample_idx = sample_counter[0] + path_idx % SAMPLES_PER_LAUNCH;
     unsigned int seed = pixel_idx + HashUInt32(sample_idx);
 
 #if 1
@@ -124,16 +145,23 @@ __kernel void RayGeneration
     ray.direction.w = MAX_RENDER_DIST;
 
     rays[ray_idx] = ray;
-    pixel_indices[ray_idx] = pixel_idx;
-    throughputs[pixel_idx] = (float3)(1.0f, 1.0f, 1.0f);
-    diffuse_albedo[pixel_idx] = (float3)(0.0f, 0.0f, 0.0f);
-    depth_buffer[pixel_idx] = MAX_RENDER_DIST;
-    normal_buffer[pixel_idx] = (float3)(0.0f, 0.0f, 0.0f);
-    velocity_buffer[pixel_idx] = (float2)(0.0f, 0.0f);
+    pixel_indices[ray_idx] = path_idx;
+    throughputs[path_idx] = (float3)(1.0f, 1.0f, 1.0f);
+
+    // The AOVs come from the first sample of the pixel
+    if (path_idx % SAMPLES_PER_LAUNCH == 0)
+    {
+        diffuse_albedo[pixel_idx] = (float3)(0.0f, 0.0f, 0.0f);
+        depth_buffer[pixel_idx] = MAX_RENDER_DIST;
+        normal_buffer[pixel_idx] = (float3)(0.0f, 0.0f, 0.0f);
+        velocity_buffer[pixel_idx] = (float2)(0.0f, 0.0f);
+    }
 
+#ifndef ADAPTIVE_SAMPLING_THRESHOLD
     // Write to global ray counter
     if (ray_idx == 0)
     {
-        ray_counter[0] = width * height;
+        ray_counter[0] = width * height * SAMPLES_PER_LAUNCH;
     }
+#endif
 }
@@ -0,0 +1,84 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "src/kernels/common/shared_structures.h"
+
+// Recomputes the bounds of one BVH level, the deeper levels are already refitted
+__kernel void RefitBvh
+(
+    // Input
+    __global uint* level_nodes,
+    uint first_level_node,
+    uint num_level_nodes,
+    __global RTTriangle* triangles,
+#ifdef PRIMITIVE_INDIRECTION
+    __global uint* primitive_indices,
+#endif
+    // Input-output
+    __global LinearBVHNode* nodes
+)
+{
+    uint idx = get_global_id(0);
+
+    if (idx >= num_level_nodes)
+    {
+        return;
+    }
+
+    uint node_idx = level_nodes[first_level_node + idx];
+    LinearBVHNode node = nodes[node_idx];
+    int num_primitives = node.num_primitives_axis >> 16;
+
+    float3 bounds_min;
+    float3 bounds_max;
+
+    if (num_primitives > 0)
+    {
+        bounds_min = (float3)(FLT_MAX, FLT_MAX, FLT_MAX);
+        bounds_max = (float3)(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+        for (int i = 0; i < num_primitives; ++i)
+        {
+#ifdef PRIMITIVE_INDIRECTION
+            uint primitive_id = primitive_indices[node.offset + i];
+#else
+            uint primitive_id = node.offset + i;
+#endif
+            RTTriangle triangle = triangles[primitive_id];
+            bounds_min = min(bounds_min, min(min(triangle.position1, triangle.position2), triangle.position3));
+            bounds_max = max(bounds_max, max(max(triangle.position1, triangle.position2), triangle.position3));
+        }
+    }
+    else
+    {
+        // The left child follows its parent
+        Bounds3 left = nodes[node_idx + 1].bounds;
+        Bounds3 right = nodes[node.offset].bounds;
+        bounds_min = min(left.pos[0], right.pos[0]);
+        bounds_max = max(left.pos[1], right.pos[1]);
+    }
+
+    nodes[node_idx].bounds.pos[0] = bounds_min;
+    nodes[node_idx].bounds.pos[1] = bounds_max;
+}
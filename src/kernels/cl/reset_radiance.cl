@@ -29,6 +29,10 @@ __kernel void ResetRadiance
     uint height,
     // Output
     __global float4* radiance_buffer
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    , __global float* luminance_sq_sums
+    , __global uint*  pixel_sample_counts
+#endif
 )
 {
     uint pixel_idx = get_global_id(0);
@@ -39,4 +43,8 @@ __kernel void ResetRadiance
     }
 
     radiance_buffer[pixel_idx] = (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    luminance_sq_sums[pixel_idx] = 0.0f;
+    pixel_sample_counts[pixel_idx] = 0;
+#endif
 }
@@ -22,11 +22,24 @@
  SOFTWARE.
  *****************************************************************************/
 
-#define SHADED_COLOR_INDEX   0
-#define DIFFUSE_INDEX        1
-#define DEPTH_INDEX          2
-#define NORMAL_INDEX         3
-#define MOTION_VECTORS_INDEX 4
+#include "src/kernels/common/shared_structures.h"
+
+#define SHADED_COLOR_INDEX      0
+#define DIFFUSE_INDEX           1
+#define DEPTH_INDEX             2
+#define NORMAL_INDEX            3
+#define MOTION_VECTORS_INDEX    4
+#define TRAVERSAL_HEATMAP_INDEX 5
+
+// Node visits plus triangle tests of a primary ray shown at the red end of the heatmap
+#define HEATMAP_MAX_TRAVERSAL_COST 256.0f
+
+// Blue - green - red ramp
+float3 HeatmapColor(float t)
+{
+    t = clamp(t, 0.0f, 1.0f);
+    return (float3)(clamp(2.0f * t - 1.0f, 0.0f, 1.0f), 1.0f - fabs(2.0f * t - 1.0f), clamp(1.0f - 2.0f * t, 0.0f, 1.0f));
+}
 
 __kernel void ResolveRadiance
 (
@@ -38,8 +51,13 @@ __kernel void ResolveRadiance
     __global float*  depth,
     __global float3* normal,
     __global float2* motion_vectors,
+    __global TraversalStats* traversal_heatmap,
     __global uint*   sample_counter,
     __write_only image2d_t result
+#ifdef ADAPTIVE_SAMPLING_THRESHOLD
+    // The pixels stop taking samples at different counts
+    , __global uint* pixel_sample_counts
+#endif
 )
 {
     uint global_id = get_global_id(0);
@@ -71,11 +89,20 @@ __kernel void ResolveRadiance
         // Motion vectors
         write_imagef(result, (int2)(x, y), (float4)(motion_vectors[global_id], 0.0f, 1.0f));
     }
+    else if (aov_index == TRAVERSAL_HEATMAP_INDEX)
+    {
+        // Traversal work of the primary rays
+        TraversalStats stats = traversal_heatmap[global_id];
+        float cost = (float)(stats.node_visits + stats.triangle_tests);
+        write_imagef(result, (int2)(x, y), (float4)(HeatmapColor(cost / HEATMAP_MAX_TRAVERSAL_COST), 1.0f));
+    }
     else
     {
         // Shaded color
 #ifdef ENABLE_DENOISER
         float3 hdr = radiance[global_id].xyz;
+#elif defined(ADAPTIVE_SAMPLING_THRESHOLD)
+        float3 hdr = radiance[global_id].xyz / (float)max(pixel_sample_counts[global_id], 1u);
 #else
         float3 hdr = radiance[global_id].xyz / (float)sample_count;
 #endif // ENABLE_DENOISER
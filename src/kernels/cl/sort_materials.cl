@@ -0,0 +1,132 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "src/kernels/common/shared_structures.h"
+#include "src/kernels/common/constants.h"
+
+// Counting sort of the hits by the material, the rays that missed go to the last bucket
+#define SORT_GROUP_SIZE 256
+
+uint GetMaterialBucket(Hit hit, __global IndexedTriangle* indexed_triangles, uint num_materials)
+{
+    return hit.primitive_id == INVALID_ID ? num_materials : indexed_triangles[hit.primitive_id].mtlIndex;
+}
+
+__kernel void ClearMaterialCounts
+(
+    __global uint* material_counts,
+    uint num_materials
+)
+{
+    for (uint bucket = get_global_id(0); bucket <= num_materials; bucket += get_global_size(0))
+    {
+        material_counts[bucket] = 0;
+    }
+}
+
+__kernel void CountMaterials
+(
+    __global Hit* hits,
+    __global uint* ray_counter,
+    __global IndexedTriangle* indexed_triangles,
+    uint num_materials,
+    __global uint* material_counts
+)
+{
+    uint num_rays = ray_counter[0];
+
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
+    {
+        atomic_inc(&material_counts[GetMaterialBucket(hits[ray_idx], indexed_triangles, num_materials)]);
+    }
+}
+
+// Exclusive scan of the material counts in place, launched as a single work group
+__kernel __attribute__((reqd_work_group_size(SORT_GROUP_SIZE, 1, 1)))
+void ScanMaterials
+(
+    __global uint* material_counts,
+    uint num_materials
+)
+{
+    __local uint item_sums[SORT_GROUP_SIZE];
+
+    uint num_buckets = num_materials + 1;
+    uint local_id = get_local_id(0);
+    uint item_chunk = (num_buckets + SORT_GROUP_SIZE - 1) / SORT_GROUP_SIZE;
+    uint begin = min(local_id * item_chunk, num_buckets);
+    uint end = min(begin + item_chunk, num_buckets);
+
+    uint sum = 0;
+    for (uint i = begin; i < end; ++i)
+    {
+        sum += material_counts[i];
+    }
+    item_sums[local_id] = sum;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_id == 0)
+    {
+        uint prefix = 0;
+        for (uint i = 0; i < SORT_GROUP_SIZE; ++i)
+        {
+            uint item_sum = item_sums[i];
+            item_sums[i] = prefix;
+            prefix += item_sum;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint prefix = item_sums[local_id];
+    for (uint i = begin; i < end; ++i)
+    {
+        uint count = material_counts[i];
+        material_counts[i] = prefix;
+        prefix += count;
+    }
+}
+
+// The order within a material follows the atomics, the shading doesn't depend on it
+__kernel void ScatterMaterials
+(
+    // Input
+    __global Hit* hits,
+    __global uint* ray_counter,
+    __global IndexedTriangle* indexed_triangles,
+    uint num_materials,
+    __global uint* material_offsets,
+    // Output
+    __global uint* shading_order
+)
+{
+    uint num_rays = ray_counter[0];
+
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
+    {
+        uint bucket = GetMaterialBucket(hits[ray_idx], indexed_triangles, num_materials);
+        shading_order[atomic_inc(&material_offsets[bucket])] = ray_idx;
+    }
+}
@@ -0,0 +1,263 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "src/kernels/common/shared_structures.h"
+
+// The direction octant above the Morton code of the origin quantized in the scene bounds
+#define RAY_KEY_ORIGIN_BITS 7
+// The radix sort takes RADIX_BITS of the key per pass
+#define RADIX_BITS 4
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define SORT_GROUP_SIZE 256
+
+// Inserts two zero bits after each of the low 10 bits
+uint ExpandBits(uint value)
+{
+    value = (value * 0x00010001u) & 0xFF0000FFu;
+    value = (value * 0x00000101u) & 0x0F00F00Fu;
+    value = (value * 0x00000011u) & 0xC30C30C3u;
+    value = (value * 0x00000005u) & 0x49249249u;
+    return value;
+}
+
+// Contiguous range of the rays sorted by the work item, the work groups and then the work items
+// of a group take the rays in order, so the sort is stable
+void GetSortRange(uint num_rays, uint* begin, uint* end)
+{
+    uint num_groups = get_num_groups(0);
+    uint group_chunk = (num_rays + num_groups - 1) / num_groups;
+    uint item_chunk = (group_chunk + SORT_GROUP_SIZE - 1) / SORT_GROUP_SIZE;
+    uint group_end = min((get_group_id(0) + 1) * group_chunk, num_rays);
+
+    *begin = min(get_group_id(0) * group_chunk + get_local_id(0) * item_chunk, group_end);
+    *end = min(*begin + item_chunk, group_end);
+}
+
+__kernel void ComputeRayKeys
+(
+    // Input
+    __global Ray* rays,
+    __global uint* ray_counter,
+    Bounds3 scene_bounds,
+    // Output
+    __global uint* keys,
+    __global uint* values
+)
+{
+    uint num_rays = ray_counter[0];
+    float3 scene_extent = max(scene_bounds.pos[1] - scene_bounds.pos[0], (float3)(1e-6f, 1e-6f, 1e-6f));
+    float max_cell = (float)((1 << RAY_KEY_ORIGIN_BITS) - 1);
+
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
+    {
+        Ray ray = rays[ray_idx];
+
+        float3 cell = clamp((ray.origin.xyz - scene_bounds.pos[0]) / scene_extent * max_cell, 0.0f, max_cell);
+        uint morton_code = (ExpandBits((uint)cell.x) << 2) | (ExpandBits((uint)cell.y) << 1) | ExpandBits((uint)cell.z);
+        uint octant = (ray.direction.x < 0.0f ? 4 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 1 : 0);
+
+        keys[ray_idx] = (octant << (3 * RAY_KEY_ORIGIN_BITS)) | morton_code;
+        values[ray_idx] = ray_idx;
+    }
+}
+
+// Writes the digit counts of each work group, digit-major so the scan keeps the groups in order
+__kernel __attribute__((reqd_work_group_size(SORT_GROUP_SIZE, 1, 1)))
+void RadixCount
+(
+    __global uint* keys,
+    __global uint* ray_counter,
+    uint shift,
+    __global uint* group_histograms
+)
+{
+    __local uint item_counts[RADIX_SIZE][SORT_GROUP_SIZE];
+
+    uint begin, end;
+    GetSortRange(ray_counter[0], &begin, &end);
+
+    uint digit_counts[RADIX_SIZE];
+    for (uint digit = 0; digit < RADIX_SIZE; ++digit)
+    {
+        digit_counts[digit] = 0;
+    }
+
+    for (uint i = begin; i < end; ++i)
+    {
+        digit_counts[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+    }
+
+    uint local_id = get_local_id(0);
+    for (uint digit = 0; digit < RADIX_SIZE; ++digit)
+    {
+        item_counts[digit][local_id] = digit_counts[digit];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_id < RADIX_SIZE)
+    {
+        uint sum = 0;
+        for (uint i = 0; i < SORT_GROUP_SIZE; ++i)
+        {
+            sum += item_counts[local_id][i];
+        }
+
+        group_histograms[local_id * get_num_groups(0) + get_group_id(0)] = sum;
+    }
+}
+
+// Exclusive scan of the group histograms in place, launched as a single work group
+__kernel __attribute__((reqd_work_group_size(SORT_GROUP_SIZE, 1, 1)))
+void RadixScan
+(
+    __global uint* group_histograms,
+    uint num_entries
+)
+{
+    __local uint item_sums[SORT_GROUP_SIZE];
+
+    uint local_id = get_local_id(0);
+    uint item_chunk = (num_entries + SORT_GROUP_SIZE - 1) / SORT_GROUP_SIZE;
+    uint begin = min(local_id * item_chunk, num_entries);
+    uint end = min(begin + item_chunk, num_entries);
+
+    uint sum = 0;
+    for (uint i = begin; i < end; ++i)
+    {
+        sum += group_histograms[i];
+    }
+    item_sums[local_id] = sum;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (local_id == 0)
+    {
+        uint prefix = 0;
+        for (uint i = 0; i < SORT_GROUP_SIZE; ++i)
+        {
+            uint item_sum = item_sums[i];
+            item_sums[i] = prefix;
+            prefix += item_sum;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint prefix = item_sums[local_id];
+    for (uint i = begin; i < end; ++i)
+    {
+        uint count = group_histograms[i];
+        group_histograms[i] = prefix;
+        prefix += count;
+    }
+}
+
+__kernel __attribute__((reqd_work_group_size(SORT_GROUP_SIZE, 1, 1)))
+void RadixScatter
+(
+    // Input
+    __global uint* keys,
+    __global uint* values,
+    __global uint* ray_counter,
+    uint shift,
+    __global uint* group_histograms,
+    // Output
+    __global uint* sorted_keys,
+    __global uint* sorted_values
+)
+{
+    __local uint item_offsets[RADIX_SIZE][SORT_GROUP_SIZE];
+
+    uint begin, end;
+    GetSortRange(ray_counter[0], &begin, &end);
+
+    uint digit_offsets[RADIX_SIZE];
+    for (uint digit = 0; digit < RADIX_SIZE; ++digit)
+    {
+        digit_offsets[digit] = 0;
+    }
+
+    for (uint i = begin; i < end; ++i)
+    {
+        digit_offsets[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+    }
+
+    uint local_id = get_local_id(0);
+    for (uint digit = 0; digit < RADIX_SIZE; ++digit)
+    {
+        item_offsets[digit][local_id] = digit_offsets[digit];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Offsets of the work items start from the scanned offset of the group
+    if (local_id < RADIX_SIZE)
+    {
+        uint prefix = group_histograms[local_id * get_num_groups(0) + get_group_id(0)];
+        for (uint i = 0; i < SORT_GROUP_SIZE; ++i)
+        {
+            uint count = item_offsets[local_id][i];
+            item_offsets[local_id][i] = prefix;
+            prefix += count;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint digit = 0; digit < RADIX_SIZE; ++digit)
+    {
+        digit_offsets[digit] = item_offsets[digit][local_id];
+    }
+
+    for (uint i = begin; i < end; ++i)
+    {
+        uint key = keys[i];
+        uint dst = digit_offsets[(key >> shift) & (RADIX_SIZE - 1)]++;
+        sorted_keys[dst] = key;
+        sorted_values[dst] = values[i];
+    }
+}
+
+__kernel void ReorderRays
+(
+    // Input
+    __global Ray* rays,
+    __global uint* pixel_indices,
+    __global uint* ray_counter,
+    __global uint* sorted_values,
+    // Output
+    __global Ray* sorted_rays,
+    __global uint* sorted_pixel_indices
+)
+{
+    uint num_rays = ray_counter[0];
+
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
+    {
+        uint src_idx = sorted_values[ray_idx];
+        sorted_rays[ray_idx] = rays[src_idx];
+        sorted_pixel_indices[ray_idx] = pixel_indices[src_idx];
+    }
+}
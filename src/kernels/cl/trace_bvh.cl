@@ -24,41 +24,91 @@
 
 #include "src/kernels/common/shared_structures.h"
 #include "src/kernels/common/constants.h"
+#include "src/kernels/common/instance.h"
+
+#ifdef BVH_WIDTH
+#if defined(COMPRESSED_NODES) && BVH_WIDTH == 8
+typedef CompressedBVH8Node WideBVHNode;
+#elif defined(COMPRESSED_NODES)
+typedef CompressedBVH4Node WideBVHNode;
+#elif BVH_WIDTH == 8
+typedef BVH8Node WideBVHNode;
+#else
+typedef BVH4Node WideBVHNode;
+#endif
+// Up to BVH_WIDTH - 1 children are pushed per visited node
+#define WIDE_STACK_SIZE (BVH_WIDTH * 16)
+#endif
 
-bool RayTriangle(Ray ray, const __global RTTriangle* triangle, float2* bc, float* out_t)
+#ifdef PERSISTENT_THREADS
+// Rays taken from the queue by a work item at once, amortizes the atomics
+#define PERSISTENT_BATCH_SIZE 4
+#endif
+
+// The ray in the frame of the watertight triangle test, see "Watertight Ray/Triangle Intersection".
+// The axes are rotated so the largest direction component is z and the ray is sheared to point along it
+typedef struct
 {
-    float3 e1 = triangle->position2 - triangle->position1;
-    float3 e2 = triangle->position3 - triangle->position1;
-    // Calculate planes normal vector
-    float3 pvec = cross(ray.direction.xyz, e2);
-    float det = dot(e1, pvec);
+    float3 origin;
+    // x, y - shear of the direction, z - inverse of its z component
+    float3 shear;
+    int kz;
+} WatertightRay;
 
-    // Ray is parallel to plane
-    if (det < 1e-8f || -det > 1e-8f)
-    {
-        return false;
-    }
+float3 PermuteAxes(float3 v, int kz)
+{
+    return kz == 0 ? v.yzx : (kz == 1 ? v.zxy : v);
+}
 
-    float inv_det = 1.0f / det;
-    float3 tvec = ray.origin.xyz - triangle->position1;
-    float u = dot(tvec, pvec) * inv_det;
+WatertightRay SetupWatertightRay(float3 origin, float3 direction)
+{
+    float3 abs_direction = fabs(direction);
+    int kz = abs_direction.x > abs_direction.y ?
+        (abs_direction.x > abs_direction.z ? 0 : 2) : (abs_direction.y > abs_direction.z ? 1 : 2);
+    float3 permuted_direction = PermuteAxes(direction, kz);
+    float inv_direction_z = 1.0f / permuted_direction.z;
+
+    WatertightRay wt_ray;
+    wt_ray.origin = PermuteAxes(origin, kz);
+    wt_ray.shear = (float3)(permuted_direction.x * inv_direction_z, permuted_direction.y * inv_direction_z, inv_direction_z);
+    wt_ray.kz = kz;
+    return wt_ray;
+}
 
-    if (u < 0.0f || u > 1.0f)
+// Two-sided, the edges shared by the triangles are evaluated from the same sheared vertices,
+// so there are no cracks between them
+bool RayTriangle(WatertightRay wt_ray, float t_min, float t_max, const __global RTTriangle* triangle, float2* bc, float* out_t)
+{
+    float3 a = PermuteAxes(triangle->position1, wt_ray.kz) - wt_ray.origin;
+    float3 b = PermuteAxes(triangle->position2, wt_ray.kz) - wt_ray.origin;
+    float3 c = PermuteAxes(triangle->position3, wt_ray.kz) - wt_ray.origin;
+
+    float ax = a.x - wt_ray.shear.x * a.z;
+    float ay = a.y - wt_ray.shear.y * a.z;
+    float bx = b.x - wt_ray.shear.x * b.z;
+    float by = b.y - wt_ray.shear.y * b.z;
+    float cx = c.x - wt_ray.shear.x * c.z;
+    float cy = c.y - wt_ray.shear.y * c.z;
+
+    // Scaled barycentrics
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
     {
         return false;
     }
 
-    float3 qvec = cross(tvec, e1);
-    float v = dot(ray.direction.xyz, qvec) * inv_det;
-
-    if (v < 0.0f || u + v > 1.0f)
+    // Ray is parallel to plane
+    float det = u + v + w;
+    if (det == 0.0f)
     {
         return false;
     }
 
-    float t = dot(e2, qvec) * inv_det;
-    float t_min = ray.origin.w;
-    float t_max = ray.direction.w;
+    float inv_det = 1.0f / det;
+    float t = (u * a.z + v * b.z + w * c.z) * wt_ray.shear.z * inv_det;
 
     if (t < t_min || t > t_max)
     {
@@ -66,7 +116,7 @@ bool RayTriangle(Ray ray, const __global RTTriangle* triangle, float2* bc, float
     }
 
     // Intersection is found
-    *bc = (float2)(u, v);
+    *bc = (float2)(v * inv_det, w * inv_det);
     *out_t = t;
 
     return true;
@@ -101,97 +151,304 @@ __kernel void TraceBvh
     // Input
     __global Ray* rays,
     __global uint* ray_counter,
+#ifdef PERSISTENT_THREADS
+    // Rays taken from the queue so far, cleared before the launch
+    __global uint* ray_queue_counter,
+#endif
     __global RTTriangle* triangles,
+#ifdef BVH_WIDTH
+    // Two-level BVHs are traversed with the binary nodes only
+    __global WideBVHNode* nodes,
+#else
     __global LinearBVHNode* nodes,
+#endif
+#ifdef PRIMITIVE_INDIRECTION
+    // Leaves reference triangles through this buffer
+    __global uint* primitive_indices,
+#endif
+#ifdef INSTANCING
+    // Referenced by the top level leaves
+    __global Instance* instances,
+#endif
     // Output
 #ifdef SHADOW_RAYS
     __global uint* shadow_hits
 #else
     __global Hit* hits
 #endif
+#ifdef BVH_STATISTICS
+    // Node visits and triangle tests of each ray
+    , __global TraversalStats* traversal_stats
+#endif
 )
 {
-    uint ray_idx = get_global_id(0);
-    ///@TODO: use indirect dispatch
     uint num_rays = ray_counter[0];
 
-    if (ray_idx >= num_rays)
+#ifdef PERSISTENT_THREADS
+    // The launch only fills the device, the work items take batches of rays from the queue until it drains
+    // so the ones done with short rays continue instead of waiting for the long rays of their wavefront
+    uint batch_end = 0;
+    for (uint ray_idx = 0; ; ++ray_idx)
     {
-        return;
-    }
+        if (ray_idx >= batch_end)
+        {
+            ray_idx = atomic_add(ray_queue_counter, PERSISTENT_BATCH_SIZE);
+            if (ray_idx >= num_rays)
+            {
+                break;
+            }
 
-    Ray ray = rays[ray_idx];
-    // TODO: fix it
-    float3 ray_inv_dir = (float3)(1.0f, 1.0f, 1.0f) / ray.direction.xyz;
-    int ray_sign[3];
-    ray_sign[0] = ray_inv_dir.x < 0;
-    ray_sign[1] = ray_inv_dir.y < 0;
-    ray_sign[2] = ray_inv_dir.z < 0;
+            batch_end = min(ray_idx + PERSISTENT_BATCH_SIZE, num_rays);
+        }
+#else
+    // The launch size is predicted from the previous frame, so a work item may process several rays
+    for (uint ray_idx = get_global_id(0); ray_idx < num_rays; ray_idx += get_global_size(0))
+    {
+#endif
+        Ray ray = rays[ray_idx];
+        // TODO: fix it
+        float3 ray_inv_dir = (float3)(1.0f, 1.0f, 1.0f) / ray.direction.xyz;
+        int ray_sign[3];
+        ray_sign[0] = ray_inv_dir.x < 0;
+        ray_sign[1] = ray_inv_dir.y < 0;
+        ray_sign[2] = ray_inv_dir.z < 0;
+        WatertightRay wt_ray = SetupWatertightRay(ray.origin.xyz, ray.direction.xyz);
+
+#ifdef INSTANCING
+        // The bottom level BVHs are traversed in the object space of the instance
+        float3 world_origin = ray.origin.xyz;
+        float3 world_direction = ray.direction.xyz;
+        uint instance_id = INVALID_ID;
+        // Stack size at the moment of entering the bottom level BVH
+        int instance_stack_base = 0;
+#endif
 
 #ifdef SHADOW_RAYS
-    uint shadow_hit = INVALID_ID;
+        uint shadow_hit = INVALID_ID;
 #endif
 
-    Hit hit;
-    hit.primitive_id = INVALID_ID;
+        Hit hit;
+        hit.primitive_id = INVALID_ID;
+        hit.instance_id = INVALID_ID;
 
-    float t;
-    // Follow ray through BVH nodes to find primitive intersections
-    int toVisitOffset = 0;
-    int currentNodeIndex = 0;
-    int nodesToVisit[64];
+#ifdef BVH_STATISTICS
+        TraversalStats stats;
+        stats.node_visits = 0;
+        stats.triangle_tests = 0;
+#endif
 
-    while (true)
-    {
-        LinearBVHNode node = nodes[currentNodeIndex];
+        float t;
+#ifdef BVH_WIDTH
+        // Test all children of the wide node and visit the hit ones from the nearest
+        int toVisitOffset = 0;
+        uint currentNodeIndex = 0;
+        uint nodesToVisit[WIDE_STACK_SIZE];
 
-        if (RayBounds(node.bounds, ray.origin.xyz, ray_inv_dir, ray.origin.w, ray.direction.w))
+        while (true)
         {
-            int num_primitives = node.num_primitives_axis >> 16;
-            // Leaf node
-            if (num_primitives > 0)
+            __global WideBVHNode* node = &nodes[currentNodeIndex];
+#ifdef BVH_STATISTICS
+            stats.node_visits++;
+#endif
+
+#ifdef COMPRESSED_NODES
+            // The child bounds are decoded in the frame of the node
+            float3 origin = (float3)(node->origin_x, node->origin_y, node->origin_z);
+            float3 scale = (float3)(as_float((node->scale_exponents & 0xFF) << 23),
+                as_float(((node->scale_exponents >> 8) & 0xFF) << 23), as_float(((node->scale_exponents >> 16) & 0xFF) << 23));
+#endif
+
+            // Interior children sorted from the farthest one
+            float child_distances[BVH_WIDTH];
+            uint child_nodes[BVH_WIDTH];
+            int num_hit_children = 0;
+
+            for (int i = 0; i < BVH_WIDTH; ++i)
             {
-                // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < num_primitives; ++i)
+#ifdef COMPRESSED_NODES
+                uint word = i >> 2;
+                uint shift = (i & 3) << 3;
+                float3 child_min = origin + scale * convert_float3(((uint3)(node->child_min_x[word], node->child_min_y[word],
+                    node->child_min_z[word]) >> shift) & 0xFF);
+                float3 child_max = origin + scale * convert_float3(((uint3)(node->child_max_x[word], node->child_max_y[word],
+                    node->child_max_z[word]) >> shift) & 0xFF);
+                uint num_primitives = (node->child_counts[i >> 1] >> ((i & 1) << 4)) & 0xFFFF;
+#else
+                float3 child_min = (float3)(node->child_min_x[i], node->child_min_y[i], node->child_min_z[i]);
+                float3 child_max = (float3)(node->child_max_x[i], node->child_max_y[i], node->child_max_z[i]);
+                uint num_primitives = node->child_counts[i];
+#endif
+
+                // Near and far planes by the ray direction, so the inverted bounds of the empty slots are never hit
+                float3 t_near = ((float3)(ray_sign[0] ? child_max.x : child_min.x, ray_sign[1] ? child_max.y : child_min.y,
+                    ray_sign[2] ? child_max.z : child_min.z) - ray.origin.xyz) * ray_inv_dir;
+                float3 t_far = ((float3)(ray_sign[0] ? child_min.x : child_max.x, ray_sign[1] ? child_min.y : child_max.y,
+                    ray_sign[2] ? child_min.z : child_max.z) - ray.origin.xyz) * ray_inv_dir;
+                float tmin = max(max3(t_near), ray.origin.w);
+                float tmax = min(min3(t_far), ray.direction.w);
+
+                if (tmax < tmin)
+                {
+                    continue;
+                }
+
+                uint offset = node->child_offsets[i];
+                // Leaf child
+                if (num_primitives > 0)
                 {
-                    if (RayTriangle(ray, &triangles[node.offset + i], &hit.bc, &hit.t))
+                    for (uint j = 0; j < num_primitives; ++j)
                     {
-                        hit.primitive_id = node.offset + i;
-                        // Set ray t_max
-                        // TODO: remove t from hit structure
-                        ray.direction.w = hit.t;
+#ifdef PRIMITIVE_INDIRECTION
+                        uint primitive_id = primitive_indices[offset + j];
+#else
+                        uint primitive_id = offset + j;
+#endif
+#ifdef BVH_STATISTICS
+                        stats.triangle_tests++;
+#endif
+                        if (RayTriangle(wt_ray, ray.origin.w, ray.direction.w, &triangles[primitive_id], &hit.bc, &t))
+                        {
+                            hit.primitive_id = primitive_id;
+                            // Set ray t_max
+                            ray.direction.w = t;
 
 #ifdef SHADOW_RAYS
-                        shadow_hit = 0;
-                        goto endtrace;
+                            shadow_hit = 0;
+                            goto endtrace;
 #endif
+                        }
                     }
                 }
+                else
+                {
+                    int j = num_hit_children++;
+                    for (; j > 0 && child_distances[j - 1] < tmin; --j)
+                    {
+                        child_distances[j] = child_distances[j - 1];
+                        child_nodes[j] = child_nodes[j - 1];
+                    }
 
-                if (toVisitOffset == 0)
+                    child_distances[j] = tmin;
+                    child_nodes[j] = offset;
+                }
+            }
+
+            // The nearest child goes last and is visited next,
+            // the children behind the hits found in the leaves are skipped
+            for (int i = 0; i < num_hit_children; ++i)
+            {
+                if (child_distances[i] <= ray.direction.w)
                 {
-                    break;
+                    nodesToVisit[toVisitOffset++] = child_nodes[i];
                 }
+            }
 
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            if (toVisitOffset == 0)
+            {
+                break;
             }
-            else
+
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+#else
+        // Follow ray through BVH nodes to find primitive intersections
+        int toVisitOffset = 0;
+        int currentNodeIndex = 0;
+        int nodesToVisit[64];
+
+        while (true)
+        {
+            LinearBVHNode node = nodes[currentNodeIndex];
+#ifdef BVH_STATISTICS
+            stats.node_visits++;
+#endif
+
+            if (RayBounds(node.bounds, ray.origin.xyz, ray_inv_dir, ray.origin.w, ray.direction.w))
             {
-                // Put far BVH node on _nodesToVisit_ stack, advance to near node
-                if (ray_sign[node.num_primitives_axis & 0xFFFF])
+                int num_primitives = node.num_primitives_axis >> 16;
+                // Leaf node
+                if (num_primitives > 0)
                 {
-                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                    currentNodeIndex = node.offset;
+#ifdef INSTANCING
+                    if (instance_id == INVALID_ID)
+                    {
+                        // Top level leaf, continue with the bottom level BVH of the instance
+                        instance_id = node.offset;
+                        Instance instance = instances[instance_id];
+                        ray.origin.xyz = TransformPoint(instance.world_to_object[0],
+                            instance.world_to_object[1], instance.world_to_object[2], world_origin);
+                        ray.direction.xyz = TransformVector(instance.world_to_object[0],
+                            instance.world_to_object[1], instance.world_to_object[2], world_direction);
+                        ray_inv_dir = (float3)(1.0f, 1.0f, 1.0f) / ray.direction.xyz;
+                        ray_sign[0] = ray_inv_dir.x < 0;
+                        ray_sign[1] = ray_inv_dir.y < 0;
+                        ray_sign[2] = ray_inv_dir.z < 0;
+                        wt_ray = SetupWatertightRay(ray.origin.xyz, ray.direction.xyz);
+                        instance_stack_base = toVisitOffset;
+                        currentNodeIndex = instance.node_offset;
+                        continue;
+                    }
+#endif
+                    // Intersect ray with primitives in leaf BVH node
+                    for (int i = 0; i < num_primitives; ++i)
+                    {
+#ifdef PRIMITIVE_INDIRECTION
+                        uint primitive_id = primitive_indices[node.offset + i];
+#else
+                        uint primitive_id = node.offset + i;
+#endif
+#ifdef BVH_STATISTICS
+                        stats.triangle_tests++;
+#endif
+                        if (RayTriangle(wt_ray, ray.origin.w, ray.direction.w, &triangles[primitive_id], &hit.bc, &t))
+                        {
+                            hit.primitive_id = primitive_id;
+#ifdef INSTANCING
+                            hit.instance_id = instance_id;
+#endif
+                            // Set ray t_max, the affine transforms keep the ray parameter
+                            ray.direction.w = t;
+
+#ifdef SHADOW_RAYS
+                            shadow_hit = 0;
+                            goto endtrace;
+#endif
+                        }
+                    }
                 }
                 else
                 {
-                    nodesToVisit[toVisitOffset++] = node.offset;
-                    currentNodeIndex = currentNodeIndex + 1;
+                    // Put far BVH node on _nodesToVisit_ stack, advance to near node
+                    if (ray_sign[node.num_primitives_axis & 0xFFFF])
+                    {
+                        nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                        currentNodeIndex = node.offset;
+                    }
+                    else
+                    {
+                        nodesToVisit[toVisitOffset++] = node.offset;
+                        currentNodeIndex = currentNodeIndex + 1;
+                    }
+
+                    continue;
                 }
             }
-        }
-        else
-        {
+
+#ifdef INSTANCING
+            if (instance_id != INVALID_ID && toVisitOffset == instance_stack_base)
+            {
+                // The bottom level BVH is done, go back to the top level
+                instance_id = INVALID_ID;
+                ray.origin.xyz = world_origin;
+                ray.direction.xyz = world_direction;
+                ray_inv_dir = (float3)(1.0f, 1.0f, 1.0f) / ray.direction.xyz;
+                ray_sign[0] = ray_inv_dir.x < 0;
+                ray_sign[1] = ray_inv_dir.y < 0;
+                ray_sign[2] = ray_inv_dir.z < 0;
+                wt_ray = SetupWatertightRay(ray.origin.xyz, ray.direction.xyz);
+            }
+#endif
+
             if (toVisitOffset == 0)
             {
                 break;
@@ -199,13 +456,17 @@ __kernel void TraceBvh
 
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
-    }
+#endif // BVH_WIDTH
 
 endtrace:
-    // Write the result to the output buffer
+        // Write the result to the output buffer
 #ifdef SHADOW_RAYS
-    shadow_hits[ray_idx] = shadow_hit;
+        shadow_hits[ray_idx] = shadow_hit;
 #else
-    hits[ray_idx] = hit;
+        hits[ray_idx] = hit;
+#endif
+#ifdef BVH_STATISTICS
+        traversal_stats[ray_idx] = stats;
 #endif
+    }
 }
@@ -0,0 +1,57 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+#include "src/kernels/common/utils.h"
+
+// Samples a pixel takes before its error estimate is trusted
+#define ADAPTIVE_SAMPLING_MIN_SAMPLES 16
+// Darker pixels are measured against this mean so the black ones converge
+#define ADAPTIVE_SAMPLING_MIN_MEAN 1e-3f
+
+float Luminance(float3 radiance)
+{
+    return dot(radiance, make_float3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Compares the standard error of the pixel mean luminance relative to the mean with the threshold.
+// The sums are over the samples of the pixel
+bool IsPixelConverged(float luminance_sum, float luminance_sq_sum, uint sample_count, float error_threshold)
+{
+    if (sample_count < ADAPTIVE_SAMPLING_MIN_SAMPLES)
+    {
+        return false;
+    }
+
+    float n = to_float(sample_count);
+    float mean = luminance_sum / n;
+    float variance = max(luminance_sq_sum / n - mean * mean, 0.0f) * n / (n - 1.0f);
+    float standard_error = sqrt(variance / n);
+
+    return standard_error < error_threshold * max(mean, ADAPTIVE_SAMPLING_MIN_MEAN);
+}
+
+#endif // ADAPTIVE_SAMPLING_H
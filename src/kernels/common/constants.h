@@ -35,4 +35,9 @@
 #define INVALID_TEXTURE_IDX 0xFF
 #define MAX_TEXTURES 512
 
+// Paths traced per pixel by a launch, the path index is pixel_idx * SAMPLES_PER_LAUNCH + sample slot
+#ifndef SAMPLES_PER_LAUNCH
+#define SAMPLES_PER_LAUNCH 1
+#endif
+
 #endif // CONSTANTS_H
@@ -0,0 +1,77 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "src/kernels/common/utils.h"
+#include "src/kernels/common/shared_structures.h"
+
+// The transforms are passed as the rows of 3x4 affine matrices
+float3 TransformPoint(float4 row0, float4 row1, float4 row2, float3 p)
+{
+    return make_float3(
+        row0.x * p.x + row0.y * p.y + row0.z * p.z + row0.w,
+        row1.x * p.x + row1.y * p.y + row1.z * p.z + row1.w,
+        row2.x * p.x + row2.y * p.y + row2.z * p.z + row2.w);
+}
+
+float3 TransformVector(float4 row0, float4 row1, float4 row2, float3 v)
+{
+    return make_float3(
+        row0.x * v.x + row0.y * v.y + row0.z * v.z,
+        row1.x * v.x + row1.y * v.y + row1.z * v.z,
+        row2.x * v.x + row2.y * v.y + row2.z * v.z);
+}
+
+// Normals are transformed by the inverse transpose, pass the rows of the inverse transform
+float3 TransformNormal(float4 inv_row0, float4 inv_row1, float4 inv_row2, float3 n)
+{
+    return make_float3(
+        inv_row0.x * n.x + inv_row1.x * n.y + inv_row2.x * n.z,
+        inv_row0.y * n.x + inv_row1.y * n.y + inv_row2.y * n.z,
+        inv_row0.z * n.x + inv_row1.z * n.y + inv_row2.z * n.z);
+}
+
+// Moves the vertices of an instanced triangle to the world space
+Triangle TransformTriangle(Instance instance, Triangle triangle)
+{
+    float4 m0 = instance.object_to_world[0];
+    float4 m1 = instance.object_to_world[1];
+    float4 m2 = instance.object_to_world[2];
+    float4 inv0 = instance.world_to_object[0];
+    float4 inv1 = instance.world_to_object[1];
+    float4 inv2 = instance.world_to_object[2];
+
+    triangle.v1.position = TransformPoint(m0, m1, m2, triangle.v1.position);
+    triangle.v2.position = TransformPoint(m0, m1, m2, triangle.v2.position);
+    triangle.v3.position = TransformPoint(m0, m1, m2, triangle.v3.position);
+    triangle.v1.normal = TransformNormal(inv0, inv1, inv2, triangle.v1.normal);
+    triangle.v2.normal = TransformNormal(inv0, inv1, inv2, triangle.v2.normal);
+    triangle.v3.normal = TransformNormal(inv0, inv1, inv2, triangle.v3.normal);
+
+    return triangle;
+}
+
+#endif // INSTANCE_H
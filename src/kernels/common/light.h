@@ -64,4 +64,82 @@ float3 Light_Sample(
     return light_radiance;
 }
 
+#ifndef GLSL
+// The emissive triangles are sampled by the OpenCL and the CPU kernels only, the GLSL ones
+// reach them by the BxDF sampling. Include material.h and mesh.h before this file
+
+// Part of the light samples taken from the emissive triangles, the analytic lights take the rest
+float EmissiveLight_SelectionPdf(SceneInfo scene_info)
+{
+    if (scene_info.emissive_count == 0)
+    {
+        return 0.0f;
+    }
+
+    return scene_info.analytic_light_count > 0 ? 0.5f : 1.0f;
+}
+
+// Solid angle pdf of EmissiveLight_Sample reaching a point of a triangle with the material. It is
+// computed from the material emission the alias table is built for, so the emission textures don't change it
+float EmissiveLight_Pdf(SceneInfo scene_info, PackedMaterial material, float sq_distance, float cos_light)
+{
+    if (scene_info.emissive_power <= 0.0f || cos_light <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    return EmissiveLight_SelectionPdf(scene_info) * Luma(UnpackRGBE(material.emission)) * sq_distance /
+        (scene_info.emissive_power * cos_light);
+}
+
+// Picks an emissive triangle by its power in O(1) and a uniform point on it. The pdf is the one
+// to divide the sample by, the MIS weights take mis_pdf from EmissiveLight_Pdf
+float3 EmissiveLight_Sample(__global EmissiveAliasEntry* emissive_alias_table,
+    __global IndexedTriangle* indexed_triangles, __global float4* vertex_positions, __global uint* vertex_texcoords,
+    __global PackedMaterial* materials, __global Texture* textures, __global uint* texture_data,
+    SceneInfo scene_info, float3 position, float s, float2 s_triangle, float3* outgoing, float* pdf, float* mis_pdf)
+{
+    // The integer part of the scaled sample picks the slot, the fraction picks the slot triangle or its alias
+    float scaled_s = s * (float)scene_info.emissive_count;
+    uint slot = (uint)scaled_s;
+    if (slot >= scene_info.emissive_count)
+    {
+        slot = scene_info.emissive_count - 1;
+    }
+
+    EmissiveAliasEntry entry = emissive_alias_table[slot];
+    if (scaled_s - (float)slot >= entry.threshold)
+    {
+        entry = emissive_alias_table[entry.alias];
+    }
+
+    Triangle triangle = FetchTriangle(indexed_triangles, vertex_positions, vertex_texcoords, entry.triangle_index);
+
+    // Uniform barycentrics
+    float sqrt_u = sqrt(s_triangle.x);
+    float2 bc = make_float2(sqrt_u * (1.0f - s_triangle.y), sqrt_u * s_triangle.y);
+
+    float3 light_position = InterpolateAttributes(triangle.v1.position, triangle.v2.position, triangle.v3.position, bc);
+    float3 texcoord = InterpolateAttributes(triangle.v1.texcoord, triangle.v2.texcoord, triangle.v3.texcoord, bc);
+    float3 light_normal = cross(triangle.v2.position - triangle.v1.position, triangle.v3.position - triangle.v1.position);
+    float area = 0.5f * length(light_normal);
+
+    PackedMaterial packed_material = materials[triangle.mtlIndex];
+    Material material;
+    ApplyTextures(packed_material, &material, make_float2(texcoord.x, texcoord.y), textures, texture_data);
+
+    float3 to_light = light_position - position;
+    float sq_distance = dot(to_light, to_light);
+    // The triangles emit on both sides as in HitSurface
+    float cos_light = fabs(dot(normalize(light_normal), to_light)) / sqrt(sq_distance);
+
+    *outgoing = to_light;
+    // Convert the area pdf to the solid angle one
+    *pdf = cos_light > 0.0f ? EmissiveLight_SelectionPdf(scene_info) * entry.pdf * sq_distance / (area * cos_light) : 0.0f;
+    *mis_pdf = EmissiveLight_Pdf(scene_info, packed_material, sq_distance, cos_light);
+
+    return material.emission;
+}
+#endif // GLSL
+
 #endif // LIGHT_H
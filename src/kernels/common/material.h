@@ -148,17 +148,17 @@ float3 EvaluateMaterial(Material material, float3 normal, float3 incoming, float
 
     // Compute f0 values for metals and dielectrics
     float f0_dielectric = IorToF0(1.0f, material.ior);
-    float3 f0_metal = material.specular_albedo.xyz;
+    float3 f0_metal = material.specular_albedo;
 
     // Blend f0 values based on metalness
     float3 f0 = mix(to_float3(f0_dielectric), f0_metal, to_float3(material.metalness));
 
     // Since metals don't have the diffuse term, fade it to zero
     //@TODO: precompute it?
-    float3 diffuse_color = (1.0f - material.metalness) * material.diffuse_albedo.xyz;
+    float3 diffuse_color = (1.0f - material.metalness) * material.diffuse_albedo;
 
     // This is the scaling value for specular bxdf
-    float3 specular_albedo = mix(material.specular_albedo.xyz, to_float3(1.0f), to_float3(material.metalness));
+    float3 specular_albedo = mix(material.specular_albedo, to_float3(1.0f), to_float3(material.metalness));
 
     float3 fresnel = FresnelSchlick(f0, h_dot_o);
 
@@ -178,8 +178,8 @@ float3 SampleBxdf(float s1, float2 s, Material material, float3 normal,
 )
 {
 #ifdef ENABLE_WHITE_FURNACE
-    material.diffuse_albedo.xyz = to_float3(1.0f);
-    material.specular_albedo.xyz = to_float3(1.0f);
+    material.diffuse_albedo = to_float3(1.0f);
+    material.specular_albedo = to_float3(1.0f);
 #endif // ENABLE_WHITE_FURNACE
 
     // Perceptual roughness remapping
@@ -188,17 +188,17 @@ float3 SampleBxdf(float s1, float2 s, Material material, float3 normal,
 
     // Compute f0 values for metals and dielectrics
     float f0_dielectric = IorToF0(1.0f, material.ior);
-    float3 f0_metal = material.specular_albedo.xyz;
+    float3 f0_metal = material.specular_albedo;
 
     // Blend f0 values based on metalness
     float3 f0 = mix(to_float3(f0_dielectric), f0_metal, to_float3(material.metalness));
 
     // Since metals don't have the diffuse term, fade it to zero
     //@TODO: precompute it?
-    float3 diffuse_albedo = (1.0f - material.metalness) * material.diffuse_albedo.xyz;
+    float3 diffuse_albedo = (1.0f - material.metalness) * material.diffuse_albedo;
 
     // This is the scaling value for specular bxdf
-    float3 specular_albedo = mix(material.specular_albedo.xyz, to_float3(1.0f), to_float3(material.metalness));
+    float3 specular_albedo = mix(material.specular_albedo, to_float3(1.0f), to_float3(material.metalness));
 
     // This is not an actual fresnel value, because we need to use half vector instead of normal here
     // it's a "heuristic" used for better layer importance sampling and energy conservation
@@ -227,19 +227,63 @@ float3 SampleBxdf(float s1, float2 s, Material material, float3 normal,
     if (s1 <= specular_sampling_pdf)
     {
         // Sample specular
-        bxdf = fresnel * SampleSpecular(s, f0, alpha, normal, incoming, outgoing, pdf) * max(dot(OUT(outgoing), normal), 0.0f);
+        // Outgoing direction is written by the sampling function, so don't read it in the same expression
+        bxdf = fresnel * SampleSpecular(s, f0, alpha, normal, incoming, outgoing, pdf);
+        bxdf *= max(dot(OUT(outgoing), normal), 0.0f);
         OUT(pdf) *= specular_sampling_pdf;
     }
     else
     {
         // Sample diffuse
-        bxdf = (1.0f - fresnel) * SampleDiffuse(s, diffuse_albedo, f0, normal, incoming, outgoing, pdf) * max(dot(OUT(outgoing), normal), 0.0f);
+        bxdf = (1.0f - fresnel) * SampleDiffuse(s, diffuse_albedo, f0, normal, incoming, outgoing, pdf);
+        bxdf *= max(dot(OUT(outgoing), normal), 0.0f);
         OUT(pdf) *= diffuse_sampling_pdf;
     }
 
     return bxdf;
 }
 
+// Solid angle pdf of SampleBxdf returning the outgoing direction, used for the multiple importance sampling.
+// 0 if the material may sample a delta layer, the light sampling can't reach the paths through it
+float EvaluateBxdfPdf(Material material, float3 normal, float3 incoming, float3 outgoing)
+{
+    if (material.transparency < 0.5)
+    {
+        return 0.0f;
+    }
+
+    // Same layer selection as in SampleBxdf
+    float roughness = material.roughness;
+    float alpha = roughness * roughness;
+    float f0_dielectric = IorToF0(1.0f, material.ior);
+    float3 f0 = mix(to_float3(f0_dielectric), material.specular_albedo, to_float3(material.metalness));
+    float3 diffuse_albedo = (1.0f - material.metalness) * material.diffuse_albedo;
+    float3 specular_albedo = mix(material.specular_albedo, to_float3(1.0f), to_float3(material.metalness));
+    float3 fresnel = FresnelSchlick(f0, dot(normal, incoming)) * specular_albedo;
+
+    float specular_weight = Luma(specular_albedo * fresnel);
+    float diffuse_weight = Luma(diffuse_albedo * (1.0f - fresnel));
+    float weight_sum = diffuse_weight + specular_weight;
+
+    if (weight_sum <= 0.0f || (specular_weight > 0.0f && alpha <= 1e-4f))
+    {
+        return 0.0f;
+    }
+
+    float specular_pdf = 0.0f;
+    float3 wh = normalize(incoming + outgoing);
+    float n_dot_h = dot(normal, wh);
+    float h_dot_o = dot(wh, outgoing);
+    if (specular_weight > 0.0f && n_dot_h > 0.0f && h_dot_o > 0.0f)
+    {
+        specular_pdf = GGX_D(alpha, n_dot_h) * n_dot_h / (4.0f * h_dot_o);
+    }
+
+    float diffuse_pdf = max(dot(normal, outgoing), 0.0f) * INV_PI;
+
+    return (specular_weight * specular_pdf + diffuse_weight * diffuse_pdf) / weight_sum;
+}
+
 #ifdef GLSL
 float3 SampleTexture(uint texture_index, float2 uv)
 {
@@ -260,7 +304,7 @@ float3 SampleTexture(Texture texture, float2 uv, __global uint* texture_data)
 
     float4 color = UnpackRGBA8(texture_data[texel_addr]);
 
-    return clamp(color.xyz, 0.0f, 1.0f);
+    return clamp(make_float3(color.x, color.y, color.z), 0.0f, 1.0f);
 }
 #endif // #ifndef GLSL
 
@@ -0,0 +1,111 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#ifndef MESH_H
+#define MESH_H
+
+#include "src/kernels/common/utils.h"
+#include "src/kernels/common/shared_structures.h"
+
+// The scene vertices are pooled and the triangles index them. The vertex positions
+// are float4 with the octahedral normal (2 x 16-bit snorm) in w, the texcoords are
+// 2 x half. The GLSL kernels read the vertex streams from the texture buffers
+// vertex_positions and vertex_texcoords and the triangles from indexed_triangles
+
+float2 UnpackSnorm2x16(uint packed)
+{
+#ifdef GLSL
+    return unpackSnorm2x16(packed);
+#else
+    float x = (float)(short)(packed & 0xFFFF) / 32767.0f;
+    float y = (float)(short)(packed >> 16) / 32767.0f;
+    return make_float2(max(x, -1.0f), max(y, -1.0f));
+#endif
+}
+
+float2 UnpackHalf2x16(uint packed)
+{
+#ifdef GLSL
+    return unpackHalf2x16(packed);
+#else
+    return vload_half2(0, (half*)&packed);
+#endif
+}
+
+// See "A Survey of Efficient Representations for Independent Unit Vectors"
+float3 DecodeOctahedral(uint packed)
+{
+    float2 e = UnpackSnorm2x16(packed);
+    float3 n = make_float3(e.x, e.y, 1.0f - fabs(e.x) - fabs(e.y));
+    float t = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
+
+Vertex DecodeVertex(float4 position, uint texcoord)
+{
+    Vertex vertex;
+    vertex.position = make_float3(position.x, position.y, position.z);
+#ifdef GLSL
+    vertex.normal = DecodeOctahedral(floatBitsToUint(position.w));
+#else
+    vertex.normal = DecodeOctahedral(as_uint(position.w));
+#endif
+    float2 uv = UnpackHalf2x16(texcoord);
+    vertex.texcoord = make_float3(uv.x, uv.y, 0.0f);
+    return vertex;
+}
+
+#ifdef GLSL
+Triangle FetchTriangle(uint triangle_idx)
+{
+    IndexedTriangle indexed_triangle = indexed_triangles[triangle_idx];
+
+    Triangle triangle;
+    triangle.v1 = DecodeVertex(texelFetch(vertex_positions, int(indexed_triangle.v1)),
+        texelFetch(vertex_texcoords, int(indexed_triangle.v1)).x);
+    triangle.v2 = DecodeVertex(texelFetch(vertex_positions, int(indexed_triangle.v2)),
+        texelFetch(vertex_texcoords, int(indexed_triangle.v2)).x);
+    triangle.v3 = DecodeVertex(texelFetch(vertex_positions, int(indexed_triangle.v3)),
+        texelFetch(vertex_texcoords, int(indexed_triangle.v3)).x);
+    triangle.mtlIndex = indexed_triangle.mtlIndex;
+    return triangle;
+}
+#else
+Triangle FetchTriangle(__global IndexedTriangle* indexed_triangles, __global float4* vertex_positions,
+    __global uint* vertex_texcoords, uint triangle_idx)
+{
+    IndexedTriangle indexed_triangle = indexed_triangles[triangle_idx];
+
+    Triangle triangle;
+    triangle.v1 = DecodeVertex(vertex_positions[indexed_triangle.v1], vertex_texcoords[indexed_triangle.v1]);
+    triangle.v2 = DecodeVertex(vertex_positions[indexed_triangle.v2], vertex_texcoords[indexed_triangle.v2]);
+    triangle.v3 = DecodeVertex(vertex_positions[indexed_triangle.v3], vertex_texcoords[indexed_triangle.v3]);
+    triangle.mtlIndex = indexed_triangle.mtlIndex;
+    return triangle;
+}
+#endif // #ifdef GLSL
+
+#endif // MESH_H
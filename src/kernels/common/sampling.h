@@ -32,7 +32,10 @@
 #define SAMPLE_TYPE_BXDF_U     2
 #define SAMPLE_TYPE_BXDF_V     3
 #define SAMPLE_TYPE_LIGHT      4
-#define SAMPLE_TYPE_MAX        5
+#define SAMPLE_TYPE_LIGHT_U    5
+#define SAMPLE_TYPE_LIGHT_V    6
+#define SAMPLE_TYPE_RUSSIAN_ROULETTE 7
+#define SAMPLE_TYPE_MAX        8
 
 #define BLUE_NOISE_BUFFERS sobol_256spp_256d, scramblingTile, rankingTile
 
@@ -81,4 +84,18 @@ float SampleRandom(uint pixel_i, uint pixel_j, uint sample_index, uint bounce, u
 #endif
 }
 
+// Russian roulette keeps a path with the largest channel of its throughput as the probability
+float RussianRouletteSurvival(float3 throughput)
+{
+    return min(max(throughput.x, max(throughput.y, throughput.z)), 1.0f);
+}
+
+// Multiple importance sampling weight of the strategy with pdf_a against the one with pdf_b
+float PowerHeuristic(float pdf_a, float pdf_b)
+{
+    float sq_pdf_a = pdf_a * pdf_a;
+    float sq_pdf_b = pdf_b * pdf_b;
+    return sq_pdf_a + sq_pdf_b > 0.0f ? sq_pdf_a / (sq_pdf_a + sq_pdf_b) : 0.0f;
+}
+
 #endif // SAMPLING_H
@@ -61,15 +61,23 @@ STRUCT_END(Ray)
 STRUCT_BEGIN(Hit)
     float2 bc;
     unsigned int primitive_id;
-    // TODO: remove t from hit structure
-    float t;
+    // INVALID_ID if the triangle is not instanced
+    unsigned int instance_id;
 STRUCT_END(Hit)
 
+// Traversal work of a ray, written by the trace kernel built with BVH_STATISTICS
+STRUCT_BEGIN(TraversalStats)
+    unsigned int node_visits;
+    unsigned int triangle_tests;
+STRUCT_END(TraversalStats)
+
 STRUCT_BEGIN(SceneInfo)
     unsigned int analytic_light_count;
+    // Slots of the emissive alias table
     unsigned int emissive_count;
     unsigned int environment_map_index;
-    unsigned int padding;
+    // Sum of the area times the emission luminance of the sampled emissive triangles
+    float emissive_power;
 STRUCT_END(SceneInfo)
 
 STRUCT_BEGIN(PackedMaterial)
@@ -87,6 +95,16 @@ STRUCT_BEGIN(Light)
     unsigned int padding[3];
 STRUCT_END(Light)
 
+// Slot of the alias table the emissive triangles are picked from by their power, see Scene::BuildEmissiveAliasTable
+STRUCT_BEGIN(EmissiveAliasEntry)
+    // The slot keeps its triangle below the threshold and takes the one of the alias slot above it
+    float threshold;
+    unsigned int alias;
+    unsigned int triangle_index;
+    // Probability to pick the triangle of the slot
+    float pdf;
+STRUCT_END(EmissiveAliasEntry)
+
 STRUCT_BEGIN(Texture)
     int data_start;
     int width;
@@ -108,8 +126,11 @@ STRUCT_BEGIN(Vertex)
     float3 normal;
 STRUCT_END(Vertex)
 
+// Loaded scene triangle, the BVH builders work with it. The kernels shade the
+// indexed triangles and decode the vertices to it, see mesh.h
 STRUCT_BEGIN(Triangle)
 #ifdef __cplusplus
+    Triangle() {}
     Triangle(Vertex v1, Vertex v2, Vertex v3, unsigned int mtlIndex)
         : v1(v1), v2(v2), v3(v3), mtlIndex(mtlIndex)
     {}
@@ -140,6 +161,17 @@ STRUCT_BEGIN(Triangle)
     unsigned int padding[3];
 STRUCT_END(Triangle)
 
+// 16 bytes, indices to the pooled vertices. A uint3 is padded to 16 bytes anyway,
+// so the material index takes the last word instead of a separate stream
+STRUCT_BEGIN(IndexedTriangle)
+    unsigned int v1;
+    unsigned int v2;
+    unsigned int v3;
+    unsigned int mtlIndex;
+STRUCT_END(IndexedTriangle)
+
+// 48 bytes, the watertight intersection test shears the vertices per ray,
+// so they are stored as is instead of a precomputed edge form
 STRUCT_BEGIN(RTTriangle)
 #ifdef __cplusplus
     RTTriangle(float3 v1, float3 v2, float3 v3)
@@ -170,6 +202,76 @@ STRUCT_BEGIN(LinearBVHNode)
     unsigned int padding[2]; // ensure 48 byte total size
 STRUCT_END(LinearBVHNode)
 
+// Wide BVH nodes collapsed from the binary BVH, the child bounds are stored per axis
+// so all children are tested at once. Empty slots have inverted bounds
+STRUCT_BEGIN(BVH4Node)
+    float child_min_x[4];
+    float child_min_y[4];
+    float child_min_z[4];
+    float child_max_x[4];
+    float child_max_y[4];
+    float child_max_z[4];
+    // Wide node index (interior child) or first primitive (leaf child)
+    unsigned int child_offsets[4];
+    // 0 -> interior child
+    unsigned int child_counts[4];
+STRUCT_END(BVH4Node)
+
+STRUCT_BEGIN(BVH8Node)
+    float child_min_x[8];
+    float child_min_y[8];
+    float child_min_z[8];
+    float child_max_x[8];
+    float child_max_y[8];
+    float child_max_z[8];
+    unsigned int child_offsets[8];
+    unsigned int child_counts[8];
+STRUCT_END(BVH8Node)
+
+// Wide BVH nodes with the child bounds quantized to 8 bits in the frame of the node:
+// bound = origin + q * 2^(exponent - 127). Bytes of the child i are at bits 8 * (i % 4) of the word i / 4
+STRUCT_BEGIN(CompressedBVH4Node)
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    // 3 x 8 bit biased exponents of the grid step
+    unsigned int scale_exponents;
+    unsigned int child_min_x[1];
+    unsigned int child_min_y[1];
+    unsigned int child_min_z[1];
+    unsigned int child_max_x[1];
+    unsigned int child_max_y[1];
+    unsigned int child_max_z[1];
+    unsigned int child_offsets[4];
+    // 16 bit primitive counts, 0 -> interior child
+    unsigned int child_counts[2];
+STRUCT_END(CompressedBVH4Node)
+
+STRUCT_BEGIN(CompressedBVH8Node)
+    float origin_x;
+    float origin_y;
+    float origin_z;
+    unsigned int scale_exponents;
+    unsigned int child_min_x[2];
+    unsigned int child_min_y[2];
+    unsigned int child_min_z[2];
+    unsigned int child_max_x[2];
+    unsigned int child_max_y[2];
+    unsigned int child_max_z[2];
+    unsigned int child_offsets[8];
+    unsigned int child_counts[4];
+STRUCT_END(CompressedBVH8Node)
+
+STRUCT_BEGIN(Instance)
+    // Rows of the 3x4 affine transforms
+    float4 object_to_world[3];
+    float4 world_to_object[3];
+    unsigned int mesh_index;
+    // Root of the bottom level BVH of the mesh
+    unsigned int node_offset;
+    unsigned int padding[2];
+STRUCT_END(Instance)
+
 STRUCT_BEGIN(Camera)
     float3 position;
     float3 front;
@@ -38,6 +38,10 @@ float3 to_float3(float x)
 {
     return float3(x, x, x);
 }
+float2 make_float2(float x, float y)
+{
+    return float2(x, y);
+}
 float3 make_float3(float x, float y, float z)
 {
     return float3(x, y, z);
@@ -47,6 +51,33 @@ float4 make_float4(float x, float y, float z, float w)
     return float4(x, y, z, w);
 }
 #define OUT(x) x
+#elif defined(__cplusplus)
+// Host build, see src/kernels/cpu/cl_builtins.hpp
+float to_float(uint x)
+{
+    return (float)(x);
+}
+int to_int(uint x)
+{
+    return (int)(x);
+}
+float3 to_float3(float x)
+{
+    return float3(x, x, x);
+}
+float2 make_float2(float x, float y)
+{
+    return float2(x, y);
+}
+float3 make_float3(float x, float y, float z)
+{
+    return float3(x, y, z);
+}
+float4 make_float4(float x, float y, float z, float w)
+{
+    return float4(x, y, z, w);
+}
+#define OUT(x) *x
 #else
 float to_float(uint x)
 {
@@ -60,6 +91,10 @@ float3 to_float3(float x)
 {
     return (float3)(x, x, x);
 }
+float2 make_float2(float x, float y)
+{
+    return (float2)(x, y);
+}
 float3 make_float3(float x, float y, float z)
 {
     return (float3)(x, y, z);
@@ -0,0 +1,171 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+// OpenCL C built-ins used by the shared kernel code (src/kernels/common),
+// implemented on top of the host math types.
+// Include this file and the kernel headers inside a namespace, so that
+// the helpers don't leak into the rest of the host code. mathlib.hpp,
+// <atomic>, <cmath> and <cstring> must be included before that.
+
+#define __global
+#define __constant const
+#define __kernel
+
+typedef unsigned int uint;
+// Storage only, as without cl_khr_fp16
+typedef std::uint16_t half;
+
+using std::sqrt;
+using std::pow;
+using std::exp;
+using std::log;
+using std::ldexp;
+using std::fabs;
+using std::floor;
+using std::sin;
+using std::cos;
+using std::tan;
+using std::acos;
+using std::atan2;
+using ::clamp;
+
+inline float as_float(uint value)
+{
+    float result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+inline uint as_uint(float value)
+{
+    uint result;
+    std::memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+inline float vload_half(std::size_t offset, half const* p)
+{
+    // The kernels point it to other types
+    half value;
+    std::memcpy(&value, p + offset, sizeof(value));
+
+    uint sign = (uint)(value & 0x8000u) << 16;
+    uint exponent = (value >> 10) & 0x1Fu;
+    uint mantissa = value & 0x3FFu;
+
+    if (exponent == 0)
+    {
+        // Zero or subnormal
+        float value = std::ldexp((float)mantissa, -24);
+        return sign ? -value : value;
+    }
+
+    // Rebias the exponent, infinities and NaNs keep the maximal one
+    uint float_exponent = exponent == 0x1Fu ? 0xFFu : exponent + 112;
+    return as_float(sign | (float_exponent << 23) | (mantissa << 13));
+}
+
+inline float2 vload_half2(std::size_t offset, half const* p)
+{
+    return float2(vload_half(offset * 2, p), vload_half(offset * 2 + 1, p));
+}
+
+inline float min(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+inline float max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+inline float3 min(float3 const& a, float3 const& b)
+{
+    return Min(a, b);
+}
+
+inline float3 max(float3 const& a, float3 const& b)
+{
+    return Max(a, b);
+}
+
+inline float dot(float3 const& a, float3 const& b)
+{
+    return Dot(a, b);
+}
+
+inline float3 cross(float3 const& a, float3 const& b)
+{
+    return Cross(a, b);
+}
+
+inline float length(float3 const& v)
+{
+    return v.Length();
+}
+
+inline float3 normalize(float3 const& v)
+{
+    return v.Normalize();
+}
+
+inline float3 pow(float3 const& v, float p)
+{
+    return float3(std::pow(v.x, p), std::pow(v.y, p), std::pow(v.z, p));
+}
+
+inline float2 floor(float2 const& v)
+{
+    return float2(std::floor(v.x), std::floor(v.y));
+}
+
+inline float3 clamp(float3 const& v, float min_value, float max_value)
+{
+    return float3(clamp(v.x, min_value, max_value),
+        clamp(v.y, min_value, max_value),
+        clamp(v.z, min_value, max_value));
+}
+
+inline float mix(float a, float b, float t)
+{
+    return a + (b - a) * t;
+}
+
+inline float3 mix(float3 const& a, float3 const& b, float t)
+{
+    return a + (b - a) * t;
+}
+
+inline float3 mix(float3 const& a, float3 const& b, float3 const& t)
+{
+    return a + (b - a) * t;
+}
+
+inline uint atomic_add(std::atomic<uint>* counter, uint value)
+{
+    return counter->fetch_add(value, std::memory_order_relaxed);
+}
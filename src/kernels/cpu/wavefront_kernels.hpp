@@ -0,0 +1,1254 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+// Host versions of the wavefront kernels in src/kernels/cl, one function per work item.
+// They share the material, sampling and light code with the GPU kernels,
+// so keep them in sync with the .cl files.
+// Include it from a single translation unit, the shared headers define non-inline functions.
+
+#include "mathlib/mathlib.hpp"
+#include "kernels/common/shared_structures.h"
+#include "loaders/image_loader.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace cpu
+{
+#include "kernels/cpu/cl_builtins.hpp"
+#include "kernels/common/constants.h"
+#include "kernels/common/utils.h"
+#include "kernels/common/sampling.h"
+#include "kernels/common/bxdf.h"
+#include "kernels/common/material.h"
+#include "kernels/common/instance.h"
+#include "kernels/common/mesh.h"
+#include "kernels/common/light.h"
+#include "kernels/common/adaptive_sampling.h"
+
+#define SHADED_COLOR_INDEX      0
+#define DIFFUSE_INDEX           1
+#define DEPTH_INDEX             2
+#define NORMAL_INDEX            3
+#define MOTION_VECTORS_INDEX    4
+#define TRAVERSAL_HEATMAP_INDEX 5
+
+// Node visits plus triangle tests of a primary ray shown at the red end of the heatmap
+#define HEATMAP_MAX_TRAVERSAL_COST 256.0f
+
+// The defines used to specialize the GPU kernels are runtime options here
+struct KernelOptions
+{
+    bool enable_white_furnace;
+    bool enable_blue_noise;
+    bool enable_denoiser;
+    // ADAPTIVE_SAMPLING_THRESHOLD, 0 - adaptive sampling is off
+    float adaptive_sampling_threshold;
+    // RUSSIAN_ROULETTE_BOUNCE, 0 - the paths run to the max bounce
+    uint russian_roulette_bounce;
+    // MAX_BOUNCES
+    uint max_bounces;
+};
+
+struct BlueNoiseBuffers
+{
+    int* sobol_256spp_256d;
+    int* scrambling_tile;
+    int* ranking_tile;
+};
+
+inline float SampleRandom(uint pixel_i, uint pixel_j, uint sample_index, uint bounce, uint sample_type,
+    bool enable_blue_noise, BlueNoiseBuffers const& blue_noise)
+{
+    if (enable_blue_noise)
+    {
+        return SampleBlueNoise(pixel_i, pixel_j, sample_index, bounce * SAMPLE_TYPE_MAX + sample_type,
+            blue_noise.sobol_256spp_256d, blue_noise.scrambling_tile, blue_noise.ranking_tile);
+    }
+
+    return SampleRandom(pixel_i, pixel_j, sample_index, bounce, sample_type,
+        blue_noise.sobol_256spp_256d, blue_noise.scrambling_tile, blue_noise.ranking_tile);
+}
+
+//
+// raygeneration.cl
+//
+
+inline float GetRandomFloat(unsigned int* seed)
+{
+    *seed = (*seed ^ 61) ^ (*seed >> 16);
+    *seed = *seed + (*seed << 3);
+    *seed = *seed ^ (*seed >> 4);
+    *seed = *seed * 0x27d4eb2d;
+    *seed = *seed ^ (*seed >> 15);
+    *seed = 1103515245 * (*seed) + 12345;
+
+    return (float)(*seed) * 2.3283064365386963e-10f;
+}
+
+inline float2 PointInHexagon(unsigned int* seed)
+{
+    float2 hexPoints[3] = { float2(-1.0f, 0.0f), float2(0.5f, 0.866f), float2(0.5f, -0.866f) };
+    int x = (int)floor(GetRandomFloat(seed) * 3.0f);
+    float2 v1 = hexPoints[x];
+    float2 v2 = hexPoints[(x + 1) % 3];
+    float p1 = GetRandomFloat(seed);
+    float p2 = GetRandomFloat(seed);
+    return float2(p1 * v1.x + p2 * v2.x, p1 * v1.y + p2 * v2.y);
+}
+
+inline unsigned int HashUInt32(unsigned int x)
+{
+    return 1103515245 * x + 12345;
+}
+
+inline void RayGeneration
+(
+    uint path_idx,
+    // Input
+    uint width,
+    uint height,
+    Camera const& camera,
+    uint sample_idx,
+    uint samples_per_launch,
+    float4 const* radiance,
+    float const*  luminance_sq_sums,
+    uint const*   pixel_sample_counts,
+    KernelOptions const& options,
+    // Output
+    Ray*    rays,
+    std::atomic<uint>* ray_counter,
+    uint*   pixel_indices,
+    float3* throughputs,
+    float3* diffuse_albedo,
+    float*  depth_buffer,
+    float3* normal_buffer,
+    float2* velocity_buffer
+)
+{
+    uint pixel_idx = path_idx / samples_per_launch;
+
+    // The samples of a pixel are neighbours in the ray buffer
+    uint ray_idx = path_idx;
+    if (options.adaptive_sampling_threshold > 0.0f)
+    {
+        // The converged pixels spawn no rays, the others are packed to the front of the ray buffer
+        if (IsPixelConverged(Luminance(radiance[pixel_idx].Xyz()), luminance_sq_sums[pixel_idx],
+            pixel_sample_counts[pixel_idx], options.adaptive_sampling_threshold))
+        {
+            return;
+        }
+
+        ray_idx = (*ray_counter)++;
+    }
+    uint pixel_x = pixel_idx % width;
+    uint pixel_y = pixel_idx / width;
+
+    float inv_width = 1.0f / (float)(width);
+    float inv_height = 1.0f / (float)(height);
+
+    sample_idx += path_idx % samples_per_launch;
+    unsigned int seed = pixel_idx + HashUInt32(sample_idx);
+
+    float x = (pixel_x + GetRandomFloat(&seed)) * inv_width;
+    float y = (pixel_y + GetRandomFloat(&seed)) * inv_height;
+
+    float angle = tan(0.5f * camera.fov);
+    x = (x * 2.0f - 1.0f) * angle * camera.aspect_ratio;
+    y = (y * 2.0f - 1.0f) * angle;
+
+    float3 right = cross(camera.front, camera.up);
+    float3 dir = normalize(x * right + y * camera.up + camera.front);
+
+    // Simple Depth of Field
+    float3 point_aimed = camera.position + camera.focus_distance * dir;
+    float2 dof_dir = PointInHexagon(&seed);
+    float r = camera.aperture;
+    float3 new_pos = camera.position + dof_dir.x * r * right + dof_dir.y * r * camera.up;
+
+    Ray ray;
+    ray.origin = float4(new_pos, 0.0f);
+    ray.direction = float4(normalize(point_aimed - new_pos), MAX_RENDER_DIST);
+
+    rays[ray_idx] = ray;
+    pixel_indices[ray_idx] = path_idx;
+    throughputs[path_idx] = float3(1.0f, 1.0f, 1.0f);
+
+    // The AOVs come from the first sample of the pixel
+    if (path_idx % samples_per_launch == 0)
+    {
+        diffuse_albedo[pixel_idx] = float3(0.0f, 0.0f, 0.0f);
+        depth_buffer[pixel_idx] = MAX_RENDER_DIST;
+        normal_buffer[pixel_idx] = float3(0.0f, 0.0f, 0.0f);
+        velocity_buffer[pixel_idx] = float2(0.0f, 0.0f);
+    }
+}
+
+//
+// trace_bvh.cl
+//
+
+// The ray in the frame of the watertight triangle test, see "Watertight Ray/Triangle Intersection".
+// The axes are rotated so the largest direction component is z and the ray is sheared to point along it
+struct WatertightRay
+{
+    float3 origin;
+    // x, y - shear of the direction, z - inverse of its z component
+    float3 shear;
+    int kz;
+};
+
+inline float3 PermuteAxes(float3 const& v, int kz)
+{
+    return kz == 0 ? float3(v.y, v.z, v.x) : (kz == 1 ? float3(v.z, v.x, v.y) : v);
+}
+
+inline WatertightRay SetupWatertightRay(float3 const& origin, float3 const& direction)
+{
+    float3 abs_direction(fabs(direction.x), fabs(direction.y), fabs(direction.z));
+    int kz = abs_direction.x > abs_direction.y ?
+        (abs_direction.x > abs_direction.z ? 0 : 2) : (abs_direction.y > abs_direction.z ? 1 : 2);
+    float3 permuted_direction = PermuteAxes(direction, kz);
+    float inv_direction_z = 1.0f / permuted_direction.z;
+
+    WatertightRay wt_ray;
+    wt_ray.origin = PermuteAxes(origin, kz);
+    wt_ray.shear = float3(permuted_direction.x * inv_direction_z, permuted_direction.y * inv_direction_z, inv_direction_z);
+    wt_ray.kz = kz;
+    return wt_ray;
+}
+
+// Two-sided, the edges shared by the triangles are evaluated from the same sheared vertices,
+// so there are no cracks between them
+inline bool RayTriangle(WatertightRay const& wt_ray, float t_min, float t_max, RTTriangle const* triangle,
+    float2* bc, float* out_t)
+{
+    float3 a = PermuteAxes(triangle->position1, wt_ray.kz) - wt_ray.origin;
+    float3 b = PermuteAxes(triangle->position2, wt_ray.kz) - wt_ray.origin;
+    float3 c = PermuteAxes(triangle->position3, wt_ray.kz) - wt_ray.origin;
+
+    float ax = a.x - wt_ray.shear.x * a.z;
+    float ay = a.y - wt_ray.shear.y * a.z;
+    float bx = b.x - wt_ray.shear.x * b.z;
+    float by = b.y - wt_ray.shear.y * b.z;
+    float cx = c.x - wt_ray.shear.x * c.z;
+    float cy = c.y - wt_ray.shear.y * c.z;
+
+    // Scaled barycentrics
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+    {
+        return false;
+    }
+
+    // Ray is parallel to plane
+    float det = u + v + w;
+    if (det == 0.0f)
+    {
+        return false;
+    }
+
+    float inv_det = 1.0f / det;
+    float t = (u * a.z + v * b.z + w * c.z) * wt_ray.shear.z * inv_det;
+
+    if (t < t_min || t > t_max)
+    {
+        return false;
+    }
+
+    // Intersection is found
+    *bc = float2(v * inv_det, w * inv_det);
+    *out_t = t;
+
+    return true;
+}
+
+inline float max3(float3 const& val)
+{
+    return max(max(val.x, val.y), val.z);
+}
+
+inline float min3(float3 const& val)
+{
+    return min(min(val.x, val.y), val.z);
+}
+
+inline bool RayBounds(Bounds3 const& bounds, float3 const& ray_origin, float3 const& ray_inv_dir, float t_min, float t_max)
+{
+    float3 t0 = (bounds.min - ray_origin) * ray_inv_dir;
+    float3 t1 = (bounds.max - ray_origin) * ray_inv_dir;
+
+    float tmin = max(max3(min(t0, t1)), t_min);
+    float tmax = min(min3(max(t0, t1)), t_max);
+
+    return (tmax >= tmin);
+}
+
+inline void SetupRayDirection(float3 const& direction, float3* inv_dir, int* sign)
+{
+    *inv_dir = float3(1.0f, 1.0f, 1.0f) / direction;
+    sign[0] = inv_dir->x < 0;
+    sign[1] = inv_dir->y < 0;
+    sign[2] = inv_dir->z < 0;
+}
+
+// Returns true if any hit is found, stops at the first one if closest_hit is false.
+// primitive_indices is nullptr if the leaves index the triangles directly,
+// instances is nullptr if the BVH has no top level, the traversal work is counted if stats is not nullptr
+inline bool TraceBvh(Ray ray, RTTriangle const* triangles, LinearBVHNode const* nodes,
+    uint const* primitive_indices, Instance const* instances, bool closest_hit, Hit* hit,
+    TraversalStats* stats = nullptr)
+{
+    float3 world_origin = ray.origin.Xyz();
+    float3 world_direction = ray.direction.Xyz();
+    float3 ray_origin = world_origin;
+    float3 ray_inv_dir;
+    int ray_sign[3];
+    SetupRayDirection(world_direction, &ray_inv_dir, ray_sign);
+    WatertightRay wt_ray = SetupWatertightRay(world_origin, world_direction);
+
+    // The bottom level BVHs are traversed in the object space of the instance
+    uint instance_id = INVALID_ID;
+    // Stack size at the moment of entering the bottom level BVH
+    int instance_stack_base = 0;
+
+    hit->primitive_id = INVALID_ID;
+    hit->instance_id = INVALID_ID;
+
+    float t;
+    // Follow ray through BVH nodes to find primitive intersections
+    int toVisitOffset = 0;
+    int currentNodeIndex = 0;
+    int nodesToVisit[64];
+
+    while (true)
+    {
+        LinearBVHNode const& node = nodes[currentNodeIndex];
+        if (stats)
+        {
+            stats->node_visits++;
+        }
+
+        if (RayBounds(node.bounds, ray_origin, ray_inv_dir, ray.origin.w, ray.direction.w))
+        {
+            int num_primitives = node.num_primitives_axis >> 16;
+            // Leaf node
+            if (num_primitives > 0)
+            {
+                if (instances && instance_id == INVALID_ID)
+                {
+                    // Top level leaf, continue with the bottom level BVH of the instance
+                    instance_id = node.offset;
+                    Instance const& instance = instances[instance_id];
+                    ray_origin = TransformPoint(instance.world_to_object[0],
+                        instance.world_to_object[1], instance.world_to_object[2], world_origin);
+                    float3 direction = TransformVector(instance.world_to_object[0],
+                        instance.world_to_object[1], instance.world_to_object[2], world_direction);
+                    ray.origin = float4(ray_origin, ray.origin.w);
+                    ray.direction = float4(direction, ray.direction.w);
+                    SetupRayDirection(direction, &ray_inv_dir, ray_sign);
+                    wt_ray = SetupWatertightRay(ray_origin, direction);
+                    instance_stack_base = toVisitOffset;
+                    currentNodeIndex = instance.node_offset;
+                    continue;
+                }
+
+                // Intersect ray with primitives in leaf BVH node
+                for (int i = 0; i < num_primitives; ++i)
+                {
+                    uint primitive_id = primitive_indices ? primitive_indices[node.offset + i] : node.offset + i;
+                    if (stats)
+                    {
+                        stats->triangle_tests++;
+                    }
+                    if (RayTriangle(wt_ray, ray.origin.w, ray.direction.w, &triangles[primitive_id], &hit->bc, &t))
+                    {
+                        hit->primitive_id = primitive_id;
+                        hit->instance_id = instance_id;
+                        // Set ray t_max, the affine transforms keep the ray parameter
+                        ray.direction.w = t;
+
+                        if (!closest_hit)
+                        {
+                            return true;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                // Put far BVH node on _nodesToVisit_ stack, advance to near node
+                if (ray_sign[node.num_primitives_axis & 0xFFFF])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.offset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.offset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+
+                continue;
+            }
+        }
+
+        if (instance_id != INVALID_ID && toVisitOffset == instance_stack_base)
+        {
+            // The bottom level BVH is done, go back to the top level
+            instance_id = INVALID_ID;
+            ray_origin = world_origin;
+            ray.origin = float4(world_origin, ray.origin.w);
+            ray.direction = float4(world_direction, ray.direction.w);
+            SetupRayDirection(world_direction, &ray_inv_dir, ray_sign);
+            wt_ray = SetupWatertightRay(world_origin, world_direction);
+        }
+
+        if (toVisitOffset == 0)
+        {
+            break;
+        }
+
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+
+    return hit->primitive_id != INVALID_ID;
+}
+
+// Child bounds and primitive counts of a wide node in fixed arrays
+template <int kWidth>
+struct WideChildren
+{
+    float min_x[kWidth];
+    float min_y[kWidth];
+    float min_z[kWidth];
+    float max_x[kWidth];
+    float max_y[kWidth];
+    float max_z[kWidth];
+    uint counts[kWidth];
+};
+
+template <typename WideNode, int kWidth>
+inline void DecodeWideChildren(WideNode const& node, WideChildren<kWidth>* children)
+{
+    for (int i = 0; i < kWidth; ++i)
+    {
+        children->min_x[i] = node.child_min_x[i];
+        children->min_y[i] = node.child_min_y[i];
+        children->min_z[i] = node.child_min_z[i];
+        children->max_x[i] = node.child_max_x[i];
+        children->max_y[i] = node.child_max_y[i];
+        children->max_z[i] = node.child_max_z[i];
+        children->counts[i] = node.child_counts[i];
+    }
+}
+
+// The compressed child bounds are decoded in the frame of the node
+template <typename CompressedNode, int kWidth>
+inline void DecodeCompressedChildren(CompressedNode const& node, WideChildren<kWidth>* children)
+{
+    float scale_x = as_float((node.scale_exponents & 0xFF) << 23);
+    float scale_y = as_float(((node.scale_exponents >> 8) & 0xFF) << 23);
+    float scale_z = as_float(((node.scale_exponents >> 16) & 0xFF) << 23);
+
+    for (int i = 0; i < kWidth; ++i)
+    {
+        uint word = i >> 2;
+        uint shift = (i & 3) << 3;
+        children->min_x[i] = node.origin_x + scale_x * float((node.child_min_x[word] >> shift) & 0xFF);
+        children->min_y[i] = node.origin_y + scale_y * float((node.child_min_y[word] >> shift) & 0xFF);
+        children->min_z[i] = node.origin_z + scale_z * float((node.child_min_z[word] >> shift) & 0xFF);
+        children->max_x[i] = node.origin_x + scale_x * float((node.child_max_x[word] >> shift) & 0xFF);
+        children->max_y[i] = node.origin_y + scale_y * float((node.child_max_y[word] >> shift) & 0xFF);
+        children->max_z[i] = node.origin_z + scale_z * float((node.child_max_z[word] >> shift) & 0xFF);
+        children->counts[i] = (node.child_counts[i >> 1] >> ((i & 1) << 4)) & 0xFFFF;
+    }
+}
+
+inline void DecodeWideChildren(CompressedBVH4Node const& node, WideChildren<4>* children)
+{
+    DecodeCompressedChildren(node, children);
+}
+
+inline void DecodeWideChildren(CompressedBVH8Node const& node, WideChildren<8>* children)
+{
+    DecodeCompressedChildren(node, children);
+}
+
+// Same as TraceBvh for the wide nodes of a single level BVH, all children of a node
+// are decoded and tested in branch-free loops and the hit ones are visited from the nearest
+template <typename WideNode>
+inline bool TraceWideBvh(Ray ray, RTTriangle const* triangles, WideNode const* nodes,
+    uint const* primitive_indices, bool closest_hit, Hit* hit, TraversalStats* stats = nullptr)
+{
+    constexpr int kWidth = sizeof(WideNode::child_offsets) / sizeof(uint);
+    // Up to kWidth - 1 children are pushed per visited node
+    constexpr int kStackSize = kWidth * 16;
+
+    float3 ray_origin = ray.origin.Xyz();
+    float3 ray_inv_dir;
+    int ray_sign[3];
+    SetupRayDirection(ray.direction.Xyz(), &ray_inv_dir, ray_sign);
+    WatertightRay wt_ray = SetupWatertightRay(ray_origin, ray.direction.Xyz());
+
+    hit->primitive_id = INVALID_ID;
+    hit->instance_id = INVALID_ID;
+
+    float t;
+    int toVisitOffset = 0;
+    uint currentNodeIndex = 0;
+    uint nodesToVisit[kStackSize];
+
+    while (true)
+    {
+        WideNode const& node = nodes[currentNodeIndex];
+        if (stats)
+        {
+            stats->node_visits++;
+        }
+
+        WideChildren<kWidth> children;
+        DecodeWideChildren(node, &children);
+
+        // Near and far planes by the ray direction, so the inverted bounds of the empty slots are never hit
+        float const* near_x = ray_sign[0] ? children.max_x : children.min_x;
+        float const* near_y = ray_sign[1] ? children.max_y : children.min_y;
+        float const* near_z = ray_sign[2] ? children.max_z : children.min_z;
+        float const* far_x = ray_sign[0] ? children.min_x : children.max_x;
+        float const* far_y = ray_sign[1] ? children.min_y : children.max_y;
+        float const* far_z = ray_sign[2] ? children.min_z : children.max_z;
+
+        float tmin[kWidth];
+        float tmax[kWidth];
+        for (int i = 0; i < kWidth; ++i)
+        {
+            tmin[i] = max(max((near_x[i] - ray_origin.x) * ray_inv_dir.x, (near_y[i] - ray_origin.y) * ray_inv_dir.y),
+                max((near_z[i] - ray_origin.z) * ray_inv_dir.z, ray.origin.w));
+            tmax[i] = min(min((far_x[i] - ray_origin.x) * ray_inv_dir.x, (far_y[i] - ray_origin.y) * ray_inv_dir.y),
+                min((far_z[i] - ray_origin.z) * ray_inv_dir.z, ray.direction.w));
+        }
+
+        uint hit_mask = 0;
+        for (int i = 0; i < kWidth; ++i)
+        {
+            hit_mask |= uint(tmin[i] <= tmax[i]) << i;
+        }
+
+        // Interior children sorted from the farthest one
+        float child_distances[kWidth];
+        uint child_nodes[kWidth];
+        int num_hit_children = 0;
+
+        for (int i = 0; i < kWidth; ++i)
+        {
+            if ((hit_mask & (1u << i)) == 0)
+            {
+                continue;
+            }
+
+            uint num_primitives = children.counts[i];
+            uint offset = node.child_offsets[i];
+            // Leaf child
+            if (num_primitives > 0)
+            {
+                for (uint j = 0; j < num_primitives; ++j)
+                {
+                    uint primitive_id = primitive_indices ? primitive_indices[offset + j] : offset + j;
+                    if (stats)
+                    {
+                        stats->triangle_tests++;
+                    }
+                    if (RayTriangle(wt_ray, ray.origin.w, ray.direction.w, &triangles[primitive_id], &hit->bc, &t))
+                    {
+                        hit->primitive_id = primitive_id;
+                        // Set ray t_max
+                        ray.direction.w = t;
+
+                        if (!closest_hit)
+                        {
+                            return true;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                int j = num_hit_children++;
+                for (; j > 0 && child_distances[j - 1] < tmin[i]; --j)
+                {
+                    child_distances[j] = child_distances[j - 1];
+                    child_nodes[j] = child_nodes[j - 1];
+                }
+
+                child_distances[j] = tmin[i];
+                child_nodes[j] = offset;
+            }
+        }
+
+        // The nearest child goes last and is visited next,
+        // the children behind the hits found in the leaves are skipped
+        for (int i = 0; i < num_hit_children; ++i)
+        {
+            if (child_distances[i] <= ray.direction.w)
+            {
+                nodesToVisit[toVisitOffset++] = child_nodes[i];
+            }
+        }
+
+        if (toVisitOffset == 0)
+        {
+            break;
+        }
+
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+
+    return hit->primitive_id != INVALID_ID;
+}
+
+//
+// aov.cl
+//
+
+inline float2 ProjectScreen(float3 const& position, Camera const& camera)
+{
+    float3 d = normalize(position - camera.position);
+
+    float3 ipd = d / dot(camera.front, d);
+    float angle = tan(0.5f * camera.fov);
+
+    float3 right = cross(camera.front, camera.up);
+    float u = dot(right, ipd) / (angle * camera.aspect_ratio);
+    float v = dot(camera.up, ipd) / (angle);
+
+    return float2(u * 0.5f + 0.5f, v * 0.5f + 0.5f);
+}
+
+inline float3 InterpolatePosition(Triangle const& triangle, float2 bc)
+{
+    return InterpolateAttributes(triangle.v1.position,
+        triangle.v2.position, triangle.v3.position, bc);
+}
+
+inline float3 GeometryNormal(Triangle const& triangle)
+{
+    return normalize(cross(triangle.v2.position - triangle.v1.position, triangle.v3.position - triangle.v1.position));
+}
+
+inline float2 InterpolateTexcoord(Triangle const& triangle, float2 bc)
+{
+    return InterpolateAttributes2(float2(triangle.v1.texcoord.x, triangle.v1.texcoord.y),
+        float2(triangle.v2.texcoord.x, triangle.v2.texcoord.y),
+        float2(triangle.v3.texcoord.x, triangle.v3.texcoord.y), bc);
+}
+
+inline float3 InterpolateNormal(Triangle const& triangle, float2 bc)
+{
+    return normalize(InterpolateAttributes(triangle.v1.normal,
+        triangle.v2.normal, triangle.v3.normal, bc));
+}
+
+inline void GenerateAOV
+(
+    uint ray_idx,
+    // Input
+    Ray const*            rays,
+    uint const*           pixel_indices,
+    Hit const*            hits,
+    IndexedTriangle*      indexed_triangles,
+    float4*               vertex_positions,
+    uint*                 vertex_texcoords,
+    Instance const*       instances,
+    PackedMaterial const* materials,
+    Texture*              textures,
+    uint*                 texture_data,
+    Camera const&         camera,
+    Camera const&         prev_camera,
+    uint                  samples_per_launch,
+    TraversalStats const* traversal_stats,
+    // Output
+    float3* diffuse_albedo,
+    float*  depth_buffer,
+    float3* normal_buffer,
+    float2* velocity_buffer,
+    TraversalStats* traversal_heatmap
+)
+{
+    // The AOVs come from the first sample of the pixel
+    uint path_idx = pixel_indices[ray_idx];
+    if (path_idx % samples_per_launch != 0)
+    {
+        return;
+    }
+
+    uint pixel_idx = path_idx / samples_per_launch;
+
+    // BVH_STATISTICS
+    if (traversal_heatmap)
+    {
+        traversal_heatmap[pixel_idx] = traversal_stats[ray_idx];
+    }
+
+    Hit hit = hits[ray_idx];
+
+    if (hit.primitive_id == INVALID_ID)
+    {
+        return;
+    }
+
+    Ray ray = rays[ray_idx];
+
+    Triangle triangle = FetchTriangle(indexed_triangles, vertex_positions, vertex_texcoords, hit.primitive_id);
+    if (hit.instance_id != INVALID_ID)
+    {
+        triangle = TransformTriangle(instances[hit.instance_id], triangle);
+    }
+
+    float3 position = InterpolatePosition(triangle, hit.bc);
+    float2 texcoord = InterpolateTexcoord(triangle, hit.bc);
+    float3 normal = InterpolateNormal(triangle, hit.bc);
+
+    PackedMaterial packed_material = materials[triangle.mtlIndex];
+    Material material;
+    ApplyTextures(packed_material, &material, texcoord, textures, texture_data);
+
+    diffuse_albedo[pixel_idx] = material.diffuse_albedo;
+    depth_buffer[pixel_idx] = length(ray.origin.Xyz() - position);
+    normal_buffer[pixel_idx] = normal;
+    velocity_buffer[pixel_idx] = ProjectScreen(position, camera) - ProjectScreen(position, prev_camera);
+}
+
+//
+// miss.cl
+//
+
+// Bilinear filtering with repeat addressing, same as the CL sampler
+inline float3 ReadImageLinear(Image const& image, float2 coords)
+{
+    float const* data = reinterpret_cast<float const*>(image.data.data());
+    int width = (int)image.width;
+    int height = (int)image.height;
+
+    float u = coords.x * width - 0.5f;
+    float v = coords.y * height - 0.5f;
+    int x0 = (int)floor(u);
+    int y0 = (int)floor(v);
+    float fx = u - x0;
+    float fy = v - y0;
+
+    auto texel = [&](int x, int y)
+    {
+        x = ((x % width) + width) % width;
+        y = ((y % height) + height) % height;
+        std::size_t idx = ((std::size_t)y * width + x) * 4;
+        return float3(data[idx], data[idx + 1], data[idx + 2]);
+    };
+
+    float3 top = mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+    float3 bottom = mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+    return mix(top, bottom, fy);
+}
+
+inline float3 SampleSky(float3 const& dir, Image const& tex)
+{
+    // Convert (normalized) dir to spherical coordinates.
+    float2 coords = float2(atan2(dir.x, dir.y) + PI, acos(clamp(dir.z, -1.0f, 1.0f)));
+    coords.x = coords.x < 0.0f ? coords.x + TWO_PI : coords.x;
+    coords.x *= INV_TWO_PI;
+    coords.y *= INV_PI;
+
+    return ReadImageLinear(tex, coords);
+}
+
+inline void Miss
+(
+    uint ray_idx,
+    // Input
+    Ray const*    rays,
+    Hit const*    hits,
+    uint const*   pixel_indices,
+    float3 const* throughputs,
+    Image const&  tex,
+    KernelOptions const& options,
+    // Output
+    float4* result_radiance
+)
+{
+    Hit hit = hits[ray_idx];
+
+    if (hit.primitive_id == INVALID_ID)
+    {
+        Ray ray = rays[ray_idx];
+        uint path_idx = pixel_indices[ray_idx];
+        float3 throughput = throughputs[path_idx];
+
+        float3 sky_radiance = options.enable_white_furnace ? float3(0.5f) : SampleSky(ray.direction.Xyz(), tex);
+        float3 radiance = sky_radiance * throughput;
+
+        float4& result = result_radiance[path_idx];
+        result.x += radiance.x;
+        result.y += radiance.y;
+        result.z += radiance.z;
+    }
+}
+
+//
+// hit_surface.cl
+//
+
+inline void AddRadiance(float4& result, float3 const& radiance)
+{
+    result.x += radiance.x;
+    result.y += radiance.y;
+    result.z += radiance.z;
+}
+
+inline void HitSurface
+(
+    uint incoming_ray_idx,
+    // Input
+    Ray const*            incoming_rays,
+    uint const*           incoming_pixel_indices,
+    Hit const*            hits,
+    IndexedTriangle*      indexed_triangles,
+    float4*               vertex_positions,
+    uint*                 vertex_texcoords,
+    Instance const*       instances,
+    Light*                analytic_lights,
+    EmissiveAliasEntry*   emissive_alias_table,
+    PackedMaterial*       materials,
+    Texture*              textures,
+    uint*                 texture_data,
+    uint bounce,
+    uint width,
+    uint sample_idx,
+    uint samples_per_launch,
+    SceneInfo const& scene_info,
+    BlueNoiseBuffers const& blue_noise,
+    KernelOptions const& options,
+    // Output
+    float3*            throughputs,
+    float*             bxdf_pdfs,
+    Ray*               outgoing_rays,
+    std::atomic<uint>* outgoing_ray_counter,
+    uint*              outgoing_pixel_indices,
+    Ray*               shadow_rays,
+    std::atomic<uint>* shadow_ray_counter,
+    uint*              shadow_pixel_indices,
+    float3*            direct_light_samples,
+    float4*            result_radiance
+)
+{
+    Hit hit = hits[incoming_ray_idx];
+
+    if (hit.primitive_id == INVALID_ID)
+    {
+        return;
+    }
+
+    Ray incoming_ray = incoming_rays[incoming_ray_idx];
+    float3 incoming = -incoming_ray.direction.Xyz();
+
+    uint path_idx = incoming_pixel_indices[incoming_ray_idx];
+    uint pixel_idx = path_idx / samples_per_launch;
+    sample_idx += path_idx % samples_per_launch;
+
+    int x = pixel_idx % width;
+    int y = pixel_idx / width;
+
+    Triangle triangle = FetchTriangle(indexed_triangles, vertex_positions, vertex_texcoords, hit.primitive_id);
+    if (hit.instance_id != INVALID_ID)
+    {
+        triangle = TransformTriangle(instances[hit.instance_id], triangle);
+    }
+
+    float3 position = InterpolatePosition(triangle, hit.bc);
+    float3 geometry_normal = GeometryNormal(triangle);
+    float2 texcoord = InterpolateTexcoord(triangle, hit.bc);
+    float3 normal = InterpolateNormal(triangle, hit.bc);
+
+    // The watertight test hits both sides, shade the side the ray came from
+    if (dot(geometry_normal, incoming) < 0.0f)
+    {
+        geometry_normal = -geometry_normal;
+        normal = -normal;
+    }
+
+    PackedMaterial packed_material = materials[triangle.mtlIndex];
+    Material material;
+    ApplyTextures(packed_material, &material, texcoord, textures, texture_data);
+
+    float3 hit_throughput = throughputs[path_idx];
+
+    float emissive_selection_pdf = options.enable_white_furnace ? 0.0f : EmissiveLight_SelectionPdf(scene_info);
+
+    if (!options.enable_white_furnace && dot(material.emission, float3(1.0f, 1.0f, 1.0f)) > 0.0f)
+    {
+        // The light sampling of the previous bounce may have reached the same point
+        float mis_weight = 1.0f;
+        if (bounce > 0 && emissive_selection_pdf > 0.0f)
+        {
+            float bxdf_pdf = bxdf_pdfs[path_idx];
+            float3 to_hit = position - incoming_ray.origin.Xyz();
+            float light_pdf = EmissiveLight_Pdf(scene_info, packed_material, dot(to_hit, to_hit), fabs(dot(geometry_normal, incoming)));
+            // 0 - the path came through a delta layer
+            mis_weight = bxdf_pdf > 0.0f ? PowerHeuristic(bxdf_pdf, light_pdf) : 1.0f;
+        }
+
+        AddRadiance(result_radiance[path_idx], hit_throughput * material.emission * mis_weight);
+    }
+
+    // Direct lighting
+    {
+        float s_light = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT, options.enable_blue_noise, blue_noise);
+        float3 outgoing;
+        float pdf;
+        float3 light_radiance;
+        float mis_weight = 1.0f;
+        float shadow_ray_offset = 0.0f;
+
+        // The sample may round up to 1
+        if (s_light < emissive_selection_pdf || emissive_selection_pdf == 1.0f)
+        {
+            float2 s_triangle;
+            s_triangle.x = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT_U, options.enable_blue_noise, blue_noise);
+            s_triangle.y = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_LIGHT_V, options.enable_blue_noise, blue_noise);
+            float light_pdf;
+            light_radiance = EmissiveLight_Sample(emissive_alias_table, indexed_triangles, vertex_positions,
+                vertex_texcoords, materials, textures, texture_data, scene_info, position,
+                s_light / emissive_selection_pdf, s_triangle, &outgoing, &pdf, &light_pdf);
+
+            // The BxDF sampling reaches the emissive triangles too, the delta layers only by it.
+            // The rays of the last bounce are not traced, the light sampling takes the full weight there
+            if (bounce < options.max_bounces)
+            {
+                float bxdf_pdf = EvaluateBxdfPdf(material, normal, incoming, normalize(outgoing));
+                mis_weight = bxdf_pdf > 0.0f ? PowerHeuristic(light_pdf, bxdf_pdf) : 0.0f;
+            }
+
+            // Don't hit the sampled triangle
+            shadow_ray_offset = 2.0f * EPS;
+        }
+        else
+        {
+            s_light = (s_light - emissive_selection_pdf) / (1.0f - emissive_selection_pdf);
+            light_radiance = Light_Sample(analytic_lights, scene_info, position, normal, s_light, &outgoing, &pdf);
+            pdf *= 1.0f - emissive_selection_pdf;
+        }
+
+        float distance_to_light = length(outgoing);
+        outgoing = normalize(outgoing);
+
+        float3 brdf = EvaluateMaterial(material, normal, incoming, outgoing);
+        float3 light_sample = light_radiance * hit_throughput * brdf / pdf * max(dot(outgoing, normal), 0.0f) * mis_weight;
+
+        bool spawn_shadow_ray = (pdf > 0.0f) && (dot(light_sample, light_sample) > 0.0f);
+
+        if (spawn_shadow_ray)
+        {
+            Ray shadow_ray;
+            shadow_ray.origin = float4(position + normal * EPS, 0.0f);
+            shadow_ray.direction = float4(outgoing, distance_to_light - shadow_ray_offset);
+
+            uint shadow_ray_idx = atomic_add(shadow_ray_counter, 1);
+
+            // Store to the memory
+            shadow_rays[shadow_ray_idx] = shadow_ray;
+            shadow_pixel_indices[shadow_ray_idx] = path_idx;
+            direct_light_samples[shadow_ray_idx] = light_sample;
+        }
+    }
+
+    // Indirect lighting
+    {
+        // Sample bxdf
+        float2 s;
+        s.x = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_U, options.enable_blue_noise, blue_noise);
+        s.y = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_V, options.enable_blue_noise, blue_noise);
+        float s1 = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_BXDF_LAYER, options.enable_blue_noise, blue_noise);
+
+        if (options.enable_white_furnace)
+        {
+            material.diffuse_albedo = to_float3(1.0f);
+            material.specular_albedo = to_float3(1.0f);
+        }
+
+        float pdf = 0.0f;
+        float3 throughput = 0.0f;
+        float3 outgoing;
+        float offset;
+        float3 bxdf = SampleBxdf(s1, s, material, normal, incoming, &outgoing, &pdf, &offset);
+
+        if (pdf > 0.0)
+        {
+            throughput = bxdf / pdf;
+        }
+
+        float3 path_throughput = hit_throughput * throughput;
+        bool spawn_outgoing_ray = (pdf > 0.0);
+
+        // The surviving paths carry the inverse probability to keep the estimate unbiased
+        if (spawn_outgoing_ray && options.russian_roulette_bounce > 0 && bounce >= options.russian_roulette_bounce)
+        {
+            float survival = RussianRouletteSurvival(path_throughput);
+            float s_rr = SampleRandom(x, y, sample_idx, bounce, SAMPLE_TYPE_RUSSIAN_ROULETTE, options.enable_blue_noise, blue_noise);
+            spawn_outgoing_ray = s_rr < survival;
+            if (spawn_outgoing_ray)
+            {
+                path_throughput /= survival;
+            }
+        }
+
+        throughputs[path_idx] = path_throughput;
+
+        if (spawn_outgoing_ray)
+        {
+            if (emissive_selection_pdf > 0.0f)
+            {
+                bxdf_pdfs[path_idx] = EvaluateBxdfPdf(material, normal, incoming, outgoing);
+            }
+
+            uint outgoing_ray_idx = atomic_add(outgoing_ray_counter, 1);
+
+            Ray outgoing_ray;
+            outgoing_ray.origin = float4(position + geometry_normal * EPS * offset, 0.0f);
+            outgoing_ray.direction = float4(outgoing, MAX_RENDER_DIST);
+
+            outgoing_rays[outgoing_ray_idx] = outgoing_ray;
+            outgoing_pixel_indices[outgoing_ray_idx] = path_idx;
+        }
+    }
+}
+
+//
+// accumulate_direct_samples.cl
+//
+
+inline void AccumulateDirectSamples
+(
+    uint ray_idx,
+    // Input
+    uint const*   shadow_hits,
+    uint const*   shadow_pixel_indices,
+    float3 const* direct_light_samples,
+    // Output
+    float4* result_radiance
+)
+{
+    uint shadow_hit = shadow_hits[ray_idx];
+
+    if (shadow_hit == INVALID_ID)
+    {
+        uint path_idx = shadow_pixel_indices[ray_idx];
+        AddRadiance(result_radiance[path_idx], direct_light_samples[ray_idx]);
+    }
+}
+
+//
+// accumulate_path_radiance.cl
+//
+
+inline void AccumulatePathRadiance
+(
+    uint pixel_idx,
+    // Input
+    uint samples_per_launch,
+    float4* path_radiance,
+    KernelOptions const& options,
+    // Output
+    float4* result_radiance,
+    float*  luminance_sq_sums,
+    uint*   pixel_sample_counts
+)
+{
+    bool adaptive_sampling = options.adaptive_sampling_threshold > 0.0f;
+
+    // Same test as the ray generation, the buffers it reads change only here
+    if (adaptive_sampling && IsPixelConverged(Luminance(result_radiance[pixel_idx].Xyz()), luminance_sq_sums[pixel_idx],
+        pixel_sample_counts[pixel_idx], options.adaptive_sampling_threshold))
+    {
+        return;
+    }
+
+    float3 radiance(0.0f);
+    float luminance_sq_sum = 0.0f;
+    for (uint sample_slot = 0; sample_slot < samples_per_launch; ++sample_slot)
+    {
+        uint path_idx = pixel_idx * samples_per_launch + sample_slot;
+        float3 sample_radiance = path_radiance[path_idx].Xyz();
+        radiance += sample_radiance;
+        float luminance = Luminance(sample_radiance);
+        luminance_sq_sum += luminance * luminance;
+        // The paths of the next launch start from zero
+        path_radiance[path_idx] = float4(0.0f);
+    }
+
+    if (adaptive_sampling)
+    {
+        luminance_sq_sums[pixel_idx] += luminance_sq_sum;
+        pixel_sample_counts[pixel_idx] += samples_per_launch;
+    }
+
+    if (options.enable_denoiser)
+    {
+        // The radiance is reset every frame, the denoiser takes the mean of the launch
+        radiance /= (float)samples_per_launch;
+    }
+
+    AddRadiance(result_radiance[pixel_idx], radiance);
+}
+
+//
+// denoiser.cl
+//
+
+inline void TemporalAccumulation
+(
+    uint pixel_idx,
+    uint width,
+    uint height,
+    float4*       radiance_buffer,
+    float4 const* prev_radiance_buffer,
+    float const*  depth,
+    float const*  prev_depth,
+    float2 const* motion_vectors
+)
+{
+    int x = pixel_idx % width;
+    int y = pixel_idx / width;
+
+    float depth_value = depth[pixel_idx];
+
+    if (depth_value == MAX_RENDER_DIST)
+    {
+        // Background
+        return;
+    }
+
+    float2 motion = motion_vectors[pixel_idx];
+    float2 prev_uv = float2((x + 0.5f) / width - motion.x, (y + 0.5f) / height - motion.y);
+    int prev_x = (int)(prev_uv.x * width);
+    int prev_y = (int)(prev_uv.y * height);
+
+    if (prev_x < 0 || prev_x >= (int)width || prev_y < 0 || prev_y >= (int)height)
+    {
+        return;
+    }
+
+    int prev_idx = prev_y * width + prev_x;
+    float prev_depth_value = prev_depth[prev_idx];
+
+    // Depth similarity test
+    if (fabs(depth_value - prev_depth_value) / depth_value > 0.1f)
+    {
+        return;
+    }
+
+    float3 current_radiance = radiance_buffer[pixel_idx].Xyz();
+    float3 prev_radiance = prev_radiance_buffer[prev_idx].Xyz();
+
+    radiance_buffer[pixel_idx] = float4(mix(current_radiance, prev_radiance, 0.9f), radiance_buffer[pixel_idx].w);
+}
+
+//
+// resolve_radiance.cl
+//
+
+// Blue - green - red ramp
+inline float3 HeatmapColor(float t)
+{
+    t = clamp(t, 0.0f, 1.0f);
+    return float3(clamp(2.0f * t - 1.0f, 0.0f, 1.0f), 1.0f - fabs(2.0f * t - 1.0f), clamp(1.0f - 2.0f * t, 0.0f, 1.0f));
+}
+
+inline void ResolveRadiance
+(
+    uint global_id,
+    uint aov_index,
+    float4 const* radiance,
+    float3 const* diffuse_albedo,
+    float const*  depth,
+    float3 const* normal,
+    float2 const* motion_vectors,
+    TraversalStats const* traversal_heatmap,
+    uint sample_count,
+    uint const* pixel_sample_counts,
+    KernelOptions const& options,
+    float4* result
+)
+{
+    if (aov_index == DIFFUSE_INDEX)
+    {
+        // Diffuse albedo
+        result[global_id] = float4(diffuse_albedo[global_id], 1.0f);
+    }
+    else if (aov_index == DEPTH_INDEX)
+    {
+        // Depth
+        float depth_value = depth[global_id] * 0.1f;
+        result[global_id] = float4(depth_value, depth_value, depth_value, 1.0f);
+    }
+    else if (aov_index == NORMAL_INDEX)
+    {
+        // Normal
+        float3 normal_value = normal[global_id] * 0.5f + 0.5f;
+        result[global_id] = float4(normal_value, 1.0f);
+    }
+    else if (aov_index == MOTION_VECTORS_INDEX)
+    {
+        // Motion vectors
+        result[global_id] = float4(motion_vectors[global_id].x, motion_vectors[global_id].y, 0.0f, 1.0f);
+    }
+    else if (aov_index == TRAVERSAL_HEATMAP_INDEX)
+    {
+        // Traversal work of the primary rays
+        TraversalStats stats = traversal_heatmap[global_id];
+        float cost = (float)(stats.node_visits + stats.triangle_tests);
+        result[global_id] = float4(HeatmapColor(cost / HEATMAP_MAX_TRAVERSAL_COST), 1.0f);
+    }
+    else
+    {
+        // Shaded color
+        float3 hdr = radiance[global_id].Xyz();
+
+        if (!options.enable_denoiser)
+        {
+            // The pixels stop taking samples at different counts with adaptive sampling
+            uint pixel_sample_count = options.adaptive_sampling_threshold > 0.0f ?
+                std::max(pixel_sample_counts[global_id], 1u) : sample_count;
+            hdr /= (float)pixel_sample_count;
+        }
+
+        float3 ldr = hdr / (hdr + 1.0f);
+        result[global_id] = float4(ldr, 1.0f);
+    }
+}
+
+} // namespace cpu
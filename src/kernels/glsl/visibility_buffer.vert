@@ -27,21 +27,21 @@
 layout (location = 0) uniform mat4 g_ViewProjection;
 layout (location = 0) out flat uint out_geometry_info;
 
-layout (binding = 1, std430) buffer TriangleBuffer
+layout (binding = 1, std430) buffer IndexedTriangleBuffer
 {
-    Triangle triangles[];
+    IndexedTriangle indexed_triangles[];
 };
 
+layout (binding = 0) uniform samplerBuffer vertex_positions;
+
 void main()
 {
     uint triangle_idx = gl_VertexID / 3;
-    Triangle triangle = triangles[triangle_idx];
+    IndexedTriangle triangle = indexed_triangles[triangle_idx];
 
-    int vertex_idx = (gl_VertexID % 3);
-    vec3 pos[3] = { triangle.v1.position.xyz,
-                    triangle.v2.position.xyz,
-                    triangle.v3.position.xyz };
+    uint vertex_indices[3] = { triangle.v1, triangle.v2, triangle.v3 };
+    vec3 position = texelFetch(vertex_positions, int(vertex_indices[gl_VertexID % 3])).xyz;
 
-    gl_Position = g_ViewProjection * vec4(pos[vertex_idx], 1.0);
+    gl_Position = g_ViewProjection * vec4(position, 1.0);
     out_geometry_info = triangle_idx;
 }
@@ -0,0 +1,524 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "lbvh.hpp"
+#include "utils/thread_pool.hpp"
+#include "kernels/common/constants.h"
+#include <chrono>
+#include <limits>
+#include <mutex>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+    constexpr auto kMaxPrimitivesInNode = 4u;
+    // Primitives sharing this number of top Morton bits form a treelet in HLBVH mode
+    constexpr auto kTreeletBits = 12u;
+    constexpr auto kRadixBits = 8u;
+    constexpr auto kRadixSize = 1u << kRadixBits;
+    constexpr std::size_t kPrimitivesGrainSize = 16384;
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    double ElapsedMs(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    int CountLeadingZeros(std::uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        return _BitScanReverse64(&index, value) ? 63 - (int)index : 64;
+#else
+        return value ? __builtin_clzll(value) : 64;
+#endif
+    }
+
+    // Inserts two zero bits after each of the 10 low bits
+    std::uint64_t ExpandBits10(std::uint64_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x30000ff;
+        v = (v | (v << 8)) & 0x300f00f;
+        v = (v | (v << 4)) & 0x30c30c3;
+        v = (v | (v << 2)) & 0x9249249;
+        return v;
+    }
+
+    // Inserts two zero bits after each of the 21 low bits
+    std::uint64_t ExpandBits21(std::uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | (v << 32)) & 0x1f00000000ffff;
+        v = (v | (v << 16)) & 0x1f0000ff0000ff;
+        v = (v | (v << 8)) & 0x100f00f00f00f00f;
+        v = (v | (v << 4)) & 0x10c30c30c30c30c3;
+        v = (v | (v << 2)) & 0x1249249249249249;
+        return v;
+    }
+
+    // Bit b of the code belongs to the axis 2 - b % 3, so the top bit splits along X
+    std::uint64_t EncodeMorton(float3 const& offset, unsigned int bits_per_axis)
+    {
+        float scale = float(1u << bits_per_axis);
+        std::uint64_t x = (std::uint64_t)clamp(offset.x * scale, 0.0f, scale - 1.0f);
+        std::uint64_t y = (std::uint64_t)clamp(offset.y * scale, 0.0f, scale - 1.0f);
+        std::uint64_t z = (std::uint64_t)clamp(offset.z * scale, 0.0f, scale - 1.0f);
+
+        if (bits_per_axis == 10)
+        {
+            return (ExpandBits10(x) << 2) | (ExpandBits10(y) << 1) | ExpandBits10(z);
+        }
+        else
+        {
+            return (ExpandBits21(x) << 2) | (ExpandBits21(y) << 1) | ExpandBits21(z);
+        }
+    }
+
+    // Stable LSD radix sort of the keys with the values, num_bits low bits of the keys are sorted
+    void RadixSort(ThreadPool& thread_pool, std::vector<std::uint64_t>& keys,
+        std::vector<std::uint32_t>& values, unsigned int num_bits)
+    {
+        std::size_t count = keys.size();
+        std::size_t num_chunks = std::max<std::size_t>(1, std::min<std::size_t>(
+            thread_pool.GetThreadCount() * 4, (count + kPrimitivesGrainSize - 1) / kPrimitivesGrainSize));
+        std::size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+
+        std::vector<std::uint64_t> temp_keys(count);
+        std::vector<std::uint32_t> temp_values(count);
+        std::vector<std::size_t> offsets(num_chunks * kRadixSize);
+
+        for (unsigned int shift = 0; shift < num_bits; shift += kRadixBits)
+        {
+            // Count the digits of each chunk
+            std::fill(offsets.begin(), offsets.end(), 0);
+            thread_pool.ParallelFor(num_chunks, [&](std::size_t begin, std::size_t end)
+                {
+                    for (std::size_t chunk = begin; chunk < end; ++chunk)
+                    {
+                        std::size_t* chunk_offsets = &offsets[chunk * kRadixSize];
+                        for (std::size_t i = chunk * chunk_size; i < std::min(count, (chunk + 1) * chunk_size); ++i)
+                        {
+                            chunk_offsets[(keys[i] >> shift) & (kRadixSize - 1)]++;
+                        }
+                    }
+                });
+
+            // Digit-major prefix sum keeps the chunks in order, so the sort is stable
+            std::size_t sum = 0;
+            for (unsigned int digit = 0; digit < kRadixSize; ++digit)
+            {
+                for (std::size_t chunk = 0; chunk < num_chunks; ++chunk)
+                {
+                    std::size_t digit_count = offsets[chunk * kRadixSize + digit];
+                    offsets[chunk * kRadixSize + digit] = sum;
+                    sum += digit_count;
+                }
+            }
+
+            thread_pool.ParallelFor(num_chunks, [&](std::size_t begin, std::size_t end)
+                {
+                    for (std::size_t chunk = begin; chunk < end; ++chunk)
+                    {
+                        std::size_t* chunk_offsets = &offsets[chunk * kRadixSize];
+                        for (std::size_t i = chunk * chunk_size; i < std::min(count, (chunk + 1) * chunk_size); ++i)
+                        {
+                            std::size_t dst = chunk_offsets[(keys[i] >> shift) & (kRadixSize - 1)]++;
+                            temp_keys[dst] = keys[i];
+                            temp_values[dst] = values[i];
+                        }
+                    }
+                });
+
+            keys.swap(temp_keys);
+            values.swap(temp_values);
+        }
+    }
+}
+
+LbvhBuilder::LbvhBuilder(BvhBuildOptions const& options)
+    : options_(options)
+    , thread_pool_(std::make_unique<ThreadPool>())
+{
+}
+
+LbvhBuilder::~LbvhBuilder() = default;
+
+void LbvhBuilder::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    std::cout << "Building Linear Bounding Volume Hierarchy for scene" << std::endl;
+
+    ThreadPool& thread_pool = *thread_pool_;
+    auto start_time = Clock::now();
+
+    assert(!triangles.empty());
+    std::uint32_t num_primitives = static_cast<std::uint32_t>(triangles.size());
+    unsigned int bits_per_axis = options_.use_63bit_morton_codes ? 21 : 10;
+    unsigned int key_bits = bits_per_axis * 3;
+
+    // Internal nodes go first, leaves are stored at [num_primitives - 1, 2 * num_primitives - 1)
+    std::vector<BuildNode> build_nodes(2 * num_primitives - 1);
+    std::uint32_t leaves_offset = num_primitives - 1;
+    std::vector<std::uint32_t> parents(build_nodes.size(), INVALID_ID);
+
+    // Compute bounds of the primitives and their centroids
+    std::vector<Bounds3> primitive_bounds(num_primitives);
+    std::vector<float3> centroids(num_primitives);
+    Bounds3 centroid_bounds;
+    std::mutex mutex;
+    thread_pool.ParallelFor(num_primitives, [&](std::size_t begin, std::size_t end)
+        {
+            Bounds3 local_centroid_bounds;
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                primitive_bounds[i] = triangles[i].GetBounds();
+                centroids[i] = primitive_bounds[i].min * 0.5f + primitive_bounds[i].max * 0.5f;
+                local_centroid_bounds = Union(local_centroid_bounds, centroids[i]);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            centroid_bounds = Union(centroid_bounds, local_centroid_bounds);
+        }, kPrimitivesGrainSize);
+
+    std::vector<std::uint64_t> morton_codes(num_primitives);
+    std::vector<std::uint32_t> primitive_order(num_primitives);
+    thread_pool.ParallelFor(num_primitives, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                morton_codes[i] = EncodeMorton(centroid_bounds.Offset(centroids[i]), bits_per_axis);
+                primitive_order[i] = static_cast<std::uint32_t>(i);
+            }
+        }, kPrimitivesGrainSize);
+
+    auto morton_time = Clock::now();
+
+    RadixSort(thread_pool, morton_codes, primitive_order, key_bits);
+
+    auto sort_time = Clock::now();
+
+    // The triangles are ordered by the Morton codes, initialize the leaves
+    thread_pool.ParallelFor(num_primitives, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                BuildNode& leaf = build_nodes[leaves_offset + i];
+                leaf.bounds = primitive_bounds[primitive_order[i]];
+                leaf.children[0] = leaf.children[1] = INVALID_ID;
+                leaf.first = static_cast<std::uint32_t>(i);
+                leaf.count = 1;
+                leaf.axis = 0;
+            }
+        }, kPrimitivesGrainSize);
+    triangle_order_ = std::move(primitive_order);
+
+    auto reorder_time = Clock::now();
+
+    // Length of the common prefix of the codes, the indices break the ties of equal codes
+    auto common_prefix = [&](std::int64_t i, std::int64_t j) -> int
+    {
+        if (j < 0 || j >= num_primitives)
+        {
+            return -1;
+        }
+
+        std::uint64_t difference = morton_codes[i] ^ morton_codes[j];
+        if (difference == 0)
+        {
+            return key_bits + CountLeadingZeros(std::uint64_t(i ^ j)) - 32;
+        }
+
+        return CountLeadingZeros(difference) - (64 - key_bits);
+    };
+
+    // Every internal node finds its range and split independently
+    thread_pool.ParallelFor(num_primitives - 1, [&](std::size_t begin, std::size_t end)
+        {
+            for (std::int64_t i = begin; i < (std::int64_t)end; ++i)
+            {
+                // Direction of the range
+                int d = common_prefix(i, i + 1) - common_prefix(i, i - 1) >= 0 ? 1 : -1;
+
+                // Upper bound of the range length
+                int min_prefix = common_prefix(i, i - d);
+                std::int64_t max_length = 2;
+                while (common_prefix(i, i + max_length * d) > min_prefix)
+                {
+                    max_length *= 2;
+                }
+
+                // Binary search for the other end of the range
+                std::int64_t length = 0;
+                for (std::int64_t t = max_length / 2; t >= 1; t /= 2)
+                {
+                    if (common_prefix(i, i + (length + t) * d) > min_prefix)
+                    {
+                        length += t;
+                    }
+                }
+                std::int64_t j = i + length * d;
+
+                // Binary search for the split position
+                int node_prefix = common_prefix(i, j);
+                std::int64_t split = 0;
+                std::int64_t step = length;
+                do
+                {
+                    step = (step + 1) / 2;
+                    if (common_prefix(i, i + (split + step) * d) > node_prefix)
+                    {
+                        split += step;
+                    }
+                } while (step > 1);
+                std::int64_t gamma = i + split * d + std::min(d, 0);
+
+                std::uint32_t first = static_cast<std::uint32_t>(std::min(i, j));
+                std::uint32_t last = static_cast<std::uint32_t>(std::max(i, j));
+
+                BuildNode& node = build_nodes[i];
+                node.children[0] = static_cast<std::uint32_t>(first == gamma ? leaves_offset + gamma : gamma);
+                node.children[1] = static_cast<std::uint32_t>(last == gamma + 1 ? leaves_offset + gamma + 1 : gamma + 1);
+                node.first = first;
+                node.count = last - first + 1;
+                // Axis of the first differing bit, the nodes of equal codes don't split any axis
+                node.axis = node_prefix < (int)key_bits ? 2 - (key_bits - 1 - node_prefix) % 3 : 0;
+
+                parents[node.children[0]] = static_cast<std::uint32_t>(i);
+                parents[node.children[1]] = static_cast<std::uint32_t>(i);
+            }
+        }, kPrimitivesGrainSize);
+
+    auto hierarchy_time = Clock::now();
+
+    // Propagate the bounds from the leaves, the second child to arrive at a node computes its bounds
+    {
+        std::unique_ptr<std::atomic<std::uint32_t>[]> arrivals(new std::atomic<std::uint32_t>[num_primitives]);
+        for (std::uint32_t i = 0; i < num_primitives; ++i)
+        {
+            arrivals[i].store(0, std::memory_order_relaxed);
+        }
+
+        thread_pool.ParallelFor(num_primitives, [&](std::size_t begin, std::size_t end)
+            {
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    std::uint32_t node_idx = parents[leaves_offset + i];
+                    while (node_idx != INVALID_ID && arrivals[node_idx].fetch_add(1, std::memory_order_acq_rel) == 1)
+                    {
+                        BuildNode& node = build_nodes[node_idx];
+                        node.bounds = Union(build_nodes[node.children[0]].bounds, build_nodes[node.children[1]].bounds);
+                        node_idx = parents[node_idx];
+                    }
+                }
+            }, kPrimitivesGrainSize);
+    }
+
+    auto bounds_time = Clock::now();
+
+    std::uint32_t root_idx = num_primitives > 1 ? 0 : leaves_offset;
+    if (options_.builder == BvhBuilder::kHlbvh && num_primitives > 1)
+    {
+        // Collect the roots of the subtrees whose primitives share the top Morton bits
+        std::vector<std::uint32_t> treelet_roots;
+        std::vector<std::uint32_t> stack = { root_idx };
+        while (!stack.empty())
+        {
+            std::uint32_t node_idx = stack.back();
+            stack.pop_back();
+
+            BuildNode const& node = build_nodes[node_idx];
+            unsigned int treelet_shift = key_bits - kTreeletBits;
+            if (node.count == 1 ||
+                (morton_codes[node.first] >> treelet_shift) == (morton_codes[node.first + node.count - 1] >> treelet_shift))
+            {
+                treelet_roots.push_back(node_idx);
+            }
+            else
+            {
+                stack.push_back(node.children[1]);
+                stack.push_back(node.children[0]);
+            }
+        }
+
+        root_idx = BuildUpperSah(build_nodes, treelet_roots, 0, treelet_roots.size());
+    }
+
+    auto upper_sah_time = Clock::now();
+
+    nodes_.clear();
+    nodes_.reserve(build_nodes.size());
+    FlattenTree(build_nodes, root_idx);
+
+    auto flatten_time = Clock::now();
+
+    std::cout << (options_.builder == BvhBuilder::kHlbvh ? "HLBVH" : "LBVH") << " created with "
+        << nodes_.size() << " nodes for " << num_primitives << " triangles ("
+        << float(nodes_.size() * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MB, "
+        << ElapsedMs(start_time, flatten_time) << " ms elapsed on " << thread_pool.GetThreadCount() << " threads)"
+        << std::endl;
+    std::cout << "LBVH build phases: morton codes " << ElapsedMs(start_time, morton_time)
+        << " ms, sort " << ElapsedMs(morton_time, sort_time)
+        << " ms, reorder " << ElapsedMs(sort_time, reorder_time)
+        << " ms, hierarchy " << ElapsedMs(reorder_time, hierarchy_time)
+        << " ms, bounds " << ElapsedMs(hierarchy_time, bounds_time)
+        << " ms, upper SAH " << ElapsedMs(bounds_time, upper_sah_time)
+        << " ms, flatten " << ElapsedMs(upper_sah_time, flatten_time) << " ms" << std::endl;
+}
+
+std::uint32_t LbvhBuilder::BuildUpperSah(std::vector<BuildNode>& build_nodes,
+    std::vector<std::uint32_t>& treelet_roots, std::size_t start, std::size_t end)
+{
+    assert(start < end);
+
+    if (end - start == 1)
+    {
+        return treelet_roots[start];
+    }
+
+    auto centroid = [&](std::uint32_t node_idx)
+    {
+        Bounds3 const& bounds = build_nodes[node_idx].bounds;
+        return bounds.min * 0.5f + bounds.max * 0.5f;
+    };
+
+    Bounds3 bounds;
+    Bounds3 centroidBounds;
+    for (std::size_t i = start; i < end; ++i)
+    {
+        bounds = Union(bounds, build_nodes[treelet_roots[i]].bounds);
+        centroidBounds = Union(centroidBounds, centroid(treelet_roots[i]));
+    }
+
+    unsigned int dim = centroidBounds.MaximumExtent();
+    std::size_t mid = (start + end) / 2;
+
+    if (centroidBounds.max[dim] > centroidBounds.min[dim])
+    {
+        // Partition the treelets using approximate SAH
+        const unsigned int nBuckets = 12;
+        struct BucketInfo
+        {
+            int count = 0;
+            Bounds3 bounds;
+        } buckets[nBuckets];
+
+        auto bucket_index = [&](std::uint32_t node_idx)
+        {
+            unsigned int b = static_cast<unsigned int>(nBuckets * centroidBounds.Offset(centroid(node_idx))[dim]);
+            return std::min(b, nBuckets - 1);
+        };
+
+        for (std::size_t i = start; i < end; ++i)
+        {
+            unsigned int b = bucket_index(treelet_roots[i]);
+            buckets[b].count++;
+            buckets[b].bounds = Union(buckets[b].bounds, build_nodes[treelet_roots[i]].bounds);
+        }
+
+        // Find bucket to split at that minimizes SAH metric
+        float minCost = std::numeric_limits<float>::max();
+        unsigned int minCostSplitBucket = 0;
+        for (unsigned int i = 0; i < nBuckets - 1; ++i)
+        {
+            Bounds3 b0, b1;
+            int count0 = 0, count1 = 0;
+            for (unsigned int j = 0; j <= i; ++j)
+            {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (unsigned int j = i + 1; j < nBuckets; ++j)
+            {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+
+            if (count0 == 0 || count1 == 0)
+            {
+                continue;
+            }
+
+            float cost = count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea();
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+
+        std::uint32_t* pmid = std::partition(&treelet_roots[start], &treelet_roots[end - 1] + 1,
+            [&](std::uint32_t node_idx)
+            {
+                return bucket_index(node_idx) <= minCostSplitBucket;
+            });
+        mid = pmid - &treelet_roots[0];
+    }
+
+    // All centroids in one bucket
+    if (mid == start || mid == end)
+    {
+        mid = (start + end) / 2;
+    }
+
+    std::uint32_t child0 = BuildUpperSah(build_nodes, treelet_roots, start, mid);
+    std::uint32_t child1 = BuildUpperSah(build_nodes, treelet_roots, mid, end);
+
+    BuildNode node;
+    node.bounds = Union(build_nodes[child0].bounds, build_nodes[child1].bounds);
+    node.children[0] = child0;
+    node.children[1] = child1;
+    node.first = 0;
+    node.count = 0;
+    node.axis = dim;
+    build_nodes.push_back(node);
+
+    return static_cast<std::uint32_t>(build_nodes.size() - 1);
+}
+
+unsigned int LbvhBuilder::FlattenTree(std::vector<BuildNode> const& build_nodes, std::uint32_t node_idx)
+{
+    BuildNode const& node = build_nodes[node_idx];
+    unsigned int linear_node_idx = static_cast<unsigned int>(nodes_.size());
+    nodes_.emplace_back();
+    nodes_[linear_node_idx].bounds = node.bounds;
+
+    // Small subtrees of the sorted primitives are collapsed to leaves
+    if (node.count > 0 && node.count <= kMaxPrimitivesInNode)
+    {
+        nodes_[linear_node_idx].offset = node.first;
+        nodes_[linear_node_idx].num_primitives_axis = node.count << 16;
+    }
+    else
+    {
+        nodes_[linear_node_idx].num_primitives_axis = node.axis;
+        FlattenTree(build_nodes, node.children[0]);
+        nodes_[linear_node_idx].offset = FlattenTree(build_nodes, node.children[1]);
+    }
+
+    return linear_node_idx;
+}
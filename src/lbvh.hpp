@@ -0,0 +1,71 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "acceleration_structure.hpp"
+#include <memory>
+
+class ThreadPool;
+
+// Linear BVH builder, trades traversal quality for the build time.
+// Triangles are sorted by the Morton codes of their centroids, the hierarchy is emitted
+// from the sorted codes in parallel (Karras 2012). HLBVH mode rebuilds the levels above
+// the treelets of the primitives sharing the top Morton bits with SAH.
+class LbvhBuilder : public AccelerationStructure
+{
+public:
+    LbvhBuilder(BvhBuildOptions const& options = {});
+    ~LbvhBuilder();
+
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    void Refit(std::vector<Triangle> const& triangles) override { RefitBvhNodes(nodes_, primitive_indices_, triangles); }
+    void SetRefittedNodes(std::vector<LinearBVHNode> const& nodes) override { nodes_ = nodes; }
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<std::uint32_t> const& GetPrimitiveIndices() const override { return primitive_indices_; }
+    std::vector<std::uint32_t> const& GetTriangleOrder() const override { return triangle_order_; }
+
+private:
+    struct BuildNode
+    {
+        Bounds3 bounds;
+        std::uint32_t children[2];
+        // Range of the sorted primitives, count is 0 for the SAH nodes above the treelets
+        std::uint32_t first;
+        std::uint32_t count;
+        std::uint32_t axis;
+    };
+
+    std::uint32_t BuildUpperSah(std::vector<BuildNode>& build_nodes,
+        std::vector<std::uint32_t>& treelet_roots, std::size_t start, std::size_t end);
+    unsigned int FlattenTree(std::vector<BuildNode> const& build_nodes, std::uint32_t node_idx);
+
+    BvhBuildOptions options_;
+    // Kept between the builds to reduce the rebuild latency
+    std::unique_ptr<ThreadPool> thread_pool_;
+    std::vector<LinearBVHNode> nodes_;
+    // Leaves always index the triangles directly
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> triangle_order_;
+};
@@ -26,6 +26,8 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <cassert>
+#include <cmath>
+#include <fstream>
 
 bool LoadSTB(const char* filename, Image& result)
 {
@@ -61,3 +63,35 @@ bool LoadSTB(const char* filename, Image& result)
     stbi_image_free(data);
     return true;
 }
+
+bool SavePPM(const char* filename, std::uint32_t width, std::uint32_t height, std::vector<float> const& data)
+{
+    assert(data.size() >= width * height * 4);
+
+    std::ofstream output_file(filename, std::ios::binary);
+    if (!output_file)
+    {
+        return false;
+    }
+
+    output_file << "P6\n" << width << " " << height << "\n255\n";
+
+    std::vector<unsigned char> pixels(width * height * 3);
+    for (std::uint32_t i = 0; i < width * height; ++i)
+    {
+        // The first row of the data is the bottom one (GL convention), PPM starts from the top
+        std::uint32_t x = i % width;
+        std::uint32_t y = height - 1 - i / width;
+        std::uint32_t pixel_idx = y * width + x;
+
+        for (std::uint32_t c = 0; c < 3; ++c)
+        {
+            // Apply the same gamma the sRGB framebuffer does
+            float value = std::pow(std::fmin(std::fmax(data[i * 4 + c], 0.0f), 1.0f), 1.0f / 2.2f);
+            pixels[pixel_idx * 3 + c] = (unsigned char)(value * 255.0f + 0.5f);
+        }
+    }
+
+    output_file.write((const char*)pixels.data(), pixels.size());
+    return (bool)output_file;
+}
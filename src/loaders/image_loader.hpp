@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <numeric>
 #include <vector>
 
@@ -37,3 +38,5 @@ public:
 
 bool LoadHDR(const char *filename, Image& result);
 bool LoadSTB(const char* filename, Image& result);
+// Saves RGBA32F data as a binary 8-bit sRGB PPM
+bool SavePPM(const char* filename, std::uint32_t width, std::uint32_t height, std::vector<float> const& data);
@@ -34,9 +34,19 @@ int main(int argc, char** argv)
         std::uint32_t window_width = 1280;
         std::uint32_t window_height = 720;
         bool use_opengl = false;
+        bool use_cpu = false;
+        std::uint32_t num_cpu_threads = 0;
+        BvhBuildOptions bvh_options;
+        IntegratorOptions integrator_options;
+        std::string bvh_builder = "sah";
         std::string scene_path = "assets/ShaderBalls.obj";
         float scene_scale = 1.0f;
         bool flip_yz = false;
+        std::uint32_t instance_grid_size = 0;
+        bool use_bvh_cache = false;
+        bool headless = false;
+        std::uint32_t num_samples = 64;
+        std::string output_path = "output.ppm";
 
         // Parse the command line
         CLI::App cli_app("RayTracing");
@@ -48,21 +58,116 @@ int main(int argc, char** argv)
         cli_app.add_option("--scene", scene_path, "Scene path");
         cli_app.add_option("--scale", scene_scale, "Scene scale");
         cli_app.add_option("--flip_yz", flip_yz, "Flip Y and Z axis");
+        cli_app.add_option("--instances", instance_grid_size,
+            "Render an NxN grid of instances of the scene through a two-level BVH, 0 - no instancing");
         cli_app.add_option("--opengl", use_opengl, "Use OpenGL");
+        cli_app.add_option("--cpu", use_cpu, "Use the multithreaded CPU path tracer");
+        cli_app.add_option("--threads", num_cpu_threads, "Number of CPU render threads, 0 - all hardware threads");
+        cli_app.add_option("--builder", bvh_builder, "BVH builder: sah, lbvh or hlbvh");
+        cli_app.add_option("--sbvh", bvh_options.enable_spatial_splits, "Build the BVH with spatial splits");
+        cli_app.add_option("--sbvh_alpha", bvh_options.spatial_split_alpha,
+            "Relative child overlap area needed to try spatial splits");
+        cli_app.add_option("--treelets", bvh_options.optimize_treelets,
+            "Restructure the treelets of the SAH BVH to lower its SAH cost");
+        cli_app.add_option("--treelet_budget", bvh_options.treelet_optimization_budget_ms,
+            "Time budget of the treelet optimization in milliseconds");
+        cli_app.add_option("--morton63", bvh_options.use_63bit_morton_codes, "Use 63-bit Morton codes in LBVH builders");
+        cli_app.add_option("--bvh_width", bvh_options.node_width,
+            "BVH node width of the traversal: 2, 4 or 8, the OpenGL backend and instancing use 2");
+        cli_app.add_option("--compressed_nodes", bvh_options.compress_nodes,
+            "Quantize the child bounds of the wide BVH nodes to 8 bits");
+        cli_app.add_option("--persistent_threads", integrator_options.persistent_threads,
+            "Trace with persistent work items taking the rays from a global queue (OpenCL)");
+        cli_app.add_option("--sort_rays", integrator_options.sort_ray_bounces,
+            "Bit mask of the bounces whose rays are sorted by direction and origin before the traversal (OpenCL)");
+        cli_app.add_option("--sort_materials", integrator_options.sort_materials,
+            "Shade the hits grouped by material (OpenCL and CPU)");
+        cli_app.add_option("--samples_per_launch", integrator_options.samples_per_launch,
+            "Paths traced per pixel by one launch of the wavefront (OpenCL and CPU)");
+        cli_app.add_option("--adaptive_threshold", integrator_options.adaptive_sampling_threshold,
+            "Relative error below which a pixel stops taking samples, 0 - off (OpenCL and CPU)");
+        cli_app.add_option("--russian_roulette", integrator_options.russian_roulette_bounce,
+            "Bounce from which the paths are terminated randomly by their throughput, 0 - off");
+        cli_app.add_option("--bvh_stats", bvh_options.print_statistics,
+            "Print the SAH cost, leaf size and depth histograms, overlap and memory of the BVH");
+        cli_app.add_option("--bvh_cache", use_bvh_cache, "Load the BVH from a cache file next to the scene if it is up to date");
+        cli_app.add_option("--headless", headless, "Render without a window and save the result");
+        cli_app.add_option("--spp", num_samples, "Number of samples to render in headless mode");
+        cli_app.add_option("--output", output_path, "Output image path in headless mode");
 
         cli_app.parse(argc, argv);
 
+        if (bvh_builder == "sah")
+        {
+            bvh_options.builder = BvhBuilder::kSah;
+        }
+        else if (bvh_builder == "lbvh")
+        {
+            bvh_options.builder = BvhBuilder::kLbvh;
+        }
+        else if (bvh_builder == "hlbvh")
+        {
+            bvh_options.builder = BvhBuilder::kHlbvh;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown BVH builder: " + bvh_builder);
+        }
+
+        if (use_opengl && !use_cpu && instance_grid_size > 0)
+        {
+            // Fail before the scene is loaded and the BVH built
+            throw std::runtime_error("Instancing is supported only by the OpenCL and CPU backends");
+        }
+
+        if (use_bvh_cache)
+        {
+            bvh_options.cache_path = scene_path + ".bvhcache";
+        }
+
         // Load the scene
         Scene scene(scene_path.c_str(), scene_scale, flip_yz);
+        if (instance_grid_size > 0)
+        {
+            // Copies of the whole scene in the XY plane
+            Bounds3 bounds = scene.GetMeshBounds(0);
+            float3 spacing = bounds.Diagonal() * 1.1f;
+            for (std::uint32_t y = 0; y < instance_grid_size; ++y)
+            {
+                for (std::uint32_t x = 0; x < instance_grid_size; ++x)
+                {
+                    float4 transform[3] =
+                    {
+                        float4(1.0f, 0.0f, 0.0f, x * spacing.x),
+                        float4(0.0f, 1.0f, 0.0f, y * spacing.y),
+                        float4(0.0f, 0.0f, 1.0f, 0.0f)
+                    };
+                    scene.AddInstance(0, transform);
+                }
+            }
+        }
+
         // Add a directional light since obj format doesn't support lights
         scene.AddDirectionalLight({ -0.6f, -1.5f, 3.5f }, { 15.0f, 10.0f, 5.0f });
 
+        Render::RenderBackend backend = use_opengl ? Render::RenderBackend::kOpenGL : Render::RenderBackend::kOpenCL;
+        if (use_cpu)
+        {
+            backend = Render::RenderBackend::kCPU;
+        }
+
+        if (headless)
+        {
+            Render render(window_width, window_height, backend, scene, num_cpu_threads, bvh_options, integrator_options);
+            render.RenderToFile(num_samples, output_path.c_str());
+            return 0;
+        }
+
         // Create the window
         Window window(window_width, window_height, "RayTracing");
 
         // Create the renderer
-        Render::RenderBackend backend = use_opengl ? Render::RenderBackend::kOpenGL : Render::RenderBackend::kOpenCL;
-        Render render(window, backend, scene);
+        Render render(window, backend, scene, num_cpu_threads, bvh_options, integrator_options);
 
         // Render loop
         while (!window.ShouldClose())
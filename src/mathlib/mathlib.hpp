@@ -53,13 +53,18 @@ public:
     float3 operator* (float scalar) { return float3(x * scalar, y * scalar, z * scalar); }
     float3 operator/ (float scalar) { return float3(x / scalar, y / scalar, z / scalar); }
     friend float3 operator* (const float3& a, float b) { return float3(a.x * b, a.y * b, a.z * b); }
+    friend float3 operator* (float a, const float3& b) { return float3(a * b.x, a * b.y, a * b.z); }
 
     // Vector operators
     friend float3 operator+ (const float3 &lhs, const float3 &rhs) { return float3(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z); }
     friend float3 operator- (const float3 &lhs, const float3 &rhs) { return float3(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z); }
+    friend float3 operator* (const float3 &lhs, const float3 &rhs) { return float3(lhs.x * rhs.x, lhs.y * rhs.y, lhs.z * rhs.z); }
+    friend float3 operator/ (const float3 &lhs, const float3 &rhs) { return float3(lhs.x / rhs.x, lhs.y / rhs.y, lhs.z / rhs.z); }
 
     float3& operator+= (const float3 &other) { x += other.x; y += other.y; z += other.z; return *this; }
     float3& operator*= (const float  &other) { x *= other;   y *= other;   z *= other;   return *this; }
+    float3& operator*= (const float3 &other) { x *= other.x; y *= other.y; z *= other.z; return *this; }
+    float3& operator/= (const float  &other) { x /= other;   y /= other;   z /= other;   return *this; }
     float3& operator-= (const float3 &other) { x -= other.x; y -= other.y; z -= other.z; return *this; }
     friend float3 operator- (const float3& vec) { return float3(-vec.x, -vec.y, -vec.z); }
 
@@ -76,8 +81,31 @@ private:
     std::uint32_t padding;
 };
 
-///@TODO: fix it
-typedef float3 float4;
+class float4
+{
+public:
+    float4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+    float4(const float3& xyz, float w) : x(xyz.x), y(xyz.y), z(xyz.z), w(w) {}
+    float4(float val) : x(val), y(val), z(val), w(val) {}
+    float4() : x(0), y(0), z(0), w(0) {}
+
+    float3 Xyz() const { return float3(x, y, z); }
+
+    // Scalar operators
+    friend float4 operator* (const float4& a, float b) { return float4(a.x * b, a.y * b, a.z * b, a.w * b); }
+    friend float4 operator/ (const float4& a, float b) { return float4(a.x / b, a.y / b, a.z / b, a.w / b); }
+
+    // Vector operators
+    friend float4 operator+ (const float4 &lhs, const float4 &rhs) { return float4(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z, lhs.w + rhs.w); }
+    friend float4 operator- (const float4 &lhs, const float4 &rhs) { return float4(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z, lhs.w - rhs.w); }
+
+    // Access
+    float&       operator[] (size_t i) { return (i == 0) ? x : (i == 1 ? y : (i == 2 ? z : w)); }
+    const float& operator[] (size_t i) const { return (i == 0) ? x : (i == 1 ? y : (i == 2 ? z : w)); }
+
+public:
+    float x, y, z, w;
+};
 
 class float2
 {
@@ -181,6 +209,7 @@ public:
             (*this)[(corner & 4) ? 1 : 0].z);
     }
 
+    bool IsValid() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
     float3 Diagonal() const { return max - min; }
     float SurfaceArea() const { float3 d = Diagonal(); return 2 * (d.x * d.y + d.x * d.z + d.y * d.z); }
     float Volume() const { float3 d = Diagonal(); return d.x * d.y * d.z; }
@@ -229,6 +258,15 @@ inline Bounds3 Union(const Bounds3 &b1, const Bounds3 &b2)
     return ret;
 }
 
+// The result is not valid if the bounds don't overlap
+inline Bounds3 Intersect(const Bounds3 &b1, const Bounds3 &b2)
+{
+    Bounds3 ret;
+    ret.min = Max(b1.min, b2.min);
+    ret.max = Min(b1.max, b2.max);
+    return ret;
+}
+
 struct Matrix
 {
     static Matrix LookAtLH(const float3& eye, const float3& target, const float3& up = float3(0.0f, 0.0f, 1.0f));
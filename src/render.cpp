@@ -25,61 +25,228 @@
 #include "render.hpp"
 #include "integrator/cl_pt_integrator.hpp"
 #include "integrator/gl_pt_integrator.hpp"
+#include "integrator/cpu_pt_integrator.hpp"
 #include "mathlib/mathlib.hpp"
 #include "utils/cl_exception.hpp"
 #include "bvh.hpp"
-#include "Utils/window.hpp"
+#include "lbvh.hpp"
+#include "two_level_bvh.hpp"
+#include "bvh_cache.hpp"
+#include "utils/window.hpp"
+#include "loaders/image_loader.hpp"
 #include <backends/imgui_impl_opengl3.h>
 #include <backends/imgui_impl_win32.h>
 #include <iostream>
+#include <chrono>
 #include <fstream>
 #include <sstream>
 
-Render::Render(Window& window, RenderBackend backend, Scene& scene)
-    : window_(window)
+Render::Render(Window& window, RenderBackend backend, Scene& scene, std::uint32_t num_cpu_threads,
+    BvhBuildOptions const& bvh_options, IntegratorOptions const& integrator_options)
+    : window_(&window)
     , render_backend_(backend)
     , scene_(scene)
+    , num_cpu_threads_(num_cpu_threads)
+    , bvh_options_(bvh_options)
+    , integrator_options_(integrator_options)
     , width_(window.GetWidth())
     , height_(window.GetHeight())
 {
     if (render_backend_ == RenderBackend::kOpenCL)
     {
-        std::vector<cl::Platform> all_platforms;
-        cl::Platform::get(&all_platforms);
-        if (all_platforms.empty())
-        {
-            throw std::runtime_error("No OpenCL platforms found");
-        }
-
-        cl_context_ = std::make_shared<CLContext>(all_platforms[0]);
+        CreateCLContext(true);
     }
 
     framebuffer_ = std::make_unique<Framebuffer>(width_, height_);
-    camera_controller_ = std::make_unique<CameraController>(window_);
+    camera_controller_ = std::make_unique<CameraController>(*window_);
+
+    BuildAccelerationStructure();
+    CreateIntegrator(framebuffer_->GetGLImage());
+}
+
+Render::Render(std::uint32_t width, std::uint32_t height, RenderBackend backend, Scene& scene,
+    std::uint32_t num_cpu_threads, BvhBuildOptions const& bvh_options, IntegratorOptions const& integrator_options)
+    : window_(nullptr)
+    , render_backend_(backend)
+    , scene_(scene)
+    , num_cpu_threads_(num_cpu_threads)
+    , bvh_options_(bvh_options)
+    , integrator_options_(integrator_options)
+    , width_(width)
+    , height_(height)
+{
+    if (render_backend_ == RenderBackend::kOpenGL)
+    {
+        throw std::runtime_error("Headless mode is supported only by the OpenCL and CPU backends");
+    }
+
+    if (render_backend_ == RenderBackend::kOpenCL)
+    {
+        CreateCLContext(false);
+    }
+
+    BuildAccelerationStructure();
+    CreateIntegrator(0);
+
+    // Same as the initial state of the camera controller
+    Camera camera = {};
+    camera.position = float3(0.0f, -1.0f, 1.0f);
+    camera.front = float3(0.0f, 1.0f, 0.0f);
+    camera.up = float3(0.0f, 0.0f, 1.0f);
+    camera.fov = 75.0f * 3.1415f / 180.0f;
+    camera.aspect_ratio = (float)width_ / (float)height_;
+    camera.focus_distance = 10.0f;
+    integrator_->SetCameraData(camera);
+}
+
+void Render::CreateCLContext(bool enable_gl_interop)
+{
+    std::vector<cl::Platform> all_platforms;
+    cl::Platform::get(&all_platforms);
+    if (all_platforms.empty())
+    {
+        throw std::runtime_error("No OpenCL platforms found");
+    }
+
+    cl_context_ = std::make_shared<CLContext>(all_platforms[0], enable_gl_interop);
+}
+
+void Render::BuildAccelerationStructure()
+{
+    // Two-level BVHs are rebuilt every time
+    bool use_cache = !bvh_options_.cache_path.empty() && scene_.GetInstances().empty();
+    std::uint64_t cache_key = use_cache ? ComputeBvhCacheKey(scene_.GetTriangles(), bvh_options_) : 0;
+    std::unique_ptr<CachedBvh> cached_bvh = use_cache ? LoadBvhCache(bvh_options_.cache_path, cache_key, scene_.GetTriangles().size()) : nullptr;
+    bool save_cache = use_cache && !cached_bvh;
 
     // Create acc structure
-    acc_structure_ = std::make_unique<Bvh>();
-    // Build it right here
+    if (cached_bvh)
+    {
+        acc_structure_ = std::move(cached_bvh);
+    }
+    else if (!scene_.GetInstances().empty())
+    {
+        auto two_level_bvh = std::make_unique<TwoLevelBvh>(bvh_options_, scene_.GetMeshes(), scene_.GetInstances());
+        two_level_bvh_ = two_level_bvh.get();
+        acc_structure_ = std::move(two_level_bvh);
+    }
+    else if (bvh_options_.builder == BvhBuilder::kSah)
+    {
+        acc_structure_ = std::make_unique<Bvh>(bvh_options_);
+    }
+    else
+    {
+        acc_structure_ = std::make_unique<LbvhBuilder>(bvh_options_);
+    }
+
+    // Build it right here, the leaves reference the triangles in the order of the build
     acc_structure_->BuildCPU(scene_.GetTriangles());
+    scene_.ReorderTriangles(acc_structure_->GetTriangleOrder());
+
+    if (save_cache)
+    {
+        if (SaveBvhCache(bvh_options_.cache_path, cache_key, *acc_structure_))
+        {
+            std::cout << "BVH cache written to " << bvh_options_.cache_path << std::endl;
+        }
+        else
+        {
+            std::cerr << "Failed to write the BVH cache to " << bvh_options_.cache_path << std::endl;
+        }
+    }
+
+    // The bottom level BVHs of a two-level BVH are not reachable from its root
+    if (bvh_options_.print_statistics && acc_structure_->GetTopLevelNodeCount() == 0)
+    {
+        PrintBvhStatistics(acc_structure_->GetNodes(), acc_structure_->GetPrimitiveIndices().size());
+        PrintBvhMemoryReport(acc_structure_->GetNodes());
+    }
 
-    // TODO, NOTE: this is done after building the acc structure because it reorders triangles
-    // Need to get rid of reordering
     scene_.Finalize();
+}
 
+void Render::UpdateGeometry()
+{
+    scene_.UpdateVertices();
+    integrator_->UpdateGeometry(scene_);
+}
+
+void Render::UpdateInstances()
+{
+    if (!two_level_bvh_)
+    {
+        throw std::runtime_error("The scene has no instances");
+    }
+
+    two_level_bvh_->UpdateInstances();
+    integrator_->UpdateInstances(scene_);
+}
+
+void Render::CreateIntegrator(unsigned int out_image)
+{
     // Create integrator
     if (render_backend_ == RenderBackend::kOpenCL)
     {
         integrator_ = std::make_unique<CLPathTraceIntegrator>(width_, height_, *acc_structure_,
-            *cl_context_, framebuffer_->GetGLImage());
+            *cl_context_, out_image);
+    }
+    else if (render_backend_ == RenderBackend::kCPU)
+    {
+        integrator_ = std::make_unique<CPUPathTraceIntegrator>(width_, height_, *acc_structure_,
+            out_image, num_cpu_threads_);
     }
     else
     {
         integrator_ = std::make_unique<GLPathTraceIntegrator>(width_, height_, *acc_structure_,
-            framebuffer_->GetGLImage());
+            out_image);
     }
 
     // Upload scene data to the GPU
     integrator_->UploadGPUData(scene_, *acc_structure_);
+    integrator_->SetBvhWidth(bvh_options_.node_width);
+    integrator_->EnableNodeCompression(bvh_options_.compress_nodes);
+    integrator_->EnablePersistentThreads(integrator_options_.persistent_threads);
+    integrator_->SetRaySortBounces(integrator_options_.sort_ray_bounces);
+    integrator_->EnableMaterialSortedShading(integrator_options_.sort_materials);
+    integrator_->SetSamplesPerLaunch(integrator_options_.samples_per_launch);
+    integrator_->SetAdaptiveSamplingThreshold(integrator_options_.adaptive_sampling_threshold);
+    integrator_->SetRussianRouletteBounce(integrator_options_.russian_roulette_bounce);
+}
+
+void Render::RenderToFile(std::uint32_t num_samples, char const* filename)
+{
+    std::uint64_t start_ray_count = integrator_->GetTracedRayCount();
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // Every launch adds samples_per_launch samples to each pixel
+    std::uint32_t samples_per_launch = integrator_->GetSamplesPerLaunch();
+    std::uint32_t num_launches = (num_samples + samples_per_launch - 1) / samples_per_launch;
+    num_samples = num_launches * samples_per_launch;
+
+    for (std::uint32_t launch = 0; launch < num_launches; ++launch)
+    {
+        integrator_->Integrate();
+    }
+
+    // Waits for the device to finish the samples
+    std::vector<float> image_data;
+    integrator_->ReadOutputImage(image_data);
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Rendered " << num_samples << " samples in " << elapsed.count() << " s" << std::endl;
+
+    std::uint64_t ray_count = integrator_->GetTracedRayCount() - start_ray_count;
+    if (ray_count > 0)
+    {
+        std::cout << "Traced " << ray_count << " rays, " << ray_count / elapsed.count() * 1e-6 << " Mrays/s" << std::endl;
+    }
+
+    if (!SavePPM(filename, width_, height_, image_data))
+    {
+        throw std::runtime_error("Failed to save image to " + std::string(filename));
+    }
+
+    std::cout << "Saved " << filename << std::endl;
 }
 
 double Render::GetCurtime() const
@@ -101,7 +268,7 @@ void Render::FrameEnd()
 {
     camera_controller_->OnEndFrame();
     glFinish();
-    window_.SwapBuffers();
+    window_->SwapBuffers();
     prev_frame_time_ = start_frame_time_;
 }
 
@@ -160,8 +327,9 @@ void Render::DrawGUI()
         }
 
         static int aov_index = 0;
-        const char* aov_names[] = { "Shaded Color", "Diffuse Albedo", "Depth", "Normal", "Motion Vectors" };
-        if (ImGui::Combo("AOV", &aov_index, aov_names, 5))
+        const char* aov_names[] = { "Shaded Color", "Diffuse Albedo", "Depth", "Normal", "Motion Vectors",
+            "Traversal Heatmap" };
+        if (ImGui::Combo("AOV", &aov_index, aov_names, 6))
         {
             integrator_->SetAOV((Integrator::AOV)aov_index);
         }
@@ -178,7 +346,7 @@ void Render::RenderFrame()
 
     bool need_to_reset = false;
 
-    if (window_.GetKey(KeyCode::kR))
+    if (window_->GetKey(KeyCode::kR))
     {
         ReloadKernels();
         need_to_reset = true;
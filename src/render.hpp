@@ -34,36 +34,56 @@
 #include <ctime>
 
 class Window;
+class TwoLevelBvh;
 class Render
 {
 public:
     enum class RenderBackend
     {
         kOpenCL,
-        kOpenGL
+        kOpenGL,
+        kCPU
     };
 
-    Render(Window& window, RenderBackend backend, Scene& scene);
+    // num_cpu_threads is used by the CPU backend only, 0 means all hardware threads
+    Render(Window& window, RenderBackend backend, Scene& scene, std::uint32_t num_cpu_threads = 0,
+        BvhBuildOptions const& bvh_options = {}, IntegratorOptions const& integrator_options = {});
+    // Headless mode, no window, framebuffer or GL interop are created
+    Render(std::uint32_t width, std::uint32_t height, RenderBackend backend, Scene& scene,
+        std::uint32_t num_cpu_threads = 0, BvhBuildOptions const& bvh_options = {},
+        IntegratorOptions const& integrator_options = {});
     ~Render() = default;
 
     void    RenderFrame();
+    // Accumulates the given number of samples and saves the result
+    void    RenderToFile(std::uint32_t num_samples, char const* filename);
+    // Call after moving the vertices of the scene triangles, refits the acceleration structure
+    void    UpdateGeometry();
+    // Call after changing the instance transforms of the scene, rebuilds the top level BVH only
+    void    UpdateInstances();
     double  GetCurtime()   const;
     double  GetDeltaTime() const;
-    Window& GetWindow() const { return window_; }
+    Window& GetWindow() const { return *window_; }
 
     std::shared_ptr<CLContext> GetCLContext() const { return cl_context_; }
 
 private:
+    void CreateCLContext(bool enable_gl_interop);
+    void BuildAccelerationStructure();
+    void CreateIntegrator(unsigned int out_image);
     void FrameBegin();
     void FrameEnd();
     void DrawGUI();
     void ReloadKernels();
     
 private:
-    // Window
-    Window& window_;
+    // Window, nullptr in headless mode
+    Window* window_;
     RenderBackend render_backend_;
     Scene& scene_;
+    std::uint32_t num_cpu_threads_;
+    BvhBuildOptions bvh_options_;
+    IntegratorOptions integrator_options_;
 
     // Render size
     std::uint32_t width_;
@@ -77,6 +97,8 @@ private:
     std::unique_ptr<Integrator> integrator_;
     // Acceleration structure
     std::unique_ptr<AccelerationStructure> acc_structure_;
+    // Same as acc_structure_ if the scene has instances, nullptr otherwise
+    TwoLevelBvh* two_level_bvh_ = nullptr;
 
     std::unique_ptr<CameraController> camera_controller_;
     std::unique_ptr<Framebuffer>      framebuffer_;
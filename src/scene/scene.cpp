@@ -31,6 +31,7 @@
 #include "mathlib/mathlib.hpp"
 #include "render.hpp"
 #include "utils/cl_exception.hpp"
+#include "utils/thread_pool.hpp"
 
 #include <algorithm>
 #include <iostream>
@@ -39,6 +40,8 @@
 #include <sstream>
 #include <ctime>
 #include <cctype>
+#include <cmath>
+#include <cstring>
 
 #undef max
 
@@ -49,6 +52,8 @@ Scene::Scene(const char* filename, float scale, bool flip_yz)
 
 namespace
 {
+constexpr std::size_t kReorderGrainSize = 4096;
+
 unsigned int PackAlbedo(float r, float g, float b, std::uint32_t texture_index)
 {
     assert(texture_index < 256);
@@ -102,6 +107,12 @@ float3 UnpackRGBE(unsigned int rgbe)
     }
 }
 
+// Same weights as Luma in src/kernels/common/utils.h
+float Luma(float3 rgb)
+{
+    return rgb.x * 0.299f + rgb.y * 0.587f + rgb.z * 0.114f;
+}
+
 unsigned int PackRoughnessMetalness(float roughness, std::uint32_t roughness_idx,
     float metalness, std::uint32_t metalness_idx)
 {
@@ -121,6 +132,140 @@ unsigned int PackIorEmissionIdxTransparency(float ior, std::uint32_t emission_id
     return ((unsigned int)(ior * 25.5f)) | (emission_idx << 8)
         | ((unsigned int)(transparency * 255.0f) << 16) | (transparency_idx << 24);
 }
+
+// Octahedral mapping of the unit vector to 2 x 16-bit snorm
+std::uint32_t PackOctahedral(float3 n)
+{
+    float length = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (length == 0.0f)
+    {
+        return 0;
+    }
+
+    float x = n.x / length;
+    float y = n.y / length;
+    if (n.z < 0.0f)
+    {
+        float folded_x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float folded_y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    auto pack_snorm = [](float value)
+    {
+        return (std::uint32_t)(std::int16_t)std::round(clamp(value, -1.0f, 1.0f) * 32767.0f) & 0xFFFF;
+    };
+    return pack_snorm(x) | (pack_snorm(y) << 16);
+}
+
+// Rounds to the nearest half, the values out of range become infinities
+std::uint32_t PackHalf(float value)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    std::uint32_t sign = (bits >> 16) & 0x8000;
+    std::uint32_t mantissa = bits & 0x7FFFFF;
+    int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+
+    if ((bits & 0x7FFFFFFF) > 0x7F800000)
+    {
+        return sign | 0x7E00;
+    }
+
+    if (exponent >= 31)
+    {
+        return sign | 0x7C00;
+    }
+
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return sign;
+        }
+
+        // Subnormal, the rounding may carry to the smallest normal
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        return sign | ((mantissa >> shift) + ((mantissa >> (shift - 1)) & 1));
+    }
+
+    // The rounding may carry to the exponent
+    return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+}
+
+// Vertex as stored in the pool, the equal ones are merged
+struct PackedVertex
+{
+    std::uint32_t position[3];
+    std::uint32_t normal;
+    std::uint32_t texcoord;
+
+    bool operator==(PackedVertex const& other) const
+    {
+        return std::memcmp(this, &other, sizeof(PackedVertex)) == 0;
+    }
+};
+
+struct PackedVertexHash
+{
+    std::size_t operator()(PackedVertex const& vertex) const
+    {
+        std::uint32_t const* words = vertex.position;
+        std::size_t hash = 0;
+        for (std::size_t i = 0; i < sizeof(PackedVertex) / sizeof(std::uint32_t); ++i)
+        {
+            hash = (hash ^ words[i]) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+};
+
+PackedVertex PackVertex(Vertex const& vertex)
+{
+    PackedVertex packed;
+    std::memcpy(&packed.position[0], &vertex.position.x, sizeof(float));
+    std::memcpy(&packed.position[1], &vertex.position.y, sizeof(float));
+    std::memcpy(&packed.position[2], &vertex.position.z, sizeof(float));
+    packed.normal = PackOctahedral(vertex.normal);
+    packed.texcoord = PackHalf(vertex.texcoord.x) | (PackHalf(vertex.texcoord.y) << 16);
+    return packed;
+}
+
+float4 GetVertexPosition(Vertex const& vertex, PackedVertex const& packed)
+{
+    float normal;
+    std::memcpy(&normal, &packed.normal, sizeof(normal));
+    return float4(vertex.position, normal);
+}
+
+// Inverse of the 3x4 affine transform given by rows
+void InvertTransform(float4 const m[3], float4 inv[3])
+{
+    // Inverse of the upper 3x3 part through the cofactors
+    float c00 = m[1].y * m[2].z - m[1].z * m[2].y;
+    float c01 = m[1].z * m[2].x - m[1].x * m[2].z;
+    float c02 = m[1].x * m[2].y - m[1].y * m[2].x;
+    float det = m[0].x * c00 + m[0].y * c01 + m[0].z * c02;
+
+    if (std::abs(det) < 1e-12f)
+    {
+        throw std::runtime_error("Instance transform is not invertible");
+    }
+
+    float inv_det = 1.0f / det;
+    float3 row0 = float3(c00, m[0].z * m[2].y - m[0].y * m[2].z, m[0].y * m[1].z - m[0].z * m[1].y) * inv_det;
+    float3 row1 = float3(c01, m[0].x * m[2].z - m[0].z * m[2].x, m[0].z * m[1].x - m[0].x * m[1].z) * inv_det;
+    float3 row2 = float3(c02, m[0].y * m[2].x - m[0].x * m[2].y, m[0].x * m[1].y - m[0].y * m[1].x) * inv_det;
+
+    // Inverse translation is -A^-1 * t
+    float3 translation(m[0].w, m[1].w, m[2].w);
+    inv[0] = float4(row0, -Dot(row0, translation));
+    inv[1] = float4(row1, -Dot(row1, translation));
+    inv[2] = float4(row2, -Dot(row2, translation));
+}
 }
 
 void Scene::Load(const char* filename, float scale, bool flip_yz)
@@ -268,6 +413,9 @@ void Scene::Load(const char* filename, float scale, bool flip_yz)
         }
     }
 
+    // The whole file is a single mesh
+    meshes_.push_back({ 0, (std::uint32_t)triangles_.size() });
+
     std::cout << "Load successful (" << triangles_.size() << " triangles)" << std::endl;
 
 }
@@ -334,7 +482,72 @@ void Scene::CollectEmissiveTriangles()
         }
     }
 
-    scene_info_.emissive_count = (std::uint32_t)emissive_indices_.size();
+    BuildEmissiveAliasTable();
+}
+
+void Scene::BuildEmissiveAliasTable()
+{
+    emissive_alias_table_.clear();
+    scene_info_.emissive_count = 0;
+    scene_info_.emissive_power = 0.0f;
+
+    // The kernels sample the triangles as loaded, the instanced emission is reached by the BxDF sampling only
+    if (!instances_.empty())
+    {
+        return;
+    }
+
+    std::vector<float> powers;
+    double power_sum = 0.0;
+    for (auto triangle_idx : emissive_indices_)
+    {
+        auto const& triangle = triangles_[triangle_idx];
+        float area = 0.5f * Cross(triangle.v2.position - triangle.v1.position,
+            triangle.v3.position - triangle.v1.position).Length();
+        float power = area * Luma(UnpackRGBE(materials_[triangle.mtlIndex].emission));
+
+        if (power > 0.0f)
+        {
+            EmissiveAliasEntry entry = {};
+            entry.triangle_index = triangle_idx;
+            emissive_alias_table_.push_back(entry);
+            powers.push_back(power);
+            power_sum += power;
+        }
+    }
+
+    // Vose's method: every slot below the average power is topped up by a slot above it,
+    // which takes its place in the lists with the power left
+    std::size_t num_slots = emissive_alias_table_.size();
+    std::vector<float> scaled_powers(num_slots);
+    std::vector<std::uint32_t> small_slots;
+    std::vector<std::uint32_t> large_slots;
+    for (std::uint32_t i = 0; i < num_slots; ++i)
+    {
+        emissive_alias_table_[i].pdf = (float)(powers[i] / power_sum);
+        emissive_alias_table_[i].threshold = 1.0f;
+        emissive_alias_table_[i].alias = i;
+        scaled_powers[i] = (float)(powers[i] * num_slots / power_sum);
+        (scaled_powers[i] < 1.0f ? small_slots : large_slots).push_back(i);
+    }
+
+    while (!small_slots.empty() && !large_slots.empty())
+    {
+        std::uint32_t small_slot = small_slots.back();
+        std::uint32_t large_slot = large_slots.back();
+        small_slots.pop_back();
+        large_slots.pop_back();
+
+        emissive_alias_table_[small_slot].threshold = scaled_powers[small_slot];
+        emissive_alias_table_[small_slot].alias = large_slot;
+
+        scaled_powers[large_slot] = (scaled_powers[large_slot] + scaled_powers[small_slot]) - 1.0f;
+        (scaled_powers[large_slot] < 1.0f ? small_slots : large_slots).push_back(large_slot);
+    }
+
+    // The slots left are full up to the rounding errors and keep the threshold of 1
+    scene_info_.emissive_count = (std::uint32_t)num_slots;
+    scene_info_.emissive_power = (float)power_sum;
 }
 
 void Scene::AddPointLight(float3 origin, float3 radiance)
@@ -349,9 +562,139 @@ void Scene::AddDirectionalLight(float3 direction, float3 radiance)
     lights_.emplace_back(std::move(light));
 }
 
+std::uint32_t Scene::AddInstance(std::uint32_t mesh_index, float4 const object_to_world[3])
+{
+    if (mesh_index >= meshes_.size())
+    {
+        throw std::runtime_error("Invalid mesh index");
+    }
+
+    Instance instance = {};
+    instance.mesh_index = mesh_index;
+    instances_.push_back(instance);
+
+    std::uint32_t instance_index = (std::uint32_t)instances_.size() - 1;
+    SetInstanceTransform(instance_index, object_to_world);
+    return instance_index;
+}
+
+void Scene::SetInstanceTransform(std::uint32_t instance_index, float4 const object_to_world[3])
+{
+    Instance& instance = instances_[instance_index];
+    for (int i = 0; i < 3; ++i)
+    {
+        instance.object_to_world[i] = object_to_world[i];
+    }
+
+    InvertTransform(instance.object_to_world, instance.world_to_object);
+}
+
+Bounds3 Scene::GetMeshBounds(std::uint32_t mesh_index) const
+{
+    Mesh const& mesh = meshes_[mesh_index];
+    Bounds3 bounds;
+    for (std::uint32_t i = mesh.first_triangle; i < mesh.first_triangle + mesh.triangle_count; ++i)
+    {
+        bounds = Union(bounds, triangles_[i].GetBounds());
+    }
+
+    return bounds;
+}
+
+void Scene::ReorderTriangles(std::vector<std::uint32_t> const& order)
+{
+    assert(order.size() == triangles_.size());
+
+    // Gather the triangles and record where every one of them went in a single pass
+    std::vector<Triangle> ordered_triangles(triangles_.size());
+    std::vector<std::uint32_t> new_indices(order.size());
+    ThreadPool thread_pool;
+    thread_pool.ParallelFor(order.size(), [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                ordered_triangles[i] = triangles_[order[i]];
+                new_indices[order[i]] = static_cast<std::uint32_t>(i);
+            }
+        }, kReorderGrainSize);
+    triangles_.swap(ordered_triangles);
+
+    // The indexed mesh may be built already
+    if (!indexed_triangles_.empty())
+    {
+        std::vector<IndexedTriangle> ordered_indexed_triangles(indexed_triangles_.size());
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            ordered_indexed_triangles[i] = indexed_triangles_[order[i]];
+        }
+        indexed_triangles_.swap(ordered_indexed_triangles);
+    }
+
+    // The emissive triangles may be collected already
+    for (auto& emissive_index : emissive_indices_)
+    {
+        emissive_index = new_indices[emissive_index];
+    }
+    std::sort(emissive_indices_.begin(), emissive_indices_.end());
+
+    if (!emissive_alias_table_.empty())
+    {
+        BuildEmissiveAliasTable();
+    }
+}
+
+void Scene::BuildIndexedMesh()
+{
+    indexed_triangles_.clear();
+    vertex_positions_.clear();
+    vertex_texcoords_.clear();
+    indexed_triangles_.reserve(triangles_.size());
+
+    std::unordered_map<PackedVertex, std::uint32_t, PackedVertexHash> vertex_indices;
+    auto add_vertex = [&](Vertex const& vertex)
+    {
+        PackedVertex packed = PackVertex(vertex);
+        auto result = vertex_indices.emplace(packed, (std::uint32_t)vertex_positions_.size());
+        if (result.second)
+        {
+            vertex_positions_.push_back(GetVertexPosition(vertex, packed));
+            vertex_texcoords_.push_back(packed.texcoord);
+        }
+        return result.first->second;
+    };
+
+    for (auto const& triangle : triangles_)
+    {
+        IndexedTriangle indexed_triangle;
+        indexed_triangle.v1 = add_vertex(triangle.v1);
+        indexed_triangle.v2 = add_vertex(triangle.v2);
+        indexed_triangle.v3 = add_vertex(triangle.v3);
+        indexed_triangle.mtlIndex = triangle.mtlIndex;
+        indexed_triangles_.push_back(indexed_triangle);
+    }
+}
+
+void Scene::UpdateVertices()
+{
+    auto update_vertex = [&](std::uint32_t vertex_index, Vertex const& vertex)
+    {
+        PackedVertex packed = PackVertex(vertex);
+        vertex_positions_[vertex_index] = GetVertexPosition(vertex, packed);
+        vertex_texcoords_[vertex_index] = packed.texcoord;
+    };
+
+    for (std::size_t i = 0; i < triangles_.size(); ++i)
+    {
+        update_vertex(indexed_triangles_[i].v1, triangles_[i].v1);
+        update_vertex(indexed_triangles_[i].v2, triangles_[i].v2);
+        update_vertex(indexed_triangles_[i].v3, triangles_[i].v3);
+    }
+}
+
 void Scene::Finalize()
 {
     CollectEmissiveTriangles();
+    BuildIndexedMesh();
 
     //scene_info_.environment_map_index = LoadTexture("textures/studio_small_03_4k.hdr");
     scene_info_.analytic_light_count = (std::uint32_t)lights_.size();
@@ -30,15 +30,34 @@
 #include <vector>
 #include <unordered_map>
 
+// Range of the scene triangles that can be instanced
+struct Mesh
+{
+    std::uint32_t first_triangle;
+    std::uint32_t triangle_count;
+};
+
 class CLContext;
 class Scene
 {
 public:
     Scene(const char* filename, float scale, bool flip_yz);
 
+    // Call UpdateVertices after moving the vertices
     std::vector<Triangle>& GetTriangles() { return triangles_; }
     std::vector<Triangle> const& GetTriangles() const { return triangles_; }
+    // Shading data of the triangles in the same order, built by Finalize. The triangles index
+    // a pool of the unique vertices, see src/kernels/common/mesh.h for the encoding
+    std::vector<IndexedTriangle> const& GetIndexedTriangles() const { return indexed_triangles_; }
+    std::vector<float4> const& GetVertexPositions() const { return vertex_positions_; }
+    std::vector<std::uint32_t> const& GetVertexTexcoords() const { return vertex_texcoords_; }
+    std::vector<Mesh> const& GetMeshes() const { return meshes_; }
+    // Empty unless instances were added, all the triangles are rendered as loaded then
+    std::vector<Instance>& GetInstances() { return instances_; }
+    std::vector<Instance> const& GetInstances() const { return instances_; }
     std::vector<std::uint32_t> const& GetEmissiveIndices() const { return emissive_indices_; }
+    // Emissive triangles picked by their power, empty for the instanced scenes
+    std::vector<EmissiveAliasEntry> const& GetEmissiveAliasTable() const { return emissive_alias_table_; }
     std::vector<PackedMaterial> const& GetMaterials() const { return materials_; }
     std::vector<Texture> const& GetTextures() const { return textures_; }
     std::vector<std::uint32_t> const& GetTextureData() const { return texture_data_; }
@@ -46,17 +65,36 @@ public:
     SceneInfo const& GetSceneInfo() const { return scene_info_; }
     Image const& GetEnvImage() const { return env_image_; }
     void Finalize();
+    // Triangle i becomes the loaded triangle order[i], call with the order of the BVH build.
+    // The meshes keep their triangle ranges if the order does
+    void ReorderTriangles(std::vector<std::uint32_t> const& order);
+    // Encodes the moved triangle vertices to the vertex pool, the triangles keep their vertex indices
+    void UpdateVertices();
     void AddPointLight(float3 origin, float3 radiance);
     void AddDirectionalLight(float3 direction, float3 radiance);
+    // object_to_world holds the rows of a 3x4 affine transform. Only the instances are rendered
+    // once the scene has any, through a two-level BVH. Returns the instance index
+    std::uint32_t AddInstance(std::uint32_t mesh_index, float4 const object_to_world[3]);
+    void SetInstanceTransform(std::uint32_t instance_index, float4 const object_to_world[3]);
+    Bounds3 GetMeshBounds(std::uint32_t mesh_index) const;
 
 private:
     void Load(char const* filename, float scale, bool flip_yz);
     // Returns texture index in textures_
     std::size_t LoadTexture(char const* filename);
     void CollectEmissiveTriangles();
+    // Alias table of the emissive triangles weighted by the area times the emission luminance
+    void BuildEmissiveAliasTable();
+    void BuildIndexedMesh();
 
     std::vector<Triangle> triangles_;
+    std::vector<IndexedTriangle> indexed_triangles_;
+    std::vector<float4> vertex_positions_; // w - octahedral normal
+    std::vector<std::uint32_t> vertex_texcoords_; // 2 x half
+    std::vector<Mesh> meshes_;
+    std::vector<Instance> instances_;
     std::vector<std::uint32_t> emissive_indices_;
+    std::vector<EmissiveAliasEntry> emissive_alias_table_;
     std::vector<PackedMaterial> materials_;
     std::vector<Light> lights_;
     std::vector<Texture> textures_;
@@ -0,0 +1,312 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "two_level_bvh.hpp"
+#include "bvh.hpp"
+#include "lbvh.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+namespace
+{
+    constexpr auto kTopLevelBuckets = 12u;
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    double ElapsedMs(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    std::unique_ptr<AccelerationStructure> CreateBottomLevelBuilder(BvhBuildOptions const& options)
+    {
+        if (options.builder == BvhBuilder::kSah)
+        {
+            return std::make_unique<Bvh>(options);
+        }
+        else
+        {
+            return std::make_unique<LbvhBuilder>(options);
+        }
+    }
+
+    float3 TransformPoint(float4 const m[3], float3 const& p)
+    {
+        return float3(
+            m[0].x * p.x + m[0].y * p.y + m[0].z * p.z + m[0].w,
+            m[1].x * p.x + m[1].y * p.y + m[1].z * p.z + m[1].w,
+            m[2].x * p.x + m[2].y * p.y + m[2].z * p.z + m[2].w);
+    }
+
+    bool IsLeaf(LinearBVHNode const& node)
+    {
+        return (node.num_primitives_axis >> 16) > 0;
+    }
+}
+
+TwoLevelBvh::TwoLevelBvh(BvhBuildOptions const& options, std::vector<Mesh> const& meshes,
+    std::vector<Instance>& instances)
+    : options_(options)
+    , meshes_(meshes)
+    , instances_(instances)
+{
+}
+
+void TwoLevelBvh::BuildCPU(std::vector<Triangle> const& triangles)
+{
+    if (instances_.empty())
+    {
+        throw std::runtime_error("Two-level BVH requires at least one instance");
+    }
+
+    std::cout << "Building two-level Bounding Volume Hierarchy for " << instances_.size() << " instances of "
+        << meshes_.size() << " meshes" << std::endl;
+
+    auto start_time = Clock::now();
+
+    // A leaf per instance
+    top_level_node_count_ = 2 * instances_.size() - 1;
+    nodes_.assign(top_level_node_count_, LinearBVHNode());
+    primitive_indices_.clear();
+    mesh_node_offsets_.clear();
+    triangle_order_.resize(triangles.size());
+
+    auto builder = CreateBottomLevelBuilder(options_);
+    std::vector<bool> mesh_has_indices;
+
+    for (auto const& mesh : meshes_)
+    {
+        if (mesh.triangle_count == 0)
+        {
+            throw std::runtime_error("Can't build the BVH of an empty mesh");
+        }
+
+        auto mesh_begin = triangles.begin() + mesh.first_triangle;
+        auto mesh_end = mesh_begin + mesh.triangle_count;
+        std::vector<Triangle> mesh_triangles(mesh_begin, mesh_end);
+        builder->BuildCPU(mesh_triangles);
+        // The triangles stay within their mesh in the order of the bottom level build
+        auto const& mesh_order = builder->GetTriangleOrder();
+        for (std::uint32_t i = 0; i < mesh.triangle_count; ++i)
+        {
+            triangle_order_[mesh.first_triangle + i] = mesh.first_triangle + mesh_order[i];
+        }
+
+        auto const& mesh_nodes = builder->GetNodes();
+        auto const& mesh_indices = builder->GetPrimitiveIndices();
+
+        // Rebase the child and primitive offsets to the shared buffers
+        std::uint32_t node_base = (std::uint32_t)nodes_.size();
+        std::uint32_t primitive_base = mesh_indices.empty() ? mesh.first_triangle : (std::uint32_t)primitive_indices_.size();
+        mesh_node_offsets_.push_back(node_base);
+        mesh_has_indices.push_back(!mesh_indices.empty());
+
+        for (auto node : mesh_nodes)
+        {
+            node.offset += IsLeaf(node) ? primitive_base : node_base;
+            nodes_.push_back(node);
+        }
+
+        for (auto primitive_index : mesh_indices)
+        {
+            primitive_indices_.push_back(mesh.first_triangle + primitive_index);
+        }
+    }
+
+    if (!primitive_indices_.empty())
+    {
+        // Some meshes have spatial splits, all leaves must reference the triangles through the indices then
+        for (std::size_t mesh_idx = 0; mesh_idx < meshes_.size(); ++mesh_idx)
+        {
+            if (mesh_has_indices[mesh_idx])
+            {
+                continue;
+            }
+
+            auto const& mesh = meshes_[mesh_idx];
+            std::uint32_t indices_base = (std::uint32_t)primitive_indices_.size();
+            for (std::uint32_t i = 0; i < mesh.triangle_count; ++i)
+            {
+                primitive_indices_.push_back(mesh.first_triangle + i);
+            }
+
+            std::size_t nodes_end = mesh_idx + 1 < meshes_.size() ? mesh_node_offsets_[mesh_idx + 1] : nodes_.size();
+            for (std::size_t node_idx = mesh_node_offsets_[mesh_idx]; node_idx < nodes_end; ++node_idx)
+            {
+                if (IsLeaf(nodes_[node_idx]))
+                {
+                    nodes_[node_idx].offset = nodes_[node_idx].offset - mesh.first_triangle + indices_base;
+                }
+            }
+        }
+    }
+
+    auto bottom_level_time = Clock::now();
+
+    UpdateInstances();
+
+    auto top_level_time = Clock::now();
+
+    std::size_t num_instanced_triangles = 0;
+    for (auto const& instance : instances_)
+    {
+        num_instanced_triangles += meshes_[instance.mesh_index].triangle_count;
+    }
+
+    std::cout << "Two-level BVH created with " << nodes_.size() << " nodes (" << top_level_node_count_
+        << " top level) for " << triangles.size() << " unique and " << num_instanced_triangles
+        << " instanced triangles (" << float(nodes_.size() * sizeof(LinearBVHNode) + primitive_indices_.size() * sizeof(std::uint32_t)) / (1024.0f * 1024.0f)
+        << " MB, bottom levels " << ElapsedMs(start_time, bottom_level_time)
+        << " ms, top level " << ElapsedMs(bottom_level_time, top_level_time) << " ms)" << std::endl;
+}
+
+void TwoLevelBvh::Refit(std::vector<Triangle> const& triangles)
+{
+    RefitBvhNodes(nodes_, primitive_indices_, triangles, top_level_node_count_);
+    UpdateInstances();
+}
+
+void TwoLevelBvh::UpdateInstances()
+{
+    if (2 * instances_.size() - 1 != top_level_node_count_)
+    {
+        throw std::runtime_error("The number of instances has changed, the BVH must be rebuilt");
+    }
+
+    std::vector<InstanceInfo> instance_info(instances_.size());
+    for (std::size_t i = 0; i < instances_.size(); ++i)
+    {
+        Instance& instance = instances_[i];
+        instance.node_offset = mesh_node_offsets_[instance.mesh_index];
+
+        // World bounds of the transformed bottom level root bounds
+        Bounds3 const& object_bounds = nodes_[instance.node_offset].bounds;
+        Bounds3 world_bounds;
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            world_bounds = Union(world_bounds, TransformPoint(instance.object_to_world, object_bounds.Corner(corner)));
+        }
+
+        instance_info[i].bounds = world_bounds;
+        instance_info[i].centroid = world_bounds.min * 0.5f + world_bounds.max * 0.5f;
+        instance_info[i].instance_index = (std::uint32_t)i;
+    }
+
+    std::uint32_t next_node = 0;
+    BuildTopLevel(instance_info, 0, instance_info.size(), next_node);
+    assert(next_node == top_level_node_count_);
+}
+
+std::uint32_t TwoLevelBvh::BuildTopLevel(std::vector<InstanceInfo>& instance_info,
+    std::size_t start, std::size_t end, std::uint32_t& next_node)
+{
+    std::uint32_t node_index = next_node++;
+
+    Bounds3 bounds;
+    Bounds3 centroid_bounds;
+    for (std::size_t i = start; i < end; ++i)
+    {
+        bounds = Union(bounds, instance_info[i].bounds);
+        centroid_bounds = Union(centroid_bounds, instance_info[i].centroid);
+    }
+
+    if (end - start == 1)
+    {
+        LinearBVHNode& leaf = nodes_[node_index];
+        leaf.bounds = bounds;
+        leaf.offset = instance_info[start].instance_index;
+        leaf.num_primitives_axis = 1 << 16;
+        return node_index;
+    }
+
+    unsigned int dim = centroid_bounds.MaximumExtent();
+    std::size_t mid = (start + end) / 2;
+
+    if (centroid_bounds.max[dim] > centroid_bounds.min[dim])
+    {
+        // Binned SAH, both end buckets are never empty here
+        struct Bucket
+        {
+            std::uint32_t count = 0;
+            Bounds3 bounds;
+        } buckets[kTopLevelBuckets];
+
+        auto get_bucket = [&](InstanceInfo const& info)
+        {
+            return std::min((unsigned int)(kTopLevelBuckets * centroid_bounds.Offset(info.centroid)[dim]),
+                kTopLevelBuckets - 1);
+        };
+
+        for (std::size_t i = start; i < end; ++i)
+        {
+            Bucket& bucket = buckets[get_bucket(instance_info[i])];
+            bucket.count++;
+            bucket.bounds = Union(bucket.bounds, instance_info[i].bounds);
+        }
+
+        float min_cost = std::numeric_limits<float>::max();
+        unsigned int min_cost_split = 0;
+        for (unsigned int split = 0; split < kTopLevelBuckets - 1; ++split)
+        {
+            Bounds3 b0, b1;
+            std::uint32_t count0 = 0, count1 = 0;
+            for (unsigned int b = 0; b <= split; ++b)
+            {
+                b0 = Union(b0, buckets[b].bounds);
+                count0 += buckets[b].count;
+            }
+
+            for (unsigned int b = split + 1; b < kTopLevelBuckets; ++b)
+            {
+                b1 = Union(b1, buckets[b].bounds);
+                count1 += buckets[b].count;
+            }
+
+            float cost = (count0 ? count0 * b0.SurfaceArea() : 0.0f) + (count1 ? count1 * b1.SurfaceArea() : 0.0f);
+            if (cost < min_cost)
+            {
+                min_cost = cost;
+                min_cost_split = split;
+            }
+        }
+
+        auto middle = std::partition(instance_info.begin() + start, instance_info.begin() + end,
+            [&](InstanceInfo const& info) { return get_bucket(info) <= min_cost_split; });
+        mid = middle - instance_info.begin();
+    }
+
+    BuildTopLevel(instance_info, start, mid, next_node);
+    std::uint32_t second_child = BuildTopLevel(instance_info, mid, end, next_node);
+
+    LinearBVHNode& node = nodes_[node_index];
+    node.bounds = bounds;
+    node.offset = second_child;
+    node.num_primitives_axis = dim;
+    return node_index;
+}
@@ -0,0 +1,75 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include "acceleration_structure.hpp"
+#include "scene/scene.hpp"
+
+// Top level BVH over the scene instances, the leaves switch to the bottom level BVHs
+// of the instanced meshes. The top level nodes go first in the node buffer, one instance
+// per leaf, followed by the bottom level BVHs of all meshes.
+class TwoLevelBvh : public AccelerationStructure
+{
+public:
+    // The meshes and the instances are owned by the scene,
+    // the bottom level BVHs are built with the given options
+    TwoLevelBvh(BvhBuildOptions const& options, std::vector<Mesh> const& meshes, std::vector<Instance>& instances);
+
+    // Builds the bottom level BVH of every mesh and the top level one,
+    // the triangles are reordered within their meshes
+    void BuildCPU(std::vector<Triangle> const& triangles) override;
+    // Refits the bottom level BVHs and rebuilds the top level one
+    void Refit(std::vector<Triangle> const& triangles) override;
+    void SetRefittedNodes(std::vector<LinearBVHNode> const& nodes) override { nodes_ = nodes; }
+    // Rebuilds the top level BVH only, call after changing the instance transforms.
+    // The number of instances can't change after the build
+    void UpdateInstances();
+    std::vector<LinearBVHNode> const& GetNodes() const override { return nodes_; }
+    std::vector<std::uint32_t> const& GetPrimitiveIndices() const override { return primitive_indices_; }
+    std::vector<std::uint32_t> const& GetTriangleOrder() const override { return triangle_order_; }
+    std::size_t GetTopLevelNodeCount() const override { return top_level_node_count_; }
+
+private:
+    struct InstanceInfo
+    {
+        Bounds3 bounds;
+        float3 centroid;
+        std::uint32_t instance_index;
+    };
+
+    // Emits the nodes in the depth first order starting from next_node, returns the index of the subtree root
+    std::uint32_t BuildTopLevel(std::vector<InstanceInfo>& instance_info,
+        std::size_t start, std::size_t end, std::uint32_t& next_node);
+
+    BvhBuildOptions options_;
+    std::vector<Mesh> const& meshes_;
+    std::vector<Instance>& instances_;
+    std::vector<LinearBVHNode> nodes_;
+    std::vector<std::uint32_t> primitive_indices_;
+    std::vector<std::uint32_t> triangle_order_;
+    // Root of the bottom level BVH of every mesh
+    std::vector<std::uint32_t> mesh_node_offsets_;
+    std::size_t top_level_node_count_ = 0;
+};
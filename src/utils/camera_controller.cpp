@@ -74,7 +74,7 @@ void CameraController::Update(float dt)
     float speed = speed_ * (window_.GetKey(KeyCode::kLeftShift) ? 5.0f : 1.0f);
 
     // Compute new camera vectors
-    camera_data_.front = float3(std::cosf(yaw_) * std::sinf(pitch_), std::sinf(yaw_) * std::sinf(pitch_), std::cosf(pitch_));
+    camera_data_.front = float3(std::cos(yaw_) * std::sin(pitch_), std::sin(yaw_) * std::sin(pitch_), std::cos(pitch_));
     float3 right = Cross(camera_data_.front, up_).Normalize();
     // Compute the actual up vector
     camera_data_.up = Cross(right, camera_data_.front);
@@ -25,7 +25,7 @@
 #pragma once
 
 #include <string>
-#include <exception>
+#include <stdexcept>
 
 inline const char* GetClErrorString(int error)
 {
@@ -106,11 +106,11 @@ inline const char* GetClErrorString(int error)
 
 }
 
-class CLException : public std::exception
+class CLException : public std::runtime_error
 {
 public:
     CLException(char const* message, int errorCode)
-        : std::exception((std::string(message) + " (" + GetClErrorString(errorCode) + ")").c_str()) {}
+        : std::runtime_error(std::string(message) + " (" + GetClErrorString(errorCode) + ")") {}
 
 };
 
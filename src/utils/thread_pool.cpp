@@ -0,0 +1,222 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#include "thread_pool.hpp"
+#include <algorithm>
+
+namespace
+{
+    // Pool and queue of the current worker thread
+    thread_local ThreadPool const* tls_thread_pool = nullptr;
+    thread_local std::size_t tls_queue_idx = 0;
+}
+
+void ThreadPool::TaskGroup::Run(std::function<void()> task)
+{
+    pending_tasks_.fetch_add(1);
+    thread_pool_.Push({ std::move(task), &pending_tasks_ });
+}
+
+void ThreadPool::TaskGroup::Wait()
+{
+    std::size_t queue_idx = thread_pool_.GetQueueIndex();
+
+    while (pending_tasks_.load() > 0)
+    {
+        if (!thread_pool_.RunPendingTask(queue_idx))
+        {
+            // The remaining tasks are being executed by the other threads
+            std::this_thread::yield();
+        }
+    }
+}
+
+ThreadPool::ThreadPool(std::uint32_t num_threads)
+{
+    if (num_threads == 0)
+    {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // One queue per worker and the shared one for the external threads
+    for (std::uint32_t i = 0; i < num_threads; ++i)
+    {
+        queues_.push_back(std::make_unique<TaskQueue>());
+    }
+
+    // The calling thread is the last one
+    for (std::uint32_t i = 0; i + 1 < num_threads; ++i)
+    {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    sleep_cv_.notify_all();
+
+    for (auto& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::GetQueueIndex() const
+{
+    return tls_thread_pool == this ? tls_queue_idx : queues_.size() - 1;
+}
+
+void ThreadPool::Push(Task task)
+{
+    TaskQueue& queue = *queues_[GetQueueIndex()];
+
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    num_queued_tasks_.fetch_add(1);
+
+    // Make sure that the sleeping worker sees the new task
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    sleep_cv_.notify_one();
+}
+
+bool ThreadPool::RunPendingTask(std::size_t queue_idx)
+{
+    Task task;
+    bool found = false;
+
+    // Own queue first, newest task
+    {
+        TaskQueue& queue = *queues_[queue_idx];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    // Steal the oldest task from the others, it's likely the biggest one
+    for (std::size_t i = 1; !found && i < queues_.size(); ++i)
+    {
+        TaskQueue& queue = *queues_[(queue_idx + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        return false;
+    }
+
+    num_queued_tasks_.fetch_sub(1);
+    task.func();
+    task.pending_tasks->fetch_sub(1);
+
+    return true;
+}
+
+void ThreadPool::WorkerLoop(std::size_t queue_idx)
+{
+    tls_thread_pool = this;
+    tls_queue_idx = queue_idx;
+
+    while (true)
+    {
+        if (RunPendingTask(queue_idx))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this] { return stop_ || num_queued_tasks_.load() > 0; });
+
+        if (stop_)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(std::size_t count, std::function<void(std::size_t, std::size_t)> const& func,
+    std::size_t grain_size)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    grain_size = std::max<std::size_t>(grain_size, 1);
+
+    // Not worth waking up the workers
+    if (workers_.empty() || count <= grain_size)
+    {
+        func(0, count);
+        return;
+    }
+
+    std::size_t num_chunks = (count + grain_size - 1) / grain_size;
+    std::atomic<std::size_t> next_chunk{ 0 };
+
+    auto process_chunks = [&]()
+    {
+        while (true)
+        {
+            std::size_t chunk = next_chunk.fetch_add(1);
+            if (chunk >= num_chunks)
+            {
+                break;
+            }
+
+            std::size_t begin = chunk * grain_size;
+            std::size_t end = std::min(begin + grain_size, count);
+            func(begin, end);
+        }
+    };
+
+    // The chunks are distributed dynamically, so one task per thread is enough
+    TaskGroup task_group(*this);
+    std::size_t num_tasks = std::min<std::size_t>(num_chunks, GetThreadCount());
+    for (std::size_t i = 1; i < num_tasks; ++i)
+    {
+        task_group.Run(process_chunks);
+    }
+
+    process_chunks();
+    task_group.Wait();
+}
@@ -0,0 +1,106 @@
+/*****************************************************************************
+ MIT License
+
+ Copyright(c) 2023 Alexander Veselov
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this softwareand associated documentation files(the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions :
+
+ The above copyright noticeand this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *****************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool
+// Every worker has its own task queue, idle workers steal the oldest tasks from the others.
+// Threads that wait for a task group execute pending tasks instead of blocking,
+// so the tasks can spawn and wait for the nested ones.
+class ThreadPool
+{
+public:
+    // A set of tasks that can be waited for
+    class TaskGroup
+    {
+    public:
+        explicit TaskGroup(ThreadPool& thread_pool) : thread_pool_(thread_pool) {}
+        ~TaskGroup() { Wait(); }
+
+        TaskGroup(TaskGroup const&) = delete;
+        TaskGroup& operator=(TaskGroup const&) = delete;
+
+        void Run(std::function<void()> task);
+        // Executes pending tasks of the pool until all tasks of the group are done
+        void Wait();
+
+    private:
+        ThreadPool& thread_pool_;
+        std::atomic<std::uint32_t> pending_tasks_{ 0 };
+    };
+
+    // Pass num_threads = 0 to use all hardware threads
+    explicit ThreadPool(std::uint32_t num_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // Including the calling thread
+    std::uint32_t GetThreadCount() const { return (std::uint32_t)workers_.size() + 1; }
+
+    // Splits [0, count) into chunks of grain_size items and calls func(begin, end) for each of them.
+    // The calling thread takes part in the work, returns when all chunks are done.
+    // Can be called from inside the pool tasks.
+    void ParallelFor(std::size_t count, std::function<void(std::size_t, std::size_t)> const& func,
+        std::size_t grain_size = 1);
+
+private:
+    struct Task
+    {
+        std::function<void()> func;
+        std::atomic<std::uint32_t>* pending_tasks;
+    };
+
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void WorkerLoop(std::size_t queue_idx);
+    // Returns the queue of the calling thread, threads outside of the pool share the last one
+    std::size_t GetQueueIndex() const;
+    void Push(Task task);
+    // Pops a task from the given queue or steals one from the others, returns false if there are none
+    bool RunPendingTask(std::size_t queue_idx);
+
+    std::vector<std::thread> workers_;
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::atomic<std::uint32_t> num_queued_tasks_{ 0 };
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    bool stop_ = false;
+
+};
@@ -31,7 +31,8 @@
 #define GLFW_EXPOSE_NATIVE_WIN32
 #include <GLFW/glfw3native.h>
 #else
-#error Other platforms are not currently supported
+// glfw3native.h pulls in Xlib which typedefs Window, declare the getter manually
+extern "C" unsigned long glfwGetX11Window(GLFWwindow* window);
 #endif
 
 #include <backends/imgui_impl_glfw.h>
@@ -266,7 +267,11 @@ void Window::SetMousePos(int x, int y) const
 
 void* Window::GetNativeHandle() const
 {
+#ifdef WIN32
     return glfwGetWin32Window(window_.get());
+#else
+    return (void*)glfwGetX11Window(window_.get());
+#endif
 }
 
 void Window::SwapBuffers()
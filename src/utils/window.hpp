@@ -149,7 +149,7 @@ public:
     Window(std::uint32_t width, std::uint32_t height, char const* title, bool no_api = false);
     ~Window();
 
-    // Returns HWND in the case of WIN32 platform
+    // Returns HWND in the case of WIN32 platform, X11 Window otherwise
     void* GetNativeHandle() const;
     std::uint32_t GetWidth() const { return width_; }
     std::uint32_t GetHeight() const { return height_; }